@@ -36,6 +36,10 @@ typedef struct {
 	gboolean send_message;
 	char *servername;
 	char *channel;
+	char *filename;
+	GFile *file;
+	char *sha256;		/* the result, or error */
+	GError *error;
 } ChecksumCallbackInfo;
 
 
@@ -70,67 +74,105 @@ print_sha256_result (ChecksumCallbackInfo *info, const char *checksum, const cha
 }
 
 static void
-file_sha256_complete (GFile *file, GAsyncResult *result, gpointer user_data)
-{	
-	ChecksumCallbackInfo * callback_info = user_data;
-	GError *error = NULL;
-	char *sha256 = NULL;
-	const char *filename = g_task_get_task_data (G_TASK (result));
-
-	sha256 = g_task_propagate_pointer (G_TASK (result), &error);
-	print_sha256_result (callback_info, sha256, filename, error);
-
-	g_free(callback_info->servername);
-	g_free(callback_info->channel);
-	g_free(callback_info);
-	g_free (sha256);
-	g_clear_error (&error);
+file_sha256_complete (hexchat_async *job, int cancelled, void *user_data)
+{
+	ChecksumCallbackInfo *callback_info = user_data;
+
+	if (!cancelled)
+		print_sha256_result (callback_info, callback_info->sha256, callback_info->filename, callback_info->error);
+
+	g_free (callback_info->servername);
+	g_free (callback_info->channel);
+	g_free (callback_info->filename);
+	g_object_unref (callback_info->file);
+	g_free (callback_info->sha256);
+	g_clear_error (&callback_info->error);
+	g_free (callback_info);
 }
 
 static void
-thread_sha256_file (GTask *task, GFile *file, gpointer task_data, GCancellable *cancellable)
+thread_sha256_file (hexchat_async *job, void *user_data)
 {
+	ChecksumCallbackInfo *callback_info = user_data;
 	GChecksum *checksum;
 	GFileInputStream *istream;
 	guint8 buffer[32768];
-	GError *error = NULL;
 	gssize ret;
 
-	istream = g_file_read (file, cancellable, &error);
-	if (error) {
-		g_task_return_error (task, error);
+	istream = g_file_read (callback_info->file, NULL, &callback_info->error);
+	if (!istream)
 		return;
-	}
 
 	checksum = g_checksum_new (G_CHECKSUM_SHA256);
 
-	while ((ret = g_input_stream_read (G_INPUT_STREAM (istream), buffer, sizeof(buffer), cancellable, &error)) > 0)
+	while (!hexchat_async_cancelled (ph, job) &&
+			 (ret = g_input_stream_read (G_INPUT_STREAM (istream), buffer, sizeof(buffer), NULL, &callback_info->error)) > 0)
 		g_checksum_update (checksum, buffer, ret);
 
-	if (error) {
-		g_checksum_free (checksum);
-		g_task_return_error (task, error);
-		return;
-	}
+	if (!callback_info->error)
+		callback_info->sha256 = g_strdup (g_checksum_get_string (checksum));
 
-	g_task_return_pointer (task, g_strdup (g_checksum_get_string (checksum)), g_free);
 	g_checksum_free (checksum);
+	g_object_unref (istream);
+}
+
+/* HexChat announces a receive once it has hashed it, so the digest is there
+   unless the file couldn't be read back */
+static char *
+dccrecv_find_sha256 (const char *destfile, const char *nick)
+{
+	hexchat_list *list;
+	const char *sha256;
+	char *ret = NULL;
+
+	list = hexchat_list_get (ph, "dcc");
+	if (!list)
+		return NULL;
+
+	while (hexchat_list_next (ph, list))
+	{
+		if (hexchat_list_int (ph, list, "type") != 1 || hexchat_list_int (ph, list, "status") != 3)
+			continue;
+		if (g_strcmp0 (hexchat_list_str (ph, list, "destfile"), destfile) != 0 ||
+			 hexchat_nickcmp (ph, hexchat_list_str (ph, list, "nick"), nick) != 0)
+			continue;
+
+		sha256 = hexchat_list_str (ph, list, "sha256");
+		if (sha256 && sha256[0])
+			ret = g_strdup (sha256);
+		break;
+	}
+
+	hexchat_list_free (ph, list);
+	return ret;
 }
 
 static int
 dccrecv_cb (char *word[], void *userdata)
 {
-	GTask *task;
 	char *filename_fs;
-	GFile *file;
 	const char *dcc_completed_dir;
 	char *filename;
+	char *sha256;
 
 	if (hexchat_get_prefs (ph, "dcc_completed_dir", &dcc_completed_dir, NULL) == 1 && dcc_completed_dir[0] != '\0')
 		filename = g_build_filename (dcc_completed_dir, word[1], NULL);
 	else
 		filename = g_strdup (word[2]);
 
+	sha256 = dccrecv_find_sha256 (word[2], word[3]);
+	if (sha256)
+	{
+		ChecksumCallbackInfo info = { FALSE };
+
+		info.servername = (char *) hexchat_get_info (ph, "server");
+		info.channel = (char *) hexchat_get_info (ph, "channel");
+		print_sha256_result (&info, sha256, filename, NULL);
+		g_free (sha256);
+		g_free (filename);
+		return HEXCHAT_EAT_NONE;
+	}
+
 	filename_fs = g_filename_from_utf8 (filename, -1, NULL, NULL, NULL);
 	if (!filename_fs) {
 		hexchat_printf (ph, "Checksum: Invalid filename (%s)\n", filename);
@@ -138,20 +180,16 @@ dccrecv_cb (char *word[], void *userdata)
 		return HEXCHAT_EAT_NONE;
 	}
 
-	ChecksumCallbackInfo *callback_data = g_new (ChecksumCallbackInfo, 1);
+	ChecksumCallbackInfo *callback_data = g_new0 (ChecksumCallbackInfo, 1);
 	callback_data->servername = g_strdup(hexchat_get_info(ph, "server"));
 	callback_data->channel = g_strdup(hexchat_get_info(ph, "channel"));
 	callback_data->send_message = FALSE;
+	callback_data->filename = filename;
+	callback_data->file = g_file_new_for_path (filename_fs);
 
-
-	file = g_file_new_for_path (filename_fs);
-	task = g_task_new (file, NULL, (GAsyncReadyCallback) file_sha256_complete, (gpointer)callback_data);
-	g_task_set_task_data (task, filename, g_free);
-	g_task_run_in_thread (task, (GTaskThreadFunc) thread_sha256_file);
+	hexchat_run_async (ph, thread_sha256_file, file_sha256_complete, callback_data);
 
 	g_free (filename_fs);
-	g_object_unref (file);
-	g_object_unref (task);
 
 	return HEXCHAT_EAT_NONE;
 }
@@ -159,23 +197,14 @@ dccrecv_cb (char *word[], void *userdata)
 static int
 dccoffer_cb (char *word[], void *userdata)
 {
-	GFile *file;
-	GTask *task;
-	char *filename;
-
-	ChecksumCallbackInfo *callback_data = g_new (ChecksumCallbackInfo, 1);
+	ChecksumCallbackInfo *callback_data = g_new0 (ChecksumCallbackInfo, 1);
 	callback_data->servername = g_strdup(hexchat_get_info(ph, "server"));
 	callback_data->channel = g_strdup(hexchat_get_info(ph, "channel"));
 	callback_data->send_message = TRUE;
+	callback_data->filename = g_strdup (word[3]);
+	callback_data->file = g_file_new_for_path (callback_data->filename);
 
-	filename = g_strdup (word[3]);
-	file = g_file_new_for_path (filename);
-	task = g_task_new (file, NULL, (GAsyncReadyCallback) file_sha256_complete, (gpointer)callback_data);
-	g_task_set_task_data (task, filename, g_free);
-	g_task_run_in_thread (task, (GTaskThreadFunc) thread_sha256_file);
-
-	g_object_unref (file);
-	g_object_unref (task);
+	hexchat_run_async (ph, thread_sha256_file, file_sha256_complete, callback_data);
 
 	return HEXCHAT_EAT_NONE;
 }
@@ -60,12 +60,20 @@ static hexchat_plugin *ph;
 #define lua_rawlen lua_objlen
 #define luaL_setfuncs(L, r, n) luaL_register(L, NULL, r)
 #endif
+#if LUA_VERSION_NUM >= 503
+#define lua_dump(L, w, d) lua_dump(L, w, d, 0)
+#endif
 
 typedef struct
 {
 	hexchat_hook *hook;
 	lua_State *state;
 	int ref;
+	int ffi; /* gets the words as char ** rather than tables, see hexchat.ffi */
+	int words; /* the word tables, kept between calls */
+	int words_eol;
+	int busy;
+	int dead; /* unhooked while busy, hook_leave() frees it */
 }
 hook_info;
 
@@ -79,6 +87,7 @@ typedef struct
 	lua_State *state;
 	GPtrArray *hooks;
 	GPtrArray *unload_hooks;
+	GPtrArray *jobs;
 	int traceback;
 	int status;
 }
@@ -247,10 +256,20 @@ static void register_hook(hook_info *hook)
 static void free_hook(hook_info *hook)
 {
 	if(hook->state)
+	{
 		luaL_unref(hook->state, LUA_REGISTRYINDEX, hook->ref);
+		if(hook->words)
+			luaL_unref(hook->state, LUA_REGISTRYINDEX, hook->words);
+		if(hook->words_eol)
+			luaL_unref(hook->state, LUA_REGISTRYINDEX, hook->words_eol);
+	}
 	if(hook->hook)
 		hexchat_unhook(ph, hook->hook);
-	g_free(hook);
+	hook->hook = NULL;
+	if(hook->busy)
+		hook->dead = 1;
+	else
+		g_free(hook);
 }
 
 static int unregister_hook(hook_info *hook)
@@ -266,9 +285,84 @@ static int unregister_hook(hook_info *hook)
 	return 0;
 }
 
+/* Pushes words[1..count]. Tables are refilled and reused from the last call,
+   unless the hook is already running further up the stack. */
+static void push_words(lua_State *L, hook_info *info, int *ref, char *words[], int count)
+{
+	int i, len;
+
+	if(info->ffi)
+	{
+		lua_pushlightuserdata(L, words);
+		return;
+	}
+
+	if(info->busy)
+		lua_newtable(L);
+	else if(*ref)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+	else
+	{
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	len = lua_rawlen(L, -1);
+	for(i = 1; i <= count; i++)
+	{
+		lua_pushstring(L, words[i]);
+		lua_rawseti(L, -2, i);
+	}
+	for(; i <= len; i++)
+	{
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i);
+	}
+}
+
+static int word_eol_count(char *word_eol[])
+{
+	int i;
+
+	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++);
+	return i - 1;
+}
+
+static int word_count(char *word[])
+{
+	int j;
+
+	for(j = 31; j >= 1; j--)
+	{
+		if(*word[j])
+			break;
+	}
+	return j;
+}
+
+static int hook_enter(hook_info *info)
+{
+	if(info->busy)
+		return 0;
+	info->busy = 1;
+	return 1;
+}
+
+/* the callback may have unhooked itself, leaving the hook to us to free */
+static void hook_leave(hook_info *info, int entered)
+{
+	if(!entered)
+		return;
+	if(info->dead)
+		g_free(info);
+	else
+		info->busy = 0;
+}
+
 static int api_command_closure(char *word[], char *word_eol[], void *udata)
 {
-	int base, i, ret;
+	int base, i, ret, entered;
 	hook_info *info = udata;
 	lua_State *L = info->state;
 	script_info *script = get_info(L);
@@ -276,29 +370,23 @@ static int api_command_closure(char *word[], char *word_eol[], void *udata)
 	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
 	base = lua_gettop(L);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, info->ref);
-	lua_newtable(L);
-	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++)
-	{
-		lua_pushstring(L, word[i]);
-		lua_rawseti(L, -2, i);
-	}
-	lua_newtable(L);
-	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++)
-	{
-		lua_pushstring(L, word_eol[i]);
-		lua_rawseti(L, -2, i);
-	}
+	i = word_eol_count(word_eol);
+	push_words(L, info, &info->words, word, i);
+	push_words(L, info, &info->words_eol, word_eol, i);
+	entered = hook_enter(info);
 	script->status |= STATUS_ACTIVE;
 	if(lua_pcall(L, 2, 1, base))
 	{
 		char const *error = lua_tostring(L, -1);
 		lua_pop(L, 2);
 		hexchat_printf(ph, "Lua error in command hook: %s", error ? error : "(non-string error)");
+		hook_leave(info, entered);
 		check_deferred(script);
 		return HEXCHAT_EAT_NONE;
 	}
 	ret = lua_tointeger(L, -1);
 	lua_pop(L, 2);
+	hook_leave(info, entered);
 	check_deferred(script);
 	return ret;
 }
@@ -314,9 +402,10 @@ static int api_hexchat_hook_command(lua_State *L)
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	help = luaL_optstring(L, 3, NULL);
 	pri = luaL_optinteger(L, 4, HEXCHAT_PRI_NORM);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
+	info->ffi = lua_toboolean(L, lua_upvalueindex(1));
 	info->hook = hexchat_hook_command(ph, command, pri, api_command_closure, help, info);
 	u = lua_newuserdata(L, sizeof(hook_info *));
 	*u = info;
@@ -331,34 +420,27 @@ static int api_print_closure(char *word[], void *udata)
 	hook_info *info = udata;
 	lua_State *L = info->state;
 	script_info *script = get_info(L);
-	int i, j, base, ret;
+	int base, ret, entered;
 
 	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
 	base = lua_gettop(L);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, info->ref);
 
-	for(j = 31; j >= 1; j--)
-	{
-		if(*word[j])
-			break;
-	}
-	lua_newtable(L);
-	for(i = 1; i <= j; i++)
-	{
-		lua_pushstring(L, word[i]);
-		lua_rawseti(L, -2, i);
-	}
+	push_words(L, info, &info->words, word, word_count(word));
+	entered = hook_enter(info);
 	script->status |= STATUS_ACTIVE;
 	if(lua_pcall(L, 1, 1, base))
 	{
 		char const *error = lua_tostring(L, -1);
 		lua_pop(L, 2);
 		hexchat_printf(ph, "Lua error in print hook: %s", error ? error : "(non-string error)");
+		hook_leave(info, entered);
 		check_deferred(script);
 		return HEXCHAT_EAT_NONE;
 	}
 	ret = lua_tointeger(L, -1);
 	lua_pop(L, 2);
+	hook_leave(info, entered);
 	check_deferred(script);
 	return ret;
 }
@@ -372,9 +454,10 @@ static int api_hexchat_hook_print(lua_State *L)
 	lua_pushvalue(L, 2);
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	pri = luaL_optinteger(L, 3, HEXCHAT_PRI_NORM);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
+	info->ffi = lua_toboolean(L, lua_upvalueindex(1));
 	info->hook = hexchat_hook_print(ph, event, pri, api_print_closure, info);
 	u = lua_newuserdata(L, sizeof(hook_info *));
 	*u = info;
@@ -396,23 +479,14 @@ static int api_print_attrs_closure(char *word[], hexchat_event_attrs *attrs, voi
 	hook_info *info = udata;
 	lua_State *L = info->state;
 	script_info *script = get_info(L);
-	int base, i, j, ret;
+	int base, ret, entered;
 	hexchat_event_attrs **u;
 
 	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
 	base = lua_gettop(L);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, info->ref);
-	for(j = 31; j >= 1; j--)
-	{
-		if(*word[j])
-			break;
-	}
-	lua_newtable(L);
-	for(i = 1; i <= j; i++)
-	{
-		lua_pushstring(L, word[i]);
-		lua_rawseti(L, -2, i);
-	}
+	push_words(L, info, &info->words, word, word_count(word));
+	entered = hook_enter(info);
 	u = lua_newuserdata(L, sizeof(hexchat_event_attrs *));
 	*u = event_attrs_copy(attrs);
 	luaL_newmetatable(L, "attrs");
@@ -423,11 +497,13 @@ static int api_print_attrs_closure(char *word[], hexchat_event_attrs *attrs, voi
 		char const *error = lua_tostring(L, -1);
 		lua_pop(L, 2);
 		hexchat_printf(ph, "Lua error in print_attrs hook: %s", error ? error : "(non-string error)");
+		hook_leave(info, entered);
 		check_deferred(script);
 		return HEXCHAT_EAT_NONE;
 	}
 	ret = lua_tointeger(L, -1);
 	lua_pop(L, 2);
+	hook_leave(info, entered);
 	check_deferred(script);
 	return ret;
 }
@@ -441,7 +517,7 @@ static int api_hexchat_hook_print_attrs(lua_State *L)
 	lua_pushvalue(L, 2);
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	pri = luaL_optinteger(L, 3, HEXCHAT_PRI_NORM);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
 	info->hook = hexchat_hook_print_attrs(ph, event, pri, api_print_attrs_closure, info);
@@ -458,34 +534,28 @@ static int api_server_closure(char *word[], char *word_eol[], void *udata)
 	hook_info *info = udata;
 	lua_State *L = info->state;
 	script_info *script = get_info(L);
-	int base, i, ret;
+	int base, i, ret, entered;
 
 	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
 	base = lua_gettop(L);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, info->ref);
-	lua_newtable(L);
-	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++)
-	{
-		lua_pushstring(L, word[i]);
-		lua_rawseti(L, -2, i);
-	}
-	lua_newtable(L);
-	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++)
-	{
-		lua_pushstring(L, word_eol[i]);
-		lua_rawseti(L, -2, i);
-	}
+	i = word_eol_count(word_eol);
+	push_words(L, info, &info->words, word, i);
+	push_words(L, info, &info->words_eol, word_eol, i);
+	entered = hook_enter(info);
 	script->status |= STATUS_ACTIVE;
 	if(lua_pcall(L, 2, 1, base))
 	{
 		char const *error = lua_tostring(L, -1);
 		lua_pop(L, 2);
 		hexchat_printf(ph, "Lua error in server hook: %s", error ? error : "(non-string error)");
+		hook_leave(info, entered);
 		check_deferred(script);
 		return HEXCHAT_EAT_NONE;
 	}
 	ret = lua_tointeger(L, -1);
 	lua_pop(L, 2);
+	hook_leave(info, entered);
 	check_deferred(script);
 	return ret;
 }
@@ -499,9 +569,10 @@ static int api_hexchat_hook_server(lua_State *L)
 	lua_pushvalue(L, 2);
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	pri = luaL_optinteger(L, 3, HEXCHAT_PRI_NORM);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
+	info->ffi = lua_toboolean(L, lua_upvalueindex(1));
 	info->hook = hexchat_hook_server(ph, command, pri, api_server_closure, info);
 	u = lua_newuserdata(L, sizeof(hook_info *));
 	*u = info;
@@ -511,29 +582,142 @@ static int api_hexchat_hook_server(lua_State *L)
 	return 1;
 }
 
-static int api_server_attrs_closure(char *word[], char *word_eol[], hexchat_event_attrs *attrs, void *udata)
+static int api_server_batch_closure(hexchat_server_line *const *lines, int count, void *udata)
 {
 	hook_info *info = udata;
 	lua_State *L = info->state;
 	script_info *script = get_info(L);
-	int base, i, ret;
-	hexchat_event_attrs **u;
+	hexchat_server_line **u;
+	int base, i;
 
 	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
 	base = lua_gettop(L);
+	/* our own list of the line objects, to invalidate them afterwards */
+	lua_createtable(L, count, 0);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, info->ref);
-	lua_newtable(L);
-	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++)
+	lua_createtable(L, count, 0);
+	luaL_newmetatable(L, "server_line");
+	for(i = 0; i < count; i++)
 	{
-		lua_pushstring(L, word[i]);
-		lua_rawseti(L, -2, i);
+		u = lua_newuserdata(L, sizeof(hexchat_server_line *));
+		*u = lines[i];
+		lua_pushvalue(L, -2);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, base + 1, i + 1);
+		lua_rawseti(L, -3, i + 1);
 	}
-	lua_newtable(L);
-	for(i = 1; i < WORD_ARRAY_LEN && *word_eol[i]; i++)
+	lua_pop(L, 1);
+	script->status |= STATUS_ACTIVE;
+	if(lua_pcall(L, 1, 0, base))
 	{
-		lua_pushstring(L, word_eol[i]);
-		lua_rawseti(L, -2, i);
+		char const *error = lua_tostring(L, -1);
+		hexchat_printf(ph, "Lua error in server_batch hook: %s", error ? error : "(non-string error)");
+		lua_pop(L, 1);
+	}
+	for(i = 1; i <= count; i++)
+	{
+		lua_rawgeti(L, base + 1, i);
+		*(hexchat_server_line **)lua_touserdata(L, -1) = NULL;
+		lua_pop(L, 1);
 	}
+	lua_pop(L, 2);
+	check_deferred(script);
+	return HEXCHAT_EAT_NONE;
+}
+
+static int api_hexchat_hook_server_batch(lua_State *L)
+{
+	char const *command = luaL_optstring(L, 1, "RAW LINE");
+	hook_info *info, **u;
+	int ref, pri;
+
+	lua_pushvalue(L, 2);
+	ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	pri = luaL_optinteger(L, 3, HEXCHAT_PRI_NORM);
+	info = g_new0(hook_info, 1);
+	info->state = L;
+	info->ref = ref;
+	info->hook = hexchat_hook_server_batch(ph, command, pri, api_server_batch_closure, info);
+	u = lua_newuserdata(L, sizeof(hook_info *));
+	*u = info;
+	luaL_newmetatable(L, "hook");
+	lua_setmetatable(L, -2);
+	register_hook(info);
+	return 1;
+}
+
+static hexchat_server_line *check_server_line(lua_State *L, int index)
+{
+	hexchat_server_line *line = *(hexchat_server_line **)luaL_checkudata(L, index, "server_line");
+	if(!line)
+		luaL_error(L, "server line used after its batch hook returned");
+	return line;
+}
+
+static int api_server_line_word(lua_State *L)
+{
+	hexchat_server_line *line = check_server_line(L, 1);
+	char const *word;
+	int len;
+
+	hexchat_server_line_word(ph, line, luaL_checkinteger(L, 2), &word, &len, NULL);
+	lua_pushlstring(L, word, len);
+	return 1;
+}
+
+static int api_server_line_word_eol(lua_State *L)
+{
+	hexchat_server_line *line = check_server_line(L, 1);
+	char const *word_eol;
+
+	hexchat_server_line_word(ph, line, luaL_checkinteger(L, 2), NULL, NULL, &word_eol);
+	lua_pushstring(L, word_eol);
+	return 1;
+}
+
+static int api_server_line_meta_index(lua_State *L)
+{
+	hexchat_server_line *line = check_server_line(L, 1);
+	char const *key = luaL_checkstring(L, 2);
+
+	if(!strcmp(key, "text"))
+		lua_pushstring(L, line->line);
+	else if(!strcmp(key, "time"))
+		lua_pushinteger(L, line->server_time_utc);
+	else if(!strcmp(key, "words"))
+		lua_pushinteger(L, hexchat_server_line_word(ph, line, 0, NULL, NULL, NULL));
+	else if(!strcmp(key, "word"))
+		lua_pushcfunction(L, api_server_line_word);
+	else if(!strcmp(key, "word_eol"))
+		lua_pushcfunction(L, api_server_line_word_eol);
+	else if(!strcmp(key, "context"))
+	{
+		hexchat_context **u = lua_newuserdata(L, sizeof(hexchat_context *));
+		*u = line->context;
+		luaL_newmetatable(L, "context");
+		lua_setmetatable(L, -2);
+	}
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int api_server_attrs_closure(char *word[], char *word_eol[], hexchat_event_attrs *attrs, void *udata)
+{
+	hook_info *info = udata;
+	lua_State *L = info->state;
+	script_info *script = get_info(L);
+	int base, i, ret, entered;
+	hexchat_event_attrs **u;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
+	base = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info->ref);
+	i = word_eol_count(word_eol);
+	push_words(L, info, &info->words, word, i);
+	push_words(L, info, &info->words_eol, word_eol, i);
+	entered = hook_enter(info);
 
 	u = lua_newuserdata(L, sizeof(hexchat_event_attrs *));
 	*u = event_attrs_copy(attrs);
@@ -545,11 +729,13 @@ static int api_server_attrs_closure(char *word[], char *word_eol[], hexchat_even
 		char const *error = lua_tostring(L, -1);
 		lua_pop(L, 2);
 		hexchat_printf(ph, "Lua error in server_attrs hook: %s", error ? error : "(non-string error)");
+		hook_leave(info, entered);
 		check_deferred(script);
 		return HEXCHAT_EAT_NONE;
 	}
 	ret = lua_tointeger(L, -1);
 	lua_pop(L, 2);
+	hook_leave(info, entered);
 	check_deferred(script);
 	return ret;
 }
@@ -563,7 +749,7 @@ static int api_hexchat_hook_server_attrs(lua_State *L)
 	lua_pushvalue(L, 2);
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	pri = luaL_optinteger(L, 3, HEXCHAT_PRI_NORM);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
 	info->hook = hexchat_hook_server_attrs(ph, command, pri, api_server_attrs_closure, info);
@@ -607,7 +793,7 @@ static int api_hexchat_hook_timer(lua_State *L)
 
 	lua_pushvalue(L, 2);
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
 	info->hook = hexchat_hook_timer(ph, timeout, api_timer_closure, info);
@@ -627,7 +813,7 @@ static int api_hexchat_hook_unload(lua_State *L)
 
 	lua_pushvalue(L, 1);
 	ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	info = g_new(hook_info, 1);
+	info = g_new0(hook_info, 1);
 	info->state = L;
 	info->ref = ref;
 	info->hook = NULL;
@@ -657,6 +843,322 @@ static int api_hexchat_unhook(lua_State *L)
 	}
 }
 
+/* a value that can be copied into or out of a worker's lua_State */
+typedef struct
+{
+	int type;
+	lua_Number number;
+	char *string;
+	size_t len;
+}
+async_value;
+
+typedef struct
+{
+	script_info *script; /* NULL once the script is gone */
+	hexchat_async *job;
+	GString *code; /* the work function, dumped */
+	GArray *args;
+	GArray *results;
+	char *error;
+	int done;
+	int self; /* the "async" userdata, whose pointer is cleared when we finish */
+}
+async_info;
+
+static void async_value_free(async_value *value)
+{
+	g_free(value->string);
+}
+
+static int async_dump_writer(lua_State *L, const void *p, size_t size, void *data)
+{
+	g_string_append_len(data, p, size);
+	return 0;
+}
+
+/* copies stack values first..last; returns the index of one it can't copy */
+static int async_values_get(lua_State *L, int first, int last, GArray *values)
+{
+	async_value value;
+	char const *str;
+	int i;
+
+	for(i = first; i <= last; i++)
+	{
+		memset(&value, 0, sizeof(value));
+		value.type = lua_type(L, i);
+		switch(value.type)
+		{
+			case LUA_TNIL:
+				break;
+			case LUA_TBOOLEAN:
+				value.number = lua_toboolean(L, i);
+				break;
+			case LUA_TNUMBER:
+				value.number = lua_tonumber(L, i);
+				break;
+			case LUA_TSTRING:
+				str = lua_tolstring(L, i, &value.len);
+				value.string = g_malloc(value.len + 1);
+				memcpy(value.string, str, value.len + 1);
+				break;
+			default:
+				return i;
+		}
+		g_array_append_val(values, value);
+	}
+	return 0;
+}
+
+static void async_values_push(lua_State *L, GArray *values)
+{
+	async_value *value;
+	guint i;
+
+	luaL_checkstack(L, values->len, "too many async values");
+	for(i = 0; i < values->len; i++)
+	{
+		value = &g_array_index(values, async_value, i);
+		switch(value->type)
+		{
+			case LUA_TBOOLEAN:
+				lua_pushboolean(L, (int)value->number);
+				break;
+			case LUA_TNUMBER:
+				lua_pushnumber(L, value->number);
+				break;
+			case LUA_TSTRING:
+				lua_pushlstring(L, value->string, value->len);
+				break;
+			default:
+				lua_pushnil(L);
+		}
+	}
+}
+
+static char async_job_field[] = "async job";
+
+/* work can't poll for itself, so stop it from a count hook once cancelled */
+static void async_check_cancelled(lua_State *L, lua_Debug *ar)
+{
+	hexchat_async *job;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, async_job_field);
+	job = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if(hexchat_async_cancelled(ph, job))
+		luaL_error(L, "cancelled");
+}
+
+#if LUA_VERSION_NUM >= 502
+/* the dump kept the work function's upvalues but not their values: point
+   _ENV at the new state's globals wherever it is, and clear the rest */
+static void async_set_env(lua_State *L)
+{
+	char const *name;
+	int i;
+
+	for(i = 1; (name = lua_getupvalue(L, -1, i)); i++)
+	{
+		lua_pop(L, 1);
+		if(!strcmp(name, "_ENV"))
+			lua_pushglobaltable(L);
+		else
+			lua_pushnil(L);
+		lua_setupvalue(L, -2, i);
+	}
+}
+#endif
+
+/* runs on a worker thread, in a fresh lua_State of its own */
+static void async_work(hexchat_async *job, void *udata)
+{
+	async_info *info = udata;
+	lua_State *L;
+	char const *error;
+	int base, bad;
+
+	L = luaL_newstate();
+	if(!L)
+	{
+		info->error = g_strdup("not enough memory");
+		return;
+	}
+	luaL_openlibs(L);
+	lua_pushlightuserdata(L, job);
+	lua_setfield(L, LUA_REGISTRYINDEX, async_job_field);
+	lua_sethook(L, async_check_cancelled, LUA_MASKCOUNT, 1000);
+	lua_getglobal(L, "debug");
+	lua_getfield(L, -1, "traceback");
+	lua_remove(L, -2);
+	base = lua_gettop(L);
+
+	if(luaL_loadbuffer(L, info->code->str, info->code->len, "=async"))
+	{
+		error = lua_tostring(L, -1);
+		info->error = g_strdup(error ? error : "(non-string error)");
+	}
+	else
+	{
+#if LUA_VERSION_NUM >= 502
+		async_set_env(L);
+#endif
+		async_values_push(L, info->args);
+		if(lua_pcall(L, info->args->len, LUA_MULTRET, base))
+		{
+			error = lua_tostring(L, -1);
+			info->error = g_strdup(error ? error : "(non-string error)");
+		}
+		else
+		{
+			bad = async_values_get(L, base + 1, lua_gettop(L), info->results);
+			if(bad)
+				info->error = g_strdup_printf("async work can't return a %s", luaL_typename(L, bad));
+		}
+	}
+
+	lua_close(L);
+}
+
+static void async_free(async_info *info)
+{
+	g_string_free(info->code, TRUE);
+	g_array_unref(info->args);
+	g_array_unref(info->results);
+	g_free(info->error);
+	g_free(info);
+}
+
+static void async_done(hexchat_async *job, int cancelled, void *udata)
+{
+	async_info *info = udata;
+	script_info *script = info->script;
+	lua_State *L;
+	async_info **u;
+	int base;
+
+	if(!script)
+	{
+		async_free(info);
+		return;
+	}
+
+	L = script->state;
+	g_ptr_array_remove_fast(script->jobs, info);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info->self);
+	u = lua_touserdata(L, -1);
+	*u = NULL;
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, info->self);
+
+	if(!cancelled && info->error)
+		hexchat_printf(ph, "Lua error in async work: %s", info->error);
+	if(cancelled || info->error || info->done == LUA_NOREF)
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, info->done);
+		async_free(info);
+		return;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, script->traceback);
+	base = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info->done);
+	luaL_unref(L, LUA_REGISTRYINDEX, info->done);
+	async_values_push(L, info->results);
+	script->status |= STATUS_ACTIVE;
+	if(lua_pcall(L, info->results->len, 0, base))
+	{
+		char const *error = lua_tostring(L, -1);
+		hexchat_printf(ph, "Lua error in async done: %s", error ? error : "(non-string error)");
+	}
+	lua_settop(L, base - 1);
+	async_free(info);
+	check_deferred(script);
+}
+
+/* the script is going away; its jobs are freed when hexchat reports them */
+static void cancel_jobs(script_info *script)
+{
+	async_info *info;
+	guint i;
+
+	if(!script->jobs)
+		return;
+	for(i = 0; i < script->jobs->len; i++)
+	{
+		info = g_ptr_array_index(script->jobs, i);
+		info->script = NULL;
+		hexchat_async_cancel(ph, info->job);
+	}
+	g_clear_pointer(&script->jobs, g_ptr_array_unref);
+}
+
+/* hexchat.run_async(work, done, ...): work(...) runs on another thread in a
+   state of its own, so it sees only the standard libraries, its arguments,
+   and no upvalues. Arguments and results must be nil, booleans, numbers or
+   strings. done(results...) is called back here. Cancelling, or unloading
+   the script, raises an error inside work the next time it runs Lua code. */
+static int api_hexchat_run_async(lua_State *L)
+{
+	script_info *script = get_info(L);
+	async_info *info, **u;
+	int bad;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	if(!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	info = g_new0(async_info, 1);
+	info->code = g_string_new(NULL);
+	info->args = g_array_new(FALSE, FALSE, sizeof(async_value));
+	g_array_set_clear_func(info->args, (GDestroyNotify)async_value_free);
+	info->results = g_array_new(FALSE, FALSE, sizeof(async_value));
+	g_array_set_clear_func(info->results, (GDestroyNotify)async_value_free);
+
+	lua_pushvalue(L, 1);
+	if(lua_iscfunction(L, 1) || lua_dump(L, async_dump_writer, info->code))
+	{
+		async_free(info);
+		return luaL_argerror(L, 1, "must be a Lua function");
+	}
+	lua_pop(L, 1);
+	bad = async_values_get(L, 3, lua_gettop(L), info->args);
+	if(bad)
+	{
+		async_free(info);
+		return luaL_argerror(L, bad, "must be nil, a boolean, a number or a string");
+	}
+
+	info->done = LUA_NOREF;
+	if(!lua_isnoneornil(L, 2))
+	{
+		lua_pushvalue(L, 2);
+		info->done = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	info->script = script;
+	g_ptr_array_add(script->jobs, info);
+
+	u = lua_newuserdata(L, sizeof(async_info *));
+	*u = info;
+	luaL_newmetatable(L, "async");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	info->self = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	info->job = hexchat_run_async(ph, async_work, async_done, info);
+	return 1;
+}
+
+static int api_async_cancel(lua_State *L)
+{
+	async_info **u = luaL_checkudata(L, 1, "async");
+
+	if(*u)
+		hexchat_async_cancel(ph, (*u)->job);
+	return 0;
+}
+
 static int api_hexchat_find_context(lua_State *L)
 {
 	char const *server = luaL_optstring(L, 1, NULL);
@@ -749,9 +1251,53 @@ static int api_hexchat_attrs(lua_State *L)
 	return 1;
 }
 
+typedef struct
+{
+	hexchat_list *list;
+	int fields; /* registry ref to the list's field name -> ID table */
+}
+list_info;
+
+/* name -> (field ID << 8 | type letter), built once per list and kept in the registry */
+static int list_field_table(lua_State *L, char const *name)
+{
+	char const * const *fields;
+	int ref, i;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "hexchat_list_fields");
+	if(lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "hexchat_list_fields");
+	}
+	lua_getfield(L, -1, name);
+	if(!lua_isnil(L, -1))
+	{
+		ref = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		return ref;
+	}
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	fields = hexchat_list_fields(ph, name);
+	for(i = 0; fields && fields[i]; i++)
+	{
+		lua_pushinteger(L, hexchat_list_field_id(ph, name, fields[i] + 1) << 8 | fields[i][0]);
+		lua_setfield(L, -2, fields[i] + 1);
+	}
+	ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushinteger(L, ref);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+	return ref;
+}
+
 static int api_iterate_closure(lua_State *L)
 {
-	hexchat_list *list = *(hexchat_list **)luaL_checkudata(L, lua_upvalueindex(1), "list");
+	hexchat_list *list = ((list_info *)luaL_checkudata(L, lua_upvalueindex(1), "list"))->list;
 	if(hexchat_list_next(ph, list))
 	{
 		lua_pushvalue(L, lua_upvalueindex(1));
@@ -764,11 +1310,13 @@ static int api_iterate_closure(lua_State *L)
 static int api_hexchat_iterate(lua_State *L)
 {
 	char const *name = luaL_checkstring(L, 1);
-	hexchat_list *list = hexchat_list_get(ph, name);
+	hexchat_list *list = hexchat_list_open(ph, name);
 	if(list)
 	{
-		hexchat_list **u = lua_newuserdata(L, sizeof(hexchat_list *));
-		*u = list;
+		int fields = list_field_table(L, name);
+		list_info *u = lua_newuserdata(L, sizeof(list_info));
+		u->list = list;
+		u->fields = fields;
 		luaL_newmetatable(L, "list");
 		lua_setmetatable(L, -2);
 		lua_pushcclosure(L, api_iterate_closure, 1);
@@ -1012,9 +1560,61 @@ static int api_attrs_meta_gc(lua_State *L)
 
 static int api_list_meta_index(lua_State *L)
 {
-	hexchat_list *list = *(hexchat_list **)luaL_checkudata(L, 1, "list");
-	char const *key = luaL_checkstring(L, 2);
-	return list_marshal(L, key, list);
+	list_info *info = luaL_checkudata(L, 1, "list");
+	int field, number;
+	char const *str;
+	time_t tm;
+
+	luaL_checkstring(L, 2);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, info->fields);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if(lua_isnil(L, -1))
+		return 1;
+	field = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+
+	switch(field & 0xff)
+	{
+		case 'p':
+			str = hexchat_list_str_id(ph, info->list, field >> 8);
+			if(str)
+			{
+				hexchat_context **u = lua_newuserdata(L, sizeof(hexchat_context *));
+				*u = (hexchat_context *)str;
+				luaL_newmetatable(L, "context");
+				lua_setmetatable(L, -2);
+				return 1;
+			}
+			break;
+		case 's':
+			str = hexchat_list_str_id(ph, info->list, field >> 8);
+			if(str)
+			{
+				lua_pushstring(L, str);
+				return 1;
+			}
+			break;
+		case 'i':
+			number = hexchat_list_int_id(ph, info->list, field >> 8);
+			if(number != -1)
+			{
+				lua_pushinteger(L, number);
+				return 1;
+			}
+			break;
+		case 't':
+			tm = hexchat_list_time_id(ph, info->list, field >> 8);
+			if(tm != -1)
+			{
+				lua_pushinteger(L, tm);
+				return 1;
+			}
+			break;
+	}
+
+	lua_pushnil(L);
+	return 1;
 }
 
 static int api_list_meta_newindex(lua_State *L)
@@ -1024,7 +1624,7 @@ static int api_list_meta_newindex(lua_State *L)
 
 static int api_list_meta_gc(lua_State *L)
 {
-	hexchat_list *list = *(hexchat_list **)luaL_checkudata(L, 1, "list");
+	hexchat_list *list = ((list_info *)luaL_checkudata(L, 1, "list"))->list;
 	hexchat_list_free(ph, list);
 	return 0;
 }
@@ -1044,9 +1644,11 @@ static luaL_Reg api_hexchat[] = {
 	{"hook_print_attrs", api_hexchat_hook_print_attrs},
 	{"hook_server", api_hexchat_hook_server},
 	{"hook_server_attrs", api_hexchat_hook_server_attrs},
+	{"hook_server_batch", api_hexchat_hook_server_batch},
 	{"hook_timer", api_hexchat_hook_timer},
 	{"hook_unload", api_hexchat_hook_unload},
 	{"unhook", api_hexchat_unhook},
+	{"run_async", api_hexchat_run_async},
 	{"get_context", api_hexchat_get_context},
 	{"find_context", api_hexchat_find_context},
 	{"set_context", api_hexchat_set_context},
@@ -1079,6 +1681,11 @@ static luaL_Reg api_hook_meta_index[] = {
 	{NULL, NULL}
 };
 
+static luaL_Reg api_async_meta_index[] = {
+	{"cancel", api_async_cancel},
+	{NULL, NULL}
+};
+
 static luaL_Reg api_attrs_meta[] = {
 	{"__index", api_attrs_meta_index},
 	{"__newindex", api_attrs_meta_newindex},
@@ -1093,10 +1700,75 @@ static luaL_Reg api_list_meta[] = {
 	{NULL, NULL}
 };
 
+#ifdef LUA_FFILIBNAME
+/* hexchat.ffi: hooks that get the words as char ** cdata instead of tables
+   of strings, and a few helpers to read them */
+static char const ffi_helpers[] =
+	"local hook_command, hook_print, hook_server = ...\n"
+	"local ffi = require 'ffi'\n"
+	"local cast, string, C = ffi.cast, ffi.string, ffi.C\n"
+	"local words_t = ffi.typeof 'char **'\n"
+	"pcall(ffi.cdef, 'int strcmp(const char *, const char *);')\n"
+	"local function wrap(callback)\n"
+	"	return function(word, word_eol)\n"
+	"		return callback(cast(words_t, word), word_eol and cast(words_t, word_eol))\n"
+	"	end\n"
+	"end\n"
+	"local M = {}\n"
+	"function M.hook_command(command, callback, help, pri)\n"
+	"	return hook_command(command, wrap(callback), help, pri)\n"
+	"end\n"
+	"function M.hook_print(event, callback, pri)\n"
+	"	return hook_print(event, wrap(callback), pri)\n"
+	"end\n"
+	"function M.hook_server(command, callback, pri)\n"
+	"	return hook_server(command, wrap(callback), pri)\n"
+	"end\n"
+	"function M.string(words, i)\n"
+	"	return string(words[i])\n"
+	"end\n"
+	"function M.equals(words, i, s)\n"
+	"	return C.strcmp(words[i], s) == 0\n"
+	"end\n"
+	"function M.count(words)\n"
+	"	for i = 31, 1, -1 do\n"
+	"		if words[i][0] ~= 0 then\n"
+	"			return i\n"
+	"		end\n"
+	"	end\n"
+	"	return 0\n"
+	"end\n"
+	"return M\n";
+
+static void luaopen_hexchat_ffi(lua_State *L)
+{
+	if(luaL_loadbuffer(L, ffi_helpers, sizeof(ffi_helpers) - 1, "=hexchat.ffi"))
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushboolean(L, 1);
+	lua_pushcclosure(L, api_hexchat_hook_command, 1);
+	lua_pushboolean(L, 1);
+	lua_pushcclosure(L, api_hexchat_hook_print, 1);
+	lua_pushboolean(L, 1);
+	lua_pushcclosure(L, api_hexchat_hook_server, 1);
+	if(lua_pcall(L, 3, 1, 0))
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_setfield(L, -2, "ffi");
+}
+#endif
+
 static int luaopen_hexchat(lua_State *L)
 {
 	lua_newtable(L);
 	luaL_setfuncs(L, api_hexchat, 0);
+#ifdef LUA_FFILIBNAME
+	luaopen_hexchat_ffi(L);
+#endif
 
 	lua_pushinteger(L, HEXCHAT_PRI_HIGHEST); lua_setfield(L, -2, "PRI_HIGHEST");
 	lua_pushinteger(L, HEXCHAT_PRI_HIGH); lua_setfield(L, -2, "PRI_HIGH");
@@ -1132,6 +1804,12 @@ static int luaopen_hexchat(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	luaL_newmetatable(L, "async");
+	lua_newtable(L);
+	luaL_setfuncs(L, api_async_meta_index, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	luaL_newmetatable(L, "context");
 	lua_newtable(L);
 	lua_pushcfunction(L, api_hexchat_set_context);
@@ -1158,6 +1836,11 @@ static int luaopen_hexchat(lua_State *L)
 	luaL_setfuncs(L, api_list_meta, 0);
 	lua_pop(L, 1);
 
+	luaL_newmetatable(L, "server_line");
+	lua_pushcfunction(L, api_server_line_meta_index);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	return 1;
 }
 
@@ -1304,6 +1987,7 @@ static void destroy_script(script_info *info)
 	{
 		g_clear_pointer(&info->hooks, g_ptr_array_unref);
 		g_clear_pointer(&info->unload_hooks, g_ptr_array_unref);
+		cancel_jobs(info);
 		g_clear_pointer(&info->state, lua_close);
 		if (info->handle)
 			hexchat_plugingui_remove(ph, info->handle);
@@ -1323,6 +2007,7 @@ static script_info *create_script(char const *file)
 	script_info *info = g_new0(script_info, 1);
 	info->hooks = g_ptr_array_new_with_free_func((GDestroyNotify)free_hook);
 	info->unload_hooks = g_ptr_array_new_with_free_func((GDestroyNotify)free_hook);
+	info->jobs = g_ptr_array_new();
 	info->filename = g_strdup(expand_path(file));
 	L = luaL_newstate();
 	info->state = L;
@@ -1470,6 +2155,7 @@ static void create_interpreter(void)
 	interp = g_new0(script_info, 1);
 	interp->hooks = g_ptr_array_new_with_free_func((GDestroyNotify)free_hook);
 	interp->unload_hooks = g_ptr_array_new_with_free_func((GDestroyNotify)free_hook);
+	interp->jobs = g_ptr_array_new();
 	interp->name = "lua interpreter";
 	interp->description = "";
 	interp->version = "";
@@ -1493,6 +2179,7 @@ static void destroy_interpreter(void)
 	{
 		g_clear_pointer(&interp->hooks, g_ptr_array_unref);
 		g_clear_pointer(&interp->unload_hooks, g_ptr_array_unref);
+		cancel_jobs(interp);
 		g_clear_pointer(&interp->state, lua_close);
 		g_clear_pointer(&interp, g_free);
 	}
@@ -65,7 +65,7 @@ our %EXPORT_TAGS = (
 		qw(KEEP REMOVE), # timers
 	],
 	hooks => [
-		qw(hook_server hook_command hook_print hook_timer hook_fd unhook),
+		qw(hook_server hook_server_batch hook_command hook_print hook_timer hook_fd unhook),
 	],
 	util => [
 		qw(register nickcmp strip_code send_modes), # misc
@@ -157,6 +157,32 @@ sub hook_server {
 	return $hook;
 }
 
+sub hook_server_batch {
+	return undef unless @_ >= 2;
+	my $message = shift;
+	my $callback = shift;
+	my $options = shift;
+	my ($package, $calling_package) = HexChat::Embed::find_pkg();
+
+	$callback = HexChat::Embed::fix_callback(
+		$package, $calling_package, $callback
+	);
+
+	my ($priority, $data) = ( HexChat::PRI_NORM, undef );
+	_process_hook_options(
+		$options,
+		[qw(priority data)],
+		[\($priority, $data)],
+	);
+
+	my $pkg_info = HexChat::Embed::pkg_info( $package );
+	my $hook = HexChat::Internal::hook_server_batch(
+		$message, $priority, $callback, $data, $package
+	);
+	push @{$pkg_info->{hooks}}, $hook if defined $hook;
+	return $hook;
+}
+
 sub hook_command {
 	return undef unless @_ >= 2;
 	my $command = shift;
@@ -0,0 +1,70 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Word arrays for hook callbacks, shared with tests/hook-bench.c. Expects
+ * perl.h and a my_perl in scope. */
+
+#ifndef HEXCHAT_PERL_WORDS_H
+#define HEXCHAT_PERL_WORDS_H
+
+/* Returns a mortal reference to words[1..count] in an array kept in *cache.
+ * The array and its elements are refilled in place from one call to the
+ * next, unless the script kept a reference to them, in which case they are
+ * left to it and replaced. A NULL word becomes undef. */
+static SV *
+words_to_rv (AV **cache, char *words[], int count)
+{
+	AV *av = *cache;
+	SV **elem;
+	SV *sv;
+	int i;
+
+	if (av == NULL || SvREFCNT (av) > 1 || SvMAGICAL (av)) {
+		if (av != NULL) {
+			SvREFCNT_dec (av);
+		}
+		av = *cache = newAV ();
+	}
+
+	if (count > 0) {
+		av_extend (av, count - 1);
+	}
+
+	for (i = 0; i < count; i++) {
+		elem = av_fetch (av, i, 0);
+		if (elem != NULL && SvREFCNT (*elem) == 1 && !SvREADONLY (*elem)
+			 && !SvMAGICAL (*elem)) {
+			sv = *elem;
+		} else {
+			sv = newSV (0);
+			av_store (av, i, sv);
+		}
+
+		if (words[i + 1] == NULL) {
+			sv_setsv (sv, &PL_sv_undef);
+		} else {
+			sv_setpv (sv, words[i + 1]);
+			SvUTF8_on (sv);
+		}
+	}
+	av_fill (av, count - 1);
+
+	return sv_2mortal (newRV_inc ((SV *) av));
+}
+
+#endif
@@ -162,9 +162,14 @@ typedef struct
 	                       by returning REMOVE
 							   */
 	unsigned int depth;
+	AV *word;         /* reused between calls, see words_to_rv () */
+	AV *word_eol;
 } HookData;
 
 static PerlInterpreter *my_perl = NULL;
+static GV *current_package_gv = NULL;
+
+#include "perl-words.h"
 extern void boot_DynaLoader (pTHX_ CV * cv);
 
 /*
@@ -283,35 +288,66 @@ list_item_to_sv ( hexchat_list *list, const char *const *fields )
 	return sv_2mortal (newRV_noinc ((SV *) hash));
 }
 
+static SV *
+list_values_to_sv (const char *const *fields, const hexchat_list_value *values)
+{
+	HV *hash = newHV();
+	SV *field_value;
+	int i;
+
+	for (i = 0; fields[i] != NULL; i++) {
+		switch (fields[i][0]) {
+		case 's':
+			if (values[i].str != NULL) {
+				field_value = newSVpvn (values[i].str, strlen (values[i].str));
+			} else {
+				field_value = &PL_sv_undef;
+			}
+			break;
+		case 'p':
+			field_value = newSViv (PTR2IV (values[i].str));
+			break;
+		case 'i':
+			field_value = newSVuv (values[i].num);
+			break;
+		case 't':
+			/* see list_item_to_sv () for why an NV is good enough here */
+			field_value = newSVnv ((const NV) values[i].time);
+			break;
+		default:
+			field_value = &PL_sv_undef;
+		}
+		(void)hv_store (hash, fields[i] + 1, strlen (fields[i] + 1), field_value, 0);
+	}
+	return sv_2mortal (newRV_noinc ((SV *) hash));
+}
+
 #define WORD_ARRAY_LEN 32
 
-static AV *
-array2av (char *array[])
+/* the words up to the first empty one */
+static int
+leading_words (char *array[])
 {
-	int count = 0;
-	SV *temp = NULL;
-	AV *av = newAV();
-	sv_2mortal ((SV *)av);
+	int count;
 
 	for (
 		count = 1;
 		count < WORD_ARRAY_LEN && array[count] != NULL && array[count][0] != 0;
 		count++
-	) {
-		temp = newSVpv (array[count], 0);
-		SvUTF8_on (temp);
-		av_push (av, temp);
-	}
+	);
 
-	return av;
+	return count - 1;
 }
 
 /* sets $HexChat::Embed::current_package */
 static void
 set_current_package (SV *package)
 {
-	SV *current_package = get_sv ("HexChat::Embed::current_package", 1);
-	SvSetSV_nosteal (current_package, package);
+	if (current_package_gv == NULL) {
+		current_package_gv = gv_fetchpv ("HexChat::Embed::current_package",
+													GV_ADD, SVt_PV);
+	}
+	SvSetSV_nosteal (GvSVn (current_package_gv), package);
 }
 
 static int
@@ -443,8 +479,8 @@ server_cb (char *word[], char *word_eol[], void *userdata)
 	/*               hexchat_printf (ph, */
 	/*                               "Received %d words in server callback", av_len (wd)); */
 	PUSHMARK (SP);
-	XPUSHs (newRV_noinc ((SV *) array2av (word)));
-	XPUSHs (newRV_noinc ((SV *) array2av (word_eol)));
+	XPUSHs (words_to_rv (&data->word, word, leading_words (word)));
+	XPUSHs (words_to_rv (&data->word_eol, word_eol, leading_words (word_eol)));
 	XPUSHs (data->userdata);
 	PUTBACK;
 
@@ -475,6 +511,53 @@ server_cb (char *word[], char *word_eol[], void *userdata)
 	return retVal;
 }
 
+/* the lines go to the callback as an array of hashes with their text, time
+   and context */
+static int
+server_batch_cb (hexchat_server_line *const *lines, int count, void *userdata)
+{
+	HookData *data = (HookData *) userdata;
+	AV *av;
+	HV *line;
+	SV *text;
+	int i;
+
+	dSP;
+	ENTER;
+	SAVETMPS;
+
+	av = (AV *) sv_2mortal ((SV *) newAV ());
+	av_extend (av, count - 1);
+	for (i = 0; i < count; i++) {
+		line = newHV ();
+		text = newSVpv (lines[i]->line, 0);
+		SvUTF8_on (text);
+		(void)hv_store (line, "text", 4, text, 0);
+		(void)hv_store (line, "time", 4, newSVnv ((const NV) lines[i]->server_time_utc), 0);
+		(void)hv_store (line, "context", 7, newSViv (PTR2IV (lines[i]->context)), 0);
+		av_push (av, newRV_noinc ((SV *) line));
+	}
+
+	PUSHMARK (SP);
+	XPUSHs (sv_2mortal (newRV_inc ((SV *) av)));
+	XPUSHs (data->userdata);
+	PUTBACK;
+
+	set_current_package (data->package);
+	call_sv (data->callback, G_EVAL | G_DISCARD | G_KEEPERR);
+	set_current_package (&PL_sv_undef);
+	SPAGAIN;
+	if (SvTRUE (ERRSV)) {
+		hexchat_printf (ph, "Error in server batch callback %s", SvPV_nolen (ERRSV));
+	}
+
+	PUTBACK;
+	FREETMPS;
+	LEAVE;
+
+	return HEXCHAT_EAT_NONE;
+}
+
 static int
 command_cb (char *word[], char *word_eol[], void *userdata)
 {
@@ -492,8 +575,8 @@ command_cb (char *word[], char *word_eol[], void *userdata)
 	/*               hexchat_printf (ph, "Received %d words in command callback", */
 	/*                               av_len (wd)); */
 	PUSHMARK (SP);
-	XPUSHs (newRV_noinc ((SV *) array2av (word)));
-	XPUSHs (newRV_noinc ((SV *) array2av (word_eol)));
+	XPUSHs (words_to_rv (&data->word, word, leading_words (word)));
+	XPUSHs (words_to_rv (&data->word_eol, word_eol, leading_words (word_eol)));
 	XPUSHs (data->userdata);
 	PUTBACK;
 
@@ -529,12 +612,9 @@ print_cb (char *word[], void *userdata)
 {
 
 	HookData *data = (HookData *) userdata;
-	SV *temp = NULL;
 	int retVal = 0;
 	int count = 1;
 	int last_index = 31;
-	/* must be initialized after SAVETMPS */
-	AV *wd = NULL;
 
 	dSP;
 	ENTER;
@@ -543,9 +623,6 @@ print_cb (char *word[], void *userdata)
 	if (data->depth)
 		return HEXCHAT_EAT_NONE;
 
-	wd = newAV ();
-	sv_2mortal ((SV *) wd);
-
 	/* need to scan backwards to find the index of the last element since some
 	   events such as "DCC Timeout" can have NULL elements in between non NULL
 	   elements */
@@ -555,21 +632,8 @@ print_cb (char *word[], void *userdata)
 		last_index--;
 	}
 
-	for (count = 1; count <= last_index; count++) {
-		if (word[count] == NULL) {
-			av_push (wd, &PL_sv_undef);
-		} else if (word[count][0] == 0) {
-			av_push (wd, newSVpvn ("",0));	
-		} else {
-			temp = newSVpv (word[count], 0);
-			SvUTF8_on (temp);
-			av_push (wd, temp);
-		}
-	}
-
-	/*hexchat_printf (ph, "Received %d words in print callback", av_len (wd)+1); */
 	PUSHMARK (SP);
-	XPUSHs (newRV_noinc ((SV *) wd));
+	XPUSHs (words_to_rv (&data->word, word, last_index));
 	XPUSHs (data->userdata);
 	PUTBACK;
 
@@ -869,7 +933,7 @@ XS (XS_HexChat_hook_server)
 		userdata = ST (3);
 		package = ST (4);
 		data = NULL;
-		data = g_new (HookData, 1);
+		data = g_new0 (HookData, 1);
 		data->callback = newSVsv (callback);
 		data->userdata = newSVsv (userdata);
 		data->depth = 0;
@@ -881,6 +945,34 @@ XS (XS_HexChat_hook_server)
 	}
 }
 
+/* HexChat::Internal::hook_server_batch(name, priority, callback, userdata, package) */
+static
+XS (XS_HexChat_hook_server_batch)
+{
+	char *name;
+	int pri;
+	HookData *data;
+	hexchat_hook *hook;
+
+	dXSARGS;
+
+	if (items != 5) {
+		hexchat_print (ph,
+						 "Usage: HexChat::Internal::hook_server_batch(name, priority, callback, userdata, package)");
+	} else {
+		name = SvPV_nolen (ST (0));
+		pri = (int) SvIV (ST (1));
+		data = g_new0 (HookData, 1);
+		data->callback = newSVsv (ST (2));
+		data->userdata = newSVsv (ST (3));
+		data->package = newSVsv (ST (4));
+
+		hook = hexchat_hook_server_batch (ph, name, pri, server_batch_cb, data);
+
+		XSRETURN_IV (PTR2IV (hook));
+	}
+}
+
 /* HexChat::Internal::hook_command(name, priority, callback, help_text, userdata) */
 static
 XS (XS_HexChat_hook_command)
@@ -914,7 +1006,7 @@ XS (XS_HexChat_hook_command)
 		package = ST (5);
 		data = NULL;
 
-		data = g_new (HookData, 1);
+		data = g_new0 (HookData, 1);
 		data->callback = newSVsv (callback);
 		data->userdata = newSVsv (userdata);
 		data->depth = 0;
@@ -950,7 +1042,7 @@ XS (XS_HexChat_hook_print)
 		userdata = ST (3);
 		package = ST (4);
 
-		data = g_new (HookData, 1);
+		data = g_new0 (HookData, 1);
 		data->callback = newSVsv (callback);
 		data->userdata = newSVsv (userdata);
 		data->depth = 0;
@@ -984,7 +1076,7 @@ XS (XS_HexChat_hook_timer)
 		userdata = ST (2);
 		package = ST (3);
 
-		data = g_new (HookData, 1);
+		data = g_new0 (HookData, 1);
 		data->callback = newSVsv (callback);
 		data->userdata = newSVsv (userdata);
 		data->ctx = hexchat_get_context (ph);
@@ -1034,7 +1126,7 @@ XS (XS_HexChat_hook_fd)
 		}
 #endif
 
-		data = g_new (HookData, 1);
+		data = g_new0 (HookData, 1);
 		data->callback = newSVsv (callback);
 		data->userdata = newSVsv (userdata);
 		data->depth = 0;
@@ -1074,6 +1166,14 @@ XS (XS_HexChat_unhook)
 				SvREFCNT_dec (userdata->package);
 			}
 
+			if (userdata->word != NULL) {
+				SvREFCNT_dec (userdata->word);
+			}
+
+			if (userdata->word_eol != NULL) {
+				SvREFCNT_dec (userdata->word_eol);
+			}
+
 			g_free (userdata);
 		}
 		XSRETURN (retCount);
@@ -1196,6 +1296,9 @@ XS (XS_HexChat_get_list)
 	SV *name;
 	hexchat_list *list;
 	const char *const *fields;
+	hexchat_list_value *values;
+	int *ids;
+	int i;
 	int count = 0;					  /* return value for scalar context */
 	dXSARGS;
 
@@ -1206,7 +1309,7 @@ XS (XS_HexChat_get_list)
 
 		name = ST (0);
 
-		list = hexchat_list_get (ph, SvPV_nolen (name));
+		list = hexchat_list_open (ph, SvPV_nolen (name));
 
 		if (list == NULL) {
 			XSRETURN_EMPTY;
@@ -1221,10 +1324,22 @@ XS (XS_HexChat_get_list)
 		}
 
 		fields = hexchat_list_fields (ph, SvPV_nolen (name));
+		for (count = 0; fields[count] != NULL; count++);
+
+		/* resolve the field names once and fetch each row in one call */
+		ids = g_new (int, count);
+		values = g_new (hexchat_list_value, count);
+		for (i = 0; i < count; i++) {
+			ids[i] = hexchat_list_field_id (ph, SvPV_nolen (name), fields[i] + 1);
+		}
+
 		while (hexchat_list_next (ph, list)) {
-			XPUSHs (list_item_to_sv (list, fields));
+			hexchat_list_fetch (ph, list, ids, count, values);
+			XPUSHs (list_values_to_sv (fields, values));
 		}
 		hexchat_list_free (ph, list);
+		g_free (ids);
+		g_free (values);
 
 		PUTBACK;
 		return;
@@ -1324,6 +1439,7 @@ xs_init (pTHX)
 	/* load up all the custom IRC perl functions */
 	newXS ("HexChat::Internal::register", XS_HexChat_register, __FILE__);
 	newXS ("HexChat::Internal::hook_server", XS_HexChat_hook_server, __FILE__);
+	newXS ("HexChat::Internal::hook_server_batch", XS_HexChat_hook_server_batch, __FILE__);
 	newXS ("HexChat::Internal::hook_command", XS_HexChat_hook_command, __FILE__);
 	newXS ("HexChat::Internal::hook_print", XS_HexChat_hook_print, __FILE__);
 	newXS ("HexChat::Internal::hook_timer", XS_HexChat_hook_timer, __FILE__);
@@ -1500,6 +1616,7 @@ perl_end (void)
 		perl_free (my_perl);
 		PERL_SYS_TERM();
 		my_perl = NULL;
+		current_package_gv = NULL;
 	}
 
 }
@@ -0,0 +1,201 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Callback throughput of a server hook's argument handling, the way
+ * server_cb () did it before the word arrays were reused and the way it does
+ * now, against a couple of typical Perl callbacks. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <EXTERN.h>
+#include <perl.h>
+
+static PerlInterpreter *my_perl = NULL;
+
+#include "../perl-words.h"
+
+#define ROUNDS 200000
+
+static char line[] =
+	":nick!user@host.example PRIVMSG #channel :a typical line of chat in a busy channel";
+static char words[sizeof (line)];
+static char *word[33];
+static char *word_eol[33];
+
+/* split line into word[] at spaces, with word_eol[i] at the offset word i
+ * starts from, like the server tokenizer does */
+static void
+split_line (void)
+{
+	char *p = line, *w = words;
+	int i;
+
+	word[0] = word_eol[0] = "";
+	for (i = 1; i < 32; i++) {
+		word[i] = word_eol[i] = "";
+		if (*p == 0)
+			continue;
+		word_eol[i] = p;
+		word[i] = w;
+		while (*p && *p != ' ')
+			*w++ = *p++;
+		*w++ = 0;
+		while (*p == ' ')
+			p++;
+	}
+	word[32] = word_eol[32] = NULL;
+}
+
+static const char *callbacks =
+	"our @kept;"
+	"sub unused { return 0 }"
+	"sub two_words { my ($word, $word_eol) = @_;"
+	"  return ($word->[1] eq 'PRIVMSG' && $word_eol->[3] =~ /^:/) ? 0 : 1 }"
+	"sub copies { my @word = @{$_[0]}; return scalar @word == 12 ? 0 : 1 }"
+	"sub keeps { push @kept, $_[0]; return 0 }";
+
+/* what server_cb () used before */
+static AV *
+array2av (char *array[])
+{
+	int count = 0;
+	SV *temp = NULL;
+	AV *av = newAV();
+	sv_2mortal ((SV *)av);
+
+	for (count = 1; count < 32 && array[count] != NULL && array[count][0] != 0; count++) {
+		temp = newSVpv (array[count], 0);
+		SvUTF8_on (temp);
+		av_push (av, temp);
+	}
+
+	return av;
+}
+
+static int
+call (SV *callback, SV *word_rv, SV *word_eol_rv, SV *current, SV *package)
+{
+	int count, ret = 0;
+
+	dSP;
+	PUSHMARK (SP);
+	XPUSHs (word_rv);
+	XPUSHs (word_eol_rv);
+	PUTBACK;
+
+	SvSetSV_nosteal (current, package);
+	count = call_sv (callback, G_SCALAR);
+	SPAGAIN;
+	if (count == 1)
+		ret = POPi;
+	PUTBACK;
+
+	return ret;
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench (const char *name, int reuse)
+{
+	SV *callback = (SV *) get_cv (name, 0);
+	SV *package = sv_2mortal (newSVpv ("HexChat::Script::bench", 0));
+	GV *current_gv = gv_fetchpv ("HexChat::Embed::current_package", GV_ADD, SVt_PV);
+	SV *current;
+	AV *word_av = NULL, *word_eol_av = NULL;
+	double start;
+	int i, ret = 0;
+
+	start = now ();
+	for (i = 0; i < ROUNDS; i++) {
+		ENTER;
+		SAVETMPS;
+		if (reuse) {
+			current = GvSVn (current_gv);
+			ret |= call (callback, words_to_rv (&word_av, word, 12),
+							 words_to_rv (&word_eol_av, word_eol, 12), current, package);
+		} else {
+			/* the stash lookup set_current_package () used to do */
+			current = get_sv ("HexChat::Embed::current_package", 1);
+			ret |= call (callback, newRV_noinc ((SV *) array2av (word)),
+							 newRV_noinc ((SV *) array2av (word_eol)), current, package);
+		}
+		FREETMPS;
+		LEAVE;
+	}
+	printf ("%-10s %-6s %8.0f calls/s\n", name, reuse ? "reused" : "fresh",
+			  ROUNDS / (now () - start));
+
+	if (word_av != NULL)
+		SvREFCNT_dec (word_av);
+	if (word_eol_av != NULL)
+		SvREFCNT_dec (word_eol_av);
+
+	return ret;
+}
+
+int
+main (int argc, char *argv[], char *env[])
+{
+	char *args[] = { "", "-e", "0", NULL };
+	AV *kept;
+	int i, ret = 0;
+
+	split_line ();
+
+	PERL_SYS_INIT3 (&argc, &argv, &env);
+	my_perl = perl_alloc ();
+	perl_construct (my_perl);
+	PL_exit_flags |= PERL_EXIT_DESTRUCT_END;
+	perl_parse (my_perl, NULL, 3, args, env);
+	eval_pv (callbacks, TRUE);
+
+	ret |= bench ("unused", 0);
+	ret |= bench ("unused", 1);
+	ret |= bench ("two_words", 0);
+	ret |= bench ("two_words", 1);
+	ret |= bench ("copies", 0);
+	ret |= bench ("copies", 1);
+	ret |= bench ("keeps", 1);
+
+	/* every array a callback held on to keeps what it was given */
+	kept = get_av ("kept", 0);
+	for (i = 0; i <= av_len (kept); i++) {
+		AV *av = (AV *) SvRV (*av_fetch (kept, i, 0));
+		if (av_len (av) != 11 || strcmp (SvPV_nolen (*av_fetch (av, 1, 0)), "PRIVMSG") != 0) {
+			fprintf (stderr, "kept array %d was overwritten\n", i);
+			ret = 1;
+			break;
+		}
+	}
+
+	perl_destruct (my_perl);
+	perl_free (my_perl);
+	PERL_SYS_TERM ();
+
+	return ret;
+}
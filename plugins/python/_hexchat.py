@@ -1,5 +1,6 @@
 import inspect
 import sys
+import threading
 from contextlib import contextmanager
 
 from _hexchat_embedded import ffi, lib
@@ -7,12 +8,12 @@ from _hexchat_embedded import ffi, lib
 __all__ = [
     'EAT_ALL', 'EAT_HEXCHAT', 'EAT_NONE', 'EAT_PLUGIN', 'EAT_XCHAT',
     'PRI_HIGH', 'PRI_HIGHEST', 'PRI_LOW', 'PRI_LOWEST', 'PRI_NORM',
-    '__doc__', '__version__', 'command', 'del_pluginpref', 'emit_print',
+    '__doc__', '__version__', 'async_cancelled', 'cancel_async', 'command', 'del_pluginpref', 'emit_print',
     'find_context', 'get_context', 'get_info',
     'get_list', 'get_lists', 'get_pluginpref', 'get_prefs', 'hook_command',
     'hook_print', 'hook_print_attrs', 'hook_server', 'hook_server_attrs',
-    'hook_timer', 'hook_unload', 'list_pluginpref', 'nickcmp', 'prnt',
-    'set_pluginpref', 'strip', 'unhook',
+    'hook_server_batch', 'hook_timer', 'hook_unload', 'list_pluginpref', 'nickcmp', 'prnt',
+    'run_async', 'set_pluginpref', 'strip', 'unhook',
 ]
 
 __doc__ = 'HexChat Scripting Interface'
@@ -168,51 +169,58 @@ else:
         return name[0]
 
 
+__LIST_LAYOUT_CACHE = {}
+
+
+def __get_list_layout(name):
+    # Field IDs are resolved once per list; each row is then read with a
+    # single hexchat_list_fetch() into a reused buffer
+    layout = __LIST_LAYOUT_CACHE.get(name)
+    if layout is None:
+        fields = __get_fields(name)
+        ids = ffi.new('int[]', len(fields))
+        attrs = []
+        for i, field in enumerate(fields):
+            ids[i] = lib.hexchat_list_field_id(lib.ph, name, field[1:])
+            attrs.append((__cached_decoded_str(field[1:]), get_getter(field)))
+
+        values = ffi.new('hexchat_list_value[]', len(fields))
+        layout = __LIST_LAYOUT_CACHE.setdefault(name, (ids, attrs, values))
+
+    return layout
+
+
 def get_list(name):
-    # XXX: This function is extremely inefficient and could be interators and
-    # lazily loaded properties, but for API compat we stay slow
     orig_name = name
     name = name.encode()
 
     if name not in __get_fields(b'lists'):
         raise KeyError('list not available')
 
-    list_ = lib.hexchat_list_get(lib.ph, name)
+    list_ = lib.hexchat_list_open(lib.ph, name)
     if list_ == ffi.NULL:
         return None
 
+    ids, attrs, values = __get_list_layout(name)
+    count = len(attrs)
     ret = []
-    fields = __get_fields(name)
-
-    def string_getter(field):
-        string = lib.hexchat_list_str(lib.ph, list_, field)
-        if string != ffi.NULL:
-            return __decode(ffi.string(string))
-
-        return ''
-
-    def ptr_getter(field):
-        if field == b'context':
-            ptr = lib.hexchat_list_str(lib.ph, list_, field)
-            ctx = ffi.cast('hexchat_context*', ptr)
-            return Context(ctx)
-
-        return None
-
-    getters = {
-        ord('s'): string_getter,
-        ord('i'): lambda field: lib.hexchat_list_int(lib.ph, list_, field),
-        ord('t'): lambda field: lib.hexchat_list_time(lib.ph, list_, field),
-        ord('p'): ptr_getter,
-    }
 
     while lib.hexchat_list_next(lib.ph, list_) == 1:
+        lib.hexchat_list_fetch(lib.ph, list_, ids, count, values)
         item = ListItem(orig_name)
-        for _field in fields:
-            getter = getters.get(get_getter(_field))
-            if getter is not None:
-                field_name = _field[1:]
-                setattr(item, __cached_decoded_str(field_name), getter(field_name))
+        for i, (attr, kind) in enumerate(attrs):
+            value = values[i]
+            if kind == ord('s'):
+                setattr(item, attr, __decode(ffi.string(value.str)) if value.str != ffi.NULL else '')
+            elif kind == ord('i'):
+                setattr(item, attr, value.num)
+            elif kind == ord('t'):
+                setattr(item, attr, value.time)
+            elif kind == ord('p'):
+                if attr == 'context':
+                    setattr(item, attr, Context(ffi.cast('hexchat_context*', value.str)))
+                else:
+                    setattr(item, attr, None)
 
         ret.append(item)
 
@@ -263,6 +271,14 @@ def hook_server_attrs(name, callback, userdata=None, priority=PRI_NORM):
     return id(hook)
 
 
+def hook_server_batch(name, callback, userdata=None, priority=PRI_NORM):
+    plugin = __get_current_plugin()
+    hook = plugin.add_hook(callback, userdata)
+    handle = lib.hexchat_hook_server_batch(lib.ph, name.encode(), priority, lib._on_server_batch_hook, hook.handle)
+    hook.hexchat_hook = handle
+    return id(hook)
+
+
 def hook_timer(timeout, callback, userdata=None):
     plugin = __get_current_plugin()
     hook = plugin.add_hook(callback, userdata)
@@ -282,6 +298,32 @@ def unhook(handle):
     return plugin.remove_hook(handle)
 
 
+def run_async(work, done=None, userdata=None):
+    plugin = __get_current_plugin()
+    job = plugin.add_job(work, done, userdata)
+    job.hexchat_job = lib.hexchat_run_async(lib.ph, lib._on_async_work, lib._on_async_done, job.handle)
+    return id(job)
+
+
+def cancel_async(handle):
+    plugin = __get_current_plugin()
+    return plugin.cancel_job(handle)
+
+
+# The job each worker thread is running, set by python.py around work.
+async_local = threading.local()
+
+
+# Long running work should check this and return early once it is true,
+# unloading waits for work that is still running.
+def async_cancelled():
+    hexchat_job = getattr(async_local, 'hexchat_job', None)
+    if hexchat_job is None:
+        return False
+
+    return bool(lib.hexchat_async_cancelled(lib.ph, hexchat_job))
+
+
 def set_pluginpref(name, value):
     if isinstance(value, str):
         return bool(lib.hexchat_pluginpref_set_str(lib.ph, name.encode(), value.encode()))
@@ -39,7 +39,10 @@ extern "Python" int _on_print_hook(char **, void *);
 extern "Python" int _on_print_attrs_hook(char **, hexchat_event_attrs *, void *);
 extern "Python" int _on_server_hook(char **, char **, void *);
 extern "Python" int _on_server_attrs_hook(char **, char **, hexchat_event_attrs *, void *);
+extern "Python" int _on_server_batch_hook(hexchat_server_line *const *, int, void *);
 extern "Python" int _on_timer_hook(void *);
+extern "Python" void _on_async_work(hexchat_async *, void *);
+extern "Python" void _on_async_done(hexchat_async *, int, void *);
 
 extern "Python" int _on_plugin_init(char **, char **, char **, char *, char *);
 extern "Python" int _on_plugin_deinit(void);
@@ -9,6 +9,11 @@ import traceback
 import weakref
 from contextlib import contextmanager
 
+try:
+    from collections.abc import MutableSequence
+except ImportError:
+    from collections import MutableSequence
+
 from _hexchat_embedded import ffi, lib
 
 if sys.version_info < (3, 0):
@@ -29,6 +34,7 @@ hexchat = None
 local_interp = None
 hexchat_stdout = None
 plugins = set()
+jobs = set()  # kept alive until their done callback, even past their plugin
 
 
 @contextmanager
@@ -96,6 +102,22 @@ class Hook:
             lib.hexchat_unhook(lib.ph, self.hexchat_hook)
 
 
+class Job:
+    def __init__(self, work, done, userdata):
+        self.work = work
+        self.done = done
+        self.userdata = userdata
+        self.result = None
+        self.error = None
+        self.hexchat_job = None
+        self.handle = ffi.new_handle(self)
+
+    def cancel(self):
+        # hexchat frees the job once done has been called
+        if self.hexchat_job is not None:
+            lib.hexchat_async_cancel(lib.ph, self.hexchat_job)
+
+
 if sys.version_info[0] == 2:
     def compile_file(data, filename):
         return compile(data, filename, 'exec', dont_inherit=True)
@@ -127,6 +149,7 @@ class Plugin:
         self.version = ''
         self.description = ''
         self.hooks = set()
+        self.jobs = weakref.WeakSet()
         self.globals = {
             '__plugin': weakref.proxy(self),
             '__name__': '__main__',
@@ -147,6 +170,20 @@ class Plugin:
         log('Hook not found')
         return None
 
+    def add_job(self, work, done, userdata):
+        job = Job(work, done, userdata)
+        self.jobs.add(job)
+        jobs.add(job)
+        return job
+
+    def cancel_job(self, job):
+        for j in self.jobs:
+            if id(j) == job:
+                j.cancel()
+                return True
+
+        return False
+
     def loadfile(self, filename):
         try:
             self.filename = filename
@@ -187,6 +224,9 @@ class Plugin:
                     traceback.print_exc()
 
         del self.hooks
+        for job in list(self.jobs):
+            job.cancel()
+
         if self.ph is not None:
             lib.hexchat_plugingui_remove(lib.ph, self.ph)
 
@@ -203,36 +243,260 @@ else:
 # There can be empty entries between non-empty ones so find the actual last value
 def wordlist_len(words):
     for i in range(31, 0, -1):
-        if ffi.string(words[i]):
+        if words[i][0] != b'\0':
             return i
 
     return 0
 
 
+_UNSET = object()
+
+
+class WordList(MutableSequence):
+    """The word or word_eol list handed to a hook.
+
+    It behaves like the list it replaces, but a word is only decoded the
+    first time it is read, and the length is only worked out when something
+    needs it. The C strings are gone once the hook returns, so a list the
+    hook kept is detach()ed then: the raw bytes are copied and still decoded
+    lazily from the copy.
+    """
+    __slots__ = ('_get', '_snapshot', '_size', '_len', '_cache', '_eol')
+
+    def __init__(self, size, get, snapshot):
+        self._get = get
+        self._snapshot = snapshot
+        self._size = size
+        self._len = None
+        self._eol = None
+        self._cache = [_UNSET] * 31
+
+    def __len__(self):
+        if self._len is None:
+            self._len = self._size()
+            del self._cache[self._len:]
+
+        return self._len
+
+    def __getitem__(self, index):
+        if isinstance(index, slice):
+            return self._words()[index]
+
+        if index < 0:
+            index += len(self)
+            if index < 0:
+                raise IndexError('list index out of range')
+
+        value = self._cache[index]
+        if value is _UNSET:
+            value = self._get(index)
+            # an empty word may be past the end
+            if not value and index >= len(self):
+                raise IndexError('list index out of range')
+
+            self._cache[index] = value
+
+        return value
+
+    def __setitem__(self, index, value):
+        self.materialize()
+        self._cache[index] = value
+        self._len = len(self._cache)
+
+    def __delitem__(self, index):
+        self.materialize()
+        del self._cache[index]
+        self._len = len(self._cache)
+
+    def insert(self, index, value):
+        self.materialize()
+        self._cache.insert(index, value)
+        self._len = len(self._cache)
+
+    def __iter__(self):
+        return iter(self._words()[:])
+
+    def __reversed__(self):
+        for i in range(len(self) - 1, -1, -1):
+            yield self[i]
+
+    def __contains__(self, value):
+        return any(word == value for word in self)
+
+    def __eq__(self, other):
+        if isinstance(other, (WordList, list, tuple)):
+            return list(self) == list(other)
+
+        return NotImplemented
+
+    def __ne__(self, other):
+        ret = self.__eq__(other)
+        return ret if ret is NotImplemented else not ret
+
+    __hash__ = None
+
+    def __add__(self, other):
+        return list(self) + list(other)
+
+    def __radd__(self, other):
+        return list(other) + list(self)
+
+    def __mul__(self, n):
+        return list(self) * n
+
+    __rmul__ = __mul__
+
+    def __repr__(self):
+        return repr(list(self))
+
+    def index(self, value, *args):
+        return list(self).index(value, *args)
+
+    def count(self, value):
+        return list(self).count(value)
+
+    def copy(self):
+        return list(self)
+
+    def sort(self, *args, **kwargs):
+        self.materialize()
+        self._cache.sort(*args, **kwargs)
+
+    def _words(self):
+        # every word, read in one go; len() trims the cache to size first
+        if self._get is not None and len(self) and _UNSET in self._cache:
+            get = self._get
+            cache = self._cache
+            for i, value in enumerate(cache):
+                if value is _UNSET:
+                    cache[i] = get(i)
+
+        return self._cache
+
+    def detach(self):
+        """Stop reading the C strings, which only live as long as the hook"""
+        if self._snapshot is not None:
+            self._get = self._snapshot(len(self))
+            self._snapshot = None
+
+    def materialize(self):
+        """Decode every word, before the list is changed"""
+        # a word_eol made from this list must not see it change
+        if self._eol is not None:
+            self._eol.materialize()
+            self._eol = None
+
+        if self._get is not None:
+            self._words()
+            self._get = self._snapshot = self._size = None
+
+
 def create_wordlist(words):
-    size = wordlist_len(words)
-    return [__decode(ffi.string(words[i])) for i in range(1, size + 1)]
+    def snapshot(n):
+        raw = [ffi.string(word) for word in words[1:n + 1]]
+        return lambda i: __decode(raw[i])
+
+    return WordList(lambda: wordlist_len(words), lambda i: __decode(ffi.string(words[i + 1])), snapshot)
 
 
 # This function only exists for compat reasons with the C plugin
 # It turns the word list from print hooks into a word_eol list
 # This makes no sense to do...
-def create_wordeollist(words):
-    words = reversed(words)
-    accum = None
-    ret = []
-    for word in words:
-        if accum is None:
-            accum = word
+def create_wordeollist(word):
+    # Every non-empty word from i on, joined by spaces
+    def get(i):
+        return ' '.join([w for w in word[i:] if w])
 
-        elif word:
-            last = accum
-            accum = ' '.join((word, last))
+    def snapshot(n):
+        word.detach()
+        return get
 
-        ret.insert(0, accum)
+    word._eol = WordList(word.__len__, get, snapshot)
+    return word._eol
 
-    return ret
 
+def refcount(obj):
+    return sys.getrefcount(obj) if hasattr(sys, 'getrefcount') else None
+
+
+# Whether the hook held on to a list, going by its reference count; without
+# sys.getrefcount() every list is assumed kept
+def was_kept(obj, refs):
+    return refs is None or sys.getrefcount(obj) > refs
+
+
+# Runs a hook with lazy word lists, which must not need the C strings after it
+def call_with_words(callback, word, word_eol, *args):
+    word_refs = refcount(word)
+    word_eol_refs = refcount(word_eol)
+    try:
+        return callback(word, word_eol, *args)
+    finally:
+        # word_eol may still need word to detach
+        if was_kept(word_eol, word_eol_refs):
+            word_eol.detach()
+        if was_kept(word, word_refs):
+            word.detach()
+
+
+class ServerLine:
+    """One line handed to a hook_server_batch() callback.
+
+    The line is copied once; word and word_eol are split by HexChat and only
+    decoded from the copy when first used.
+    """
+    __slots__ = ('raw', 'time', 'context', '_line', '_word', '_word_eol')
+
+    def __init__(self, line):
+        self.raw = ffi.string(line.line)
+        self.time = line.server_time_utc
+        self.context = hexchat.Context(line.context)
+        self._line = line
+        self._word = None
+        self._word_eol = None
+
+    def _split(self):
+        line = self._line
+        word = ffi.new('const char **')
+        length = ffi.new('int *')
+        eol = ffi.new('const char **')
+        self._word = []
+        self._word_eol = []
+        count = lib.hexchat_server_line_word(lib.ph, line, 1, word, length, eol)
+        for i in range(1, count + 1):
+            lib.hexchat_server_line_word(lib.ph, line, i, word, length, eol)
+            start = word[0] - line.line
+            self._word.append(self._decode(self.raw[start:start + length[0]]))
+            self._word_eol.append(self._decode(self.raw[eol[0] - line.line:]))
+
+    # HexChat frees its lines once the callback returns
+    def detach(self):
+        if self._word is None:
+            self._split()
+        self._line = None
+
+    @property
+    def text(self):
+        return self._decode(self.raw)
+
+    @property
+    def word(self):
+        if self._word is None:
+            self._split()
+        return self._word
+
+    @property
+    def word_eol(self):
+        if self._word_eol is None:
+            self._split()
+        return self._word_eol
+
+    def __repr__(self):
+        return '<ServerLine {!r}>'.format(self.raw)
+
+
+# set out here, where the name isn't mangled
+ServerLine._decode = staticmethod(__decode)
 
 def to_cb_ret(value):
     if value is None:
@@ -246,7 +510,7 @@ def _on_command_hook(word, word_eol, userdata):
     hook = ffi.from_handle(userdata)
     word = create_wordlist(word)
     word_eol = create_wordlist(word_eol)
-    return to_cb_ret(hook.callback(word, word_eol, hook.userdata))
+    return to_cb_ret(call_with_words(hook.callback, word, word_eol, hook.userdata))
 
 
 @ffi.def_extern()
@@ -254,7 +518,7 @@ def _on_print_hook(word, userdata):
     hook = ffi.from_handle(userdata)
     word = create_wordlist(word)
     word_eol = create_wordeollist(word)
-    return to_cb_ret(hook.callback(word, word_eol, hook.userdata))
+    return to_cb_ret(call_with_words(hook.callback, word, word_eol, hook.userdata))
 
 
 @ffi.def_extern()
@@ -264,7 +528,7 @@ def _on_print_attrs_hook(word, attrs, userdata):
     word_eol = create_wordeollist(word)
     attr = Attribute()
     attr.time = attrs.server_time_utc
-    return to_cb_ret(hook.callback(word, word_eol, hook.userdata, attr))
+    return to_cb_ret(call_with_words(hook.callback, word, word_eol, hook.userdata, attr))
 
 
 @ffi.def_extern()
@@ -272,7 +536,7 @@ def _on_server_hook(word, word_eol, userdata):
     hook = ffi.from_handle(userdata)
     word = create_wordlist(word)
     word_eol = create_wordlist(word_eol)
-    return to_cb_ret(hook.callback(word, word_eol, hook.userdata))
+    return to_cb_ret(call_with_words(hook.callback, word, word_eol, hook.userdata))
 
 
 @ffi.def_extern()
@@ -282,7 +546,26 @@ def _on_server_attrs_hook(word, word_eol, attrs, userdata):
     word_eol = create_wordlist(word_eol)
     attr = Attribute()
     attr.time = attrs.server_time_utc
-    return to_cb_ret(hook.callback(word, word_eol, hook.userdata, attr))
+    return to_cb_ret(call_with_words(hook.callback, word, word_eol, hook.userdata, attr))
+
+
+@ffi.def_extern()
+def _on_server_batch_hook(lines, count, userdata):
+    hook = ffi.from_handle(userdata)
+    lines = [ServerLine(lines[i]) for i in range(count)]
+    lines_refs = refcount(lines)
+    line_refs = [refcount(line) for line in lines]
+    try:
+        hook.callback(lines, hook.userdata)
+
+    finally:
+        # the list, or lines from it, may have been kept
+        kept = was_kept(lines, lines_refs)
+        for line, refs in zip(lines, line_refs):
+            if kept or was_kept(line, refs):
+                line.detach()
+
+    return 0
 
 
 @ffi.def_extern()
@@ -308,6 +591,39 @@ def _on_timer_hook(userdata):
     return 0
 
 
+# Runs on a worker thread, cffi takes the GIL for us. Nothing here may touch
+# lib other than hexchat_async_cancelled, so errors wait for _on_async_done.
+@ffi.def_extern()
+def _on_async_work(hexchat_job, userdata):
+    job = ffi.from_handle(userdata)
+    current = sys.modules['_hexchat'].async_local
+    current.hexchat_job = hexchat_job
+    try:
+        job.result = job.work(job.userdata)
+
+    except Exception:
+        job.error = sys.exc_info()
+
+    finally:
+        current.hexchat_job = None
+
+
+@ffi.def_extern()
+def _on_async_done(hexchat_job, cancelled, userdata):
+    job = ffi.from_handle(userdata)
+    job.hexchat_job = None
+    jobs.discard(job)
+    if cancelled:
+        return
+
+    if job.error is not None:
+        traceback.print_exception(*job.error)
+        return
+
+    if job.done is not None:
+        job.done(job.result, job.userdata)
+
+
 @ffi.def_extern(error=3)
 def _on_say_command(word, word_eol, userdata):
     channel = ffi.string(lib.hexchat_get_info(lib.ph, b'channel'))
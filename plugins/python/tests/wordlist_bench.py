@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Per-callback cost of building word lists, old eager lists against WordList.
+
+Loads python.py with a stand-in for the embedded cffi module, then times the
+argument handling of the hook callbacks for a few common callback shapes.
+"""
+
+import importlib.util
+import sys
+import timeit
+import types
+
+import cffi
+
+ROUNDS = 100000
+
+
+class StubFFI(cffi.FFI):
+    def def_extern(self, *args, **kwargs):
+        return lambda func: func
+
+
+ffi = StubFFI()
+sys.modules['_hexchat_embedded'] = types.SimpleNamespace(ffi=ffi, lib=None)
+spec = importlib.util.spec_from_file_location('python_plugin', sys.argv[1])
+plugin = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(plugin)
+
+
+# What python.py did before WordList
+def eager_wordlist(words):
+    size = plugin.wordlist_len(words)
+    return [ffi.string(words[i]).decode() for i in range(1, size + 1)]
+
+
+def eager_wordeollist(words):
+    words = reversed(words)
+    accum = None
+    ret = []
+    for word in words:
+        if accum is None:
+            accum = word
+
+        elif word:
+            last = accum
+            accum = ' '.join((word, last))
+
+        ret.insert(0, accum)
+
+    return ret
+
+
+keep = []
+
+
+def c_words(words, eol):
+    """char *word[32] as HexChat passes them, and the matching word_eol"""
+    word = ffi.new('char *[]', 32)
+    word_eol = ffi.new('char *[]', 32)
+    empty = ffi.new('char[]', b'')
+    keep.append(empty)
+    for i in range(32):
+        word[i] = word_eol[i] = empty
+
+    for i, text in enumerate(words, 1):
+        cstr = ffi.new('char[]', text.encode())
+        keep.append(cstr)
+        word[i] = cstr
+
+    if eol:
+        for i in range(1, len(words) + 1):
+            cstr = ffi.new('char[]', ' '.join(words[i - 1:]).encode())
+            keep.append(cstr)
+            word_eol[i] = cstr
+
+    return word, word_eol
+
+
+privmsg = c_words([':nick!user@host', 'PRIVMSG', '#channel', ':some', 'words', 'of',
+                   'a', 'typical', 'line', 'in', 'a', 'channel'], True)
+command = c_words(['greet', 'nick', 'and', 'a', 'message'], True)
+message = c_words(['nick', 'a typical message in a channel', '@', ''], False)
+
+shapes = [
+    # name, C args, is a print hook, callback
+    ('server, unused', privmsg, False, lambda word, word_eol: None),
+    ('server, 2 words', privmsg, False, lambda word, word_eol: (word[0], word_eol[3])),
+    ('command, 2 words', command, False, lambda word, word_eol: (word[1], word_eol[2])),
+    ('print, 2 words', message, True, lambda word, word_eol: (word[0], word[1])),
+    ('print, word_eol', message, True, lambda word, word_eol: word_eol[0]),
+    ('print, kept', message, True, lambda word, word_eol: keep.append(word)),
+]
+
+
+def eager(args, is_print, callback):
+    word = eager_wordlist(args[0])
+    word_eol = eager_wordeollist(word) if is_print else eager_wordlist(args[1])
+    return callback(word, word_eol)
+
+
+def lazy(args, is_print, callback):
+    word = plugin.create_wordlist(args[0])
+    word_eol = plugin.create_wordeollist(word) if is_print else plugin.create_wordlist(args[1])
+    return plugin.call_with_words(callback, word, word_eol)
+
+
+for name, args, is_print, callback in shapes:
+    # same results, including for every index and slice
+    assert eager(args, is_print, lambda *a: a) == lazy(args, is_print, lambda w, e: (list(w), list(e)))
+    assert eager(args, is_print, callback) == lazy(args, is_print, callback)
+
+    results = []
+    for func in (eager, lazy):
+        seconds = timeit.timeit(lambda: func(args, is_print, callback), number=ROUNDS)
+        results.append(seconds * 1e9 / ROUNDS)
+
+    print('{:<18} eager {:7.0f} ns  lazy {:7.0f} ns'.format(name, *results))
+
+# lists a callback kept must still read back once the C strings are gone,
+# whichever of the two it kept and however much it had read
+def clobber(args):
+    for words in args:
+        for i in range(1, 32):
+            words[i][0] = b'\0'
+
+
+for args, is_print in ((command, False), (message, True)):
+    for which in (0, 1, (0, 1)):
+        for read in (False, True):
+            fresh = c_words([ffi.string(w).decode() for w in args[0][1:plugin.wordlist_len(args[0]) + 1]],
+                            not is_print)
+            want = eager(fresh, is_print, lambda *a: a)
+            kept = []
+
+            def callback(word, word_eol):
+                if read:
+                    word[0], word_eol[-1]
+                kept.extend((word, word_eol)[i] for i in (which if isinstance(which, tuple) else (which,)))
+
+            lazy(fresh, is_print, callback)
+            clobber(fresh)
+            for lst in kept:
+                assert lst in want, (lst, want)
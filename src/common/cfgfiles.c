@@ -548,6 +548,7 @@ const struct prefs vars[] =
 	{"notify_whois_online", P_OFFINT (hex_notify_whois_online), TYPE_BOOL},
 
 	{"perl_warnings", P_OFFINT (hex_perl_warnings), TYPE_BOOL},
+	{"plugin_slow_warn", P_OFFINT (hex_plugin_slow_warn), TYPE_INT},
 
 	{"stamp_log", P_OFFINT (hex_stamp_log), TYPE_BOOL},
 	{"stamp_log_format", P_OFFSET (hex_stamp_log_format), TYPE_STR},
@@ -565,6 +566,7 @@ const struct prefs vars[] =
 	{"text_indent", P_OFFINT (hex_text_indent), TYPE_BOOL},
 	{"text_max_indent", P_OFFINT (hex_text_max_indent), TYPE_INT},
 	{"text_max_lines", P_OFFINT (hex_text_max_lines), TYPE_INT},
+	{"text_max_memory", P_OFFINT (hex_text_max_memory), TYPE_INT},
 	{"text_replay", P_OFFINT (hex_text_replay), TYPE_BOOL},
 	{"text_search_case_match", P_OFFINT (hex_text_search_case_match), TYPE_BOOL},
 	{"text_search_highlight_all", P_OFFINT (hex_text_search_highlight_all), TYPE_BOOL},
@@ -837,6 +839,7 @@ load_default_config(void)
 	prefs.hex_net_ping_timeout = 60;
 	prefs.hex_net_reconnect_delay = 10;
 	prefs.hex_notify_timeout = 15;
+	prefs.hex_plugin_slow_warn = 250;
 	prefs.hex_text_max_indent = 256;
 	prefs.hex_text_max_lines = 5000;
 	prefs.hex_url_grabber_limit = 100; 		/* 0 means unlimited */
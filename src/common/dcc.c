@@ -25,6 +25,8 @@
 
 /* Required to make lseek use off64_t, but doesn't work on Windows */
 #define _FILE_OFFSET_BITS 64
+/* Required for fallocate() */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +46,7 @@
 #include <io.h>
 #else
 #include <unistd.h>
+#include <netinet/tcp.h>
 #endif
 
 #include "hexchat.h"
@@ -55,14 +58,37 @@
 #include "plugin.h"
 #include "server.h"
 #include "text.h"
+#include "timerwheel.h"
+#include "dccsched.h"
 #include "url.h"
 #include "hexchatc.h"
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 /* Setting _FILE_OFFSET_BITS to 64 doesn't change lseek to use off64_t on Windows, so override lseek to the version that does */
 #if defined(WIN32) && (!defined(__MINGW32__) && !defined(__MINGW64__))
 	#define lseek _lseeki64
 #endif
 
+/* how many blocks a fast send may push per write wakeup */
+#define DCC_SEND_BURST 8
+
+/* unsent data the kernel may hold for a send before poll() wakes us again */
+#define DCC_NOTSENT_LOWAT 131072
+
+/* how often the bandwidth buckets are refilled */
+#define DCC_REFILL_MS 50
+
+/* how much the hash worker reads at a time, and how far the file must be
+ * ahead of it before another one is started */
+#define DCC_HASH_CHUNK 262144
+
+/* receive buffer bounds, both powers of two */
+#define DCC_RECVBUF_MIN 16384
+#define DCC_RECVBUF_MAX 1048576
+
 /* interval timer to detect timeouts */
 static int timeout_timer = 0;
 
@@ -77,8 +103,39 @@ struct dccstat_info dccstat[] = {
 	{N_("Aborted"), 4 /*red */ },
 };
 
-static int dcc_global_throttle;	/* 0x1 = sends, 0x2 = gets */
-static gint64 dcc_sendcpssum, dcc_getcpssum;
+/* Bandwidth hierarchy roots: global -> peer -> transfer. Sends and
+ * receives have separate global limits, so they never compete and sit in
+ * trees of their own; within one, every peer and transfer has weight 1. */
+static dccsched_node sched_send, sched_recv;
+static int refill_timer = 0;
+static gint64 refill_last;
+
+struct dcc_peer
+{
+	dccsched_node node;	/* must be first */
+	server *serv;
+	char *nick;
+};
+
+/* SHA-256 of a file being received, worked out by a worker thread reading
+ * the file back behind dcc_recv_flush(), mostly from the page cache, so the
+ * main thread never hashes. A resumed file's existing part is just where
+ * the worker starts. It stops once it has caught up and is started again
+ * when the file is DCC_HASH_CHUNK ahead, or the transfer is complete. */
+struct dcc_hash
+{
+	GMutex lock;			/* guards written, running and cancelled */
+	gint refs;
+	int fd;					/* the worker's own read handle */
+	GChecksum *sum;
+	guint64 hashed;		/* bytes of the file in sum, the worker's while running */
+	guint64 written;		/* bytes of the file on disk */
+	gboolean running;		/* a worker is reading */
+	gboolean cancelled;	/* the transfer failed, or the file couldn't be read */
+	gboolean done;			/* the transfer is complete */
+	gboolean waiting;		/* DCC RECV Complete waits for the digest */
+	struct DCC *dcc;		/* NULL once the DCC is gone */
+};
 
 static struct DCC *new_dcc (void);
 static void dcc_close (struct DCC *dcc, enum dcc_state dccstat, int destroy);
@@ -86,6 +143,7 @@ static gboolean dcc_send_data (GIOChannel *, GIOCondition, struct DCC *);
 static gboolean dcc_read (GIOChannel *, GIOCondition, struct DCC *);
 static gboolean dcc_read_ack (GIOChannel *source, GIOCondition condition, struct DCC *dcc);
 static int dcc_check_timeouts (void);
+static void dcc_send_tune (int sok);
 
 static int new_id(void)
 {
@@ -128,11 +186,7 @@ static void
 dcc_calc_cps (struct DCC *dcc)
 {
 	GTimeVal now;
-	gint64 oldcps;
 	double timediff, startdiff;
-	int glob_throttle_bit, wasthrottled;
-	gint64 *cpssum;
-	int glob_limit;
 	goffset pos, posdiff;
 
 	g_get_current_time (&now);
@@ -143,17 +197,9 @@ dcc_calc_cps (struct DCC *dcc)
 	{
 		/* carefull to avoid 32bit overflow */
 		pos = dcc->pos - ((dcc->pos - dcc->ack) / 2);
-		glob_throttle_bit = 0x1;
-		cpssum = &dcc_sendcpssum;
-		glob_limit = prefs.hex_dcc_global_max_send_cps;
 	}
 	else
-	{
 		pos = dcc->pos;
-		glob_throttle_bit = 0x2;
-		cpssum = &dcc_getcpssum;
-		glob_limit = prefs.hex_dcc_global_max_get_cps;
-	}
 
 	if (!dcc->firstcpstv.tv_sec && !dcc->firstcpstv.tv_usec)
 		dcc->firstcpstv = now;
@@ -170,49 +216,127 @@ dcc_calc_cps (struct DCC *dcc)
 			timediff = startdiff = 1;
 
 		posdiff = pos - dcc->lastcpspos;
-		oldcps = dcc->cps;
 		dcc->cps = (gint64) ((posdiff / timediff) * (timediff / startdiff) + dcc->cps * (1.0 - (timediff / startdiff)));
-
-		*cpssum += dcc->cps - oldcps;
 	}
 
 	dcc->lastcpspos = pos;
 	dcc->lastcpstv = now;
+}
 
-	/* now check cps against set limits... */
-	wasthrottled = dcc->throttled;
+/* is any active transfer held back by a cps limit? */
+static gboolean
+dcc_sched_needed (void)
+{
+	GSList *list;
+	struct DCC *dcc;
 
-	/* check global limits first */
-	dcc->throttled &= ~0x2;
-	if (glob_limit > 0 && *cpssum >= glob_limit)
+	for (list = dcc_list; list; list = list->next)
 	{
-		dcc_global_throttle |= glob_throttle_bit;
-		if (dcc->maxcps >= 0)
-			dcc->throttled |= 0x2;
+		dcc = list->data;
+		if (dcc->throttled || (dcc->bucket.parent && dccsched_limited (&dcc->bucket)))
+			return TRUE;
 	}
-	else
-		dcc_global_throttle &= ~glob_throttle_bit;
+	return FALSE;
+}
 
-	/* now check per-connection limit */
-	if (dcc->maxcps > 0 && dcc->cps > dcc->maxcps)
-		dcc->throttled |= 0x1;
-	else
-		dcc->throttled &= ~0x1;
+/* this is called by refill_timer every DCC_REFILL_MS while it's needed */
+static int
+dcc_refill (void)
+{
+	gint64 now = g_get_monotonic_time ();
+	GSList *next, *list;
+	struct DCC *dcc;
 
-	/* take action */
-	if (wasthrottled && !dcc->throttled)
-		dcc_unthrottle (dcc);
+	sched_send.rate = MAX (prefs.hex_dcc_global_max_send_cps, 0);
+	sched_recv.rate = MAX (prefs.hex_dcc_global_max_get_cps, 0);
+	dccsched_refill (&sched_send, now - refill_last);
+	dccsched_refill (&sched_recv, now - refill_last);
+	refill_last = now;
+
+	for (list = dcc_list; list; list = next)
+	{
+		dcc = list->data;
+		next = list->next;
+
+		if (dcc->throttled && dccsched_ready (&dcc->bucket))
+		{
+			dcc->throttled = 0;
+			dcc_unthrottle (dcc);
+		}
+	}
+
+	if (!dcc_sched_needed ())
+	{
+		refill_timer = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+dcc_sched_update (void)
+{
+	sched_send.rate = MAX (prefs.hex_dcc_global_max_send_cps, 0);
+	sched_recv.rate = MAX (prefs.hex_dcc_global_max_get_cps, 0);
+
+	if (refill_timer == 0 && dcc_sched_needed ())
+	{
+		refill_last = g_get_monotonic_time ();
+		refill_timer = timerwheel_add (DCC_REFILL_MS, dcc_refill, NULL);
+	}
 }
 
+/* put an active transfer under its peer's node, so that one peer with
+   many transfers can't crowd out the others */
 static void
-dcc_remove_from_sum (struct DCC *dcc)
+dcc_sched_join (struct DCC *dcc)
 {
-	if (dcc->dccstat != STAT_ACTIVE)
+	dccsched_node *root = (dcc->type == TYPE_SEND) ? &sched_send : &sched_recv;
+	struct dcc_peer *peer = NULL;
+	GSList *list;
+
+	/* a negative -maxcps has always meant "ignore the global limit too" */
+	if (dcc->maxcps < 0)
 		return;
-	if (dcc->type == TYPE_SEND)
-		dcc_sendcpssum -= dcc->cps;
-	else if (dcc->type == TYPE_RECV)
-		dcc_getcpssum -= dcc->cps;
+
+	for (list = root->children; list; list = list->next)
+	{
+		peer = list->data;
+		if (peer->serv == dcc->serv && !dcc->serv->p_cmp (peer->nick, dcc->nick))
+			break;
+		peer = NULL;
+	}
+
+	if (!peer)
+	{
+		peer = g_new0 (struct dcc_peer, 1);
+		peer->serv = dcc->serv;
+		peer->nick = g_strdup (dcc->nick);
+		dccsched_attach (&peer->node, root);
+	}
+
+	dcc->bucket.rate = MAX (dcc->maxcps, 0);
+	dccsched_attach (&dcc->bucket, &peer->node);
+	dcc_sched_update ();
+}
+
+static void
+dcc_sched_leave (struct DCC *dcc)
+{
+	struct dcc_peer *peer = (struct dcc_peer *) dcc->bucket.parent;
+
+	if (!peer)
+		return;
+
+	dccsched_detach (&dcc->bucket);
+	dcc->throttled = 0;
+
+	if (!peer->node.children)
+	{
+		dccsched_detach (&peer->node);
+		g_free (peer->nick);
+		g_free (peer);
+	}
 }
 
 gboolean
@@ -256,6 +380,8 @@ dcc_check_timeouts (void)
 		case STAT_ACTIVE:
 			dcc_calc_cps (dcc);
 			fe_dcc_update (dcc);
+			/* picks up changed limits */
+			dcc_sched_update ();
 
 			if (dcc->type == TYPE_SEND || dcc->type == TYPE_RECV)
 			{
@@ -368,6 +494,227 @@ dcc_connect_sok (struct DCC *dcc)
 	return sok;
 }
 
+static void
+dcc_hash_unref (struct dcc_hash *hash)
+{
+	if (!g_atomic_int_dec_and_test (&hash->refs))
+		return;
+
+	if (hash->fd != -1)
+		close (hash->fd);
+	g_checksum_free (hash->sum);
+	g_mutex_clear (&hash->lock);
+	g_free (hash);
+}
+
+static void
+dcc_recv_complete (struct DCC *dcc)
+{
+	char buf[32];
+
+	/* the server may have gone while the digest was being finished */
+	if (!dcc->serv)
+		return;
+
+	sprintf (buf, "%" G_GINT64_FORMAT, dcc->cps);
+	EMIT_SIGNAL (XP_TE_DCCRECVCOMP, dcc->serv->front_session,
+					 dcc->file, dcc->destfile, dcc->nick, buf, 0);
+}
+
+static void
+dcc_hash_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancel)
+{
+	struct dcc_hash *hash = data;
+	guchar *buf = g_malloc (DCC_HASH_CHUNK);
+	guint64 target;
+	int n;
+
+	while (1)
+	{
+		g_mutex_lock (&hash->lock);
+		target = hash->written;
+		if (hash->cancelled || hash->hashed >= target)
+		{
+			hash->running = FALSE;
+			g_mutex_unlock (&hash->lock);
+			break;
+		}
+		g_mutex_unlock (&hash->lock);
+
+		n = read (hash->fd, buf, MIN (DCC_HASH_CHUNK, target - hash->hashed));
+		if (n < 1)
+		{
+			if (n == -1 && errno == EINTR)
+				continue;
+			g_mutex_lock (&hash->lock);
+			hash->cancelled = TRUE;
+			hash->running = FALSE;
+			g_mutex_unlock (&hash->lock);
+			break;
+		}
+		g_checksum_update (hash->sum, buf, n);
+		hash->hashed += n;
+	}
+
+	g_free (buf);
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+dcc_hash_thread_done (GObject *source, GAsyncResult *result, gpointer data)
+{
+	struct dcc_hash *hash = data;
+	struct DCC *dcc = hash->dcc;
+	gboolean finished;
+
+	g_mutex_lock (&hash->lock);
+	finished = hash->waiting && !hash->running;
+	if (finished)
+		hash->waiting = FALSE;
+	g_mutex_unlock (&hash->lock);
+
+	/* the transfer completed before we caught up */
+	if (dcc && finished)
+	{
+		if (!hash->cancelled)
+			dcc->sha256 = g_strdup (g_checksum_get_string (hash->sum));
+		fe_dcc_update (dcc);
+		dcc_recv_complete (dcc);
+	}
+
+	dcc_hash_unref (hash);
+}
+
+/* hash->lock is held */
+static void
+dcc_hash_run (struct dcc_hash *hash)
+{
+	GTask *task;
+
+	hash->running = TRUE;
+	g_atomic_int_inc (&hash->refs);
+	task = g_task_new (NULL, NULL, dcc_hash_thread_done, hash);
+	g_task_set_task_data (task, hash, NULL);
+	g_task_run_in_thread (task, dcc_hash_thread);
+	g_object_unref (task);
+}
+
+static void
+dcc_hash_start (struct DCC *dcc, const char *filename_fs)
+{
+	struct dcc_hash *hash = g_new0 (struct dcc_hash, 1);
+
+	g_mutex_init (&hash->lock);
+	hash->refs = 1;
+	hash->sum = g_checksum_new (G_CHECKSUM_SHA256);
+	hash->dcc = dcc;
+	dcc->hash = hash;
+
+	hash->written = dcc->resumable;
+	hash->fd = g_open (filename_fs, OFLAGS | O_RDONLY, 0);
+	if (hash->fd == -1)
+	{
+		hash->cancelled = TRUE;
+		return;
+	}
+
+	/* hash what's already there in the background */
+	if (hash->written > 0)
+		dcc_hash_run (hash);
+}
+
+static void
+dcc_hash_update (struct dcc_hash *hash, int len)
+{
+	g_mutex_lock (&hash->lock);
+	hash->written += len;
+	if (!hash->running && !hash->cancelled && hash->written - hash->hashed >= DCC_HASH_CHUNK)
+		dcc_hash_run (hash);
+	g_mutex_unlock (&hash->lock);
+}
+
+/* Called once everything has been written. Returns FALSE if the digest is
+ * still being worked out; dcc_hash_thread_done() then announces the receive
+ * once it is there, so plugins find it next to the completed DCC. */
+static gboolean
+dcc_hash_finish (struct DCC *dcc)
+{
+	struct dcc_hash *hash = dcc->hash;
+	gboolean ready = TRUE;
+
+	if (!hash)
+		return TRUE;
+
+	g_mutex_lock (&hash->lock);
+	hash->done = TRUE;
+	if (!hash->cancelled)
+	{
+		if (hash->running || hash->hashed < hash->written)
+		{
+			if (!hash->running)
+				dcc_hash_run (hash);
+			hash->waiting = TRUE;
+			ready = FALSE;
+		}
+		else
+			dcc->sha256 = g_strdup (g_checksum_get_string (hash->sum));
+	}
+	g_mutex_unlock (&hash->lock);
+
+	return ready;
+}
+
+static void
+dcc_hash_stop (struct DCC *dcc)
+{
+	struct dcc_hash *hash = dcc->hash;
+	gboolean waiting;
+
+	if (!hash)
+		return;
+	dcc->hash = NULL;
+
+	g_mutex_lock (&hash->lock);
+	hash->cancelled = TRUE;
+	hash->dcc = NULL;
+	waiting = hash->waiting;
+	hash->waiting = FALSE;
+	g_mutex_unlock (&hash->lock);
+
+	/* removed before the digest was there, announce it without */
+	if (waiting)
+		dcc_recv_complete (dcc);
+
+	dcc_hash_unref (hash);
+}
+
+/* Write out whatever dcc_read() has collected. Returns FALSE with errno set
+ * if the disk wouldn't take it. */
+static gboolean
+dcc_recv_flush (struct DCC *dcc)
+{
+	char *p = dcc->recvbuf;
+	int n;
+
+	while (dcc->recvbuf_used > 0)
+	{
+		n = write (dcc->fp, p, dcc->recvbuf_used);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			memmove (dcc->recvbuf, p, dcc->recvbuf_used);
+			return FALSE;
+		}
+		if (dcc->hash)
+			dcc_hash_update (dcc->hash, n);
+		p += n;
+		dcc->recvbuf_used -= n;
+	}
+
+	return TRUE;
+}
+
 static void
 dcc_close (struct DCC *dcc, enum dcc_state dccstat, int destroy)
 {
@@ -389,13 +736,26 @@ dcc_close (struct DCC *dcc, enum dcc_state dccstat, int destroy)
 		dcc->sok = -1;
 	}
 
-	dcc_remove_from_sum (dcc);
+	dcc_sched_leave (dcc);
 
 	if (dcc->fp != -1)
 	{
+		/* keep what we got, a resume picks up from the file size */
+		dcc_recv_flush (dcc);
 		close (dcc->fp);
 		dcc->fp = -1;
 
+		/* a completed hash may still be catching up */
+		if (dccstat != STAT_DONE)
+			dcc_hash_stop (dcc);
+
+		g_free (dcc->recvbuf);
+		dcc->recvbuf = NULL;
+		dcc->recvbuf_used = 0;
+		g_free (dcc->sendbuf);
+		dcc->sendbuf = NULL;
+		dcc->sendbuf_len = 0;
+
 		if(dccstat == STAT_DONE)
 		{
 			/* if we just completed a dcc receive, move the */
@@ -421,14 +781,16 @@ dcc_close (struct DCC *dcc, enum dcc_state dccstat, int destroy)
 	{
 		dcc_list = g_slist_remove (dcc_list, dcc);
 		fe_dcc_remove (dcc);
+		dcc_hash_stop (dcc);
 		g_free (dcc->proxy);
 		g_free (dcc->file);
 		g_free (dcc->destfile);
 		g_free (dcc->nick);
+		g_free (dcc->sha256);
 		g_free (dcc);
 		if (dcc_list == NULL && timeout_timer != 0)
 		{
-			fe_timeout_remove (timeout_timer);
+			timerwheel_remove (timeout_timer);
 			timeout_timer = 0;
 		}
 		return;
@@ -650,18 +1012,37 @@ dcc_calc_average_cps (struct DCC *dcc)
 static void
 dcc_send_ack (struct DCC *dcc)
 {
+	guint32 pos;
+
+	/* one ack covers everything received since the last one */
+	if (dcc->ack == dcc->pos)
+		return;
+	dcc->ack = dcc->pos;
+
 	/* send in 32-bit big endian */
-	guint32 pos = htonl (dcc->pos & 0xffffffff);
+	pos = htonl (dcc->pos & 0xffffffff);
 	send (dcc->sok, (char *) &pos, 4, 0);
 }
 
+/* Reserve disk space for the rest of the file up front so it isn't
+ * fragmented by many small appends. The file size is left alone, since
+ * resuming relies on it matching what was actually received. */
+static void
+dcc_recv_preallocate (struct DCC *dcc)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (dcc->size > dcc->pos)
+		fallocate (dcc->fp, FALLOC_FL_KEEP_SIZE, dcc->pos, dcc->size - dcc->pos);
+#endif
+}
+
 static gboolean
 dcc_read (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 {
 	char *old;
 	char buf[4096];
-	int n;
-	gboolean need_ack = FALSE;
+	int n, want, burst = 0;
+	gboolean need_ack = FALSE, ready;
 
 	if (dcc->fp == -1)
 	{
@@ -673,10 +1054,13 @@ dcc_read (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 		{
 			gchar *filename_fs = g_filename_from_utf8(dcc->destfile, -1, NULL, NULL, NULL);
 			dcc->fp = g_open(dcc->destfile, O_WRONLY | O_APPEND | OFLAGS, 0);
-			g_free (filename_fs);
 
 			dcc->pos = dcc->resumable;
 			dcc->ack = dcc->resumable;
+
+			if (dcc->fp != -1)
+				dcc_hash_start (dcc, filename_fs);
+			g_free (filename_fs);
 		}
 		else
 		{
@@ -702,8 +1086,13 @@ dcc_read (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 
 			filename_fs = g_filename_from_utf8 (dcc->destfile, -1, NULL, NULL, NULL);
 			dcc->fp = g_open (filename_fs, OFLAGS | O_TRUNC | O_WRONLY | O_CREAT, prefs.hex_dcc_permissions);
+			if (dcc->fp != -1)
+				dcc_hash_start (dcc, filename_fs);
 			g_free (filename_fs);
 		}
+
+		if (dcc->fp != -1)
+			dcc_recv_preallocate (dcc);
 	}
 	if (dcc->fp == -1)
 	{
@@ -715,6 +1104,10 @@ dcc_read (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 	}
 	while (1)
 	{
+		/* out of tokens, dcc_refill() will carry on */
+		if (!dcc->throttled && !dccsched_ready (&dcc->bucket))
+			dcc->throttled = 1;
+
 		if (dcc->throttled)
 		{
 			if (need_ack)
@@ -728,7 +1121,19 @@ dcc_read (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 		if (!dcc->iotag)
 			dcc->iotag = fe_input_add (dcc->sok, FIA_READ|FIA_EX, dcc_read, dcc);
 
-		n = recv (dcc->sok, buf, sizeof (buf), 0);
+		if (!dcc->recvbuf)
+		{
+			dcc->recvbuf_len = DCC_RECVBUF_MIN;
+			dcc->recvbuf = g_malloc (dcc->recvbuf_len);
+		}
+
+		/* fill up to the next multiple of the buffer size in the file, so
+			each write lands on an aligned offset */
+		want = dcc->recvbuf_len - ((dcc->pos - dcc->recvbuf_used) & (dcc->recvbuf_len - 1));
+		want -= dcc->recvbuf_used;
+
+		n = recv (dcc->sok, dcc->recvbuf + dcc->recvbuf_used,
+					 dccsched_allow (&dcc->bucket, want), 0);
 		if (n < 1)
 		{
 			if (n < 0)
@@ -750,29 +1155,43 @@ dcc_read (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 			return TRUE;
 		}
 
-		if (write (dcc->fp, buf, n) == -1) /* could be out of hdd space */
+		if (!need_ack)
+			dcc->lasttime = time (0);
+		dcc->pos += n;
+		dccsched_charge (&dcc->bucket, n);
+		dcc->recvbuf_used += n;
+		burst += n;
+		need_ack = TRUE;	/* send ack when we're done recv()ing */
+
+		if (n == want || dcc->pos >= dcc->size)
 		{
-			EMIT_SIGNAL (XP_TE_DCCRECVERR, dcc->serv->front_session, dcc->file,
-							 dcc->destfile, dcc->nick, errorstring (errno), 0);
-			if (need_ack)
+			if (!dcc_recv_flush (dcc)) /* could be out of hdd space */
+			{
+				EMIT_SIGNAL (XP_TE_DCCRECVERR, dcc->serv->front_session, dcc->file,
+								 dcc->destfile, dcc->nick, errorstring (errno), 0);
 				dcc_send_ack (dcc);
-			dcc_close (dcc, STAT_FAILED, FALSE);
-			return TRUE;
-		}
+				dcc_close (dcc, STAT_FAILED, FALSE);
+				return TRUE;
+			}
 
-		dcc->lasttime = time (0);
-		dcc->pos += n;
-		need_ack = TRUE;	/* send ack when we're done recv()ing */
+			/* a whole buffer arrived in one wakeup, so the peer is outrunning us */
+			if (burst >= dcc->recvbuf_len && dcc->recvbuf_len < DCC_RECVBUF_MAX)
+			{
+				g_free (dcc->recvbuf);
+				dcc->recvbuf_len *= 2;
+				dcc->recvbuf = g_malloc (dcc->recvbuf_len);
+			}
+			burst = 0;
+		}
 
 		if (dcc->pos >= dcc->size)
 		{
 			dcc_send_ack (dcc);
+			ready = dcc_hash_finish (dcc);
 			dcc_close (dcc, STAT_DONE, FALSE);
-			dcc_calc_average_cps (dcc);	/* this must be done _after_ dcc_close, or dcc_remove_from_sum will see the wrong value in dcc->cps */
-			/* cppcheck-suppress deallocuse */
-			sprintf (buf, "%" G_GINT64_FORMAT, dcc->cps);
-			EMIT_SIGNAL (XP_TE_DCCRECVCOMP, dcc->serv->front_session,
-							 dcc->file, dcc->destfile, dcc->nick, buf, 0);
+			dcc_calc_average_cps (dcc);
+			if (ready)
+				dcc_recv_complete (dcc);
 			return TRUE;
 		}
 	}
@@ -853,6 +1272,7 @@ dcc_connect_finished (GIOChannel *source, GIOCondition condition, struct DCC *dc
 	switch (dcc->type)
 	{
 	case TYPE_RECV:
+		dcc_sched_join (dcc);
 		dcc->iotag = fe_input_add (dcc->sok, FIA_READ|FIA_EX, dcc_read, dcc);
 		EMIT_SIGNAL (XP_TE_DCCCONRECV, dcc->serv->front_session,
 						 dcc->nick, host, dcc->file, NULL, 0);
@@ -860,6 +1280,8 @@ dcc_connect_finished (GIOChannel *source, GIOCondition condition, struct DCC *dc
 	case TYPE_SEND:
 		/* passive send */
 		dcc->fastsend = prefs.hex_dcc_fast_send;
+		dcc_send_tune (dcc->sok);
+		dcc_sched_join (dcc);
 		if (dcc->fastsend)
 			dcc->wiotag = fe_input_add (dcc->sok, FIA_WRITE, dcc_send_data, dcc);
 		dcc->iotag = fe_input_add (dcc->sok, FIA_READ|FIA_EX, dcc_read_ack, dcc);
@@ -1412,11 +1834,61 @@ dcc_connect (struct DCC *dcc)
 	fe_dcc_update (dcc);
 }
 
+/* Limit how much unsent data a send socket may queue, so write wakeups track
+ * what the receiver actually takes instead of filling a huge socket buffer. */
+static void
+dcc_send_tune (int sok)
+{
+#ifdef TCP_NOTSENT_LOWAT
+	int lowat = DCC_NOTSENT_LOWAT;
+
+	setsockopt (sok, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *) &lowat, sizeof (lowat));
+#endif
+}
+
+/* Push up to len bytes of the file at dcc->pos to the socket. Returns what
+ * was sent, 0 at end of file, or -1 with the error left in errno. */
+static int
+dcc_send_block (struct DCC *dcc, int len)
+{
+	int n;
+
+#ifdef HAVE_SENDFILE
+	if (!dcc->nosendfile)
+	{
+		off_t off = dcc->pos;
+
+		n = sendfile (dcc->sok, dcc->fp, &off, len);
+		if (n >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return n;
+		/* not a file sendfile() can handle, copy it ourselves */
+		dcc->nosendfile = TRUE;
+	}
+#endif
+
+	if (dcc->sendbuf_len < len)
+	{
+		g_free (dcc->sendbuf);
+		dcc->sendbuf = g_malloc (len);
+		dcc->sendbuf_len = len;
+	}
+
+#ifdef WIN32
+	lseek (dcc->fp, dcc->pos, SEEK_SET);
+	n = read (dcc->fp, dcc->sendbuf, len);
+#else
+	n = pread (dcc->fp, dcc->sendbuf, len, dcc->pos);
+#endif
+	if (n < 1)
+		return n;
+
+	return send (dcc->sok, dcc->sendbuf, n, 0);
+}
+
 static gboolean
 dcc_send_data (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 {
-	char *buf;
-	int len, sent, sok = dcc->sok;
+	int len, sent, burst, sok = dcc->sok;
 
 	if (prefs.hex_dcc_blocksize < 1) /* this is too little! */
 		prefs.hex_dcc_blocksize = 1024;
@@ -1424,6 +1896,10 @@ dcc_send_data (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 	if (prefs.hex_dcc_blocksize > 102400)	/* this is too much! */
 		prefs.hex_dcc_blocksize = 102400;
 
+	/* out of tokens, dcc_refill() will carry on */
+	if (!dcc->throttled && !dccsched_ready (&dcc->bucket))
+		dcc->throttled = 1;
+
 	if (dcc->throttled)
 	{
 		fe_input_remove (dcc->wiotag);
@@ -1439,27 +1915,29 @@ dcc_send_data (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 	else if (!dcc->wiotag)
 		dcc->wiotag = fe_input_add (sok, FIA_WRITE, dcc_send_data, dcc);
 
-	buf = g_malloc (prefs.hex_dcc_blocksize);
+	/* a fast send keeps going until the socket is full or its tokens run out */
+	burst = dcc->fastsend ? DCC_SEND_BURST : 1;
 
-	lseek (dcc->fp, dcc->pos, SEEK_SET);
-	len = read (dcc->fp, buf, prefs.hex_dcc_blocksize);
-	if (len < 1)
-		goto abortit;
-	sent = send (sok, buf, len, 0);
-
-	if (sent < 0 && !(would_block ()))
-	{
-abortit:
-		g_free (buf);
-		EMIT_SIGNAL (XP_TE_DCCSENDFAIL, dcc->serv->front_session,
-						 file_part (dcc->file), dcc->nick,
-						 errorstring (sock_error ()), NULL, 0);
-		dcc_close (dcc, STAT_FAILED, FALSE);
-		return TRUE;
-	}
-	if (sent > 0)
+	while (burst-- > 0 && dcc->pos < dcc->size)
 	{
+		len = dccsched_allow (&dcc->bucket, MIN ((guint64) prefs.hex_dcc_blocksize, dcc->size - dcc->pos));
+		if (len < 1)
+			break;
+
+		sent = dcc_send_block (dcc, len);
+		if (sent == 0 || (sent < 0 && !(would_block ())))
+		{
+			EMIT_SIGNAL (XP_TE_DCCSENDFAIL, dcc->serv->front_session,
+							 file_part (dcc->file), dcc->nick,
+							 errorstring (sent ? sock_error () : 0), NULL, 0);
+			dcc_close (dcc, STAT_FAILED, FALSE);
+			return TRUE;
+		}
+		if (sent < 0)
+			break;
+
 		dcc->pos += sent;
+		dccsched_charge (&dcc->bucket, sent);
 		dcc->lasttime = time (0);
 	}
 
@@ -1474,8 +1952,6 @@ abortit:
 		}
 	}
 
-	g_free (buf);
-
 	return TRUE;
 }
 
@@ -1504,7 +1980,7 @@ dcc_handle_new_ack (struct DCC *dcc)
 	{
 		dcc->ack = dcc->size;	/* force 100% ack for >4 GB */
 		dcc_close (dcc, STAT_DONE, FALSE);
-		dcc_calc_average_cps (dcc);	/* this must be done _after_ dcc_close, or dcc_remove_from_sum will see the wrong value in dcc->cps */
+		dcc_calc_average_cps (dcc);
 		/* cppcheck-suppress deallocuse */
 		sprintf (buf, "%" G_GINT64_FORMAT, dcc->cps);
 		EMIT_SIGNAL (XP_TE_DCCSENDCOMP, dcc->serv->front_session,
@@ -1593,6 +2069,8 @@ dcc_accept (GIOChannel *source, GIOCondition condition, struct DCC *dcc)
 	switch (dcc->type)
 	{
 	case TYPE_SEND:
+		dcc_send_tune (sok);
+		dcc_sched_join (dcc);
 		if (dcc->fastsend)
 			dcc->wiotag = fe_input_add (sok, FIA_WRITE, dcc_send_data, dcc);
 		dcc->iotag = fe_input_add (sok, FIA_READ|FIA_EX, dcc_read_ack, dcc);
@@ -2248,7 +2726,7 @@ new_dcc (void)
 	dcc_list = g_slist_prepend (dcc_list, dcc);
 	if (timeout_timer == 0)
 	{
-		timeout_timer = fe_timeout_add_seconds (1, dcc_check_timeouts, NULL);
+		timeout_timer = timerwheel_add_seconds (1, dcc_check_timeouts, NULL);
 	}
 	return dcc;
 }
@@ -21,6 +21,7 @@
 
 #include <time.h>						/* for time_t */
 #include "proto-irc.h"
+#include "dccsched.h"
 
 #ifndef HEXCHAT_DCC_H
 #define HEXCHAT_DCC_H
@@ -62,10 +63,19 @@ struct DCC
 	GTimeVal lastcpstv, firstcpstv;
 	goffset lastcpspos;
 	gint64 maxcps;
+	dccsched_node bucket;		/* this transfer's leaf in the bandwidth hierarchy */
 
 	unsigned char ack_buf[4];	/* buffer for reading 4-byte ack */
 	int ack_pos;
 
+	char *sendbuf;				/* kept for the whole send when sendfile() can't be used */
+	int sendbuf_len;
+	char *recvbuf;				/* received data not yet written to fp */
+	int recvbuf_len;
+	int recvbuf_used;
+	struct dcc_hash *hash;	/* SHA-256 of a receive in progress */
+	char *sha256;				/* hex digest once the receive is complete */
+
 	guint64 size;
 	guint64 resumable;
 	guint64 ack;
@@ -80,10 +90,10 @@ struct DCC
 	enum dcc_state dccstat;
 	unsigned int resume_sent:1;	/* resume request sent */
 	unsigned int fastsend:1;
+	unsigned int nosendfile:1;	/* sendfile() refused this file, copy through sendbuf */
 	unsigned int ackoffset:1;	/* is receiver sending acks as an offset from */
 										/* the resume point? */
-	unsigned int throttled:2;	/* 0x1 = per send/get throttle
-											0x2 = global throttle */
+	unsigned int throttled:1;	/* out of tokens, waiting for a refill */
 };
 
 #define MAX_PROXY_BUFFER 1024
@@ -0,0 +1,230 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Token buckets in the HTB style: a refill first works out how much each
+ * node could take (its bucket space, or the sum over its children, capped
+ * by its own rate), then hands the root's budget down level by level. At
+ * each level the children get shares in proportion to their weight; any
+ * share a child can't take is handed round again to the rest. */
+
+#include <glib.h>
+
+#include "dccsched.h"
+
+#define DEPTH_USEC 250000	/* a leaf may bank a quarter second of its rate */
+#define SHARE_USEC 2000000	/* time constant of the share average */
+
+/* a leaf's bucket under the tightest rate 'cap' above it, 0 for none;
+ * never less than a quantum, or dccsched_ready() could never be met */
+static gint64
+leaf_depth (gint64 cap)
+{
+	return MAX (cap * DEPTH_USEC / G_USEC_PER_SEC, DCCSCHED_QUANTUM);
+}
+
+/* A new node's bucket is sized right away and starts with one quantum, so
+ * a transfer can begin before the next refill gets to it. */
+void
+dccsched_attach (dccsched_node *node, dccsched_node *parent)
+{
+	dccsched_node *up;
+	gint64 cap = 0;
+
+	if (node->weight < 1)
+		node->weight = 1;
+	node->parent = parent;
+	node->share = 0;
+	node->frac = 0;
+	parent->children = g_slist_prepend (parent->children, node);
+
+	for (up = node; up; up = up->parent)
+	{
+		if (up->rate > 0 && (cap == 0 || up->rate < cap))
+			cap = up->rate;
+	}
+	node->depth = leaf_depth (cap);
+	node->tokens = DCCSCHED_QUANTUM;
+}
+
+void
+dccsched_detach (dccsched_node *node)
+{
+	if (!node->parent)
+		return;
+	node->parent->children = g_slist_remove (node->parent->children, node);
+	node->parent = NULL;
+	node->share = 0;
+}
+
+gboolean
+dccsched_limited (dccsched_node *node)
+{
+	for (; node; node = node->parent)
+	{
+		if (node->rate > 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* After this returns TRUE, dccsched_allow() gives at least a quantum. */
+gboolean
+dccsched_ready (dccsched_node *leaf)
+{
+	return !dccsched_limited (leaf) || leaf->tokens >= DCCSCHED_QUANTUM;
+}
+
+gint64
+dccsched_allow (dccsched_node *leaf, gint64 want)
+{
+	if (!dccsched_limited (leaf))
+		return want;
+	return CLAMP (leaf->tokens, 0, want);
+}
+
+void
+dccsched_charge (dccsched_node *leaf, gint64 bytes)
+{
+	if (dccsched_limited (leaf))
+		leaf->tokens -= bytes;
+}
+
+/* bytes the node's own rate allows over usec, keeping the remainder */
+static gint64
+node_budget (dccsched_node *node, gint64 usec)
+{
+	gint64 scaled = node->rate * usec + node->frac;
+
+	node->frac = scaled % G_USEC_PER_SEC;
+	return scaled / G_USEC_PER_SEC;
+}
+
+/* size the buckets from the tightest rate above them and total up what
+ * each node could take this round */
+static gint64
+node_demand (dccsched_node *node, gint64 cap, gint64 usec)
+{
+	GSList *list;
+	gint64 demand = 0;
+
+	if (node->rate > 0 && (cap == 0 || node->rate < cap))
+		cap = node->rate;
+
+	if (!node->children)
+	{
+		node->depth = leaf_depth (cap);
+		if (node->tokens > node->depth)
+			node->tokens = node->depth;
+		demand = node->depth - node->tokens;
+	}
+
+	for (list = node->children; list; list = list->next)
+		demand += node_demand (list->data, cap, usec);
+
+	if (node->rate > 0)
+		demand = MIN (demand, node_budget (node, usec));
+
+	node->demand = demand;
+	return demand;
+}
+
+static void
+node_grant (dccsched_node *node, gint64 budget)
+{
+	dccsched_node *child;
+	GSList *list;
+	gint64 left = budget, round, give;
+	int weights;
+
+	node->grant = budget;
+	if (!node->children)
+	{
+		node->tokens += budget;
+		return;
+	}
+
+	for (list = node->children; list; list = list->next)
+		((dccsched_node *) list->data)->grant = 0;
+
+	while (left > 0)
+	{
+		weights = 0;
+		for (list = node->children; list; list = list->next)
+		{
+			child = list->data;
+			if (child->grant < child->demand)
+				weights += child->weight;
+		}
+		if (weights == 0)
+			break;
+
+		round = left;
+		for (list = node->children; list && left > 0; list = list->next)
+		{
+			child = list->data;
+			if (child->grant >= child->demand)
+				continue;
+
+			/* at least a byte, or rounding down could stall the loop */
+			give = MAX (round * child->weight / weights, 1);
+			give = MIN (MIN (give, child->demand - child->grant), left);
+			child->grant += give;
+			left -= give;
+		}
+	}
+
+	for (list = node->children; list; list = list->next)
+	{
+		child = list->data;
+		node_grant (child, child->grant);
+	}
+}
+
+static void
+node_share (dccsched_node *node, gint64 usec, gboolean limited)
+{
+	GSList *list;
+	gint64 rate;
+
+	limited = limited || node->rate > 0;
+	if (!limited)
+		node->share = 0;
+	else
+	{
+		/* exponential average, weighted by how long the round took */
+		rate = node->grant * G_USEC_PER_SEC / usec;
+		node->share += (rate - node->share) * usec / SHARE_USEC;
+	}
+
+	for (list = node->children; list; list = list->next)
+		node_share (list->data, usec, limited);
+}
+
+void
+dccsched_refill (dccsched_node *root, gint64 usec)
+{
+	if (usec <= 0)
+		return;
+	/* a stalled main loop shouldn't turn into one huge burst */
+	if (usec > G_USEC_PER_SEC)
+		usec = G_USEC_PER_SEC;
+
+	/* the root's demand is already capped by the global rate */
+	node_grant (root, node_demand (root, 0, usec));
+	node_share (root, usec, FALSE);
+}
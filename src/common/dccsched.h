@@ -0,0 +1,52 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef HEXCHAT_DCCSCHED_H
+#define HEXCHAT_DCCSCHED_H
+
+/* Hierarchical token buckets for DCC bandwidth. Each direction has a root
+ * node carrying the global limit, with one node per peer under it and one
+ * leaf per transfer under that. Only leaves hold tokens; a refill splits
+ * the root's budget over the tree by weighted max-min fairness, so a
+ * transfer that can't use its share leaves it to the others. */
+
+#define DCCSCHED_QUANTUM 4096	/* a leaf isn't worth waking for less */
+
+typedef struct dccsched_node
+{
+	struct dccsched_node *parent;
+	GSList *children;
+	int weight;
+	gint64 rate;		/* own limit in bytes/s, 0 for none */
+	gint64 tokens;		/* bytes a leaf may move now */
+	gint64 depth;		/* most a leaf may save up */
+	gint64 share;		/* bytes/s granted lately, 0 if unlimited */
+	gint64 frac;		/* rate * usec left over from the last refill */
+	gint64 demand;
+	gint64 grant;
+} dccsched_node;
+
+void dccsched_attach (dccsched_node *node, dccsched_node *parent);
+void dccsched_detach (dccsched_node *node);
+gboolean dccsched_limited (dccsched_node *node);
+gboolean dccsched_ready (dccsched_node *leaf);
+gint64 dccsched_allow (dccsched_node *leaf, gint64 want);
+void dccsched_charge (dccsched_node *leaf, gint64 bytes);
+void dccsched_refill (dccsched_node *root, gint64 usec);
+
+#endif
@@ -46,6 +46,7 @@ extern "C" {
 typedef struct _hexchat_plugin hexchat_plugin;
 typedef struct _hexchat_list hexchat_list;
 typedef struct _hexchat_hook hexchat_hook;
+typedef struct _hexchat_async hexchat_async;
 #ifndef PLUGIN_C
 typedef struct _hexchat_context hexchat_context;
 #endif
@@ -53,6 +54,18 @@ typedef struct
 {
 	time_t server_time_utc; /* 0 if not used */
 } hexchat_event_attrs;
+typedef struct
+{
+	const char *str;	/* 's' and 'p' fields */
+	int num;			/* 'i' fields */
+	time_t time;		/* 't' fields */
+} hexchat_list_value;
+typedef struct
+{
+	const char *line;	/* the whole line, as in word_eol[1] */
+	hexchat_context *context;	/* where a server hook would have run */
+	time_t server_time_utc; /* 0 if not used */
+} hexchat_server_line;
 
 #ifndef PLUGIN_C
 struct _hexchat_plugin
@@ -193,6 +206,45 @@ struct _hexchat_plugin
 	hexchat_event_attrs *(*hexchat_event_attrs_create) (hexchat_plugin *ph);
 	void (*hexchat_event_attrs_free) (hexchat_plugin *ph,
 									  hexchat_event_attrs *attrs);
+	hexchat_list *(*hexchat_list_open) (hexchat_plugin *ph,
+		const char *name);
+	int (*hexchat_list_field_id) (hexchat_plugin *ph,
+		const char *list,
+		const char *field);
+	const char * (*hexchat_list_str_id) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+	int (*hexchat_list_int_id) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+	time_t (*hexchat_list_time_id) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+	int (*hexchat_list_fetch) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		const int *ids,
+		int count,
+		hexchat_list_value *values);
+	hexchat_hook *(*hexchat_hook_server_batch) (hexchat_plugin *ph,
+		const char *name,
+		int pri,
+		int (*callback) (hexchat_server_line *const *lines, int count,
+						 void *user_data),
+		void *userdata);
+	int (*hexchat_server_line_word) (hexchat_plugin *ph,
+		const hexchat_server_line *line,
+		int index,
+		const char **word,
+		int *len,
+		const char **word_eol);
+	hexchat_async *(*hexchat_run_async) (hexchat_plugin *ph,
+		void (*work) (hexchat_async *job, void *user_data),
+		void (*done) (hexchat_async *job, int cancelled, void *user_data),
+		void *userdata);
+	void (*hexchat_async_cancel) (hexchat_plugin *ph,
+		hexchat_async *job);
+	int (*hexchat_async_cancelled) (hexchat_plugin *ph,
+		hexchat_async *job);
 };
 #endif
 
@@ -338,6 +390,67 @@ hexchat_list_time (hexchat_plugin *ph,
 		 hexchat_list *xlist,
 		 const char *name);
 
+hexchat_list *
+hexchat_list_open (hexchat_plugin *ph,
+		const char *name);
+
+int
+hexchat_list_field_id (hexchat_plugin *ph,
+		const char *list,
+		const char *field);
+
+const char *
+hexchat_list_str_id (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+
+int
+hexchat_list_int_id (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+
+time_t
+hexchat_list_time_id (hexchat_plugin *ph,
+		 hexchat_list *xlist,
+		 int id);
+
+int
+hexchat_list_fetch (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		const int *ids,
+		int count,
+		hexchat_list_value *values);
+
+hexchat_hook *
+hexchat_hook_server_batch (hexchat_plugin *ph,
+		const char *name,
+		int pri,
+		int (*callback) (hexchat_server_line *const *lines, int count,
+						 void *user_data),
+		void *userdata);
+
+int
+hexchat_server_line_word (hexchat_plugin *ph,
+		const hexchat_server_line *line,
+		int index,
+		const char **word,
+		int *len,
+		const char **word_eol);
+
+hexchat_async *
+hexchat_run_async (hexchat_plugin *ph,
+		void (*work) (hexchat_async *job, void *user_data),
+		void (*done) (hexchat_async *job, int cancelled, void *user_data),
+		void *userdata);
+
+void
+hexchat_async_cancel (hexchat_plugin *ph,
+		hexchat_async *job);
+
+int
+hexchat_async_cancelled (hexchat_plugin *ph,
+		hexchat_async *job);
+
 void *
 hexchat_plugingui_add (hexchat_plugin *ph,
 		     const char *filename,
@@ -451,6 +564,17 @@ hexchat_pluginpref_list (hexchat_plugin *ph,
 #define hexchat_pluginpref_get_int ((HEXCHAT_PLUGIN_HANDLE)->hexchat_pluginpref_get_int)
 #define hexchat_pluginpref_delete ((HEXCHAT_PLUGIN_HANDLE)->hexchat_pluginpref_delete)
 #define hexchat_pluginpref_list ((HEXCHAT_PLUGIN_HANDLE)->hexchat_pluginpref_list)
+#define hexchat_list_open ((HEXCHAT_PLUGIN_HANDLE)->hexchat_list_open)
+#define hexchat_list_field_id ((HEXCHAT_PLUGIN_HANDLE)->hexchat_list_field_id)
+#define hexchat_list_str_id ((HEXCHAT_PLUGIN_HANDLE)->hexchat_list_str_id)
+#define hexchat_list_int_id ((HEXCHAT_PLUGIN_HANDLE)->hexchat_list_int_id)
+#define hexchat_list_time_id ((HEXCHAT_PLUGIN_HANDLE)->hexchat_list_time_id)
+#define hexchat_list_fetch ((HEXCHAT_PLUGIN_HANDLE)->hexchat_list_fetch)
+#define hexchat_hook_server_batch ((HEXCHAT_PLUGIN_HANDLE)->hexchat_hook_server_batch)
+#define hexchat_server_line_word ((HEXCHAT_PLUGIN_HANDLE)->hexchat_server_line_word)
+#define hexchat_run_async ((HEXCHAT_PLUGIN_HANDLE)->hexchat_run_async)
+#define hexchat_async_cancel ((HEXCHAT_PLUGIN_HANDLE)->hexchat_async_cancel)
+#define hexchat_async_cancelled ((HEXCHAT_PLUGIN_HANDLE)->hexchat_async_cancelled)
 #endif
 
 #ifdef __cplusplus
@@ -50,6 +50,7 @@
 #include "servlist.h"
 #include "outbound.h"
 #include "text.h"
+#include "timerwheel.h"
 #include "url.h"
 #include "hexchatc.h"
 
@@ -372,34 +373,34 @@ hexchat_reinit_timers (void)
 	/* notify timeout */
 	if (prefs.hex_notify_timeout && notify_tag == 0)
 	{
-		notify_tag = fe_timeout_add_seconds (prefs.hex_notify_timeout,
+		notify_tag = timerwheel_add_seconds (prefs.hex_notify_timeout,
 						     notify_checklist, NULL);
 	}
 	else if (!prefs.hex_notify_timeout && notify_tag != 0)
 	{
-		fe_timeout_remove (notify_tag);
+		timerwheel_remove (notify_tag);
 		notify_tag = 0;
 	}
 
 	/* away status tracking */
 	if (prefs.hex_away_track && away_tag == 0)
 	{
-		away_tag = fe_timeout_add_seconds (prefs.hex_away_timeout, away_check, NULL);
+		away_tag = timerwheel_add_seconds (prefs.hex_away_timeout, away_check, NULL);
 	}
 	else if (!prefs.hex_away_track && away_tag != 0)
 	{
-		fe_timeout_remove (away_tag);
+		timerwheel_remove (away_tag);
 		away_tag = 0;
 	}
 
 	/* lag-o-meter */
 	if (prefs.hex_gui_lagometer && lag_check_update_tag == 0)
 	{
-		lag_check_update_tag = fe_timeout_add (500, hexchat_lag_check_update, NULL);
+		lag_check_update_tag = timerwheel_add (500, hexchat_lag_check_update, NULL);
 	}
 	else if (!prefs.hex_gui_lagometer && lag_check_update_tag != 0)
 	{
-		fe_timeout_remove (lag_check_update_tag);
+		timerwheel_remove (lag_check_update_tag);
 		lag_check_update_tag = 0;
 	}
 
@@ -407,12 +408,12 @@ hexchat_reinit_timers (void)
 	if ((prefs.hex_net_ping_timeout != 0 || prefs.hex_gui_lagometer)
 	    && lag_check_tag == 0)
 	{
-		lag_check_tag = fe_timeout_add_seconds (30, hexchat_lag_check, NULL);
+		lag_check_tag = timerwheel_add_seconds (30, hexchat_lag_check, NULL);
 	}
 	else if ((!prefs.hex_net_ping_timeout && !prefs.hex_gui_lagometer)
 					 && lag_check_tag != 0)
 	{
-		fe_timeout_remove (lag_check_tag);
+		timerwheel_remove (lag_check_tag);
 		lag_check_tag = 0;
 	}
 }
@@ -430,7 +431,7 @@ irc_init (session *sess)
 
 	done_init = TRUE;
 
-	plugin_add (sess, NULL, NULL, timer_plugin_init, NULL, NULL, FALSE);
+	plugin_add (sess, NULL, NULL, timer_plugin_init, timer_plugin_deinit, NULL, FALSE);
 	plugin_add (sess, NULL, NULL, identd_plugin_init, identd_plugin_deinit, NULL, FALSE);
 
 #ifdef USE_PLUGIN
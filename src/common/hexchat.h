@@ -276,8 +276,10 @@ struct hexchatprefs
 	int hex_net_proxy_use;				/* 0=all 1=IRC_ONLY 2=DCC_ONLY */
 	int hex_net_reconnect_delay;
 	int hex_notify_timeout;
+	int hex_plugin_slow_warn;			/* ms a hook may take before a warning, 0=never */
 	int hex_text_max_indent;
 	int hex_text_max_lines;
+	int hex_text_max_memory;			/* MiB of scrollback kept in memory, 0=unlimited */
 	int hex_url_grabber_limit;
 
 	/* STRINGS */
@@ -34,6 +34,7 @@
 #include "cfgfiles.h"
 #include "fe.h"
 #include "text.h"
+#include "timerwheel.h"
 #include "util.h"
 #include "hexchatc.h"
 #include "typedef.h"
@@ -404,7 +405,7 @@ flood_check (char *nick, char *ip, server *serv, session *sess, int what)	/*0=ct
 					{
 						prefs.hex_gui_autoopen_dialog = 0;
 						/* turn it back on in 30 secs */
-						fe_timeout_add_seconds (30, flood_autodialog_timeout, NULL);
+						timerwheel_add_seconds (30, flood_autodialog_timeout, NULL);
 					}
 					return 0;
 				}
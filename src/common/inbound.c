@@ -44,6 +44,7 @@
 #include "server.h"
 #include "servlist.h"
 #include "text.h"
+#include "timerwheel.h"
 #include "ctcp.h"
 #include "hexchatc.h"
 #include "chanopt.h"
@@ -68,7 +69,7 @@ clear_channel (session *sess)
 
 	if (sess->mode_timeout_tag)
 	{
-		fe_timeout_remove (sess->mode_timeout_tag);
+		timerwheel_remove (sess->mode_timeout_tag);
 		sess->mode_timeout_tag = 0;
 	}
 
@@ -1606,7 +1607,7 @@ inbound_login_end (session *sess, char *text, const message_tags_data *tags_data
 			&& ((net->pass && inbound_nickserv_login (serv))
 				|| net->commandlist))
 		{
-			serv->joindelay_tag = fe_timeout_add_seconds (prefs.hex_irc_join_delay, check_autojoin_channels, serv);
+			serv->joindelay_tag = timerwheel_add_seconds (prefs.hex_irc_join_delay, check_autojoin_channels, serv);
 		}
 		else
 		{
@@ -1639,7 +1640,7 @@ inbound_identified (server *serv)	/* 'MODE +e MYSELF' on freenode */
 	if (serv->joindelay_tag)
 	{
 		/* stop waiting, just auto JOIN now */
-		fe_timeout_remove (serv->joindelay_tag);
+		timerwheel_remove (serv->joindelay_tag);
 		serv->joindelay_tag = 0;
 		check_autojoin_channels (serv);
 	}
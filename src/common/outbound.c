@@ -886,17 +886,42 @@ cmd_debug (struct session *sess, char *tbuf, char *word[], char *word_eol[])
 	struct session *s;
 	struct server *v;
 	GSList *list = sess_list;
+	int kib, skipped, total = 0;
+	gboolean tracked;
 
-	PrintText (sess, "Session   T Channel    WaitChan  WillChan  Server\n");
+	/* frontends without a scrollback widget have no numbers to give */
+	tracked = fe_gui_info (sess, 1) >= 0;
+
+	PrintText (sess, tracked ? "Session   T Channel    WaitChan  WillChan  Server    Buffer\n" :
+						"Session   T Channel    WaitChan  WillChan  Server\n");
 	while (list)
 	{
 		s = (struct session *) list->data;
-		sprintf (tbuf, "%p %1x %-10.10s %-10.10s %-10.10s %p\n",
-					s, s->type, s->channel, s->waitchannel,
-					s->willjoinchannel, s->server);
+		kib = fe_gui_info (s, 1);
+		if (kib > 0)
+			total += kib;
+		if (kib >= 0)
+			sprintf (tbuf, "%p %1x %-10.10s %-10.10s %-10.10s %p %dK\n",
+						s, s->type, s->channel, s->waitchannel,
+						s->willjoinchannel, s->server, kib);
+		else
+			sprintf (tbuf, "%p %1x %-10.10s %-10.10s %-10.10s %p\n",
+						s, s->type, s->channel, s->waitchannel,
+						s->willjoinchannel, s->server);
 		PrintText (sess, tbuf);
 		list = list->next;
 	}
+	if (tracked)
+	{
+		sprintf (tbuf, "Scrollback total: %dK\n", total);
+		PrintText (sess, tbuf);
+	}
+	skipped = fe_gui_info (sess, 2);
+	if (skipped >= 0)
+	{
+		sprintf (tbuf, "Frames dropped/s: %d\n", skipped);
+		PrintText (sess, tbuf);
+	}
 
 	list = serv_list;
 	PrintText (sess, "Server    Sock  Name\n");
@@ -3089,6 +3114,19 @@ cmd_ping (struct session *sess, char *tbuf, char *word[], char *word_eol[])
 	return TRUE;
 }
 
+static int
+cmd_plugin (struct session *sess, char *tbuf, char *word[], char *word_eol[])
+{
+	if (g_ascii_strcasecmp (word[2], "STATS") != 0)
+		return FALSE;
+
+	if (*word[3] && g_ascii_strcasecmp (word[3], "RESET") != 0)
+		return FALSE;
+
+	plugin_show_stats (sess, *word[3] != 0);
+	return TRUE;
+}
+
 session *
 open_query (server *serv, char *nick, gboolean focus_existing)
 {
@@ -3311,6 +3349,42 @@ cmd_say (struct session *sess, char *tbuf, char *word[], char *word_eol[])
 	return FALSE;
 }
 
+static int
+cmd_scrollback (struct session *sess, char *tbuf, char *word[], char *word_eol[])
+{
+	struct session *s;
+	GSList *list;
+	int kib, spilled, total = 0, total_spilled = 0;
+
+	if (fe_gui_info (sess, 1) < 0)
+	{
+		PrintText (sess, _("Scrollback memory isn't tracked by this frontend.\n"));
+		return TRUE;
+	}
+
+	PrintText (sess, "Memory   On disk  Tab\n");
+	for (list = sess_list; list; list = list->next)
+	{
+		s = (struct session *) list->data;
+		kib = fe_gui_info (s, 1);
+		spilled = fe_gui_info (s, 3);
+		total += kib;
+		total_spilled += spilled;
+		sprintf (tbuf, "%7dK %7dK %s %s\n", kib, spilled,
+					s->server->servername, s->channel);
+		PrintText (sess, tbuf);
+	}
+
+	if (prefs.hex_text_max_memory)
+		sprintf (tbuf, "%7dK %7dK Total, budget %dM\n", total, total_spilled,
+					prefs.hex_text_max_memory);
+	else
+		sprintf (tbuf, "%7dK %7dK Total, no budget\n", total, total_spilled);
+	PrintText (sess, tbuf);
+
+	return TRUE;
+}
+
 static int
 cmd_send (struct session *sess, char *tbuf, char *word[], char *word_eol[])
 {
@@ -4097,6 +4171,8 @@ const struct commands xc_cmds[] = {
 	 N_("PART [<channel>] [<reason>], leaves the channel, by default the current one")},
 	{"PING", cmd_ping, 1, 0, 1,
 	 N_("PING <nick | channel>, CTCP pings nick or channel")},
+	{"PLUGIN", cmd_plugin, 0, 0, 1,
+	 N_("PLUGIN STATS [RESET], shows how often each plugin hook ran and how long it took, or clears the counts")},
 	{"QUERY", cmd_query, 0, 0, 1,
 	 N_("QUERY [-nofocus] <nick> [message], opens up a new privmsg window to someone and optionally sends a message")},
 	{"QUIET", cmd_quiet, 1, 1, 1,
@@ -4116,6 +4192,8 @@ const struct commands xc_cmds[] = {
 	{"RELOAD", cmd_reload, 0, 0, 1, N_("RELOAD <name>, reloads a plugin or script")},
 	{"SAY", cmd_say, 0, 0, 1,
 	 N_("SAY <text>, sends the text to the object in the current window")},
+	{"SCROLLBACK", cmd_scrollback, 0, 0, 1,
+	 N_("SCROLLBACK, shows how much memory each tab's scrollback takes and how much of it is on disk")},
 	{"SEND", cmd_send, 0, 0, 1, N_("SEND <nick> [<file>]")},
 #ifdef USE_OPENSSL
 	{"SERVCHAN", cmd_servchan, 0, 0, 1,
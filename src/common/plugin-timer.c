@@ -31,7 +31,9 @@
 #define _(x) hexchat_gettext(ph,x)
 
 static hexchat_plugin *ph;	/* plugin handle */
-static GSList *timer_list = NULL;
+static GQueue timer_queue = G_QUEUE_INIT;	/* in the order they were added */
+static GHashTable *timer_refs = NULL;		/* ref number -> timer */
+static int timer_top = 0;						/* highest ref number in use */
 
 #define STATIC
 #define HELP \
@@ -43,39 +45,49 @@ typedef struct
 	hexchat_hook *hook;
 	hexchat_context *context;
 	char *command;
+	GList *link;		/* in timer_queue */
 	int ref;
 	int repeat;
 	int timeout;
 	unsigned int forever:1;
+	unsigned int running:1;	/* its command is being run right now */
+	unsigned int deleted:1;	/* deleted by that command, timeout_cb frees it */
 } timer;
 
 static void
-timer_del (timer *tim)
+timer_free (timer *tim)
 {
-	timer_list = g_slist_remove (timer_list, tim);
 	g_free (tim->command);
-	hexchat_unhook (ph, tim->hook);
 	g_free (tim);
 }
 
+static void
+timer_del (timer *tim)
+{
+	g_queue_delete_link (&timer_queue, tim->link);
+	g_hash_table_remove (timer_refs, GINT_TO_POINTER (tim->ref));
+	while (timer_top > 0 && !g_hash_table_contains (timer_refs, GINT_TO_POINTER (timer_top)))
+		timer_top--;
+
+	hexchat_unhook (ph, tim->hook);
+	if (tim->running)
+		tim->deleted = TRUE;
+	else
+		timer_free (tim);
+}
+
 static void
 timer_del_ref (int ref, int quiet)
 {
-	GSList *list;
 	timer *tim;
 
-	list = timer_list;
-	while (list)
+	tim = g_hash_table_lookup (timer_refs, GINT_TO_POINTER (ref));
+	if (tim)
 	{
-		tim = list->data;
-		if (tim->ref == ref)
-		{
-			timer_del (tim);
-			if (!quiet)
-				hexchat_printf (ph, _("Timer %d deleted.\n"), ref);
-			return;
-		}
-		list = list->next;
+		timer_del (tim);
+		if (!quiet)
+			hexchat_printf (ph, _("Timer %d deleted.\n"), ref);
+		return;
 	}
 	if (!quiet)
 		hexchat_print (ph, _("No such ref number found.\n"));
@@ -86,7 +98,15 @@ timeout_cb (timer *tim)
 {
 	if (hexchat_set_context (ph, tim->context))
 	{
+		/* the command may delete or replace this very timer */
+		tim->running = TRUE;
 		hexchat_command (ph, tim->command);
+		tim->running = FALSE;
+		if (tim->deleted)
+		{
+			timer_free (tim);
+			return 0;
+		}
 
 		if (tim->forever)
 			return 1;
@@ -104,20 +124,14 @@ static void
 timer_add (int ref, int timeout, int repeat, char *command)
 {
 	timer *tim;
-	GSList *list;
 
 	if (ref == 0)
-	{
-		ref = 1;
-		list = timer_list;
-		while (list)
-		{
-			tim = list->data;
-			if (tim->ref >= ref)
-				ref = tim->ref + 1;
-			list = list->next;
-		}
-	}
+		ref = timer_top + 1;
+
+	/* reusing a ref number replaces that timer */
+	tim = g_hash_table_lookup (timer_refs, GINT_TO_POINTER (ref));
+	if (tim)
+		timer_del (tim);
 
 	tim = g_new (timer, 1);
 	tim->ref = ref;
@@ -126,21 +140,26 @@ timer_add (int ref, int timeout, int repeat, char *command)
 	tim->command = g_strdup (command);
 	tim->context = hexchat_get_context (ph);
 	tim->forever = FALSE;
+	tim->running = FALSE;
+	tim->deleted = FALSE;
 
 	if (repeat == 0)
 		tim->forever = TRUE;
 
 	tim->hook = hexchat_hook_timer (ph, timeout, (void *)timeout_cb, tim);
-	timer_list = g_slist_append (timer_list, tim);
+	g_queue_push_tail (&timer_queue, tim);
+	tim->link = timer_queue.tail;
+	g_hash_table_insert (timer_refs, GINT_TO_POINTER (ref), tim);
+	timer_top = MAX (timer_top, ref);
 }
 
 static void
 timer_showlist (void)
 {
-	GSList *list;
+	GList *list;
 	timer *tim;
 
-	if (timer_list == NULL)
+	if (g_queue_is_empty (&timer_queue))
 	{
 		hexchat_print (ph, _("No timers installed.\n"));
 		hexchat_print (ph, _(HELP));
@@ -148,7 +167,7 @@ timer_showlist (void)
 	}
 							 /*  00000 00000000 0000000 abc */
 	hexchat_print (ph, _("\026 Ref#  Seconds  Repeat  Command \026\n"));
-	list = timer_list;
+	list = timer_queue.head;
 	while (list)
 	{
 		tim = list->data;
@@ -220,6 +239,7 @@ hexchat_plugin_init
 {
 	/* we need to save this for use with any hexchat_* functions */
 	ph = plugin_handle;
+	timer_refs = g_hash_table_new (g_direct_hash, g_direct_equal);
 
 	*plugin_name = "Timer";
 	*plugin_desc = "IrcII style /TIMER command";
@@ -229,3 +249,19 @@ hexchat_plugin_init
 
 	return 1;       /* return 1 for success */
 }
+
+int
+#ifdef STATIC
+timer_plugin_deinit
+#else
+hexchat_plugin_deinit
+#endif
+				(hexchat_plugin *plugin_handle)
+{
+	while (!g_queue_is_empty (&timer_queue))
+		timer_del (g_queue_peek_head (&timer_queue));
+	g_clear_pointer (&timer_refs, g_hash_table_destroy);
+	timer_top = 0;
+
+	return 1;
+}
@@ -22,5 +22,6 @@
 
 int timer_plugin_init (hexchat_plugin *plugin_handle, char **plugin_name,
 				char **plugin_desc, char **plugin_version, char *arg);
+int timer_plugin_deinit (hexchat_plugin *plugin_handle);
 
 #endif
@@ -40,6 +40,7 @@
 #include "modes.h"
 #include "notify.h"
 #include "text.h"
+#include "timerwheel.h"
 #define PLUGIN_C
 typedef struct session hexchat_context;
 #include "hexchat-plugin.h"
@@ -57,7 +58,6 @@ typedef struct session hexchat_context;
 
 #define DEBUG(x) {x;}
 
-/* crafted to be an even 32 bytes */
 struct _hexchat_hook
 {
 	hexchat_plugin *pl;	/* the plugin to which it belongs */
@@ -68,6 +68,64 @@ struct _hexchat_hook
 	int tag;				/* for timers & FDs only */
 	int type;			/* HOOK_* */
 	int pri;	/* fd */	/* priority / fd for HOOK_FD only */
+	guint seq;			/* order of creation, breaks priority ties */
+	const char *key;	/* interned lowercase name, NULL for RAW LINE */
+	struct hook_index *index;	/* NULL for timers & fds */
+	GPtrArray *bucket;	/* the index array holding this hook */
+	guint calls;		/* profiling, see plugin_hook_account() */
+	guint eaten;
+	gint64 time_total;	/* microseconds */
+	gint64 time_max;
+	gboolean warned;	/* already reported as slow */
+	GPtrArray *batch;	/* struct server_line, queued for HOOK_SERVER_BATCH */
+};
+
+/* a line queued for batch hooks, shared between all of them */
+struct server_line
+{
+	hexchat_server_line pub;	/* what plugins see, must be first */
+	int refs;
+	int words;			/* split lazily, see server_line_split() */
+	int *start;			/* byte offsets of each word, and of each word_eol */
+	int *len;
+	int *eol;
+};
+
+/* work handed to hexchat_run_async() */
+struct _hexchat_async
+{
+	hexchat_plugin *pl;		/* NULL once reported at unload */
+	session *context;			/* restored for done */
+	void (*work) (hexchat_async *job, void *user_data);
+	void (*done) (hexchat_async *job, int cancelled, void *user_data);
+	void *userdata;
+	GList *link;				/* in async_jobs */
+	gint cancelled;			/* atomic, work can poll it */
+	int state;					/* ASYNC_*, under async_lock */
+	gboolean reported;		/* done has been called */
+};
+
+enum
+{
+	ASYNC_QUEUED,
+	ASYNC_RUNNING,
+	ASYNC_FINISHED
+};
+
+#define ASYNC_THREADS_MAX 4
+#define ASYNC_UNLOAD_WAIT (5 * G_TIME_SPAN_SECOND)	/* for work that ignores cancel */
+
+/* a copy of a hook's stats, for the "hooks" list */
+struct hook_row
+{
+	char *name;
+	char *plugin;
+	const char *type;
+	int pri;
+	guint calls;
+	guint eaten;
+	gint64 time_total;
+	gint64 time_max;
 };
 
 struct _hexchat_list
@@ -75,8 +133,13 @@ struct _hexchat_list
 	int type;			/* LIST_* */
 	GSList *pos;		/* current pos */
 	GSList *next;		/* next pos */
-	GSList *head;		/* for LIST_USERS only */
+	GSList *head;		/* for LIST_USERS and LIST_HOOKS only */
 	struct notify_per_server *notifyps;	/* notify_per_server * */
+	void *data;			/* the current item */
+	session *sess;		/* user tree cursor, see hexchat_list_open() */
+	GPtrArray *users;	/* its users when opened */
+	guint index;		/* the next one in users */
+	gboolean selected_done;	/* fe_userlist_set_selected() called */
 };
 
 typedef int (hexchat_cmd_cb) (char *word[], char *word_eol[], void *user_data);
@@ -84,6 +147,7 @@ typedef int (hexchat_serv_cb) (char *word[], char *word_eol[], void *user_data);
 typedef int (hexchat_print_cb) (char *word[], void *user_data);
 typedef int (hexchat_serv_attrs_cb) (char *word[], char *word_eol[], hexchat_event_attrs *attrs, void *user_data);
 typedef int (hexchat_print_attrs_cb) (char *word[], hexchat_event_attrs *attrs, void *user_data);
+typedef int (hexchat_serv_batch_cb) (hexchat_server_line *const *lines, int count, void *user_data);
 typedef int (hexchat_fd_cb) (int fd, int flags, void *user_data);
 typedef int (hexchat_timer_cb) (void *user_data);
 typedef int (hexchat_init_func) (hexchat_plugin *, char **, char **, char **, char *);
@@ -95,13 +159,14 @@ enum
 	LIST_DCC,
 	LIST_IGNORE,
 	LIST_NOTIFY,
-	LIST_USERS
+	LIST_USERS,
+	LIST_HOOKS
 };
 
-/* We use binary flags here because it makes it possible for plugin_hook_find()
- * to match several types of hooks.  This is used so that plugin_hook_run()
- * match both HOOK_SERVER and HOOK_SERVER_ATTRS hooks when plugin_emit_server()
- * is called.
+/* We use binary flags here because it makes it possible for plugin_hook_run()
+ * to match several types of hooks.  This is used so that it matches
+ * HOOK_SERVER, HOOK_SERVER_ATTRS and HOOK_SERVER_BATCH hooks, which share an
+ * index, when plugin_emit_server() is called.
  */
 enum
 {
@@ -112,7 +177,8 @@ enum
 	HOOK_PRINT_ATTRS  = 1 << 4, /* same as above, with attributes */
 	HOOK_TIMER        = 1 << 5, /* timeouts */
 	HOOK_FD           = 1 << 6, /* sockets & fds */
-	HOOK_DELETED      = 1 << 7  /* marked for deletion */
+	HOOK_SERVER_BATCH = 1 << 7, /* same as above, delivered once per loop */
+	HOOK_DELETED      = 1 << 8  /* marked for deletion */
 };
 
 enum
@@ -145,10 +211,144 @@ enum
 
 GSList *plugin_list = NULL;	/* export for plugingui.c */
 static GSList *hook_list = NULL;
+static GHashTable *hooks_alive = NULL;	/* the same hooks, to check one in O(1) */
+
+/* Hooks that are run by name, for each of commands, server and print hooks:
+ * a table from lowercased name to an array of hooks in the order they run,
+ * plus the server hooks on "RAW LINE", which see every name. */
+struct hook_index
+{
+	GHashTable *names;	/* interned name -> GPtrArray of hexchat_hook */
+	GPtrArray *raw;
+};
+
+static struct hook_index hook_index[3];
+static guint hook_seq = 0;
+static int hook_depth = 0;		/* plugin_hook_run()s in progress */
+static int hooks_deleted = 0;	/* unhooked, waiting for plugin_hook_sweep() */
+static GSList *batch_hooks = NULL;	/* batch hooks with lines queued */
+static guint batch_tag = 0;
+
+static GThreadPool *async_pool = NULL;
+static GList *async_jobs = NULL;	/* every job not yet freed, main thread only */
+static GMutex async_lock;			/* guards the rest */
+static GCond async_cond;			/* a job has left ASYNC_RUNNING */
+static GQueue async_finished = G_QUEUE_INIT;
+static guint async_idle = 0;
 
 extern const struct prefs vars[];	/* cfgfiles.c */
 
 
+/* call a job's done, in the context it was started from */
+
+static void
+async_report (hexchat_async *job)
+{
+	hexchat_plugin *pl = job->pl;
+
+	job->reported = TRUE;
+	pl->context = is_session (job->context) ? job->context : current_sess;
+	job->done (job, g_atomic_int_get (&job->cancelled), job->userdata);
+}
+
+/* main thread: call done for everything the workers have finished */
+
+static gboolean
+async_complete (gpointer unused)
+{
+	GQueue finished;
+	hexchat_async *job;
+
+	g_mutex_lock (&async_lock);
+	finished = async_finished;
+	g_queue_init (&async_finished);
+	async_idle = 0;
+	g_mutex_unlock (&async_lock);
+
+	while ((job = g_queue_pop_head (&finished)))
+	{
+		if (!job->reported)
+			async_report (job);
+		async_jobs = g_list_delete_link (async_jobs, job->link);
+		g_free (job);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* worker thread side of hexchat_run_async() */
+
+static void
+async_thread (gpointer data, gpointer unused)
+{
+	hexchat_async *job = data;
+	gboolean run;
+
+	g_mutex_lock (&async_lock);
+	run = !g_atomic_int_get (&job->cancelled);
+	job->state = run ? ASYNC_RUNNING : ASYNC_FINISHED;
+	g_mutex_unlock (&async_lock);
+
+	if (run)
+		job->work (job, job->userdata);
+
+	g_mutex_lock (&async_lock);
+	job->state = ASYNC_FINISHED;
+	g_cond_broadcast (&async_cond);
+	g_queue_push_tail (&async_finished, job);
+	if (async_idle == 0)
+		async_idle = g_idle_add (async_complete, NULL);
+	g_mutex_unlock (&async_lock);
+}
+
+/* The plugin is going away: cancel its jobs, wait for any that are in its
+   code right now and report them all. The jobs themselves are freed when the
+   workers are done with them, as usual. Returns FALSE if some work is still
+   running after ASYNC_UNLOAD_WAIT, the plugin must then stay in memory. */
+
+static gboolean
+async_unload (hexchat_plugin *pl)
+{
+	GList *list;
+	hexchat_async *job;
+	gboolean running;
+	gint64 end_time = g_get_monotonic_time () + ASYNC_UNLOAD_WAIT;
+
+	g_mutex_lock (&async_lock);
+	for (list = async_jobs; list; list = list->next)
+	{
+		job = list->data;
+		if (job->pl == pl)
+			g_atomic_int_set (&job->cancelled, TRUE);
+	}
+	do
+	{
+		running = FALSE;
+		for (list = async_jobs; list; list = list->next)
+		{
+			job = list->data;
+			if (job->pl == pl && job->state == ASYNC_RUNNING)
+				running = TRUE;
+		}
+		if (running && !g_cond_wait_until (&async_cond, &async_lock, end_time))
+			break;
+	}
+	while (running);
+	g_mutex_unlock (&async_lock);
+
+	for (list = async_jobs; list; list = list->next)
+	{
+		job = list->data;
+		if (job->pl != pl)
+			continue;
+		if (!job->reported)
+			async_report (job);
+		job->pl = NULL;
+	}
+
+	return !running;
+}
+
 /* unload a plugin and remove it from our linked list */
 
 static int
@@ -181,6 +381,14 @@ plugin_free (hexchat_plugin *pl, int do_deinit, int allow_refuse)
 		list = next;
 	}
 
+	if (!async_unload (pl))
+	{
+		/* work is still running in its code and may call back through pl */
+		PrintTextf (current_sess, _("Plugin %s: async work did not stop, keeping it in memory\n"), pl->name);
+		plugin_list = g_slist_remove (plugin_list, pl);
+		goto update;
+	}
+
 #ifdef USE_PLUGIN
 	if (pl->handle)
 		g_module_close (pl->handle);
@@ -198,6 +406,7 @@ xit:
 
 	plugin_list = g_slist_remove (plugin_list, pl);
 
+update:
 #ifdef USE_PLUGIN
 	fe_pluginlist_update ();
 #endif
@@ -319,6 +528,17 @@ plugin_add (session *sess, char *filename, void *handle, void *init_func,
 		pl->hexchat_emit_print_attrs = hexchat_emit_print_attrs;
 		pl->hexchat_event_attrs_create = hexchat_event_attrs_create;
 		pl->hexchat_event_attrs_free = hexchat_event_attrs_free;
+		pl->hexchat_list_open = hexchat_list_open;
+		pl->hexchat_list_field_id = hexchat_list_field_id;
+		pl->hexchat_list_str_id = hexchat_list_str_id;
+		pl->hexchat_list_int_id = hexchat_list_int_id;
+		pl->hexchat_list_time_id = hexchat_list_time_id;
+		pl->hexchat_list_fetch = hexchat_list_fetch;
+		pl->hexchat_hook_server_batch = hexchat_hook_server_batch;
+		pl->hexchat_server_line_word = hexchat_server_line_word;
+		pl->hexchat_run_async = hexchat_run_async;
+		pl->hexchat_async_cancel = hexchat_async_cancel;
+		pl->hexchat_async_cancelled = hexchat_async_cancelled;
 
 		/* run hexchat_plugin_init, if it returns 0, close the plugin */
 		if (((hexchat_init_func *)init_func) (pl, &pl->name, &pl->desc, &pl->version, arg) == 0)
@@ -544,27 +764,319 @@ plugin_reload (session *sess, char *name, int by_filename)
 
 #endif
 
-static GSList *
-plugin_hook_find (GSList *list, int type, char *name)
+static struct hook_index *
+plugin_hook_index (int type)
+{
+	struct hook_index *idx;
+
+	if (type & HOOK_COMMAND)
+		idx = &hook_index[0];
+	else if (type & (HOOK_SERVER | HOOK_SERVER_ATTRS | HOOK_SERVER_BATCH))
+		idx = &hook_index[1];
+	else if (type & (HOOK_PRINT | HOOK_PRINT_ATTRS))
+		idx = &hook_index[2];
+	else
+		return NULL;
+
+	if (!idx->names)
+	{
+		idx->names = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+														(GDestroyNotify) g_ptr_array_unref);
+		idx->raw = g_ptr_array_new ();
+	}
+
+	return idx;
+}
+
+/* the hooks on this name, in the order they run */
+
+static GPtrArray *
+plugin_hook_lookup (struct hook_index *idx, const char *name)
+{
+	char buf[64];
+	char *lower;
+	GPtrArray *hooks;
+	int i;
+
+	for (i = 0; name[i] && i < (int) sizeof (buf) - 1; i++)
+		buf[i] = g_ascii_tolower (name[i]);
+	buf[i] = 0;
+
+	if (name[i] == 0)
+		return g_hash_table_lookup (idx->names, buf);
+
+	lower = g_ascii_strdown (name, -1);
+	hooks = g_hash_table_lookup (idx->names, lower);
+	g_free (lower);
+
+	return hooks;
+}
+
+/* higher priority first; among equals, the newest first */
+
+static gboolean
+plugin_hook_runs_before (hexchat_hook *a, hexchat_hook *b)
+{
+	return a->pri > b->pri || (a->pri == b->pri && a->seq > b->seq);
+}
+
+/* walks one index array while callbacks may add hooks to it; nothing is
+   removed from it until the sweep, so whatever ran last can only move right */
+
+struct hook_cursor
+{
+	GPtrArray *hooks;
+	guint pos;
+	hexchat_hook *last;
+	guint last_pos;
+};
+
+static hexchat_hook *
+plugin_hook_cursor_peek (struct hook_cursor *c, int type)
+{
+	hexchat_hook *hook;
+
+	if (!c->hooks)
+		return NULL;
+
+	if (c->last)
+	{
+		while (g_ptr_array_index (c->hooks, c->last_pos) != c->last)
+			c->last_pos++;
+		c->pos = c->last_pos + 1;
+	}
+	else
+		c->pos = 0;
+
+	for (; c->pos < c->hooks->len; c->pos++)
+	{
+		hook = g_ptr_array_index (c->hooks, c->pos);
+		if (hook->type & type)
+			return hook;
+	}
+
+	return NULL;
+}
+
+static void
+plugin_hook_cursor_take (struct hook_cursor *c)
+{
+	c->last = g_ptr_array_index (c->hooks, c->pos);
+	c->last_pos = c->pos;
+}
+
+static const char *
+plugin_hook_type_name (int type)
+{
+	switch (type)
+	{
+	case HOOK_COMMAND:
+		return "command";
+	case HOOK_SERVER:
+	case HOOK_SERVER_ATTRS:
+	case HOOK_SERVER_BATCH:
+		return "server";
+	case HOOK_PRINT:
+	case HOOK_PRINT_ATTRS:
+		return "print";
+	case HOOK_TIMER:
+		return "timer";
+	case HOOK_FD:
+		return "fd";
+	}
+	return "";
+}
+
+/* record one callback that started at 'start' (monotonic); the clock is
+   read twice per call, which is cheap next to any script callback */
+
+static void
+plugin_hook_account (hexchat_hook *hook, gint64 start, int eaten)
+{
+	gint64 elapsed = g_get_monotonic_time () - start;
+
+	hook->calls++;
+	if (eaten)
+		hook->eaten++;
+	hook->time_total += elapsed;
+	if (elapsed > hook->time_max)
+		hook->time_max = elapsed;
+
+	/* a hook that unhooked itself may have taken its plugin with it */
+	if (prefs.hex_plugin_slow_warn > 0 && !hook->warned && hook->type != HOOK_DELETED
+		 && elapsed >= (gint64) prefs.hex_plugin_slow_warn * 1000)
+	{
+		hook->warned = TRUE;
+		PrintTextf (current_sess, _("Plugin %s: %s hook %s took %d ms, see /PLUGIN STATS\n"),
+						hook->pl->name, plugin_hook_type_name (hook->type),
+						hook->name ? hook->name : "", (int) (elapsed / 1000));
+	}
+}
+
+/* really remove deleted hooks now, unless a callback is still running */
+
+static void
+plugin_hook_sweep (void)
 {
+	GSList *list, *next;
 	hexchat_hook *hook;
 
+	if (hook_depth > 0 || hooks_deleted == 0)
+		return;
+
+	list = hook_list;
 	while (list)
 	{
 		hook = list->data;
-		if (hook && (hook->type & type))
+		next = list->next;
+		if (hook->type == HOOK_DELETED)
 		{
-			if (g_ascii_strcasecmp (hook->name, name) == 0)
-				return list;
+			if (hook->bucket)
+			{
+				g_ptr_array_remove (hook->bucket, hook);
+				if (hook->key && hook->bucket->len == 0)
+					g_hash_table_remove (hook->index->names, hook->key);
+			}
+			hook_list = g_slist_delete_link (hook_list, list);
+			g_hash_table_remove (hooks_alive, hook);
+			g_free (hook);
+		}
+		list = next;
+	}
+
+	hooks_deleted = 0;
+}
+
+static void
+server_line_unref (struct server_line *line)
+{
+	if (--line->refs > 0)
+		return;
+
+	g_free ((char *) line->pub.line);
+	g_free (line->start);
+	g_free (line);
+}
+
+/* splits the line the way process_data_init() does without quote handling,
+   except that the last word runs to the end of the line */
+
+static void
+server_line_split (struct server_line *line)
+{
+	const char *text = line->pub.line;
+	int i = 0, n = 1;
+
+	line->start = g_new (int, PDIWORDS * 3);
+	line->len = line->start + PDIWORDS;
+	line->eol = line->len + PDIWORDS;
 
-			if ((type & HOOK_SERVER)
-				&& g_ascii_strcasecmp (hook->name, "RAW LINE") == 0)
-					return list;
+	line->start[1] = line->eol[1] = 0;
+	while (1)
+	{
+		if (text[i] == ' ' && n < PDIWORDS - 1)
+		{
+			line->len[n] = i - line->start[n];
+			line->eol[++n] = ++i;
+			while (text[i] == ' ')
+				i++;
+			line->start[n] = i;
 		}
-		list = list->next;
+		else if (text[i] == 0)
+		{
+			line->len[n] = i - line->start[n];
+			break;
+		}
+		else
+			i++;
 	}
 
-	return NULL;
+	line->words = n;
+}
+
+/* deliver everything queued since the last main loop iteration */
+
+static gboolean
+plugin_batch_flush (gpointer unused)
+{
+	GSList *list, *hooks;
+	hexchat_hook *hook;
+	GPtrArray *batch;
+	session *sess, *alive;
+	gint64 start;
+	guint i;
+
+	hooks = g_slist_reverse (batch_hooks);
+	batch_hooks = NULL;
+	batch_tag = 0;
+
+	hook_depth++;
+	for (list = hooks; list; list = list->next)
+	{
+		hook = list->data;
+		batch = hook->batch;
+		hook->batch = NULL;
+		if (!batch)
+			continue;	/* unhooked meanwhile */
+
+		/* drop lines for tabs that were closed since they were queued,
+		   possibly by an earlier hook's callback */
+		alive = NULL;
+		for (i = batch->len; i-- > 0;)
+		{
+			sess = ((struct server_line *) batch->pdata[i])->pub.context;
+			if (sess == alive)
+				continue;
+			if (is_session (sess))
+				alive = sess;
+			else
+				g_ptr_array_remove_index (batch, i);
+		}
+		if (batch->len == 0)
+		{
+			g_ptr_array_free (batch, TRUE);
+			continue;
+		}
+
+		hook->pl->context = current_sess;
+		start = g_get_monotonic_time ();
+		((hexchat_serv_batch_cb *)hook->callback) ((hexchat_server_line **) batch->pdata,
+																 batch->len, hook->userdata);
+		plugin_hook_account (hook, start, FALSE);
+
+		g_ptr_array_free (batch, TRUE);
+	}
+	hook_depth--;
+
+	g_slist_free (hooks);
+	plugin_hook_sweep ();
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+plugin_batch_queue (hexchat_hook *hook, struct server_line **line, session *sess,
+						  char *word_eol[], hexchat_event_attrs *attrs)
+{
+	/* copied once, however many batch hooks want it */
+	if (!*line)
+	{
+		*line = g_new0 (struct server_line, 1);
+		(*line)->pub.line = g_strdup (word_eol[1]);
+		(*line)->pub.context = sess;
+		(*line)->pub.server_time_utc = attrs ? attrs->server_time_utc : 0;
+	}
+	(*line)->refs++;
+
+	if (!hook->batch)
+	{
+		hook->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) server_line_unref);
+		batch_hooks = g_slist_prepend (batch_hooks, hook);
+	}
+	g_ptr_array_add (hook->batch, *line);
+
+	if (!batch_tag)
+		batch_tag = g_idle_add_full (G_PRIORITY_DEFAULT, plugin_batch_flush, NULL, NULL);
 }
 
 /* check for plugin hooks and run them */
@@ -573,20 +1085,40 @@ static int
 plugin_hook_run (session *sess, char *name, char *word[], char *word_eol[],
 				 hexchat_event_attrs *attrs, int type)
 {
-	GSList *list, *next;
-	hexchat_hook *hook;
+	struct hook_index *idx = plugin_hook_index (type);
+	struct hook_cursor named = { NULL }, raw = { NULL };
+	struct server_line *line = NULL;
+	hexchat_hook *hook, *raw_hook;
+	gint64 start;
 	int ret, eat = 0;
 
-	list = hook_list;
+	named.hooks = plugin_hook_lookup (idx, name);
+	if (type & HOOK_SERVER)
+		raw.hooks = idx->raw;
+
+	hook_depth++;
 	while (1)
 	{
-		list = plugin_hook_find (list, type, name);
-		if (!list)
+		hook = plugin_hook_cursor_peek (&named, type);
+		raw_hook = plugin_hook_cursor_peek (&raw, type);
+		if (raw_hook && (!hook || plugin_hook_runs_before (raw_hook, hook)))
+		{
+			hook = raw_hook;
+			plugin_hook_cursor_take (&raw);
+		}
+		else if (hook)
+			plugin_hook_cursor_take (&named);
+		else
 			goto xit;
 
-		hook = list->data;
-		next = list->next;
+		if (hook->type == HOOK_SERVER_BATCH)
+		{
+			plugin_batch_queue (hook, &line, sess, word_eol, attrs);
+			continue;
+		}
+
 		hook->pl->context = sess;
+		start = g_get_monotonic_time ();
 
 		/* run the plugin's callback function */
 		switch (hook->type)
@@ -608,6 +1140,8 @@ plugin_hook_run (session *sess, char *name, char *word[], char *word_eol[],
 			break;
 		}
 
+		plugin_hook_account (hook, start, ret & HEXCHAT_EAT_HEXCHAT);
+
 		if ((ret & HEXCHAT_EAT_HEXCHAT) && (ret & HEXCHAT_EAT_PLUGIN))
 		{
 			eat = 1;
@@ -617,24 +1151,11 @@ plugin_hook_run (session *sess, char *name, char *word[], char *word_eol[],
 			goto xit;	/* stop running plugins */
 		if (ret & HEXCHAT_EAT_HEXCHAT)
 			eat = 1;	/* eventually we'll return 1, but continue running plugins */
-
-		list = next;
 	}
 
 xit:
-	/* really remove deleted hooks now */
-	list = hook_list;
-	while (list)
-	{
-		hook = list->data;
-		next = list->next;
-		if (!hook || hook->type == HOOK_DELETED)
-		{
-			hook_list = g_slist_remove (hook_list, hook);
-			g_free (hook);
-		}
-		list = next;
-	}
+	hook_depth--;
+	plugin_hook_sweep ();
 
 	return eat;
 }
@@ -669,8 +1190,8 @@ plugin_emit_server (session *sess, char *name, char *word[], char *word_eol[],
 
 	attrs.server_time_utc = server_time;
 
-	return plugin_hook_run (sess, name, word, word_eol, &attrs, 
-							HOOK_SERVER | HOOK_SERVER_ATTRS);
+	return plugin_hook_run (sess, name, word, word_eol, &attrs,
+							HOOK_SERVER | HOOK_SERVER_ATTRS | HOOK_SERVER_BATCH);
 }
 
 /* see if any plugins are interested in this print event */
@@ -735,69 +1256,92 @@ plugin_emit_keypress (session *sess, unsigned int state, unsigned int keyval, gu
 static int
 plugin_timeout_cb (hexchat_hook *hook)
 {
+	gint64 start;
 	int ret;
 
 	/* timer_cb's context starts as front-most-tab */
 	hook->pl->context = current_sess;
 
-	/* call the plugin's timeout function */
+	/* call the plugin's timeout function; hold off the sweep so the hook is
+	   still there to account for afterwards */
+	hook_depth++;
+	start = g_get_monotonic_time ();
 	ret = ((hexchat_timer_cb *)hook->callback) (hook->userdata);
+	plugin_hook_account (hook, start, FALSE);
+	hook_depth--;
 
-	/* the callback might have already unhooked it! */
-	if (!g_slist_find (hook_list, hook) || hook->type == HOOK_DELETED)
+	/* the callback might have already unhooked it! hook_depth kept it from
+	   being swept meanwhile, so it's still there to look at */
+	if (hook->type == HOOK_DELETED)
 		return 0;
 
 	if (ret == 0)
 	{
-		hook->tag = 0;	/* avoid fe_timeout_remove, returning 0 is enough! */
+		hook->tag = 0;	/* avoid timerwheel_remove, returning 0 is enough! */
 		hexchat_unhook (hook->pl, hook);
 	}
 
 	return ret;
 }
 
-/* insert a hook into hook_list according to its priority */
+/* add a hook to hook_list and, if it runs by name, to its place in the index */
 
 static void
 plugin_insert_hook (hexchat_hook *new_hook)
 {
-	GSList *list;
+	struct hook_index *idx;
+	GPtrArray *hooks;
 	hexchat_hook *hook;
-	int new_hook_type;
- 
-	switch (new_hook->type)
+	char *lower;
+	guint i;
+
+	hook_list = g_slist_prepend (hook_list, new_hook);
+	if (!hooks_alive)
+		hooks_alive = g_hash_table_new (NULL, NULL);
+	g_hash_table_add (hooks_alive, new_hook);
+
+	idx = plugin_hook_index (new_hook->type);
+	if (!idx)
+		return;
+
+	if ((new_hook->type & (HOOK_SERVER | HOOK_SERVER_ATTRS | HOOK_SERVER_BATCH))
+		 && g_ascii_strcasecmp (new_hook->name, "RAW LINE") == 0)
 	{
-		case HOOK_PRINT:
-		case HOOK_PRINT_ATTRS:
-			new_hook_type = HOOK_PRINT | HOOK_PRINT_ATTRS;
-			break;
-		case HOOK_SERVER:
-		case HOOK_SERVER_ATTRS:
-			new_hook_type = HOOK_SERVER | HOOK_PRINT_ATTRS;
-			break;
-		default:
-			new_hook_type = new_hook->type;
+		hooks = idx->raw;
 	}
-
-	list = hook_list;
-	while (list)
+	else
 	{
-		hook = list->data;
-		if (hook && (hook->type & new_hook_type) && hook->pri <= new_hook->pri)
+		lower = g_ascii_strdown (new_hook->name, -1);
+		new_hook->key = g_intern_string (lower);
+		g_free (lower);
+
+		hooks = g_hash_table_lookup (idx->names, new_hook->key);
+		if (!hooks)
 		{
-			hook_list = g_slist_insert_before (hook_list, list, new_hook);
-			return;
+			hooks = g_ptr_array_new ();
+			g_hash_table_insert (idx->names, (char *) new_hook->key, hooks);
 		}
-		list = list->next;
 	}
 
-	hook_list = g_slist_append (hook_list, new_hook);
+	new_hook->index = idx;
+	new_hook->bucket = hooks;
+
+	/* ahead of the first one it runs before, i.e. of anything with the same
+	   or lower priority */
+	for (i = 0; i < hooks->len; i++)
+	{
+		hook = g_ptr_array_index (hooks, i);
+		if (plugin_hook_runs_before (new_hook, hook))
+			break;
+	}
+	g_ptr_array_insert (hooks, i, new_hook);
 }
 
 static gboolean
 plugin_fd_cb (GIOChannel *source, GIOCondition condition, hexchat_hook *hook)
 {
 	int flags = 0, ret;
+	gint64 start;
 	typedef int (hexchat_fd_cb2) (int fd, int flags, void *user_data, GIOChannel *);
 
 	if (condition & G_IO_IN)
@@ -807,10 +1351,15 @@ plugin_fd_cb (GIOChannel *source, GIOCondition condition, hexchat_hook *hook)
 	if (condition & G_IO_PRI)
 		flags |= HEXCHAT_FD_EXCEPTION;
 
+	hook_depth++;
+	start = g_get_monotonic_time ();
 	ret = ((hexchat_fd_cb2 *)hook->callback) (hook->pri, flags, hook->userdata, source);
+	plugin_hook_account (hook, start, FALSE);
+	hook_depth--;
 
-	/* the callback might have already unhooked it! */
-	if (!g_slist_find (hook_list, hook) || hook->type == HOOK_DELETED)
+	/* the callback might have already unhooked it! hook_depth kept it from
+	   being swept meanwhile, so it's still there to look at */
+	if (hook->type == HOOK_DELETED)
 		return 0;
 
 	if (ret == 0)
@@ -838,12 +1387,13 @@ plugin_add_hook (hexchat_plugin *pl, int type, int pri, const char *name,
 	hook->callback = callb;
 	hook->pl = pl;
 	hook->userdata = userdata;
+	hook->seq = ++hook_seq;
 
 	/* insert it into the linked list */
 	plugin_insert_hook (hook);
 
 	if (type == HOOK_TIMER)
-		hook->tag = fe_timeout_add (timeout, plugin_timeout_cb, hook);
+		hook->tag = timerwheel_add (timeout, plugin_timeout_cb, hook);
 
 	return hook;
 }
@@ -886,21 +1436,95 @@ plugin_command_foreach (session *sess, void *userdata,
 int
 plugin_show_help (session *sess, char *cmd)
 {
+	GPtrArray *hooks;
+	hexchat_hook *hook;
+	guint i;
+
+	hooks = plugin_hook_lookup (plugin_hook_index (HOOK_COMMAND), cmd);
+	if (!hooks)
+		return 0;
+
+	for (i = 0; i < hooks->len; i++)
+	{
+		hook = g_ptr_array_index (hooks, i);
+		if (hook->type == HOOK_COMMAND)
+		{
+			if (hook->help_text)
+			{
+				PrintText (sess, hook->help_text);
+				return 1;
+			}
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static gint
+plugin_stats_compare (gconstpointer a, gconstpointer b)
+{
+	const hexchat_hook *ha = *(hexchat_hook * const *) a;
+	const hexchat_hook *hb = *(hexchat_hook * const *) b;
+
+	if (ha->time_total != hb->time_total)
+		return ha->time_total < hb->time_total ? 1 : -1;
+	return 0;
+}
+
+/* /PLUGIN STATS: the busiest hooks first */
+
+void
+plugin_show_stats (session *sess, gboolean reset)
+{
+	GPtrArray *hooks;
 	GSList *list;
 	hexchat_hook *hook;
+	guint i;
 
-	list = plugin_hook_find (hook_list, HOOK_COMMAND, cmd);
-	if (list)
+	hooks = g_ptr_array_new ();
+	for (list = hook_list; list; list = list->next)
 	{
 		hook = list->data;
-		if (hook->help_text)
+		if (hook->type == HOOK_DELETED)
+			continue;
+		if (reset)
 		{
-			PrintText (sess, hook->help_text);
-			return 1;
+			hook->calls = hook->eaten = 0;
+			hook->time_total = hook->time_max = 0;
+			hook->warned = FALSE;
 		}
+		else if (hook->calls)
+			g_ptr_array_add (hooks, hook);
 	}
 
-	return 0;
+	if (reset)
+	{
+		PrintText (sess, _("Plugin hook statistics cleared.\n"));
+		g_ptr_array_free (hooks, TRUE);
+		return;
+	}
+
+	g_ptr_array_sort (hooks, plugin_stats_compare);
+
+	PrintTextf (sess, "%-16s %-8s %-20s %9s %10s %9s %9s %5s\n", _("Plugin"), _("Type"),
+					_("Name"), _("Calls"), _("Total ms"), _("Avg ms"), _("Max ms"), _("Eat%"));
+	for (i = 0; i < hooks->len; i++)
+	{
+		hook = g_ptr_array_index (hooks, i);
+		PrintTextf (sess, "%-16.16s %-8s %-20.20s %9u %10.1f %9.3f %9.1f %4u%%\n",
+						hook->pl->name, plugin_hook_type_name (hook->type),
+						hook->name ? hook->name : "", hook->calls,
+						hook->time_total / 1000.0, hook->time_total / 1000.0 / hook->calls,
+						hook->time_max / 1000.0,
+						(guint) ((guint64) hook->eaten * 100 / hook->calls));
+	}
+	if (hooks->len == 0)
+		PrintText (sess, _("No plugin hooks have run yet.\n"));
+	PrintTextf (sess, _("%u timers pending, %.1f main loop wakeups/s for timers\n"),
+					timerwheel_pending (), timerwheel_wakeups ());
+
+	g_ptr_array_free (hooks, TRUE);
 }
 
 session *
@@ -971,17 +1595,26 @@ plugin_find_context (const char *servname, const char *channel, server *current_
 void *
 hexchat_unhook (hexchat_plugin *ph, hexchat_hook *hook)
 {
-	/* perl.c trips this */
-	if (!g_slist_find (hook_list, hook) || hook->type == HOOK_DELETED)
+	/* perl.c trips this, with hooks that may already be freed */
+	if (!hooks_alive || !g_hash_table_contains (hooks_alive, hook) ||
+		 hook->type == HOOK_DELETED)
 		return NULL;
 
 	if (hook->type == HOOK_TIMER && hook->tag != 0)
-		fe_timeout_remove (hook->tag);
+		timerwheel_remove (hook->tag);
 
 	if (hook->type == HOOK_FD && hook->tag != 0)
 		fe_input_remove (hook->tag);
 
+	if (hook->batch)
+	{
+		g_ptr_array_free (hook->batch, TRUE);
+		hook->batch = NULL;
+		batch_hooks = g_slist_remove (batch_hooks, hook);
+	}
+
 	hook->type = HOOK_DELETED;	/* expunge later */
+	hooks_deleted++;
 
 	g_free (hook->name);	/* NULL for timers & fds */
 	g_free (hook->help_text);	/* NULL for non-commands */
@@ -1012,6 +1645,109 @@ hexchat_hook_server_attrs (hexchat_plugin *ph, const char *name, int pri,
 							userdata);
 }
 
+/* Like hexchat_hook_server(), but the lines are queued and handed over
+   together once per main loop iteration, so the callback can't eat them.
+   They are only valid until it returns. */
+
+hexchat_hook *
+hexchat_hook_server_batch (hexchat_plugin *ph, const char *name, int pri,
+									hexchat_serv_batch_cb *callb, void *userdata)
+{
+	return plugin_add_hook (ph, HOOK_SERVER_BATCH, pri, name, 0, callb, 0,
+									userdata);
+}
+
+/* Word 'index' of a batched line, as word[] and word_eol[] would have had it;
+   the word is not terminated, use *len. Returns the number of words. */
+
+int
+hexchat_server_line_word (hexchat_plugin *ph, const hexchat_server_line *pub,
+								  int index, const char **word, int *len,
+								  const char **word_eol)
+{
+	struct server_line *line = (struct server_line *) pub;
+	const char *w = "", *eol = "";
+	int l = 0;
+
+	if (!line->start)
+		server_line_split (line);
+
+	/* word[0] is the message type, as for hexchat_hook_server() */
+	if (index == 0)
+	{
+		index = pub->line[0] == ':' ? 2 : 1;
+		if (index <= line->words)
+		{
+			w = pub->line + line->start[index];
+			l = line->len[index];
+		}
+	}
+	else if (index > 0 && index <= line->words)
+	{
+		w = pub->line + line->start[index];
+		l = line->len[index];
+		eol = pub->line + line->eol[index];
+	}
+
+	if (word)
+		*word = w;
+	if (len)
+		*len = l;
+	if (word_eol)
+		*word_eol = eol;
+
+	return line->words;
+}
+
+/* Run work on a worker thread; it must not call any other hexchat_*
+   function. done then runs on the main thread, in the context the job was
+   started from. done is called exactly once, with cancelled set if the job
+   was cancelled, including when the plugin is unloaded. The job is freed
+   once done returns. */
+
+hexchat_async *
+hexchat_run_async (hexchat_plugin *ph,
+						 void (*work) (hexchat_async *job, void *user_data),
+						 void (*done) (hexchat_async *job, int cancelled, void *user_data),
+						 void *userdata)
+{
+	hexchat_async *job;
+
+	if (async_pool == NULL)
+		async_pool = g_thread_pool_new (async_thread, NULL,
+												  CLAMP (g_get_num_processors (), 1, ASYNC_THREADS_MAX),
+												  FALSE, NULL);
+
+	job = g_new0 (hexchat_async, 1);
+	job->pl = ph;
+	job->context = ph->context;
+	job->work = work;
+	job->done = done;
+	job->userdata = userdata;
+	job->state = ASYNC_QUEUED;
+	async_jobs = g_list_prepend (async_jobs, job);
+	job->link = async_jobs;
+
+	g_thread_pool_push (async_pool, job, NULL);
+
+	return job;
+}
+
+/* done still runs, with cancelled set; work is skipped if it hasn't started
+   and can poll hexchat_async_cancelled() if it has */
+
+void
+hexchat_async_cancel (hexchat_plugin *ph, hexchat_async *job)
+{
+	g_atomic_int_set (&job->cancelled, TRUE);
+}
+
+int
+hexchat_async_cancelled (hexchat_plugin *ph, hexchat_async *job)
+{
+	return g_atomic_int_get (&job->cancelled);
+}
+
 hexchat_hook *
 hexchat_hook_print (hexchat_plugin *ph, const char *name, int pri,
 						hexchat_print_cb *callb, void *userdata)
@@ -1162,6 +1898,14 @@ hexchat_get_info (hexchat_plugin *ph, const char *id)
 		case 0x14f51cd8: /* version */
 			return PACKAGE_VERSION;
 
+		case 0xd73dba1a: /* timer_wakeups */
+			{
+				static char wakeups[32];
+
+				g_snprintf (wakeups, sizeof (wakeups), "%.1f", timerwheel_wakeups ());
+				return wakeups;
+			}
+
 		case 0xdd9b1abd:	/* xchatdir */
 		case 0xe33f6c4a:	/* xchatdirfs */
 		case 0xd00d220b:	/* configdir */
@@ -1292,6 +2036,167 @@ hexchat_get_prefs (hexchat_plugin *ph, const char *name, const char **string, in
 	return 0;
 }
 
+static void
+plugin_hook_row_free (gpointer data)
+{
+	struct hook_row *row = data;
+
+	g_free (row->name);
+	g_free (row->plugin);
+	g_free (row);
+}
+
+/* the "hooks" list is a snapshot: hooks can come and go while a script is
+   still walking it */
+
+static GSList *
+plugin_hook_rows (void)
+{
+	GSList *list, *rows = NULL;
+	hexchat_hook *hook;
+	struct hook_row *row;
+
+	for (list = hook_list; list; list = list->next)
+	{
+		hook = list->data;
+		if (hook->type == HOOK_DELETED)
+			continue;
+
+		row = g_new (struct hook_row, 1);
+		row->name = g_strdup (hook->name ? hook->name : "");
+		row->plugin = g_strdup (hook->pl->name);
+		row->type = plugin_hook_type_name (hook->type);
+		row->pri = hook->pri;
+		row->calls = hook->calls;
+		row->eaten = hook->eaten;
+		row->time_total = hook->time_total;
+		row->time_max = hook->time_max;
+		rows = g_slist_prepend (rows, row);
+	}
+
+	return g_slist_reverse (rows);
+}
+
+/* The fields of each list, in LIST_* order; the first letter gives the
+ * type. A field ID is the list type shifted left by 8 plus the index into
+ * its array here, with the F_* names below for the indices. */
+
+static const char * const channels_fields[] =
+{
+	"schannel", "schannelkey", "schanmodes", "schantypes", "pcontext", "iflags", "iid", "ilag", "imaxmodes",
+	"snetwork", "snickmodes", "snickprefixes", "iqueue", "sserver", "itype", "iusers",
+	NULL
+};
+static const char * const dcc_fields[] =
+{
+	"iaddress32","icps",		"icpslimit",	"sdestfile","sfile",		"snick",	"iport",
+	"ipos", "iposhigh", "iresume", "iresumehigh", "ssha256", "isize", "isizehigh", "istatus", "itype", NULL
+};
+static const char * const ignore_fields[] =
+{
+	"iflags", "smask", NULL
+};
+static const char * const notify_fields[] =
+{
+	"iflags", "snetworks", "snick", "toff", "ton", "tseen", NULL
+};
+static const char * const users_fields[] =
+{
+	"saccount", "iaway", "shost", "tlasttalk", "snick", "sprefix", "srealname", "iselected", NULL
+};
+static const char * const hooks_fields[] =
+{
+	"iavg", "icalls", "ieaten", "imax", "sname", "splugin", "ipri", "itotal", "stype", NULL
+};
+
+enum
+{
+	F_CHAN_CHANNEL, F_CHAN_CHANNELKEY, F_CHAN_CHANMODES, F_CHAN_CHANTYPES, F_CHAN_CONTEXT,
+	F_CHAN_FLAGS, F_CHAN_ID, F_CHAN_LAG, F_CHAN_MAXMODES, F_CHAN_NETWORK, F_CHAN_NICKMODES,
+	F_CHAN_NICKPREFIXES, F_CHAN_QUEUE, F_CHAN_SERVER, F_CHAN_TYPE, F_CHAN_USERS
+};
+enum
+{
+	F_DCC_ADDRESS32, F_DCC_CPS, F_DCC_CPSLIMIT, F_DCC_DESTFILE, F_DCC_FILE, F_DCC_NICK, F_DCC_PORT,
+	F_DCC_POS, F_DCC_POSHIGH, F_DCC_RESUME, F_DCC_RESUMEHIGH, F_DCC_SHA256, F_DCC_SIZE, F_DCC_SIZEHIGH,
+	F_DCC_STATUS, F_DCC_TYPE
+};
+enum
+{
+	F_IGNORE_FLAGS, F_IGNORE_MASK
+};
+enum
+{
+	F_NOTIFY_FLAGS, F_NOTIFY_NETWORKS, F_NOTIFY_NICK, F_NOTIFY_OFF, F_NOTIFY_ON, F_NOTIFY_SEEN
+};
+enum
+{
+	F_USER_ACCOUNT, F_USER_AWAY, F_USER_HOST, F_USER_LASTTALK, F_USER_NICK, F_USER_PREFIX,
+	F_USER_REALNAME, F_USER_SELECTED
+};
+enum
+{
+	F_HOOK_AVG, F_HOOK_CALLS, F_HOOK_EATEN, F_HOOK_MAX, F_HOOK_NAME, F_HOOK_PLUGIN,
+	F_HOOK_PRI, F_HOOK_TOTAL, F_HOOK_TYPE
+};
+
+static const char * const list_names[] =
+{
+	"channels", "dcc", "ignore", "notify", "users", "hooks"
+};
+static const char * const * const list_fields[] =
+{
+	channels_fields, dcc_fields, ignore_fields, notify_fields, users_fields, hooks_fields
+};
+static const int list_nfields[] =
+{
+	G_N_ELEMENTS (channels_fields) - 1, G_N_ELEMENTS (dcc_fields) - 1,
+	G_N_ELEMENTS (ignore_fields) - 1, G_N_ELEMENTS (notify_fields) - 1,
+	G_N_ELEMENTS (users_fields) - 1, G_N_ELEMENTS (hooks_fields) - 1
+};
+
+static int
+list_type_find (const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int) G_N_ELEMENTS (list_names); i++)
+	{
+		if (strcmp (list_names[i], name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* field name without its type letter -> field ID */
+
+static int
+list_field_find (int type, const char *name)
+{
+	const char * const *fields = list_fields[type];
+	int i;
+
+	for (i = 0; fields[i]; i++)
+	{
+		if (strcmp (fields[i] + 1, name) == 0)
+			return (type << 8) | i;
+	}
+
+	return -1;
+}
+
+/* the type letter of a field ID that belongs to this list, or 0 */
+
+static char
+list_field_type (int type, int id)
+{
+	if (id < 0 || (id >> 8) != type || (id & 0xff) >= list_nfields[type])
+		return 0;
+
+	return list_fields[type][id & 0xff][0];
+}
+
 hexchat_list *
 hexchat_list_get (hexchat_plugin *ph, const char *name)
 {
@@ -1299,30 +2204,35 @@ hexchat_list_get (hexchat_plugin *ph, const char *name)
 
 	list = g_new0 (hexchat_list, 1);
 
-	switch (str_hash (name))
+	switch (list_type_find (name))
 	{
-	case 0x556423d0: /* channels */
+	case LIST_CHANNELS:
 		list->type = LIST_CHANNELS;
 		list->next = sess_list;
 		break;
 
-	case 0x183c4:	/* dcc */
+	case LIST_DCC:
 		list->type = LIST_DCC;
 		list->next = dcc_list;
 		break;
 
-	case 0xb90bfdd2:	/* ignore */
+	case LIST_IGNORE:
 		list->type = LIST_IGNORE;
 		list->next = ignore_list;
 		break;
 
-	case 0xc2079749:	/* notify */
+	case LIST_NOTIFY:
 		list->type = LIST_NOTIFY;
 		list->next = notify_list;
 		list->head = (void *)ph->context;	/* reuse this pointer */
 		break;
 
-	case 0x6a68e08: /* users */
+	case LIST_HOOKS:
+		list->type = LIST_HOOKS;
+		list->head = list->next = plugin_hook_rows ();
+		break;
+
+	case LIST_USERS:
 		if (is_session (ph->context))
 		{
 			list->type = LIST_USERS;
@@ -1339,22 +2249,70 @@ hexchat_list_get (hexchat_plugin *ph, const char *name)
 	return list;
 }
 
+static int
+list_users_cb (const void *user, void *users)
+{
+	g_ptr_array_add (users, (void *)user);
+	return TRUE;
+}
+
+/* Like hexchat_list_get(), but "users" copies the channel's user pointers
+   into one array instead of a list node each, and leaves the selection to
+   the "selected" field. The items belong to HexChat, so don't run commands
+   while the cursor is open. */
+
+hexchat_list *
+hexchat_list_open (hexchat_plugin *ph, const char *name)
+{
+	hexchat_list *list;
+	session *sess = ph->context;
+
+	if (strcmp (name, "users") != 0)
+		return hexchat_list_get (ph, name);
+
+	if (!is_session (sess))
+		return NULL;
+
+	list = g_new0 (hexchat_list, 1);
+	list->type = LIST_USERS;
+	list->sess = sess;
+	list->users = g_ptr_array_sized_new (sess->usertree ? tree_size (sess->usertree) : 0);
+	tree_foreach (sess->usertree, list_users_cb, list->users);
+
+	return list;
+}
+
 void
 hexchat_list_free (hexchat_plugin *ph, hexchat_list *xlist)
 {
 	if (xlist->type == LIST_USERS)
 		g_slist_free (xlist->head);
+	if (xlist->users)
+		g_ptr_array_free (xlist->users, TRUE);
+	if (xlist->type == LIST_HOOKS)
+		g_slist_free_full (xlist->head, plugin_hook_row_free);
 	g_free (xlist);
 }
 
 int
 hexchat_list_next (hexchat_plugin *ph, hexchat_list *xlist)
 {
+	/* user tree cursor */
+	if (xlist->users)
+	{
+		if (!is_session (xlist->sess) || xlist->index >= xlist->users->len)
+			return 0;
+
+		xlist->data = g_ptr_array_index (xlist->users, xlist->index++);
+		return 1;
+	}
+
 	if (xlist->next == NULL)
 		return 0;
 
 	xlist->pos = xlist->next;
 	xlist->next = xlist->pos->next;
+	xlist->data = xlist->pos->data;
 
 	/* NOTIFY LIST: Find the entry which matches the context
 		of the plugin when list_get was originally called. */
@@ -1372,80 +2330,64 @@ hexchat_list_next (hexchat_plugin *ph, hexchat_list *xlist)
 const char * const *
 hexchat_list_fields (hexchat_plugin *ph, const char *name)
 {
-	static const char * const dcc_fields[] =
-	{
-		"iaddress32","icps",		"sdestfile","sfile",		"snick",	"iport",
-		"ipos", "iposhigh", "iresume", "iresumehigh", "isize", "isizehigh", "istatus", "itype", NULL
-	};
-	static const char * const channels_fields[] =
-	{
-		"schannel", "schannelkey", "schanmodes", "schantypes", "pcontext", "iflags", "iid", "ilag", "imaxmodes",
-		"snetwork", "snickmodes", "snickprefixes", "iqueue", "sserver", "itype", "iusers",
-		NULL
-	};
-	static const char * const ignore_fields[] =
-	{
-		"iflags", "smask", NULL
-	};
-	static const char * const notify_fields[] =
-	{
-		"iflags", "snetworks", "snick", "toff", "ton", "tseen", NULL
-	};
-	static const char * const users_fields[] =
-	{
-		"saccount", "iaway", "shost", "tlasttalk", "snick", "sprefix", "srealname", "iselected", NULL
-	};
 	static const char * const list_of_lists[] =
 	{
-		"channels",	"dcc", "ignore", "notify", "users", NULL
+		"channels",	"dcc", "hooks", "ignore", "notify", "users", NULL
 	};
+	int type;
 
-	switch (str_hash (name))
-	{
-	case 0x556423d0:	/* channels */
-		return channels_fields;
-	case 0x183c4:		/* dcc */
-		return dcc_fields;
-	case 0xb90bfdd2:	/* ignore */
-		return ignore_fields;
-	case 0xc2079749:	/* notify */
-		return notify_fields;
-	case 0x6a68e08:	/* users */
-		return users_fields;
-	case 0x6236395:	/* lists */
+	if (strcmp (name, "lists") == 0)
 		return list_of_lists;
-	}
 
-	return NULL;
+	type = list_type_find (name);
+	if (type < 0)
+		return NULL;
+
+	return list_fields[type];
+}
+
+/* Resolves a field of a list once, e.g. ("users", "nick"), for the *_id
+   getters and hexchat_list_fetch(). Returns -1 if there is no such field. */
+
+int
+hexchat_list_field_id (hexchat_plugin *ph, const char *list, const char *field)
+{
+	int type = list_type_find (list);
+
+	if (type < 0)
+		return -1;
+
+	return list_field_find (type, field);
 }
 
 time_t
-hexchat_list_time (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+hexchat_list_time_id (hexchat_plugin *ph, hexchat_list *xlist, int id)
 {
-	guint32 hash = str_hash (name);
-	gpointer data;
+	gpointer data = xlist->data;
+
+	if (list_field_type (xlist->type, id) != 't' || !data)
+		return (time_t) -1;
 
 	switch (xlist->type)
 	{
 	case LIST_NOTIFY:
 		if (!xlist->notifyps)
 			return (time_t) -1;
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x1ad6f:	/* off */
+		case F_NOTIFY_OFF:
 			return xlist->notifyps->lastoff;
-		case 0xddf:	/* on */
+		case F_NOTIFY_ON:
 			return xlist->notifyps->laston;
-		case 0x35ce7b:	/* seen */
+		case F_NOTIFY_SEEN:
 			return xlist->notifyps->lastseen;
 		}
 		break;
 
 	case LIST_USERS:
-		data = xlist->pos->data;
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0xa9118c42:	/* lasttalk */
+		case F_USER_LASTTALK:
 			return ((struct User *)data)->lasttalk;
 		}
 	}
@@ -1453,88 +2395,112 @@ hexchat_list_time (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
 	return (time_t) -1;
 }
 
+time_t
+hexchat_list_time (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+	return hexchat_list_time_id (ph, xlist, list_field_find (xlist->type, name));
+}
+
 const char *
-hexchat_list_str (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+hexchat_list_str_id (hexchat_plugin *ph, hexchat_list *xlist, int id)
 {
-	guint32 hash = str_hash (name);
 	gpointer data = ph->context;
 	int type = LIST_CHANNELS;
+	char t;
 
 	/* a NULL xlist is a shortcut to current "channels" context */
 	if (xlist)
 	{
-		data = xlist->pos->data;
+		data = xlist->data;
 		type = xlist->type;
 	}
 
+	t = list_field_type (type, id);
+	if ((t != 's' && t != 'p') || !data)
+		return NULL;
+
 	switch (type)
 	{
 	case LIST_CHANNELS:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x2c0b7d03: /* channel */
+		case F_CHAN_CHANNEL:
 			return ((session *)data)->channel;
-		case 0x8cea5e7c: /* channelkey */
+		case F_CHAN_CHANNELKEY:
 			return ((session *)data)->channelkey;
-		case 0x5716ab1e: /* chanmodes */
+		case F_CHAN_CHANMODES:
 			return ((session*)data)->server->chanmodes;
-		case 0x577e0867: /* chantypes */
+		case F_CHAN_CHANTYPES:
 			return ((session *)data)->server->chantypes;
-		case 0x38b735af: /* context */
+		case F_CHAN_CONTEXT:
 			return data;	/* this is a session * */
-		case 0x6de15a2e: /* network */
+		case F_CHAN_NETWORK:
 			return server_get_network (((session *)data)->server, FALSE);
-		case 0x8455e723: /* nickprefixes */
+		case F_CHAN_NICKPREFIXES:
 			return ((session *)data)->server->nick_prefixes;
-		case 0x829689ad: /* nickmodes */
+		case F_CHAN_NICKMODES:
 			return ((session *)data)->server->nick_modes;
-		case 0xca022f43: /* server */
+		case F_CHAN_SERVER:
 			return ((session *)data)->server->servername;
 		}
 		break;
 
 	case LIST_DCC:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x3d9ad31e:	/* destfile */
+		case F_DCC_DESTFILE:
 			return ((struct DCC *)data)->destfile;
-		case 0x2ff57c:	/* file */
+		case F_DCC_FILE:
 			return ((struct DCC *)data)->file;
-		case 0x339763: /* nick */
+		case F_DCC_NICK:
 			return ((struct DCC *)data)->nick;
+		case F_DCC_SHA256:
+			return ((struct DCC *)data)->sha256;
 		}
 		break;
 
 	case LIST_IGNORE:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x3306ec:	/* mask */
+		case F_IGNORE_MASK:
 			return ((struct ignore *)data)->mask;
 		}
 		break;
 
 	case LIST_NOTIFY:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x4e49ec05:	/* networks */
+		case F_NOTIFY_NETWORKS:
 			return ((struct notify *)data)->networks;
-		case 0x339763: /* nick */
+		case F_NOTIFY_NICK:
 			return ((struct notify *)data)->name;
 		}
 		break;
 
+	case LIST_HOOKS:
+		switch (id & 0xff)
+		{
+		case F_HOOK_NAME:
+			return ((struct hook_row *)data)->name;
+		case F_HOOK_PLUGIN:
+			return ((struct hook_row *)data)->plugin;
+		case F_HOOK_TYPE:
+			return ((struct hook_row *)data)->type;
+		}
+		break;
+
 	case LIST_USERS:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0xb9d38a2d: /* account */
+		case F_USER_ACCOUNT:
 			return ((struct User *)data)->account;
-		case 0x339763: /* nick */
+		case F_USER_NICK:
 			return ((struct User *)data)->nick;
-		case 0x30f5a8: /* host */
+		case F_USER_HOST:
 			return ((struct User *)data)->hostname;
-		case 0xc594b292: /* prefix */
+		case F_USER_PREFIX:
 			return ((struct User *)data)->prefix;
-		case 0xccc6d529: /* realname */
+		case F_USER_REALNAME:
 			return ((struct User *)data)->realname;
 		}
 		break;
@@ -1543,10 +2509,16 @@ hexchat_list_str (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
 	return NULL;
 }
 
+const char *
+hexchat_list_str (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+	return hexchat_list_str_id (ph, xlist,
+										 list_field_find (xlist ? xlist->type : LIST_CHANNELS, name));
+}
+
 int
-hexchat_list_int (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+hexchat_list_int_id (hexchat_plugin *ph, hexchat_list *xlist, int id)
 {
-	guint32 hash = str_hash (name);
 	gpointer data = ph->context;
 
 	int channel_flag;
@@ -1558,18 +2530,21 @@ hexchat_list_int (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
 	/* a NULL xlist is a shortcut to current "channels" context */
 	if (xlist)
 	{
-		data = xlist->pos->data;
+		data = xlist->data;
 		type = xlist->type;
 	}
 
+	if (list_field_type (type, id) != 'i' || !data)
+		return -1;
+
 	switch (type)
 	{
 	case LIST_DCC:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x34207553: /* address32 */
+		case F_DCC_ADDRESS32:
 			return ((struct DCC *)data)->addr;
-		case 0x181a6: /* cps */
+		case F_DCC_CPS:
 		{
 			gint64 cps = ((struct DCC *)data)->cps;
 			if (cps <= INT_MAX)
@@ -1578,41 +2553,43 @@ hexchat_list_int (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
 			}
 			return INT_MAX;
 		}
-		case 0x349881: /* port */
+		case F_DCC_CPSLIMIT:
+			return (int) MIN (((struct DCC *)data)->bucket.share, INT_MAX);
+		case F_DCC_PORT:
 			return ((struct DCC *)data)->port;
-		case 0x1b254: /* pos */
+		case F_DCC_POS:
 			return ((struct DCC *)data)->pos & 0xffffffff;
-		case 0xe8a945f6: /* poshigh */
+		case F_DCC_POSHIGH:
 			return (((struct DCC *)data)->pos >> 32) & 0xffffffff;
-		case 0xc84dc82d: /* resume */
+		case F_DCC_RESUME:
 			return ((struct DCC *)data)->resumable & 0xffffffff;
-		case 0xded4c74f: /* resumehigh */
+		case F_DCC_RESUMEHIGH:
 			return (((struct DCC *)data)->resumable >> 32) & 0xffffffff;
-		case 0x35e001: /* size */
+		case F_DCC_SIZE:
 			return ((struct DCC *)data)->size & 0xffffffff;
-		case 0x3284d523: /* sizehigh */
+		case F_DCC_SIZEHIGH:
 			return (((struct DCC *)data)->size >> 32) & 0xffffffff;
-		case 0xcacdcff2: /* status */
+		case F_DCC_STATUS:
 			return ((struct DCC *)data)->dccstat;
-		case 0x368f3a: /* type */
+		case F_DCC_TYPE:
 			return ((struct DCC *)data)->type;
 		}
 		break;
 
 	case LIST_IGNORE:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x5cfee87:	/* flags */
+		case F_IGNORE_FLAGS:
 			return ((struct ignore *)data)->type;
 		}
 		break;
 
 	case LIST_CHANNELS:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0xd1b:	/* id */
+		case F_CHAN_ID:
 			return ((struct session *)data)->server->id;
-		case 0x5cfee87:	/* flags */
+		case F_CHAN_FLAGS:
 			channel_flags[0] = ((struct session *)data)->server->connected;
 			channel_flags[1] = ((struct session *)data)->server->connecting;
 			channel_flags[2] = ((struct session *)data)->server->is_away;
@@ -1645,34 +2622,61 @@ hexchat_list_int (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
 			}
 
 			return channel_flags_used;
-		case 0x1a192: /* lag */
+		case F_CHAN_LAG:
 			return ((struct session *)data)->server->lag;
-		case 0x1916144c: /* maxmodes */
+		case F_CHAN_MAXMODES:
 			return ((struct session *)data)->server->modes_per_line;
-		case 0x66f1911: /* queue */
+		case F_CHAN_QUEUE:
 			return ((struct session *)data)->server->sendq_len;
-		case 0x368f3a:	/* type */
+		case F_CHAN_TYPE:
 			return ((struct session *)data)->type;
-		case 0x6a68e08: /* users */
+		case F_CHAN_USERS:
 			return ((struct session *)data)->total;
 		}
 		break;
 
+	case LIST_HOOKS:
+		switch (id & 0xff)
+		{
+		case F_HOOK_AVG:	/* microseconds */
+			if (((struct hook_row *)data)->calls == 0)
+				return 0;
+			return ((struct hook_row *)data)->time_total / ((struct hook_row *)data)->calls;
+		case F_HOOK_CALLS:
+			return MIN (((struct hook_row *)data)->calls, (guint) INT_MAX);
+		case F_HOOK_EATEN:
+			return MIN (((struct hook_row *)data)->eaten, (guint) INT_MAX);
+		case F_HOOK_MAX:	/* microseconds */
+			return MIN (((struct hook_row *)data)->time_max, INT_MAX);
+		case F_HOOK_PRI:
+			return ((struct hook_row *)data)->pri;
+		case F_HOOK_TOTAL:	/* milliseconds */
+			return MIN (((struct hook_row *)data)->time_total / 1000, INT_MAX);
+		}
+		break;
+
 	case LIST_NOTIFY:
 		if (!xlist->notifyps)
 			return -1;
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x5cfee87: /* flags */
+		case F_NOTIFY_FLAGS:
 			return xlist->notifyps->ison;
 		}
+		break;
 
 	case LIST_USERS:
-		switch (hash)
+		switch (id & 0xff)
 		{
-		case 0x2de2ee:	/* away */
+		case F_USER_AWAY:
 			return ((struct User *)data)->away;
-		case 0x4705f29b: /* selected */
+		case F_USER_SELECTED:
+			/* a cursor only asks the GUI once someone wants to know */
+			if (xlist->sess && is_session (xlist->sess) && !xlist->selected_done)
+			{
+				fe_userlist_set_selected (xlist->sess);
+				xlist->selected_done = TRUE;
+			}
 			return ((struct User *)data)->selected;
 		}
 		break;
@@ -1682,6 +2686,50 @@ hexchat_list_int (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
 	return -1;
 }
 
+int
+hexchat_list_int (hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+	return hexchat_list_int_id (ph, xlist,
+										 list_field_find (xlist ? xlist->type : LIST_CHANNELS, name));
+}
+
+/* Reads several fields of the current item at once, values[i] getting
+   field ids[i] in the member that matches its type. Returns how many of the
+   IDs belonged to this list. */
+
+int
+hexchat_list_fetch (hexchat_plugin *ph, hexchat_list *xlist, const int *ids,
+						  int count, hexchat_list_value *values)
+{
+	int i, valid = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		values[i].str = NULL;
+		values[i].num = -1;
+		values[i].time = (time_t) -1;
+
+		switch (list_field_type (xlist->type, ids[i]))
+		{
+		case 's':
+		case 'p':
+			values[i].str = hexchat_list_str_id (ph, xlist, ids[i]);
+			break;
+		case 'i':
+			values[i].num = hexchat_list_int_id (ph, xlist, ids[i]);
+			break;
+		case 't':
+			values[i].time = hexchat_list_time_id (ph, xlist, ids[i]);
+			break;
+		default:
+			continue;
+		}
+		valid++;
+	}
+
+	return valid;
+}
+
 void *
 hexchat_plugingui_add (hexchat_plugin *ph, const char *filename,
 							const char *name, const char *desc,
@@ -149,6 +149,45 @@ struct _hexchat_plugin
 	hexchat_event_attrs *(*hexchat_event_attrs_create) (hexchat_plugin *ph);
 	void (*hexchat_event_attrs_free) (hexchat_plugin *ph,
 									  hexchat_event_attrs *attrs);
+	hexchat_list *(*hexchat_list_open) (hexchat_plugin *ph,
+		const char *name);
+	int (*hexchat_list_field_id) (hexchat_plugin *ph,
+		const char *list,
+		const char *field);
+	const char * (*hexchat_list_str_id) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+	int (*hexchat_list_int_id) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+	time_t (*hexchat_list_time_id) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		int id);
+	int (*hexchat_list_fetch) (hexchat_plugin *ph,
+		hexchat_list *xlist,
+		const int *ids,
+		int count,
+		hexchat_list_value *values);
+	hexchat_hook *(*hexchat_hook_server_batch) (hexchat_plugin *ph,
+		const char *name,
+		int pri,
+		int (*callback) (hexchat_server_line *const *lines, int count,
+						 void *user_data),
+		void *userdata);
+	int (*hexchat_server_line_word) (hexchat_plugin *ph,
+		const hexchat_server_line *line,
+		int index,
+		const char **word,
+		int *len,
+		const char **word_eol);
+	hexchat_async *(*hexchat_run_async) (hexchat_plugin *ph,
+		void (*work) (hexchat_async *job, void *user_data),
+		void (*done) (hexchat_async *job, int cancelled, void *user_data),
+		void *userdata);
+	void (*hexchat_async_cancel) (hexchat_plugin *ph,
+		hexchat_async *job);
+	int (*hexchat_async_cancelled) (hexchat_plugin *ph,
+		hexchat_async *job);
 
 	/* PRIVATE FIELDS! */
 	void *handle;		/* from dlopen */
@@ -178,6 +217,7 @@ int plugin_emit_dummy_print (session *sess, char *name);
 int plugin_emit_keypress (session *sess, unsigned int state, unsigned int keyval, gunichar key);
 GList* plugin_command_list(GList *tmp_list);
 int plugin_show_help (session *sess, char *cmd);
+void plugin_show_stats (session *sess, gboolean reset);
 void plugin_command_foreach (session *sess, void *userdata, void (*cb) (session *sess, void *userdata, char *name, char *usage));
 session *plugin_find_context (const char *servname, const char *channel, server *current_server);
 
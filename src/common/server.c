@@ -49,6 +49,7 @@
 #include "inbound.h"
 #include "outbound.h"
 #include "text.h"
+#include "timerwheel.h"
 #include "util.h"
 #include "url.h"
 #include "proto-irc.h"
@@ -237,7 +238,7 @@ keep_priority:
 	serv->sendq_len += len; /* tcp_send_queue uses strlen */
 
 	if (tcp_send_queue (serv) && noqueue)
-		fe_timeout_add (500, tcp_send_queue, serv);
+		timerwheel_add (500, tcp_send_queue, serv);
 
 	return 1;
 }
@@ -273,7 +274,7 @@ static void
 close_socket (int sok)
 {
 	/* close the socket in 5 seconds so the QUIT message is not lost */
-	fe_timeout_add_seconds (5, close_socket_cb, GINT_TO_POINTER (sok));
+	timerwheel_add_seconds (5, close_socket_cb, GINT_TO_POINTER (sok));
 }
 
 /* handle 1 line of text received from the server */
@@ -433,7 +434,7 @@ server_stopconnecting (server * serv)
 
 	if (serv->joindelay_tag)
 	{
-		fe_timeout_remove (serv->joindelay_tag);
+		timerwheel_remove (serv->joindelay_tag);
 		serv->joindelay_tag = 0;
 	}
 
@@ -459,7 +460,7 @@ server_stopconnecting (server * serv)
 #ifdef USE_OPENSSL
 	if (serv->ssl_do_connect_tag)
 	{
-		fe_timeout_remove (serv->ssl_do_connect_tag);
+		timerwheel_remove (serv->ssl_do_connect_tag);
 		serv->ssl_do_connect_tag = 0;
 	}
 #endif
@@ -743,11 +744,11 @@ auto_reconnect (server *serv, int send_quit, int err)
 	/* is this server in a reconnect delay? remove it! */
 	if (serv->recondelay_tag)
 	{
-		fe_timeout_remove (serv->recondelay_tag);
+		timerwheel_remove (serv->recondelay_tag);
 		serv->recondelay_tag = 0;
 	}
 
-	serv->recondelay_tag = fe_timeout_add (del, timeout_auto_reconnect, serv);
+	serv->recondelay_tag = timerwheel_add (del, timeout_auto_reconnect, serv);
 	fe_server_event (serv, FE_SE_RECONDELAY, del);
 }
 
@@ -783,7 +784,7 @@ server_connect_success (server *serv)
 		/* FIXME: it'll be needed by new servers */
 		/* send(serv->sok, "STLS\r\n", 6, 0); sleep(1); */
 		set_nonblocking (serv->sok);
-		serv->ssl_do_connect_tag = fe_timeout_add (SSLDOCONNTMOUT,
+		serv->ssl_do_connect_tag = timerwheel_add (SSLDOCONNTMOUT,
 																 ssl_do_connect, serv);
 		return;
 	}
@@ -930,7 +931,7 @@ server_cleanup (server * serv)
 
 	if (serv->joindelay_tag)
 	{
-		fe_timeout_remove (serv->joindelay_tag);
+		timerwheel_remove (serv->joindelay_tag);
 		serv->joindelay_tag = 0;
 	}
 
@@ -969,7 +970,7 @@ server_cleanup (server * serv)
 	/* is this server in a reconnect delay? remove it! */
 	if (serv->recondelay_tag)
 	{
-		fe_timeout_remove (serv->recondelay_tag);
+		timerwheel_remove (serv->recondelay_tag);
 		serv->recondelay_tag = 0;
 		return 3;
 	}
@@ -31,6 +31,7 @@
 #include "fe.h"
 #include "server.h"
 #include "text.h"
+#include "timerwheel.h"
 #include "util.h" /* token_foreach */
 #include "hexchatc.h"
 
@@ -548,7 +549,7 @@ servlist_cycle (server *serv)
 				del = 500;				  /* so it doesn't block the gui */
 
 			if (del)
-				serv->recondelay_tag = fe_timeout_add (del, servlist_cycle_cb, serv);
+				serv->recondelay_tag = timerwheel_add (del, servlist_cycle_cb, serv);
 			else
 				servlist_connect (serv->server_session, net, TRUE);
 
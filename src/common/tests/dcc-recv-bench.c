@@ -0,0 +1,198 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Receives a file over a loopback TCP connection the way dcc_read() does:
+ * woken by poll(), draining the socket and acking once per wakeup. Compares
+ * the old 4 KB recv-and-write loop with the adaptive, aligned write batching,
+ * with and without preallocating the file. */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+
+#define FILE_SIZE (256 * 1024 * 1024)
+#define RECVBUF_MIN 16384
+#define RECVBUF_MAX 1048576
+
+static char chunk[256 * 1024];
+
+static gpointer
+produce (gpointer data)
+{
+	int sok = GPOINTER_TO_INT (data);
+	gsize left = FILE_SIZE;
+	gssize n;
+	char ack[4096];
+
+	while (left > 0)
+	{
+		n = send (sok, chunk, MIN (left, sizeof (chunk)), 0);
+		g_assert_cmpint (n, >, 0);
+		left -= n;
+	}
+
+	/* swallow the acks, closing with them unread would reset the connection */
+	shutdown (sok, SHUT_WR);
+	while (recv (sok, ack, sizeof (ack), 0) > 0)
+		;
+	close (sok);
+	return NULL;
+}
+
+static void
+loopback_pair (int *out, int *in)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+	int listener;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	listener = socket (AF_INET, SOCK_STREAM, 0);
+	g_assert_cmpint (bind (listener, (struct sockaddr *) &addr, sizeof (addr)), ==, 0);
+	g_assert_cmpint (listen (listener, 1), ==, 0);
+	getsockname (listener, (struct sockaddr *) &addr, &len);
+
+	*out = socket (AF_INET, SOCK_STREAM, 0);
+	g_assert_cmpint (connect (*out, (struct sockaddr *) &addr, sizeof (addr)), ==, 0);
+	*in = accept (listener, NULL, NULL);
+	g_assert_cmpint (*in, >=, 0);
+	close (listener);
+	fcntl (*in, F_SETFL, O_NONBLOCK);
+}
+
+static void
+run (const char *name, gboolean batch, gboolean prealloc)
+{
+	struct pollfd pfd;
+	GThread *sender;
+	char *path, *buf;
+	guint64 pos = 0, acked = 0;
+	gint64 start, elapsed;
+	int fd, out, in, n, want, len, used = 0, burst;
+	guint writes = 0, acks = 0;
+	guint32 ack;
+
+	fd = g_file_open_tmp ("dcc-recv-XXXXXX", &path, NULL);
+	g_assert_cmpint (fd, >=, 0);
+	g_unlink (path);
+	g_free (path);
+
+	loopback_pair (&out, &in);
+	sender = g_thread_new ("produce", produce, GINT_TO_POINTER (out));
+
+	len = batch ? RECVBUF_MIN : 4096;
+	buf = g_malloc (RECVBUF_MAX);
+
+	start = g_get_monotonic_time ();
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (prealloc)
+		fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, FILE_SIZE);
+#else
+	if (prealloc)
+		return;
+#endif
+
+	pfd.fd = in;
+	pfd.events = POLLIN;
+	while (pos < FILE_SIZE)
+	{
+		poll (&pfd, 1, -1);
+		burst = 0;
+
+		while (pos < FILE_SIZE)
+		{
+			if (batch)
+				want = len - ((pos - used) & (len - 1)) - used;
+			else
+				want = len;
+
+			n = recv (in, buf + (batch ? used : 0), want, 0);
+			if (n < 0 && errno == EAGAIN)
+				break;
+			g_assert_cmpint (n, >, 0);
+			pos += n;
+
+			if (!batch)
+			{
+				g_assert_cmpint (write (fd, buf, n), ==, n);
+				writes++;
+				continue;
+			}
+
+			used += n;
+			burst += n;
+			if (n == want || pos >= FILE_SIZE)
+			{
+				g_assert_cmpint (write (fd, buf, used), ==, used);
+				writes++;
+				used = 0;
+				if (burst >= len && len < RECVBUF_MAX)
+					len *= 2;
+				burst = 0;
+			}
+		}
+
+		/* like dcc_send_ack(), skip acks that wouldn't say anything new */
+		if (pos != acked || !batch)
+		{
+			ack = htonl (pos & 0xffffffff);
+			send (in, &ack, 4, 0);
+			acked = pos;
+			acks++;
+		}
+	}
+	elapsed = g_get_monotonic_time () - start;
+
+	close (in);
+	g_thread_join (sender);
+	close (fd);
+	g_free (buf);
+
+	g_print ("%-12s %-8s %8.1f MB/s %7u writes %7u acks\n", name,
+				prealloc ? "prealloc" : "", (double) FILE_SIZE / elapsed, writes, acks);
+}
+
+int
+main (int argc, char *argv[])
+{
+	int i;
+
+	for (i = 0; i < sizeof (chunk); i++)
+		chunk[i] = g_random_int ();
+
+	run ("4k writes", FALSE, FALSE);
+	run ("batched", TRUE, FALSE);
+	run ("batched", TRUE, TRUE);
+
+	return 0;
+}
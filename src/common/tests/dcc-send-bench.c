@@ -0,0 +1,197 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Pushes a file over a loopback TCP connection the ways dcc_send_data() can:
+ * a fresh buffer per block as it used to, one kept buffer with pread(), and
+ * sendfile(). A thread on the other end drains and counts the bytes.
+ *
+ * The strategies are copied here rather than run through dcc.c, whose
+ * sender needs a session, a server and the main loop; the DCC Loopback
+ * benchmark of hexchat-text covers the real code path end to end. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#define FILE_SIZE (256 * 1024 * 1024)
+#define BLOCKSIZE 102400
+
+enum { MODE_MALLOC, MODE_PREAD, MODE_SENDFILE };
+
+static gpointer
+drain (gpointer data)
+{
+	int sok = GPOINTER_TO_INT (data);
+	static char buf[256 * 1024];
+	gsize total = 0;
+	gssize n;
+
+	while ((n = recv (sok, buf, sizeof (buf), 0)) > 0)
+		total += n;
+
+	close (sok);
+	return GSIZE_TO_POINTER (total);
+}
+
+static void
+loopback_pair (int *out, int *in)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+	int listener;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	listener = socket (AF_INET, SOCK_STREAM, 0);
+	g_assert_cmpint (bind (listener, (struct sockaddr *) &addr, sizeof (addr)), ==, 0);
+	g_assert_cmpint (listen (listener, 1), ==, 0);
+	getsockname (listener, (struct sockaddr *) &addr, &len);
+
+	*out = socket (AF_INET, SOCK_STREAM, 0);
+	g_assert_cmpint (connect (*out, (struct sockaddr *) &addr, sizeof (addr)), ==, 0);
+	*in = accept (listener, NULL, NULL);
+	g_assert_cmpint (*in, >=, 0);
+	close (listener);
+}
+
+static gssize
+send_block (int mode, int sok, int fd, guint64 pos, int len, char *buf)
+{
+	gssize n;
+
+	switch (mode)
+	{
+	case MODE_MALLOC:
+		buf = g_malloc (len);
+		lseek (fd, pos, SEEK_SET);
+		n = read (fd, buf, len);
+		if (n > 0)
+			n = send (sok, buf, n, 0);
+		g_free (buf);
+		return n;
+	case MODE_PREAD:
+		n = pread (fd, buf, len, pos);
+		if (n > 0)
+			n = send (sok, buf, n, 0);
+		return n;
+#ifdef HAVE_SENDFILE
+	case MODE_SENDFILE:
+		{
+			off_t off = pos;
+			return sendfile (sok, fd, &off, len);
+		}
+#endif
+	}
+	return -1;
+}
+
+static void
+run (const char *name, int mode, int fd, gboolean lowat)
+{
+	char *buf;
+	GThread *reader;
+	guint64 pos = 0;
+	gint64 start, elapsed;
+	gsize received;
+	gssize n;
+	int out, in;
+
+#ifndef TCP_NOTSENT_LOWAT
+	if (lowat)
+		return;
+#endif
+
+	buf = g_malloc (BLOCKSIZE);
+	loopback_pair (&out, &in);
+#ifdef TCP_NOTSENT_LOWAT
+	if (lowat)
+	{
+		int val = 131072;
+		setsockopt (out, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof (val));
+	}
+#endif
+
+	reader = g_thread_new ("drain", drain, GINT_TO_POINTER (in));
+
+	start = g_get_monotonic_time ();
+	while (pos < FILE_SIZE)
+	{
+		n = send_block (mode, out, fd, pos, MIN (BLOCKSIZE, FILE_SIZE - pos), buf);
+		if (n < 0 && errno == EINTR)
+			continue;
+		g_assert_cmpint (n, >, 0);
+		pos += n;
+	}
+	shutdown (out, SHUT_WR);
+	received = GPOINTER_TO_SIZE (g_thread_join (reader));
+	elapsed = g_get_monotonic_time () - start;
+	close (out);
+	g_free (buf);
+
+	g_assert_cmpuint (received, ==, FILE_SIZE);
+	g_print ("%-16s %-8s %8.1f MB/s\n", name, lowat ? "lowat" : "",
+				(double) FILE_SIZE / elapsed);
+}
+
+int
+main (int argc, char *argv[])
+{
+	char *path, *chunk;
+	int fd, i;
+
+	fd = g_file_open_tmp ("dcc-send-XXXXXX", &path, NULL);
+	g_assert_cmpint (fd, >=, 0);
+	g_unlink (path);
+	g_free (path);
+
+	chunk = g_malloc (1024 * 1024);
+	for (i = 0; i < 1024 * 1024; i++)
+		chunk[i] = g_random_int ();
+	for (i = 0; i < FILE_SIZE / (1024 * 1024); i++)
+		g_assert_cmpint (write (fd, chunk, 1024 * 1024), ==, 1024 * 1024);
+	g_free (chunk);
+
+	for (i = 0; i < 2; i++)
+	{
+		run ("malloc per block", MODE_MALLOC, fd, i);
+		run ("pread", MODE_PREAD, fd, i);
+#ifdef HAVE_SENDFILE
+		run ("sendfile", MODE_SENDFILE, fd, i);
+#endif
+	}
+
+	close (fd);
+	return 0;
+}
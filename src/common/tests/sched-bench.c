@@ -0,0 +1,180 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Drives the DCC bandwidth buckets through a simulated clock: checks that
+ * peers share the global limit fairly, that per-transfer limits and idle
+ * transfers hand their share on, and times a refill over many transfers. */
+
+#include <glib.h>
+
+#include "dccsched.h"
+
+#define TICK_USEC 50000
+#define KB 1024
+
+typedef struct
+{
+	dccsched_node node;
+	gint64 appetite;	/* most bytes/s the transfer itself can move */
+	gint64 moved;
+} transfer;
+
+static void
+run_ticks (dccsched_node *root, transfer *t, int n, int ticks)
+{
+	gint64 take;
+	int i, j;
+
+	for (i = 0; i < ticks; i++)
+	{
+		dccsched_refill (root, TICK_USEC);
+		for (j = 0; j < n; j++)
+		{
+			take = t[j].appetite ? t[j].appetite * TICK_USEC / G_USEC_PER_SEC : G_MAXINT64;
+			take = dccsched_allow (&t[j].node, take);
+			dccsched_charge (&t[j].node, take);
+			t[j].moved += take;
+		}
+	}
+}
+
+static void
+check_rate (const char *name, transfer *t, int seconds, gint64 want)
+{
+	gint64 rate = t->moved / seconds;
+
+	g_print ("%-28s %8.1f KB/s (want %6.1f), share %8.1f\n", name,
+				(double) rate / KB, (double) want / KB, (double) t->node.share / KB);
+	g_assert_cmpint (ABS (rate - want), <=, want / 50);
+}
+
+static void
+fairness (void)
+{
+	dccsched_node root = { 0 }, peer[3] = { { 0 } };
+	transfer t[5] = { { { 0 } } };
+	int i;
+
+	root.rate = 1000 * KB;
+	for (i = 0; i < 3; i++)
+		dccsched_attach (&peer[i], &root);
+
+	/* three transfers from one peer, one limited, one that can't keep up */
+	for (i = 0; i < 3; i++)
+		dccsched_attach (&t[i].node, &peer[0]);
+	dccsched_attach (&t[3].node, &peer[1]);
+	t[3].node.rate = 100 * KB;
+	dccsched_attach (&t[4].node, &peer[2]);
+	t[4].appetite = 50 * KB;
+
+	/* let the buckets fill, then measure */
+	run_ticks (&root, t, 5, 20);
+	for (i = 0; i < 5; i++)
+		t[i].moved = 0;
+	run_ticks (&root, t, 5, 200);
+
+	check_rate ("peer A transfer 1", &t[0], 10, 850 * KB / 3);
+	check_rate ("peer A transfer 2", &t[1], 10, 850 * KB / 3);
+	check_rate ("peer A transfer 3", &t[2], 10, 850 * KB / 3);
+	check_rate ("peer B, limited to 100", &t[3], 10, 100 * KB);
+	check_rate ("peer C, only needs 50", &t[4], 10, 50 * KB);
+}
+
+static void
+weights (void)
+{
+	dccsched_node root = { 0 };
+	transfer t[2] = { { { 0 } } };
+
+	root.rate = 300 * KB;
+	t[1].node.weight = 2;
+	dccsched_attach (&t[0].node, &root);
+	dccsched_attach (&t[1].node, &root);
+
+	run_ticks (&root, t, 2, 20);
+	t[0].moved = t[1].moved = 0;
+	run_ticks (&root, t, 2, 200);
+
+	check_rate ("weight 1", &t[0], 10, 100 * KB);
+	check_rate ("weight 2", &t[1], 10, 200 * KB);
+}
+
+/* a transfer that was just attached must be able to move data before the
+ * first refill, and ready() must never promise what allow() won't give */
+static void
+attach (void)
+{
+	dccsched_node root = { 0 }, peer = { 0 };
+	transfer t = { { 0 } };
+	gint64 take;
+
+	root.rate = 1 * KB;
+	dccsched_attach (&peer, &root);
+	dccsched_attach (&t.node, &peer);
+
+	g_assert_cmpint (t.node.depth, >=, DCCSCHED_QUANTUM);
+	g_assert_true (dccsched_ready (&t.node));
+	take = dccsched_allow (&t.node, 100 * KB);
+	g_assert_cmpint (take, >=, DCCSCHED_QUANTUM);
+	dccsched_charge (&t.node, take);
+
+	/* spent: not ready until a refill brings a whole quantum back */
+	g_assert_false (dccsched_ready (&t.node));
+	dccsched_refill (&root, TICK_USEC);
+	if (dccsched_ready (&t.node))
+		g_assert_cmpint (dccsched_allow (&t.node, 100 * KB), >=, DCCSCHED_QUANTUM);
+	g_print ("just attached                ok\n");
+}
+
+static void
+timing (void)
+{
+	dccsched_node root = { 0 }, *peers;
+	transfer *t;
+	gint64 start, elapsed;
+	int i, n = 1000, rounds = 2000;
+
+	peers = g_new0 (dccsched_node, n / 10);
+	t = g_new0 (transfer, n);
+	root.rate = 10 * 1024 * KB;
+	for (i = 0; i < n / 10; i++)
+		dccsched_attach (&peers[i], &root);
+	for (i = 0; i < n; i++)
+	{
+		dccsched_attach (&t[i].node, &peers[i / 10]);
+		t[i].node.rate = (i % 3) ? 0 : 20 * KB;
+	}
+
+	start = g_get_monotonic_time ();
+	run_ticks (&root, t, n, rounds);
+	elapsed = g_get_monotonic_time () - start;
+	g_print ("refill with %d transfers    %8.1f us\n", n, (double) elapsed / rounds);
+
+	g_free (t);
+	g_free (peers);
+}
+
+int
+main (int argc, char *argv[])
+{
+	attach ();
+	fairness ();
+	weights ();
+	timing ();
+	return 0;
+}
@@ -0,0 +1,109 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Times strip_color()/strip_color2() over the kinds of lines a busy channel
+ * produces and checks the result against a byte-at-a-time reference. */
+
+#include <string.h>
+#include <glib.h>
+
+#include "hexchat.h"
+#include "util.h"
+
+#define ROUNDS 200000
+
+static const char *lines[] = {
+	"plain", "just an ordinary line of chat without any formatting in it, long enough to matter",
+	"utf8", "d\303\251j\303\240 vu \342\200\224 \320\277\321\200\320\270\320\262\320\265\321\202 \344\270\226\347\225\214 \360\237\230\200 and some more text after it",
+	"colour", "\00304,01red on black\003 then \00312blue\003 and back to \0033green\003 ok",
+	"attrib", "\002bold\002 \035italic\035 \037under\037 \026rev\026 \036strike\036 \017reset",
+	"nick", "\00318\002<\002\00318someone\00318\002>\002\017\tthe rest of a message that is mostly plain text",
+};
+
+static int
+reference_strip (const char *src, int len, char *dst)
+{
+	int i, o = 0, rcol = 0, bgcol = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		if (rcol > 0 && (g_ascii_isdigit (src[i]) ||
+			(src[i] == ',' && g_ascii_isdigit (src[i + 1]) && !bgcol)))
+		{
+			if (src[i + 1] != ',') rcol--;
+			if (src[i] == ',')
+			{
+				rcol = 2;
+				bgcol = 1;
+			}
+			continue;
+		}
+		rcol = bgcol = 0;
+		if (src[i] == '\003')
+			rcol = 2;
+		else if (!strchr ("\002\007\010\017\026\035\036\037", src[i]) || !src[i])
+			dst[o++] = src[i];
+	}
+	dst[o] = 0;
+	return o;
+}
+
+int
+main (int argc, char *argv[])
+{
+	char buf[512], ref[512];
+	gint64 start, elapsed;
+	gsize total = 0;
+	int i, n, len;
+
+	for (i = 0; i < G_N_ELEMENTS (lines); i += 2)
+	{
+		len = strlen (lines[i + 1]);
+
+		n = reference_strip (lines[i + 1], len, ref);
+		g_assert_cmpint (strip_color2 (lines[i + 1], len, buf, STRIP_ALL), ==, n);
+		g_assert_cmpstr (buf, ==, ref);
+
+		start = g_get_monotonic_time ();
+		for (n = 0; n < ROUNDS; n++)
+			total += strip_color2 (lines[i + 1], len, buf, STRIP_ALL);
+		elapsed = g_get_monotonic_time () - start;
+		g_print ("strip_color2 %-8s %7.1f ns/line %7.1f MB/s\n", lines[i],
+					elapsed * 1000.0 / ROUNDS, (double) len * ROUNDS / elapsed);
+
+		start = g_get_monotonic_time ();
+		for (n = 0; n < ROUNDS; n++)
+		{
+			memcpy (buf, lines[i + 1], len + 1);
+			total += strip_color2 (buf, len, buf, STRIP_ALL);
+		}
+		elapsed = g_get_monotonic_time () - start;
+		g_print ("in place     %-8s %7.1f ns/line %7.1f MB/s\n", lines[i],
+					elapsed * 1000.0 / ROUNDS, (double) len * ROUNDS / elapsed);
+
+		start = g_get_monotonic_time ();
+		for (n = 0; n < ROUNDS; n++)
+			g_free (strip_color (lines[i + 1], len, STRIP_ALL));
+		elapsed = g_get_monotonic_time () - start;
+		g_print ("strip_color  %-8s %7.1f ns/line\n", lines[i],
+					elapsed * 1000.0 / ROUNDS);
+	}
+
+	/* keep the loops from being optimised away */
+	return total == 0;
+}
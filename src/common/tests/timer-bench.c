@@ -0,0 +1,143 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* Compares thousands of idle timeouts as separate GLib sources against the
+ * same timeouts on the timer wheel: the cost of adding and removing them and
+ * what they do to every main loop iteration while a busy timer runs. */
+
+#include <glib.h>
+
+#include "timerwheel.h"
+
+#define TIMERS 10000
+#define RUN_USEC (G_USEC_PER_SEC / 2)
+
+static guint ticks;
+static GString *order;
+
+static gboolean
+idle_cb (gpointer data)
+{
+	g_assert_not_reached ();
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+tick_cb (gpointer data)
+{
+	ticks++;
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+order_cb (gpointer data)
+{
+	g_string_append_c (order, GPOINTER_TO_INT (data));
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+removed_cb (gpointer data)
+{
+	g_assert_not_reached ();
+	return G_SOURCE_REMOVE;
+}
+
+static void
+check_order (void)
+{
+	gint64 end;
+
+	order = g_string_new (NULL);
+	timerwheel_add (300, order_cb, GINT_TO_POINTER ('c'));
+	timerwheel_add (30, order_cb, GINT_TO_POINTER ('b'));
+	timerwheel_remove (timerwheel_add (20, removed_cb, NULL));
+	timerwheel_add (10, order_cb, GINT_TO_POINTER ('a'));
+
+	end = g_get_monotonic_time () + G_USEC_PER_SEC;
+	while (order->len < 3 && g_get_monotonic_time () < end)
+		g_main_context_iteration (NULL, TRUE);
+
+	g_assert_cmpstr (order->str, ==, "abc");
+	g_assert_cmpuint (timerwheel_pending (), ==, 0);
+	g_string_free (order, TRUE);
+}
+
+static void
+run (const char *name, gboolean wheel)
+{
+	int *tags = g_new (int, TIMERS);
+	guint iterations = 0;
+	gint64 start, added, busy;
+	int i, tick;
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < TIMERS; i++)
+	{
+		int interval = 60000 + g_random_int_range (0, 600000);
+
+		if (wheel)
+			tags[i] = timerwheel_add (interval, idle_cb, NULL);
+		else
+			tags[i] = g_timeout_add (interval, idle_cb, NULL);
+	}
+	added = g_get_monotonic_time () - start;
+
+	ticks = 0;
+	tick = wheel ? timerwheel_add (10, tick_cb, NULL) : g_timeout_add (10, tick_cb, NULL);
+	start = g_get_monotonic_time ();
+	/* don't block, so this measures what each iteration costs */
+	while (g_get_monotonic_time () - start < RUN_USEC)
+	{
+		g_main_context_iteration (NULL, FALSE);
+		iterations++;
+	}
+	busy = g_get_monotonic_time () - start;
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < TIMERS; i++)
+	{
+		if (wheel)
+			timerwheel_remove (tags[i]);
+		else
+			g_source_remove (tags[i]);
+	}
+	g_print ("%-6s add %6.1f ns  remove %6.1f ns  %5u iterations  %4u ticks  %6.1f us/iteration\n",
+				name, added * 1000.0 / TIMERS, (g_get_monotonic_time () - start) * 1000.0 / TIMERS,
+				iterations, ticks, (double) busy / iterations);
+
+	if (wheel)
+	{
+		g_print ("wheel wakeups/s %.1f\n", timerwheel_wakeups ());
+		timerwheel_remove (tick);
+	}
+	else
+		g_source_remove (tick);
+	g_free (tags);
+}
+
+int
+main (int argc, char *argv[])
+{
+	check_order ();
+
+	run ("glib", FALSE);
+	run ("wheel", TRUE);
+
+	return 0;
+}
@@ -54,13 +54,32 @@
 const gchar* unicode_fallback_string = "\357\277\275"; /* The Unicode replacement character 0xFFFD */
 const gchar* arbitrary_encoding_fallback_string = "?";
 
-struct pevt_stage1
+/* A compiled print event, as stored in pntevts[]: the literal runs and
+   argument slots in output order, followed by the literal bytes they point
+   into. It's one allocation, so g_free() releases it. */
+enum
 {
-	int len;
-	char *data;
-	struct pevt_stage1 *next;
+	PEVT_SEG_TEXT,
+	PEVT_SEG_ARG,
+	PEVT_SEG_TAB
+};
+
+struct pevt_seg
+{
+	guint8 type;
+	guint8 arg;		/* PEVT_SEG_ARG: index into args[], 1-based */
+	int off, len;	/* PEVT_SEG_TEXT: position in the literal bytes */
+};
+
+struct pevt_tmpl
+{
+	int nseg;
+	int text_len;	/* output bytes not coming from arguments */
+	struct pevt_seg seg[];
 };
 
+#define PEVT_TMPL_TEXT(t) ((const char *) &(t)->seg[(t)->nseg])
+
 #ifdef USE_LIBCANBERRA
 static ca_context *ca_con;
 #endif
@@ -860,6 +879,29 @@ PrintTextTimeStamp (session *sess, char *text, time_t timestamp)
 	g_free (text);
 }
 
+/* Like PrintTextTimeStamp, for a line the caller owns and no longer needs:
+   valid UTF-8 goes out as is instead of being copied first. */
+static void
+print_text_buf (session *sess, char *text, gsize len, time_t timestamp)
+{
+	char *fixed = NULL;
+
+	if (!sess)
+	{
+		if (!sess_list)
+			return;
+		sess = (session *) sess_list->data;
+	}
+
+	if (!g_utf8_validate (text, len, NULL))
+		text = fixed = text_fixup_invalid_utf8 (text, len, NULL);
+
+	log_write (sess, text, timestamp);
+	scrollback_save (sess, text, timestamp);
+	fe_print_text (sess, text, timestamp, FALSE);
+	g_free (fixed);
+}
+
 void
 PrintText (session *sess, char *text)
 {
@@ -930,19 +972,12 @@ PrintTextTimeStampf (session *sess, time_t timestamp, const char *format, ...)
 
    On startup ~/.xchat/printevents.conf is loaded if it doesn't exist the
    defaults are loaded. Any missing events are filled from defaults.
-   Each event is parsed by pevt_build_string and a binary output is produced
-   which looks like:
-
-   (byte) value: 0 = {
-   (int) numbers of bytes
-   (char []) that number of byte to be memcpy'ed into the buffer
-   }
-   1 =
-   (byte) number of varable to insert
-   2 = end of buffer
+   Each event is parsed by pevt_build_string into a struct pevt_tmpl: a
+   list of segments, each either a run of literal bytes, the number of a
+   variable to insert or a $t tab, followed by the literal bytes themselves.
 
    Each XP_TE_* signal is hard coded to call text_emit which calls
-   display_event which decodes the data
+   display_event which fills in the template
 
    This means that this system *should be faster* than g_snprintf because
    it always 'knows' that format of the string (basically is preparses much
@@ -1732,99 +1767,145 @@ load_text_events ()
 	CL: format_event now handles filtering of arguments:
 	1) if prefs.hex_text_stripcolor_msg is set, filter all style control codes from arguments
 	2) always strip \010 (ATTR_HIDDEN) from arguments: it is only for use in the format string itself
+
+	arglens[] may give the length of each args[] entry (-1 if unknown) so they
+	needn't be measured. Returns the length of the line written to o, or, if
+	it doesn't fit in sizeofo bytes, writes nothing and returns the size of
+	buffer it needs, which is always more than sizeofo.
 */
 #define ARG_FLAG(argn) (1 << (argn))
 
-void
-format_event (session *sess, int index, char **args, char *o, gsize sizeofo, unsigned int stripcolor_args)
+gsize
+format_event (session *sess, int index, char **args, int *arglens, char *o, gsize sizeofo, unsigned int stripcolor_args)
 {
-	int len, ii, numargs;
-	gsize oi;
-	char *i, *ar, d, a, done_all = FALSE;
-
-	i = pntevts[index];
-	numargs = te[index].num_args & 0x7f;
+	struct pevt_tmpl *t = (struct pevt_tmpl *) pntevts[index];
+	const struct pevt_seg *seg;
+	int lens[PDIWORDS];
+	int n, a, numargs;
+	gsize oi, need;
 
-	oi = ii = len = d = a = 0;
 	o[0] = 0;
 
-	if (i == NULL)
-		return;
+	if (t == NULL)
+		return 0;
 
-	while (done_all == FALSE)
+	numargs = te[index].num_args & 0x7f;
+
+	/* measure each argument once; after this they are only copied */
+	need = t->text_len + 2;
+	for (n = 0; n < PDIWORDS; n++)
+		lens[n] = -1;
+	for (n = 0; n < t->nseg; n++)
 	{
-		d = i[ii++];
-		switch (d)
+		seg = &t->seg[n];
+		if (seg->type != PEVT_SEG_ARG || seg->arg > numargs + 1)
+			continue;
+		a = seg->arg;
+		if (lens[a] == -1 && args[a] != NULL)
+			lens[a] = (arglens && arglens[a] >= 0) ? arglens[a] : strlen (args[a]);
+		if (lens[a] > 0)
+			need += lens[a];
+	}
+	if (need > sizeofo)
+		return need;
+
+	oi = 0;
+	for (n = 0; n < t->nseg; n++)
+	{
+		seg = &t->seg[n];
+		switch (seg->type)
 		{
-		case 0:
-			memcpy (&len, &(i[ii]), sizeof (int));
-			ii += sizeof (int);
-			if (oi + len > sizeofo)
-			{
-				printf ("Overflow in display_event (%s)\n", i);
-				o[0] = 0;
-				return;
-			}
-			memcpy (&(o[oi]), &(i[ii]), len);
-			oi += len;
-			ii += len;
+		case PEVT_SEG_TEXT:
+			memcpy (o + oi, PEVT_TMPL_TEXT (t) + seg->off, seg->len);
+			oi += seg->len;
 			break;
-		case 1:
-			a = i[ii++];
-			if (a > numargs)
+		case PEVT_SEG_ARG:
+			a = seg->arg;
+			if (a > numargs + 1)
 			{
 				fprintf (stderr,
 							"HexChat DEBUG: display_event: arg > numargs (%d %d %s)\n",
-							a, numargs, i);
+							a - 1, numargs, te[index].name);
 				break;
 			}
-			ar = args[(int) a + 1];
-			if (ar == NULL)
-			{
-				printf ("arg[%d] is NULL in print event\n", a + 1);
-			} else
+			if (args[a] == NULL)
 			{
-				if (strlen (ar) > sizeofo - oi - 4)
-					ar[sizeofo - oi - 4] = 0;	/* Avoid buffer overflow */
-				if (stripcolor_args & ARG_FLAG(a + 1)) len = strip_color2 (ar, -1, &o[oi], STRIP_ALL);
-				else len = strip_hidden_attribute (ar, &o[oi]);
-				oi += len;
+				printf ("arg[%d] is NULL in print event\n", a);
+				break;
 			}
-			break;
-		case 2:
-			o[oi++] = '\n';
-			o[oi++] = 0;
-			done_all = TRUE;
-			continue;
-		case 3:
-			if (prefs.hex_text_indent)
-				o[oi++] = '\t';
+			if (stripcolor_args & ARG_FLAG(a))
+				oi += strip_color2 (args[a], lens[a], o + oi, STRIP_ALL);
 			else
-				o[oi++] = ' ';
+				oi += strip_color2 (args[a], lens[a], o + oi, STRIP_HIDDEN);
+			break;
+		case PEVT_SEG_TAB:
+			o[oi++] = prefs.hex_text_indent ? '\t' : ' ';
 			break;
 		}
 	}
+	o[oi++] = '\n';
 	o[oi] = 0;
+
 	if (*o == '\n')
+	{
 		o[0] = 0;
+		return 0;
+	}
+
+	return oi;
 }
 
 static void
-display_event (session *sess, int event, char **args, 
+display_event (session *sess, int event, char **args, int *arglens,
 					unsigned int stripcolor_args, time_t timestamp)
 {
-	char o[4096];
-	format_event (sess, event, args, o, sizeof (o), stripcolor_args);
-	if (o[0])
-		PrintTextTimeStamp (sess, o, timestamp);
+	char buf[4096], *o = buf;
+	gsize len;
+
+	len = format_event (sess, event, args, arglens, buf, sizeof (buf), stripcolor_args);
+	if (len >= sizeof (buf))
+	{
+		o = g_malloc (len);
+		len = format_event (sess, event, args, arglens, o, len, stripcolor_args);
+	}
+	if (len)
+		print_text_buf (sess, o, len, timestamp);
+	if (o != buf)
+		g_free (o);
+}
+
+static void
+pevt_add_seg (GArray *segs, int type, int arg)
+{
+	struct pevt_seg seg;
+
+	seg.type = type;
+	seg.arg = arg;
+	seg.off = seg.len = 0;
+	g_array_append_val (segs, seg);
+}
+
+static void
+pevt_add_text (GArray *segs, GString *text, const char *o, int len)
+{
+	struct pevt_seg seg;
+
+	seg.type = PEVT_SEG_TEXT;
+	seg.arg = 0;
+	seg.off = text->len;
+	seg.len = len;
+	g_array_append_val (segs, seg);
+	g_string_append_len (text, o, len);
 }
 
 int
 pevt_build_string (const char *input, char **output, int *max_arg)
 {
-	struct pevt_stage1 *s = NULL, *base = NULL, *last = NULL, *next;
-	int clen;
-	char o[4096], d, *obuf, *i;
+	struct pevt_tmpl *t;
+	GArray *segs;
+	GString *text;
+	int tabs = 0;
+	char o[4096], d, *i;
 	int oi, ii, max = -1, len, x;
 
 	len = strlen (input);
@@ -1834,7 +1915,9 @@ pevt_build_string (const char *input, char **output, int *max_arg)
 
 	len = strlen (i);
 
-	clen = oi = ii = 0;
+	segs = g_array_new (FALSE, FALSE, sizeof (struct pevt_seg));
+	text = g_string_new (NULL);
+	oi = ii = 0;
 
 	for (;;)
 	{
@@ -1853,19 +1936,7 @@ pevt_build_string (const char *input, char **output, int *max_arg)
 		}
 		if (oi > 0)
 		{
-			s = g_new (struct pevt_stage1, 1);
-			if (base == NULL)
-				base = s;
-			if (last != NULL)
-				last->next = s;
-			last = s;
-			s->next = NULL;
-			s->data = g_malloc (oi + sizeof (int) + 1);
-			s->len = oi + sizeof (int) + 1;
-			clen += oi + sizeof (int) + 1;
-			s->data[0] = 0;
-			memcpy (&(s->data[1]), &oi, sizeof (int));
-			memcpy (&(s->data[1 + sizeof (int)]), o, oi);
+			pevt_add_text (segs, text, o, oi);
 			oi = 0;
 		}
 		if (ii == len)
@@ -1907,18 +1978,8 @@ pevt_build_string (const char *input, char **output, int *max_arg)
 		if (d == 't')
 		{
 			/* Tab - if tabnicks is set then write '\t' else ' ' */
-			s = g_new (struct pevt_stage1, 1);
-			if (base == NULL)
-				base = s;
-			if (last != NULL)
-				last->next = s;
-			last = s;
-			s->next = NULL;
-			s->data = g_malloc (1);
-			s->len = 1;
-			clen += 1;
-			s->data[0] = 3;
-
+			pevt_add_seg (segs, PEVT_SEG_TAB, 0);
+			tabs++;
 			continue;
 		}
 		if (d < '1' || d > '9')
@@ -1930,82 +1991,34 @@ pevt_build_string (const char *input, char **output, int *max_arg)
 		d -= '0';
 		if (max < d)
 			max = d;
-		s = g_new (struct pevt_stage1, 1);
-		if (base == NULL)
-			base = s;
-		if (last != NULL)
-			last->next = s;
-		last = s;
-		s->next = NULL;
-		s->data = g_malloc (2);
-		s->len = 2;
-		clen += 2;
-		s->data[0] = 1;
-		s->data[1] = d - 1;
+		pevt_add_seg (segs, PEVT_SEG_ARG, d);
 	}
 	if (oi > 0)
-	{
-		s = g_new (struct pevt_stage1, 1);
-		if (base == NULL)
-			base = s;
-		if (last != NULL)
-			last->next = s;
-		last = s;
-		s->next = NULL;
-		s->data = g_malloc (oi + sizeof (int) + 1);
-		s->len = oi + sizeof (int) + 1;
-		clen += oi + sizeof (int) + 1;
-		s->data[0] = 0;
-		memcpy (&(s->data[1]), &oi, sizeof (int));
-		memcpy (&(s->data[1 + sizeof (int)]), o, oi);
-		oi = 0;
-	}
-	s = g_new (struct pevt_stage1, 1);
-	if (base == NULL)
-		base = s;
-	if (last != NULL)
-		last->next = s;
-	s->next = NULL;
-	s->data = g_malloc (1);
-	s->len = 1;
-	clen += 1;
-	s->data[0] = 2;
+		pevt_add_text (segs, text, o, oi);
 
-	oi = 0;
-	s = base;
-	obuf = g_malloc (clen);
-
-	while (s)
-	{
-		next = s->next;
-		memcpy (&obuf[oi], s->data, s->len);
-		oi += s->len;
-		g_free (s->data);
-		g_free (s);
-		s = next;
-	}
+	t = g_malloc (sizeof (struct pevt_tmpl) + segs->len * sizeof (struct pevt_seg) + text->len);
+	t->nseg = segs->len;
+	t->text_len = text->len + tabs;
+	memcpy (t->seg, segs->data, segs->len * sizeof (struct pevt_seg));
+	memcpy ((char *) PEVT_TMPL_TEXT (t), text->str, text->len);
 
+	g_array_free (segs, TRUE);
+	g_string_free (text, TRUE);
 	g_free (i);
 
 	if (max_arg)
 		*max_arg = max;
 	if (output)
-		*output = obuf;
+		*output = (char *) t;
 	else
-		g_free (obuf);
+		g_free (t);
 
 	return 0;
 
 err:
-	while (s)
-	{
-		next = s->next;
-		g_free (s->data);
-		g_free (s);
-		s = next;
-	}
-
-	g_free(i);
+	g_array_free (segs, TRUE);
+	g_string_free (text, TRUE);
+	g_free (i);
 
 	return 1;
 }
@@ -2041,10 +2054,15 @@ text_emit (int index, session *sess, char *a, char *b, char *c, char *d,
 	tab_state_flags plugin_state = sess->last_tab_state;
 	unsigned int stripcolor_args = (chanopt_is_set (prefs.hex_text_stripcolor_msg, sess->text_strip) ? 0xFFFFFFFF : 0);
 	char tbuf[NICKLEN + 4];
+	int arglens[PDIWORDS];
+
+	for (i = 0; i < PDIWORDS; i++)
+		arglens[i] = -1;
 
 	if (a != NULL && prefs.hex_text_color_nicks && (index == XP_TE_CHANACTION || index == XP_TE_CHANMSG))
 	{
-		g_snprintf (tbuf, sizeof (tbuf), "\003%d%s", text_color_of (a), a);
+		arglens[1] = MIN (g_snprintf (tbuf, sizeof (tbuf), "\003%d%s", text_color_of (a), a),
+								(int) sizeof (tbuf) - 1);
 		a = tbuf;
 		stripcolor_args &= ~ARG_FLAG(1);	/* don't strip color from this argument */
 	}
@@ -2129,7 +2147,7 @@ text_emit (int index, session *sess, char *a, char *b, char *c, char *d,
 
 	if (!prefs.hex_away_omit_alerts || !sess->server->is_away)
 		sound_play_event (index);
-	display_event (sess, index, word, stripcolor_args, timestamp);
+	display_event (sess, index, word, arglens, stripcolor_args, timestamp);
 }
 
 char *
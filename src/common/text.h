@@ -60,7 +60,7 @@ int text_emit_by_name (char *name, session *sess, time_t timestamp,
 gchar *text_convert_invalid (const gchar* text, gssize len, GIConv converter, const gchar *fallback, gsize *len_out);
 gchar *text_fixup_invalid_utf8 (const gchar* text, gssize len, gsize *len_out);
 int get_stamp_str (char *fmt, time_t tim, char **ret);
-void format_event (session *sess, int index, char **args, char *o, gsize sizeofo, unsigned int stripcolor_args);
+gsize format_event (session *sess, int index, char **args, int *arglens, char *o, gsize sizeofo, unsigned int stripcolor_args);
 char *text_find_format_string (char *name);
 
 extern const gchar* unicode_fallback_string;
@@ -0,0 +1,429 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/* A hierarchical timer wheel in the Varghese & Lauck style. The root level
+ * has one slot per millisecond tick for the next 256 ms; each higher level
+ * has 64 slots, each as wide as a whole turn of the level below. A timer
+ * goes into the level its delay fits in and is moved down ("cascaded")
+ * when the lower level wraps around to its slot, so adding and removing
+ * are O(1) and only the slots that are due are ever looked at.
+ *
+ * The GSource is only woken when the soonest timer is due; cascades on the
+ * way there are done by the same wakeup. */
+
+#include <glib.h>
+
+#include "timerwheel.h"
+
+#define ROOT_BITS 8
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define LEVEL_BITS 6
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define WHEEL_LEVELS 5	/* 8 + 4 * 6 bits of milliseconds, about 49 days */
+#define LEVEL_SHIFT(l) (ROOT_BITS + ((l) - 1) * LEVEL_BITS)
+#define WHEEL_SPAN (G_GUINT64_CONSTANT (1) << (ROOT_BITS + (WHEEL_LEVELS - 1) * LEVEL_BITS))
+
+typedef struct wheel_timer
+{
+	struct wheel_timer *next;
+	struct wheel_timer **prev;	/* whatever points at us */
+	guint64 expires;				/* in ticks */
+	GSourceFunc callback;
+	void *userdata;
+	int interval;					/* ms */
+	int tag;
+	gint8 level;					/* -1 when not in a slot */
+	guint8 slot;
+	unsigned int seconds:1;		/* round to whole seconds, like g_timeout_add_seconds */
+	unsigned int running:1;
+	unsigned int removed:1;		/* removed from inside its own callback */
+} wheel_timer;
+
+typedef struct
+{
+	wheel_timer *slot[ROOT_SIZE];
+	guint32 used[ROOT_SIZE / 32];	/* which slots are non-empty */
+} wheel_level;
+
+static wheel_level wheel[WHEEL_LEVELS];
+/* a lower bound on what each upper slot holds, so the source can sleep
+   through cascades that only move timers down a level */
+static guint64 wheel_soonest[WHEEL_LEVELS][LEVEL_SIZE];
+static guint64 wheel_tick;		/* the next tick to run */
+static gint64 wheel_base;		/* monotonic time of tick 0 */
+static GSource *wheel_source;
+static GHashTable *wheel_tags;
+static int wheel_last_tag;
+
+static gint64 rate_start;
+static guint rate_count;
+static double rate_last;
+
+static inline int
+level_size (int level)
+{
+	return level ? LEVEL_SIZE : ROOT_SIZE;
+}
+
+/* offset of the first used slot at or after 'from', wrapping around; -1 if
+   the level is empty */
+static int
+level_next (wheel_level *lv, int size, int from)
+{
+	guint32 bits;
+	int n, idx;
+
+	for (n = 0; n < size; n += 32 - (idx & 31))
+	{
+		idx = (from + n) & (size - 1);
+		bits = lv->used[idx >> 5] >> (idx & 31);
+		if (bits)
+			return n + g_bit_nth_lsf (bits, -1);
+	}
+	return -1;
+}
+
+static guint64
+wheel_now (gint64 now, gboolean round_up)
+{
+	return (now - wheel_base + (round_up ? 999 : 0)) / 1000;
+}
+
+static void
+wheel_insert (wheel_timer *t)
+{
+	wheel_level *lv;
+	guint64 expires, delta;
+	int level, slot;
+
+	expires = MAX (t->expires, wheel_tick);
+	delta = expires - wheel_tick;
+
+	if (delta < ROOT_SIZE)
+	{
+		level = 0;
+		slot = expires & (ROOT_SIZE - 1);
+	}
+	else
+	{
+		/* too far out for the wheel: park it in the top level and let the
+		   cascade put it back once it comes round */
+		if (delta >= WHEEL_SPAN)
+			expires = wheel_tick + WHEEL_SPAN - 1;
+		for (level = 1; level < WHEEL_LEVELS - 1; level++)
+		{
+			if (delta < G_GUINT64_CONSTANT (1) << (LEVEL_SHIFT (level) + LEVEL_BITS))
+				break;
+		}
+		slot = (expires >> LEVEL_SHIFT (level)) & (LEVEL_SIZE - 1);
+	}
+
+	lv = &wheel[level];
+	if (level > 0 && (!lv->slot[slot] || t->expires < wheel_soonest[level][slot]))
+		wheel_soonest[level][slot] = t->expires;
+	t->level = level;
+	t->slot = slot;
+	t->next = lv->slot[slot];
+	if (t->next)
+		t->next->prev = &t->next;
+	t->prev = &lv->slot[slot];
+	lv->slot[slot] = t;
+	lv->used[slot >> 5] |= 1u << (slot & 31);
+}
+
+static void
+wheel_unlink (wheel_timer *t)
+{
+	*t->prev = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	if (t->level >= 0 && wheel[t->level].slot[t->slot] == NULL)
+		wheel[t->level].used[t->slot >> 5] &= ~(1u << (t->slot & 31));
+	t->level = -1;
+}
+
+/* take a whole slot off the wheel */
+static wheel_timer *
+wheel_take (int level, int slot)
+{
+	wheel_timer *list, *t;
+
+	list = wheel[level].slot[slot];
+	wheel[level].slot[slot] = NULL;
+	wheel[level].used[slot >> 5] &= ~(1u << (slot & 31));
+
+	for (t = list; t; t = t->next)
+		t->level = -1;
+	return list;
+}
+
+/* the root level has wrapped: move the next slot of each level above down */
+static void
+wheel_cascade (void)
+{
+	wheel_timer *list, *t;
+	int level, slot;
+
+	for (level = 1; level < WHEEL_LEVELS; level++)
+	{
+		slot = (wheel_tick >> LEVEL_SHIFT (level)) & (LEVEL_SIZE - 1);
+		list = wheel_take (level, slot);
+		while ((t = list))
+		{
+			list = t->next;
+			wheel_insert (t);
+		}
+		if (slot != 0)
+			break;
+	}
+}
+
+static void
+wheel_free (wheel_timer *t)
+{
+	if (!t->removed)
+		g_hash_table_remove (wheel_tags, GINT_TO_POINTER (t->tag));
+	g_free (t);
+}
+
+static void
+wheel_reschedule (wheel_timer *t, guint64 now)
+{
+	t->expires = now + MAX (t->interval, 1);
+	if (t->seconds)
+		t->expires = (t->expires + 999) / 1000 * 1000;
+	wheel_insert (t);
+}
+
+/* run everything due by 'now'; repeating timers count their next interval
+   from 'resched', which is now rounded up so they never fire early */
+static void
+wheel_run (guint64 now, guint64 resched)
+{
+	wheel_timer *expired, *t;
+	gboolean again;
+	int idx, next;
+
+	while (wheel_tick <= now)
+	{
+		idx = wheel_tick & (ROOT_SIZE - 1);
+		if (idx == 0)
+			wheel_cascade ();
+
+		expired = wheel_take (0, idx);
+		if (expired)
+			expired->prev = &expired;
+		wheel_tick++;
+
+		/* a callback can remove any of the others, so unlink as we go */
+		while ((t = expired))
+		{
+			wheel_unlink (t);
+			t->running = TRUE;
+			again = t->callback (t->userdata);
+			t->running = FALSE;
+
+			if (again && !t->removed)
+				wheel_reschedule (t, resched);
+			else
+				wheel_free (t);
+		}
+
+		/* skip the empty root slots, but not past the next cascade */
+		idx = wheel_tick & (ROOT_SIZE - 1);
+		if (idx != 0)
+		{
+			next = level_next (&wheel[0], ROOT_SIZE, idx);
+			if (next < 0 || idx + next >= ROOT_SIZE)
+				next = ROOT_SIZE - idx;
+			wheel_tick = MIN (wheel_tick + next, now + 1);
+		}
+	}
+}
+
+/* the tick the source next has to wake up for */
+static guint64
+wheel_deadline (void)
+{
+	guint64 deadline, boundary;
+	int level, shift, cur, first, next;
+
+	deadline = G_MAXUINT64;
+	next = level_next (&wheel[0], ROOT_SIZE, wheel_tick & (ROOT_SIZE - 1));
+	if (next >= 0)
+		deadline = wheel_tick + next;
+
+	for (level = 1; level < WHEEL_LEVELS; level++)
+	{
+		shift = LEVEL_SHIFT (level);
+		cur = (wheel_tick >> shift) & (LEVEL_SIZE - 1);
+		/* the current slot still counts if its cascade hasn't run yet */
+		first = (wheel_tick & ((G_GUINT64_CONSTANT (1) << shift) - 1)) ? 1 : 0;
+		next = level_next (&wheel[level], LEVEL_SIZE, cur + first);
+		if (next < 0)
+			continue;
+		next += first;
+		boundary = ((wheel_tick >> shift) + next) << shift;
+		boundary = MAX (boundary, wheel_soonest[level][(cur + next) & (LEVEL_SIZE - 1)]);
+		deadline = MIN (deadline, boundary);
+	}
+
+	return deadline;
+}
+
+static void
+wheel_schedule (void)
+{
+	guint64 deadline;
+
+	if (g_hash_table_size (wheel_tags) == 0)
+	{
+		g_source_set_ready_time (wheel_source, -1);
+		return;
+	}
+
+	deadline = wheel_deadline ();
+	g_source_set_ready_time (wheel_source, wheel_base + (gint64) deadline * 1000);
+}
+
+static gboolean
+wheel_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	gint64 now = g_source_get_time (source);
+
+	rate_count++;
+	if (now - rate_start >= G_USEC_PER_SEC)
+	{
+		rate_last = rate_count * (double) G_USEC_PER_SEC / (now - rate_start);
+		rate_start = now;
+		rate_count = 0;
+	}
+
+	wheel_run (wheel_now (now, FALSE), wheel_now (now, TRUE));
+	wheel_schedule ();
+
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs wheel_funcs =
+{
+	NULL, NULL, wheel_dispatch, NULL
+};
+
+static int
+wheel_add (int interval, gboolean seconds, void *callback, void *userdata)
+{
+	wheel_timer *t;
+	guint64 now;
+
+	if (wheel_source == NULL)
+	{
+		wheel_base = rate_start = g_get_monotonic_time ();
+		wheel_tags = g_hash_table_new (g_direct_hash, g_direct_equal);
+		wheel_source = g_source_new (&wheel_funcs, sizeof (GSource));
+		g_source_set_name (wheel_source, "hexchat timer wheel");
+		g_source_attach (wheel_source, NULL);
+	}
+
+	now = wheel_now (g_get_monotonic_time (), TRUE);
+
+	/* an empty wheel can simply be wound forward */
+	if (g_hash_table_size (wheel_tags) == 0 && wheel_tick < now)
+		wheel_tick = now;
+
+	t = g_new0 (wheel_timer, 1);
+	t->callback = callback;
+	t->userdata = userdata;
+	t->interval = MAX (interval, 0);
+	t->seconds = seconds;
+	do
+	{
+		if (++wheel_last_tag <= 0)
+			wheel_last_tag = 1;
+	}
+	while (g_hash_table_contains (wheel_tags, GINT_TO_POINTER (wheel_last_tag)));
+	t->tag = wheel_last_tag;
+	g_hash_table_insert (wheel_tags, GINT_TO_POINTER (t->tag), t);
+
+	wheel_reschedule (t, now);
+	wheel_schedule ();
+
+	return t->tag;
+}
+
+int
+timerwheel_add (int interval, void *callback, void *userdata)
+{
+	return wheel_add (interval, FALSE, callback, userdata);
+}
+
+int
+timerwheel_add_seconds (int interval, void *callback, void *userdata)
+{
+	if (interval > G_MAXINT / 1000)
+		interval = G_MAXINT / 1000;
+	return wheel_add (interval * 1000, TRUE, callback, userdata);
+}
+
+void
+timerwheel_remove (int tag)
+{
+	wheel_timer *t;
+
+	if (wheel_tags == NULL)
+		return;
+
+	t = g_hash_table_lookup (wheel_tags, GINT_TO_POINTER (tag));
+	if (t == NULL)
+		return;
+
+	g_hash_table_remove (wheel_tags, GINT_TO_POINTER (tag));
+	if (t->running)
+	{
+		/* wheel_run() frees it when the callback returns */
+		t->removed = TRUE;
+		return;
+	}
+
+	wheel_unlink (t);
+	g_free (t);
+
+	/* otherwise it finds out it can sleep longer when it next wakes */
+	if (g_hash_table_size (wheel_tags) == 0)
+		g_source_set_ready_time (wheel_source, -1);
+}
+
+guint
+timerwheel_pending (void)
+{
+	return wheel_tags ? g_hash_table_size (wheel_tags) : 0;
+}
+
+/* how many times a second the wheel has woken the main loop, over about the
+   last second */
+double
+timerwheel_wakeups (void)
+{
+	gint64 now = g_get_monotonic_time ();
+
+	if (wheel_source == NULL)
+		return 0;
+	if (now - rate_start >= G_USEC_PER_SEC)
+		return rate_count * (double) G_USEC_PER_SEC / (now - rate_start);
+	return rate_last;
+}
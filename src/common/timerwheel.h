@@ -0,0 +1,32 @@
+/* HexChat
+ * Copyright (C) 2026 HexChat contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef HEXCHAT_TIMERWHEEL_H
+#define HEXCHAT_TIMERWHEEL_H
+
+/* Timeouts kept on a hashed timer wheel behind a single GSource, so a few
+ * thousand plugin timers cost the main loop one poll entry instead of one
+ * each. The callbacks and tags behave like fe_timeout_add()'s. */
+
+int timerwheel_add (int interval, void *callback, void *userdata);
+int timerwheel_add_seconds (int interval, void *callback, void *userdata);
+void timerwheel_remove (int tag);
+guint timerwheel_pending (void);
+double timerwheel_wakeups (void);
+
+#endif
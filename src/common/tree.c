@@ -252,3 +252,12 @@ int tree_size (tree *t)
 	return t->elements;
 }
 
+void *
+tree_nth (tree *t, int pos)
+{
+	if (!t || pos < 0 || pos >= t->elements)
+		return NULL;
+
+	return t->array[pos];
+}
+
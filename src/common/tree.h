@@ -36,5 +36,6 @@ void tree_foreach (tree *t, tree_traverse_func *func, void *data);
 int tree_insert (tree *t, void *key);
 void tree_append (tree* t, void *key);
 int tree_size (tree *t);
+void *tree_nth (tree *t, int pos);
 
 #endif
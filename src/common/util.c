@@ -52,6 +52,14 @@
 #include <sys/sysctl.h>
 #endif
 
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_SCAN
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_SCAN
+#endif
+
 /* SASL mechanisms */
 #ifdef USE_OPENSSL
 #include <openssl/bn.h>
@@ -271,6 +279,58 @@ expand_homedir (char *file)
 	return g_strdup (file);
 }
 
+/* Returns the offset of the first byte below 0x20 in str[0..len), or len if
+   there is none. Every mIRC control code and HIDDEN_CHAR lives below 0x20 and
+   none of them can appear inside a UTF-8 sequence, so anything before that
+   offset is plain text. */
+int
+ctrl_char_scan (const char *str, int len)
+{
+	const unsigned char *p = (const unsigned char *) str;
+	int i = 0;
+
+#if defined (HAVE_SSE2_SCAN)
+	const __m128i limit = _mm_set1_epi8 (0x1f);
+
+	/* v <= 0x1f exactly when min (v, 0x1f) == v; unsigned, so UTF-8 is fine */
+	for (; i + 32 <= len; i += 32)
+	{
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (p + i));
+		__m128i b = _mm_loadu_si128 ((const __m128i *) (p + i + 16));
+		__m128i ca = _mm_cmpeq_epi8 (_mm_min_epu8 (a, limit), a);
+		__m128i cb = _mm_cmpeq_epi8 (_mm_min_epu8 (b, limit), b);
+
+		if (_mm_movemask_epi8 (_mm_or_si128 (ca, cb)))
+			break;
+	}
+#elif defined (HAVE_NEON_SCAN)
+	for (; i + 16 <= len; i += 16)
+	{
+		if (vminvq_u8 (vld1q_u8 (p + i)) < 0x20)
+			break;
+	}
+#endif
+
+	/* 8 bytes at a time: a byte below 0x20 borrows into its top bit */
+	for (; i + 8 <= len; i += 8)
+	{
+		guint64 x;
+
+		memcpy (&x, p + i, 8);
+		if ((x - G_GUINT64_CONSTANT (0x2020202020202020)) & ~x &
+			 G_GUINT64_CONSTANT (0x8080808080808080))
+			break;
+	}
+
+	for (; i < len; i++)
+	{
+		if (p[i] < 0x20)
+			return i;
+	}
+
+	return len;
+}
+
 gchar *
 strip_color (const char *text, int len, int flags)
 {
@@ -297,12 +357,30 @@ strip_color (const char *text, int len, int flags)
 int
 strip_color2 (const char *src, int len, char *dst, int flags)
 {
-	int rcol = 0, bgcol = 0;
+	int rcol = 0, bgcol = 0, run;
 	char *start = dst;
 
 	if (len == -1) len = strlen (src);
-	while (len-- > 0)
+	while (len > 0)
 	{
+		if (rcol == 0)
+		{
+			/* copy everything up to the next control code in one go; for
+				the usual line without any, this is the whole job and an
+				in-place strip doesn't touch memory at all */
+			run = ctrl_char_scan (src, len);
+			if (run > 0)
+			{
+				if (dst != src)
+					memmove (dst, src, run);
+				dst += run;
+				src += run;
+				len -= run;
+				if (len == 0)
+					break;
+			}
+		}
+
 		if (rcol > 0 && (isdigit ((unsigned char)*src) ||
 			(*src == ',' && isdigit ((unsigned char)src[1]) && !bgcol)))
 		{
@@ -339,6 +417,7 @@ strip_color2 (const char *src, int len, char *dst, int flags)
 			}
 		}
 		src++;
+		len--;
 	}
 	*dst = 0;
 
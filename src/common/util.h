@@ -57,6 +57,7 @@ void util_exec (const char *cmd);
 #define STRIP_HIDDEN 4
 #define STRIP_ESCMARKUP 8
 #define STRIP_ALL 7
+int ctrl_char_scan (const char *str, int len);
 gchar *strip_color (const char *text, int len, int flags);
 int strip_color2 (const char *src, int len, char *dst, int flags);
 int strip_hidden_attribute (char *src, char *dst);
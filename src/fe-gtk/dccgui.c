@@ -390,7 +390,12 @@ dcc_prepare_file_data (struct DCC *dcc, gboolean is_send, gboolean update_only,
 			strcpy (eta, "--:--:--");
 	}
 
-	g_snprintf (kbs, 16, "%.1f", ((float)dcc->cps) / 1024);
+	/* with a limit in force, show what the scheduler allows too */
+	if (dcc->bucket.share > 0)
+		g_snprintf (kbs, 32, "%.1f/%.1f", ((float)dcc->cps) / 1024,
+		            ((float)dcc->bucket.share) / 1024);
+	else
+		g_snprintf (kbs, 32, "%.1f", ((float)dcc->cps) / 1024);
 	g_snprintf (perc, 16, "%.0f%%", per);
 
 	if (!update_only)
@@ -402,7 +407,7 @@ dcc_prepare_file_data (struct DCC *dcc, gboolean is_send, gboolean update_only,
 static HcDccFileItem *
 dcc_prepare_file_item (struct DCC *dcc, gboolean is_send)
 {
-	char status[64], file[256], size[16], pos[16], perc[16], kbs[16], eta[16];
+	char status[64], file[256], size[16], pos[16], perc[16], kbs[32], eta[16];
 	GdkRGBA *colour;
 
 	dcc_prepare_file_data (dcc, is_send, FALSE, status, file, size, pos, perc, kbs, eta, &colour);
@@ -414,7 +419,7 @@ dcc_prepare_file_item (struct DCC *dcc, gboolean is_send)
 static void
 dcc_update_file_item (HcDccFileItem *item, struct DCC *dcc, gboolean is_send)
 {
-	char status[64], file[256], size[16], pos[16], perc[16], kbs[16], eta[16];
+	char status[64], file[256], size[16], pos[16], perc[16], kbs[32], eta[16];
 	GdkRGBA *colour;
 
 	dcc_prepare_file_data (dcc, is_send, TRUE, status, file, size, pos, perc, kbs, eta, &colour);
@@ -1115,6 +1115,21 @@ fe_gui_info (session *sess, int info_type)
 		}
 
 		return 0;		/* normal (no keyboard focus or behind a window) */
+
+	case 1:	/* scrollback memory, in KiB */
+		if (!sess->res->buffer)
+			return 0;
+		return gtk_xtext_buffer_get_memory (sess->res->buffer) / 1024;
+
+	case 2:	/* frames a redraw came late by, per second */
+		if (!sess->gui->xtext)
+			return 0;
+		return gtk_xtext_get_skipped_renders (GTK_XTEXT (sess->gui->xtext));
+
+	case 3:	/* scrollback spilled to disk, in KiB */
+		if (!sess->res->buffer)
+			return 0;
+		return gtk_xtext_buffer_get_spilled (sess->res->buffer) / 1024;
 	}
 
 	return -1;
@@ -589,6 +589,7 @@ static const setting logging_settings[] =
 	{ST_HEADER,	N_("Logging"),0,0,0},
 	{ST_TOGGLE,	N_("Display scrollback from previous session"), P_OFFINTNL(hex_text_replay), 0, 0, 0},
 	{ST_NUMBER,	N_("Scrollback lines:"), P_OFFINTNL(hex_text_max_lines),0,0,100000},
+	{ST_NUMBER,	N_("Scrollback memory:"), P_OFFINTNL(hex_text_max_memory), N_("Beyond this, scrollback of the tabs looked at least recently is moved to disk. 0 means no limit."), (const char **)N_("MB."), 65536},
 	{ST_TOGGLE,	N_("Enable logging of conversations to disk"), P_OFFINTNL(hex_irc_logging), 0, 0, 0},
 	{ST_ENTRY,	N_("Log filename:"), P_OFFSETNL(hex_irc_logmask), 0, 0, sizeof prefs.hex_irc_logmask},
 	{ST_LABEL,	N_("%s=Server %c=Channel %n=Network.")},
@@ -23,13 +23,16 @@
 
 #define GDK_MULTIHEAD_SAFE
 #define MARGIN 2						/* dont touch. */
-#define REFRESH_TIMEOUT 20
 #define WORDWRAP_LIMIT 24
+#define REWRAP_SLICE 4000			/* usecs of background re-wrap per idle call */
 
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <time.h>
+#include <fcntl.h>
+
+#include <glib/gstdio.h>
 
 #include "config.h"
 #include "../common/hexchat.h"
@@ -71,7 +74,18 @@
 /* force scrolling off */
 #define dontscroll(buf) (buf)->last_pixel_pos = 0x7fffffff
 
+/* work queued for the next frame, see gtk_xtext_tick */
+#define XTEXT_DIRTY_DRAW	1	/* repaint the page */
+#define XTEXT_DIRTY_LINES	2	/* lines were appended or trimmed */
+#define XTEXT_DIRTY_WIDTH	4	/* the width changed, re-wrap */
+
 static GtkWidgetClass *parent_class = NULL;
+static GList *buffers_lru;		/* all buffers, most recently shown first */
+
+/* wrap offsets kept inside the textentry; longer entries spill to the heap */
+#define SUBLINES_INLINE 4
+#define CHUNK_SIZE (64 * 1024)	/* arena chunk for textentries and their text */
+#define CHUNK_ALIGN(n) (((n) + 7) & ~(gsize) 7)
 
 struct textentry
 {
@@ -86,10 +100,16 @@ struct textentry
 	gint16 indent;
 	gint16 left_len;
 	GSList *slp;
-	GSList *sublines;
-	guchar tag;
-	guchar pad1;
-	guchar pad2;	/* 32-bit align : 44 bytes total */
+	struct glyph_table *glyphs;	/* built on demand by gtk_xtext_ent_glyphs */
+	struct ent_node *node;		/* retained rendering, while on screen */
+	guint16 *sublines;	/* end offset of each wrapped line */
+	guint16 nsublines;	/* number of lines this entry takes */
+	guint16 sublines_size;
+	guint16 sublines_inline[SUBLINES_INLINE];
+	int slot;				/* position in the buffer's line index */
+	xtext_chunk *chunk;	/* arena chunk this entry (and its str) lives in */
+	gboolean needs_wrap;	/* nsublines is only an estimate for the current width */
+	gboolean needs_measure;	/* str_width is a guess, slp isn't built yet */
 	GList *marks;	/* List of found strings */
 };
 
@@ -126,6 +146,9 @@ static int gtk_xtext_render_ents (GtkXText * xtext, textentry *, textentry *);
 static void gtk_xtext_recalc_widths (xtext_buffer *buf, int);
 static void gtk_xtext_fix_indent (xtext_buffer *buf);
 static int gtk_xtext_find_subline (GtkXText *xtext, textentry *ent, int line);
+static void gtk_xtext_ent_rewrap (xtext_buffer *buf, textentry *ent);
+static int gtk_xtext_ent_subline_end (xtext_buffer *buf, textentry *ent, int k);
+static void gtk_xtext_rewrap_start (xtext_buffer *buf);
 /* static char *gtk_xtext_conv_color (unsigned char *text, int len, int *newlen); */
 /* For use by gtk_xtext_strip_color() and its callers -- */
 struct offlen_s {
@@ -139,7 +162,8 @@ static unsigned char *
 gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 							  int *newlen, GSList **slp, int strip_hidden);
 static gboolean gtk_xtext_check_ent_visibility (GtkXText * xtext, textentry *find_ent, int add);
-static int gtk_xtext_render_page_timeout (GtkXText * xtext);
+static void gtk_xtext_invalidate (GtkXText *xtext, int what);
+static void gtk_xtext_ent_node_free (GtkXText *xtext, textentry *ent);
 static int gtk_xtext_search_offset (xtext_buffer *buf, textentry *ent, unsigned int off);
 static GList * gtk_xtext_search_textentry (xtext_buffer *, textentry *);
 static void gtk_xtext_search_textentry_add (xtext_buffer *, textentry *, GList *, gboolean);
@@ -177,6 +201,7 @@ static gboolean gtk_xtext_scroll (GtkEventControllerScroll *controller, double d
 #define EMPH_HIDDEN 4
 static PangoAttrList *attr_lists[4];
 static int fontwidths[4][128];
+static int fontunits[4][128];	/* the same, in Pango units */
 
 static PangoAttribute *
 xtext_pango_attr (PangoAttribute *attr)
@@ -228,10 +253,16 @@ xtext_pango_init (GtkXText *xtext)
 		{
 			buf[0] = j;
 			pango_layout_set_text (xtext->layout, buf, 1);
-			pango_layout_get_pixel_size (xtext->layout, &fontwidths[i][j], NULL);
+			pango_layout_get_size (xtext->layout, &fontunits[i][j], NULL);
+			fontwidths[i][j] = PANGO_PIXELS_CEIL (fontunits[i][j]);
 		}
 	}
 	xtext->space_width = fontwidths[0][' '];
+	xtext->font_mono = fontunits[0]['i'] == fontunits[0]['W'] &&
+							 fontunits[0]['i'] == fontunits[0]['.'];
+
+	if (xtext->char_widths)
+		g_hash_table_remove_all (xtext->char_widths);
 }
 
 static void
@@ -332,10 +363,112 @@ backend_get_char_width (guchar c, int emphasis)
 	return -1;  /* Signal caller to use Pango for non-ASCII */
 }
 
+/* Can 'c' be measured on its own, without looking at its neighbours?
+ * Marks, joiners, emoji modifiers and scripts that shape their letters
+ * depending on context can't. */
+
+static gboolean
+backend_char_is_simple (gunichar c)
+{
+	if (c < 0x300)
+		return TRUE;
+
+	switch (g_unichar_type (c))
+	{
+	case G_UNICODE_NON_SPACING_MARK:
+	case G_UNICODE_SPACING_MARK:
+	case G_UNICODE_ENCLOSING_MARK:
+	case G_UNICODE_FORMAT:
+	case G_UNICODE_MODIFIER_SYMBOL:
+	case G_UNICODE_SURROGATE:
+		return FALSE;
+	default:
+		break;
+	}
+
+	if (c >= 0x1F1E6 && c <= 0x1F1FF)	/* regional indicators pair up into flags */
+		return FALSE;
+	if (c >= 0x1100 && c <= 0x11FF)		/* conjoining Hangul jamo */
+		return FALSE;
+
+	switch (g_unichar_get_script (c))
+	{
+	case G_UNICODE_SCRIPT_COMMON:
+	case G_UNICODE_SCRIPT_LATIN:
+	case G_UNICODE_SCRIPT_GREEK:
+	case G_UNICODE_SCRIPT_CYRILLIC:
+	case G_UNICODE_SCRIPT_ARMENIAN:
+	case G_UNICODE_SCRIPT_GEORGIAN:
+	case G_UNICODE_SCRIPT_HAN:
+	case G_UNICODE_SCRIPT_HIRAGANA:
+	case G_UNICODE_SCRIPT_KATAKANA:
+	case G_UNICODE_SCRIPT_HANGUL:
+	case G_UNICODE_SCRIPT_BOPOMOFO:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* width of one non-ASCII character in Pango units, measured once per
+ * font and emphasis */
+
+static int
+backend_get_char_units (GtkXText *xtext, gunichar c, int emphasis)
+{
+	gpointer key = GUINT_TO_POINTER ((c << 2) | emphasis);
+	gpointer val;
+	char buf[6];
+	int units;
+
+	if (xtext->char_widths == NULL)
+		xtext->char_widths = g_hash_table_new (g_direct_hash, g_direct_equal);
+	else if ((val = g_hash_table_lookup (xtext->char_widths, key)))
+		return GPOINTER_TO_INT (val) - 1;
+
+	pango_layout_set_attributes (xtext->layout, attr_lists[emphasis]);
+	pango_layout_set_text (xtext->layout, buf, g_unichar_to_utf8 (c, buf));
+	pango_layout_get_size (xtext->layout, &units, NULL);
+
+	g_hash_table_insert (xtext->char_widths, key, GINT_TO_POINTER (units + 1));
+	return units;
+}
+
+/* Sum the cached widths of a run, or -1 if it needs real shaping. Only
+ * used with fixed-pitch fonts: there is no kerning to lose, so this is
+ * exactly what Pango would lay out. */
+
+static int
+backend_get_run_width (GtkXText *xtext, guchar *str, int len, int emphasis)
+{
+	guchar *end = str + len;
+	gunichar c;
+	int units = 0;
+
+	while (str < end)
+	{
+		if (*str < 128)
+		{
+			units += fontunits[emphasis][*str];
+			str++;
+			continue;
+		}
+
+		c = g_utf8_get_char_validated ((char *) str, end - str);
+		if (c == (gunichar) -1 || c == (gunichar) -2 || !backend_char_is_simple (c))
+			return -1;
+		units += backend_get_char_units (xtext, c, emphasis);
+		str += charlen (str);
+	}
+
+	return PANGO_PIXELS_CEIL (units);
+}
+
 static int
 backend_get_text_width_emph (GtkXText *xtext, guchar *str, int len, int emphasis)
 {
 	int width;
+	gunichar c;
 
 	if (*str == 0)
 		return 0;
@@ -348,6 +481,21 @@ backend_get_text_width_emph (GtkXText *xtext, guchar *str, int len, int emphasis
 	if (len == 1 && *str < 128)
 		return fontwidths[emphasis][*str];
 
+	/* a single character of any other kind, from the width cache */
+	if (len == charlen (str))
+	{
+		c = g_utf8_get_char_validated ((char *) str, len);
+		if (c != (gunichar) -1 && c != (gunichar) -2)
+			return PANGO_PIXELS_CEIL (backend_get_char_units (xtext, c, emphasis));
+	}
+
+	if (xtext->font_mono)
+	{
+		width = backend_get_run_width (xtext, str, len, emphasis);
+		if (width >= 0)
+			return width;
+	}
+
 	/* Use Pango's full-string width calculation to match actual rendering.
 	 * Previously we summed individual character widths, but this accumulated
 	 * rounding errors (~0.65 pixels per character) causing URL underlines
@@ -434,10 +582,9 @@ static void
 gtk_xtext_init (GtkXText * xtext)
 {
 	xtext->pixmap = NULL;
-	xtext->io_tag = 0;
-	xtext->add_io_tag = 0;
+	xtext->tick_id = 0;
+	xtext->dirty = 0;
 	xtext->scroll_tag = 0;
-	xtext->resize_tag = 0;
 	xtext->max_lines = 0;
 	xtext->col_back = XTEXT_BG;
 	xtext->col_fore = XTEXT_FG;
@@ -538,15 +685,6 @@ gtk_xtext_adjustment_set (xtext_buffer *buf, int fire_signal)
 	}
 }
 
-static gint
-gtk_xtext_adjustment_timeout (GtkXText * xtext)
-{
-	/* GTK3: Queue a redraw instead of rendering directly */
-	gtk_widget_queue_draw (GTK_WIDGET (xtext));
-	xtext->io_tag = 0;
-	return 0;
-}
-
 static void
 gtk_xtext_adjustment_changed (GtkAdjustment * adj, GtkXText * xtext)
 {
@@ -566,24 +704,7 @@ gtk_xtext_adjustment_changed (GtkAdjustment * adj, GtkXText * xtext)
 		else
 			xtext->buffer->scrollbar_down = FALSE;
 
-		if (value + 1 == xtext->buffer->old_value ||
-			 value - 1 == xtext->buffer->old_value)	/* clicked an arrow? */
-		{
-			if (xtext->io_tag)
-			{
-				g_source_remove (xtext->io_tag);
-				xtext->io_tag = 0;
-			}
-			/* GTK3: Queue a redraw instead of rendering directly */
-			gtk_widget_queue_draw (GTK_WIDGET (xtext));
-		} else
-		{
-			if (!xtext->io_tag)
-				xtext->io_tag = g_timeout_add (REFRESH_TIMEOUT,
-															(GSourceFunc)
-															gtk_xtext_adjustment_timeout,
-															xtext);
-		}
+		gtk_xtext_invalidate (xtext, XTEXT_DIRTY_DRAW);
 	}
 	xtext->buffer->old_value = value;
 }
@@ -611,10 +732,10 @@ gtk_xtext_dispose (GObject * object)
 {
 	GtkXText *xtext = GTK_XTEXT (object);
 
-	if (xtext->add_io_tag)
+	if (xtext->tick_id)
 	{
-		g_source_remove (xtext->add_io_tag);
-		xtext->add_io_tag = 0;
+		gtk_widget_remove_tick_callback (GTK_WIDGET (xtext), xtext->tick_id);
+		xtext->tick_id = 0;
 	}
 
 	if (xtext->scroll_tag)
@@ -623,18 +744,6 @@ gtk_xtext_dispose (GObject * object)
 		xtext->scroll_tag = 0;
 	}
 
-	if (xtext->resize_tag)
-	{
-		g_source_remove (xtext->resize_tag);
-		xtext->resize_tag = 0;
-	}
-
-	if (xtext->io_tag)
-	{
-		g_source_remove (xtext->io_tag);
-		xtext->io_tag = 0;
-	}
-
 	if (xtext->pixmap)
 	{
 		cairo_surface_destroy (xtext->pixmap);
@@ -647,6 +756,20 @@ gtk_xtext_dispose (GObject * object)
 		xtext->font = NULL;
 	}
 
+	if (xtext->char_widths)
+	{
+		g_hash_table_destroy (xtext->char_widths);
+		xtext->char_widths = NULL;
+	}
+
+	if (xtext->node_ents)
+	{
+		while (xtext->node_ents->len)
+			gtk_xtext_ent_node_free (xtext, g_ptr_array_index (xtext->node_ents, 0));
+		g_ptr_array_free (xtext->node_ents, TRUE);
+		xtext->node_ents = NULL;
+	}
+
 	if (xtext->adj)
 	{
 		g_signal_handlers_disconnect_matched (G_OBJECT (xtext->adj),
@@ -756,31 +879,6 @@ gtk_xtext_measure (GtkWidget *widget,
 		*natural_baseline = -1;
 }
 
-/* Timeout for deferred line recalculation during window resize.
- * This throttles expensive recalculations when the user is actively resizing. */
-#define RESIZE_TIMEOUT 50
-
-static gboolean
-gtk_xtext_resize_cb (gpointer data)
-{
-	GtkXText *xtext = data;
-
-	xtext->resize_tag = 0;
-	gtk_xtext_calc_lines (xtext->buffer, FALSE);
-
-	/* After reflow, restore scroll position to bottom if it was there before */
-	if (xtext->buffer->scrollbar_down)
-	{
-		gtk_adjustment_set_value (xtext->adj,
-			gtk_adjustment_get_upper (xtext->adj) -
-			gtk_adjustment_get_page_size (xtext->adj));
-	}
-
-	gtk_widget_queue_draw (GTK_WIDGET (xtext));
-
-	return G_SOURCE_REMOVE;
-}
-
 /* GTK4: size_allocate has different signature - width, height, baseline */
 static void
 gtk_xtext_size_allocate (GtkWidget * widget, int width, int height, int baseline)
@@ -797,11 +895,8 @@ gtk_xtext_size_allocate (GtkWidget * widget, int width, int height, int baseline
 	dontscroll (xtext->buffer);	/* force scrolling off */
 	if (!height_only)
 	{
-		/* Throttle expensive line recalculation during rapid resize.
-		 * Cancel any pending recalc and schedule a new one. */
-		if (xtext->resize_tag)
-			g_source_remove (xtext->resize_tag);
-		xtext->resize_tag = g_timeout_add (RESIZE_TIMEOUT, gtk_xtext_resize_cb, xtext);
+		/* re-wrap once per frame, however many allocations come in between */
+		gtk_xtext_invalidate (xtext, XTEXT_DIRTY_WIDTH);
 	}
 	else
 	{
@@ -835,86 +930,159 @@ gtk_xtext_selection_clear (xtext_buffer *buf)
 	return ret;
 }
 
-static int
-find_x (GtkXText *xtext, textentry *ent, int x, int subline, int indent)
+/* The x position of every glyph of an entry, measured once, so that
+ * wrapping and hit-testing are a binary search instead of a walk through
+ * Pango for each non-ASCII character. */
+
+typedef struct glyph_table
 {
-	int xx = indent;
-	int suboff;
+	guint font_gen;		/* xtext->font_gen this was measured with */
+	gboolean ignore_hidden;	/* and xtext->ignore_hidden */
+	int n;					/* number of glyphs */
+	int *x;					/* left edge of glyph i, x[n] is the total width */
+	guint16 *off;			/* byte offset of glyph i in ent->str */
+} glyph_table;
+
+static void
+gtk_xtext_ent_glyphs_free (textentry *ent)
+{
+	g_free (ent->glyphs);
+	ent->glyphs = NULL;
+}
+
+static glyph_table *
+gtk_xtext_ent_glyphs (GtkXText *xtext, textentry *ent)
+{
+	glyph_table *gt = ent->glyphs;
 	GSList *list;
-	GSList *hid = NULL;
 	offlen_t *meta;
-	int off, len, wid, mbl, mbw;
+	int n, i, off, end, mbl, emph, x;
+
+	if (gt && gt->font_gen == xtext->font_gen && gt->ignore_hidden == xtext->ignore_hidden)
+		return gt;
+	gtk_xtext_ent_glyphs_free (ent);
+
+	n = 0;
+	for (list = ent->slp; list; list = g_slist_next (list))
+	{
+		meta = list->data;
+		for (off = meta->off, end = meta->off + meta->len; off < end; off += charlen (ent->str + off))
+			n++;
+	}
 
-	/* Skip to the first chunk of stuff for the subline */
-	if (subline > 0)
+	gt = g_malloc (sizeof (glyph_table) + (n + 1) * sizeof (int) + (n + 1) * sizeof (guint16));
+	gt->font_gen = xtext->font_gen;
+	gt->ignore_hidden = xtext->ignore_hidden;
+	gt->n = n;
+	gt->x = (int *) (gt + 1);
+	gt->off = (guint16 *) (gt->x + n + 1);
+
+	i = 0;
+	x = 0;
+	for (list = ent->slp; list; list = g_slist_next (list))
 	{
-		suboff = GPOINTER_TO_INT (g_slist_nth_data (ent->sublines, subline - 1));
-		for (list = ent->slp; list; list = g_slist_next (list))
+		meta = list->data;
+		emph = meta->emph;
+		if (xtext->ignore_hidden)
+			emph &= ~EMPH_HIDDEN;
+		for (off = meta->off, end = meta->off + meta->len; off < end; off += mbl)
 		{
-			meta = list->data;
-			if (meta->off + meta->len > suboff)
-				break;
+			mbl = charlen (ent->str + off);
+			gt->x[i] = x;
+			gt->off[i] = off;
+			x += backend_get_text_width_emph (xtext, ent->str + off, mbl, emph);
+			i++;
 		}
 	}
-	else
+	gt->x[n] = x;
+	gt->off[n] = ent->str_len;
+
+	ent->glyphs = gt;
+	return gt;
+}
+
+/* first glyph at or after byte offset 'off' */
+
+static int
+glyph_at_offset (glyph_table *gt, int off)
+{
+	int lo = 0, hi = gt->n;
+
+	while (lo < hi)
 	{
-		suboff = 0;
-		list = ent->slp;
-	} 
-	/* Step to the first character of the subline */
-	if (list == NULL)
-		return 0;
-	meta = list->data;
-	off = meta->off;
-	len = meta->len;
-	if (meta->emph & EMPH_HIDDEN)
-		hid = list;
-	while (len > 0)
+		int mid = (lo + hi) / 2;
+		if (gt->off[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* first glyph from 'from' on whose right edge is past 'x', or gt->n */
+
+static int
+glyph_at_x (glyph_table *gt, int from, int x)
+{
+	int lo = from, hi = gt->n;
+
+	while (lo < hi)
 	{
-		if (off >= suboff)
-			break;
-		mbl = charlen (ent->str + off);
-		len -= mbl;
-		off += mbl;
-	}
-	if (len < 0)
-		return ent->str_len;		/* Bad char -- return max offset. */
-
-	/* Step through characters to find the one at the x position */
-	wid = x - indent;
-	len = meta->len - (off - meta->off);
-	while (wid > 0)
-	{
-		mbl = charlen (ent->str + off);
-		mbw = backend_get_text_width_emph (xtext, ent->str + off, mbl, meta->emph);
-		wid -= mbw;
-		xx += mbw;
-		if (xx >= x)
-			return off;
-		len -= mbl;
-		off += mbl;
-		if (len <= 0)
-		{
-			if (meta->emph & EMPH_HIDDEN)
-				hid = list;
-			list = g_slist_next (list);
-			if (list == NULL)
-				return ent->str_len;
-			meta = list->data;
-			off = meta->off;
-			len = meta->len;
-		}
+		int mid = (lo + hi) / 2;
+		if (gt->x[mid + 1] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
+
+static int
+find_x (GtkXText *xtext, textentry *ent, int x, int subline, int indent)
+{
+	glyph_table *gt;
+	GSList *list, *first = NULL, *prev = NULL;
+	offlen_t *meta;
+	int suboff, g0, g;
+
+	if (ent->slp == NULL)
+		return 0;
+
+	if (ent->needs_wrap)
+		gtk_xtext_ent_rewrap (xtext->buffer, ent);
+	if (subline > ent->nsublines)
+		return ent->str_len;
 
-	/* If previous chunk exists and is marked hidden, regard it as unhidden */
-	if (hid && list && hid->next == list)
+	suboff = subline > 0 ? gtk_xtext_ent_subline_end (xtext->buffer, ent, subline - 1) : 0;
+
+	gt = gtk_xtext_ent_glyphs (xtext, ent);
+	g0 = glyph_at_offset (gt, suboff);
+	if (g0 >= gt->n)
+		return ent->str_len;
+
+	if (x - indent <= 0)
+		return gt->off[g0];
+
+	/* the glyph under x: the first one whose right edge reaches it */
+	g = glyph_at_x (gt, g0, gt->x[g0] + x - indent - 1);
+	if (g >= gt->n)
+		return ent->str_len;
+
+	/* If the previous chunk is marked hidden, regard it as unhidden */
+	for (list = ent->slp; list; prev = list, list = g_slist_next (list))
 	{
-		meta = hid->data;
-		off = meta->off;
+		meta = list->data;
+		if (!first && meta->off + meta->len > gt->off[g0])
+			first = list;
+		if (meta->off + meta->len > gt->off[g])
+			break;
 	}
+	if (list && prev && first && list != first &&
+		 (((offlen_t *) prev->data)->emph & EMPH_HIDDEN))
+		return ((offlen_t *) prev->data)->off;
 
 	/* Return offset of character at x within subline */
-	return off;
+	return gt->off[g];
 }
 
 static int
@@ -968,6 +1136,13 @@ gtk_xtext_find_char (GtkXText * xtext, int x, int y, int *off, int *out_of_bound
 	if (!ent)
 		return NULL;
 
+	/* not wrapped for this width yet, the estimate may be off */
+	if (ent->needs_wrap)
+	{
+		gtk_xtext_ent_rewrap (xtext->buffer, ent);
+		subline = MIN (subline, ent->nsublines - 1);
+	}
+
 	if (off)
 		*off = gtk_xtext_find_x (xtext, x, ent, subline, line, &outofbounds);
 	if (out_of_bounds)
@@ -1072,7 +1247,7 @@ gtk_xtext_draw_marker (GtkXText * xtext, textentry * ent, int y)
 	else if (xtext->buffer->marker_pos == ent->next && ent->next != NULL)
 	{
 		/* We're rendering the last read entry - draw marker after all sublines */
-		render_y = y + xtext->fontsize * g_slist_length (ent->sublines) + 4;
+		render_y = y + xtext->fontsize * ent->nsublines + 4;
 	}
 	else return;
 
@@ -1178,6 +1353,19 @@ gtk_xtext_snapshot (GtkWidget *widget, GtkSnapshot *snapshot)
 	/* Create bounds for the snapshot */
 	graphene_rect_init (&bounds, 0, 0, width, height);
 
+	/* without a background image, lines are drawn as retained nodes and
+	 * only the ones that changed get rendered again */
+	if (!xtext->pixmap)
+	{
+		dontscroll (xtext->buffer);	/* force scrolling off */
+		xtext->snapshot = snapshot;
+		gtk_snapshot_push_clip (snapshot, &bounds);
+		gtk_xtext_render_page (xtext);
+		gtk_snapshot_pop (snapshot);
+		xtext->snapshot = NULL;
+		return;
+	}
+
 	/* Get a cairo context from the snapshot */
 	cr = gtk_snapshot_append_cairo (snapshot, &bounds);
 
@@ -1880,11 +2068,7 @@ gtk_xtext_motion_notify (GtkEventControllerMotion *controller, double event_x, d
 				if (xtext->buffer->scrollbar_down)
 					gtk_adjustment_set_value (xtext->adj, gtk_adjustment_get_upper (xtext->adj) -
 													  gtk_adjustment_get_page_size (xtext->adj));
-				if (!xtext->io_tag)
-					xtext->io_tag = g_timeout_add (REFRESH_TIMEOUT,
-															(GSourceFunc)
-															gtk_xtext_adjustment_timeout,
-															xtext);
+				gtk_xtext_invalidate (xtext, XTEXT_DIRTY_DRAW);
 			}
 		}
 		return;
@@ -2525,6 +2709,7 @@ gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 	unsigned char *new_str;
 	unsigned char *text0 = text;
 	int mbl;	/* multi-byte length */
+	int run, k;
 
 	if (outbuf == NULL)
 		new_str = g_malloc (len + 2);
@@ -2537,6 +2722,33 @@ gtk_xtext_strip_color (unsigned char *text, int len, unsigned char *outbuf,
 	c.emph = 0;
 	while (len > 0)
 	{
+		if (rcol == 0 && (run = ctrl_char_scan ((char *)text, len)) > 0)
+		{
+			/* Plain text up to the next control code. The buffer holds valid
+			   UTF-8, so only a character cut short by len can straddle the
+			   end of the run; leave that one to the loop below. */
+			if (run == len)
+			{
+				k = run - 1;
+				while (k > 0 && k > run - 4 && (text[k] & 0xc0) == 0x80)
+					k--;
+				if (k + charlen (text + k) > run)
+					run = k;
+			}
+			if (run > 0 && (strip_hidden == 2 || !(hidden && strip_hidden)))
+			{
+				if (c.len1 == 0)
+					c.off1 = text - text0;
+				memcpy (new_str + i, text, run);
+				i += run;
+				c.len1 += run;
+			}
+			text += run;
+			len -= run;
+			if (len == 0)
+				break;
+		}
+
 		mbl = charlen (text);
 		if (mbl > len)
 			goto bad_utf8;
@@ -2623,6 +2835,7 @@ gtk_xtext_text_width_ent (GtkXText *xtext, textentry *ent)
 		g_slist_free_full (ent->slp, g_free);
 		ent->slp = NULL;
 	}
+	gtk_xtext_ent_glyphs_free (ent);
 
 	new_buf = gtk_xtext_strip_color (ent->str, ent->str_len, xtext->scratch_buffer,
 												NULL, &slp0, 2);
@@ -3230,23 +3443,15 @@ gtk_xtext_render_str (GtkXText * xtext, int y, textentry * ent,
 	return ret;
 }
 
-/* walk through str until this line doesn't fit anymore */
+/* find where the line starting at str has to wrap */
 
 static int
 find_next_wrap (GtkXText * xtext, textentry * ent, unsigned char *str,
 					 int win_width, int indent)
 {
-	unsigned char *last_space = str;
-	unsigned char *orig_str = str;
-	int str_width = indent;
-	int rcol = 0, bgcol = 0;
-	int hidden = FALSE;
-	int mbl;
-	int char_width;
-	int ret;
-	int limit_offset = 0;
-	int emphasis = 0;
-	GSList *lp;
+	glyph_table *gt;
+	int start = str - ent->str;
+	int g0, g, j, ret, bytes;
 
 	/* single liners */
 	if (win_width >= ent->str_width + ent->indent)
@@ -3255,110 +3460,42 @@ find_next_wrap (GtkXText * xtext, textentry * ent, unsigned char *str,
 	/* it does happen! */
 	if (win_width < 1)
 	{
-		ret = ent->str_len - (str - ent->str);
+		ret = ent->str_len - start;
 		goto done;
 	}
 
-	/* Find emphasis value for the offset that is the first byte of our string */
-	for (lp = ent->slp; lp; lp = g_slist_next (lp))
-	{
-		offlen_t *meta = lp->data;
-		unsigned char *start, *end;
+	gt = gtk_xtext_ent_glyphs (xtext, ent);
+	g0 = glyph_at_offset (gt, start);
 
-		start = ent->str + meta->off;
-		end = start + meta->len;
-		if (str >= start && str < end)
-		{
-			emphasis = meta->emph;
-			break;
-		}
+	/* the first glyph that doesn't fit anymore */
+	g = glyph_at_x (gt, g0, gt->x[g0] + win_width - indent);
+	if (g >= gt->n)
+	{
+		ret = ent->str_len - start;
+		goto done;
 	}
+	ret = gt->off[g] - start;
 
-	while (1)
+	if (xtext->wordwrap)
 	{
-		if (rcol > 0 && (isdigit (*str) || (*str == ',' && isdigit (str[1]) && !bgcol)))
-		{
-			if (str[1] != ',') rcol--;
-			if (*str == ',')
-			{
-				rcol = 2;
-				bgcol = 1;
-			}
-			limit_offset++;
-			str++;
-		} else
+		/* back up to the last space, unless it's too far away */
+		bytes = 0;
+		for (j = g - 1; j >= g0; j--)
 		{
-			rcol = bgcol = 0;
-			switch (*str)
-			{
-			case ATTR_COLOR:
-				rcol = 2;
-			case ATTR_BEEP:
-			case ATTR_RESET:
-			case ATTR_REVERSE:
-			case ATTR_BOLD:
-			case ATTR_UNDERLINE:
-			case ATTR_STRIKETHROUGH:
-			case ATTR_ITALICS:
-				if (*str == ATTR_RESET)
-					emphasis = 0;
-				if (*str == ATTR_ITALICS)
-					emphasis ^= EMPH_ITAL;
-				if (*str == ATTR_BOLD)
-					emphasis ^= EMPH_BOLD;
-				limit_offset++;
-				str++;
+			bytes += charlen (ent->str + gt->off[j]);
+			if (bytes > WORDWRAP_LIMIT)
 				break;
-			case ATTR_HIDDEN:
-				if (xtext->ignore_hidden)
-					goto def;
-				hidden = !hidden;
-				limit_offset++;
-				str++;
+			if (is_del (ent->str[gt->off[j]]))
+			{
+				if (ent->str[gt->off[j]] == ' ')
+					bytes = gt->off[j] + 1 - start;
+				else
+					bytes = gt->off[j] - start;
+				if (bytes > 0)	/* otherwise fall back to character wrap */
+					ret = bytes;
 				break;
-			default:
-			def:
-				mbl = charlen (str);
-				char_width = backend_get_text_width_emph (xtext, str, mbl, emphasis);
-				if (!hidden) str_width += char_width;
-				if (str_width > win_width)
-				{
-					if (xtext->wordwrap)
-					{
-						if (str - last_space > WORDWRAP_LIMIT + limit_offset)
-							ret = str - orig_str; /* fall back to character wrap */
-						else
-						{
-							if (*last_space == ' ')
-								last_space++;
-							ret = last_space - orig_str;
-							if (ret == 0) /* fall back to character wrap */
-								ret = str - orig_str;
-						}
-						goto done;
-					}
-					ret = str - orig_str;
-					goto done;
-				}
-
-				/* keep a record of the last space, for wordwrapping */
-				if (is_del (*str))
-				{
-					last_space = str;
-					limit_offset = 0;
-				}
-
-				/* progress to the next char */
-				str += mbl;
-
 			}
 		}
-
-		if (str >= ent->str + ent->str_len)
-		{
-			ret = str - orig_str;
-			goto done;
-		}
 	}
 
 done:
@@ -3379,7 +3516,7 @@ gtk_xtext_find_subline (GtkXText *xtext, textentry *ent, int line)
 
 	if (line > 0)
 	{
-		rlen = GPOINTER_TO_UINT (g_slist_nth_data (ent->sublines, line - 1));
+		rlen = gtk_xtext_ent_subline_end (xtext->buffer, ent, line - 1);
 		if (rlen == 0)
 			rlen = ent->str_len;
 	}
@@ -3473,6 +3610,9 @@ gtk_xtext_render_line (GtkXText * xtext, textentry * ent, int line,
 	int indent, taken, entline, len, y, start_subline;
 	int emphasis = 0;
 
+	if (ent->needs_wrap)
+		gtk_xtext_ent_rewrap (xtext->buffer, ent);
+
 	entline = taken = 0;
 	str = ent->str;
 	indent = ent->indent;
@@ -3493,10 +3633,9 @@ gtk_xtext_render_line (GtkXText * xtext, textentry * ent, int line,
 	/* draw each line one by one */
 	do
 	{
+		len = gtk_xtext_ent_subline_end (xtext->buffer, ent, entline);
 		if (entline > 0)
-			len = GPOINTER_TO_INT (g_slist_nth_data (ent->sublines, entline)) - GPOINTER_TO_INT (g_slist_nth_data (ent->sublines, entline - 1));
-		else
-			len = GPOINTER_TO_INT (g_slist_nth_data (ent->sublines, entline));
+			len -= gtk_xtext_ent_subline_end (xtext->buffer, ent, entline - 1);
 
 		entline++;
 
@@ -3508,7 +3647,7 @@ gtk_xtext_render_line (GtkXText * xtext, textentry * ent, int line,
 			{
 				/* small optimization */
 				gtk_xtext_draw_marker (xtext, ent, y - xtext->fontsize * (taken + start_subline + 1));
-				return g_slist_length (ent->sublines) - subline;
+				return ent->nsublines - subline;
 			}
 		} else
 		{
@@ -3555,6 +3694,7 @@ gtk_xtext_set_palette (GtkXText * xtext, GdkRGBA palette[])
 	}
 	xtext->col_fore = XTEXT_FG;
 	xtext->col_back = XTEXT_BG;
+	xtext->palette_gen++;
 }
 
 static void
@@ -3585,7 +3725,8 @@ gtk_xtext_recalc_widths (xtext_buffer *buf, int do_str_width)
 	ent = buf->text_first;
 	while (ent)
 	{
-		if (do_str_width)
+		/* deferred entries get measured with the new font when laid out */
+		if (do_str_width && !ent->needs_measure)
 		{
 			ent->str_width = gtk_xtext_text_width_ent (buf->xtext, ent);
 		}
@@ -3604,6 +3745,26 @@ gtk_xtext_recalc_widths (xtext_buffer *buf, int do_str_width)
 	gtk_xtext_calc_lines (buf, FALSE);
 }
 
+/* drop the glyph tables of all of xtext's buffers, they are measured with
+ * a font that is gone now */
+
+static void
+gtk_xtext_glyphs_flush (GtkXText *xtext)
+{
+	xtext_buffer *buf;
+	textentry *ent;
+	GList *list;
+
+	for (list = buffers_lru; list; list = list->next)
+	{
+		buf = list->data;
+		if (buf->xtext != xtext)
+			continue;
+		for (ent = buf->text_first; ent; ent = ent->next)
+			gtk_xtext_ent_glyphs_free (ent);
+	}
+}
+
 int
 gtk_xtext_set_font (GtkXText *xtext, char *name)
 {
@@ -3617,6 +3778,8 @@ gtk_xtext_set_font (GtkXText *xtext, char *name)
 	backend_font_open (xtext, name);
 	if (xtext->font == NULL)
 		return FALSE;
+	xtext->font_gen++;
+	gtk_xtext_glyphs_flush (xtext);
 
 	{
 		char *time_str;
@@ -3673,50 +3836,577 @@ gtk_xtext_save (GtkXText * xtext, int fh)
 	}
 }
 
-/* count how many lines 'ent' will take (with wraps) */
+/* record the end offset of the next wrapped line of 'ent' */
 
-static int
-gtk_xtext_lines_taken (xtext_buffer *buf, textentry * ent)
+static void
+gtk_xtext_sublines_push (textentry *ent, int off)
 {
-	unsigned char *str;
-	int indent, len;
-	int win_width;
-
-	g_slist_free (ent->sublines);
-	ent->sublines = NULL;
-	win_width = buf->window_width - MARGIN;
-
-	if (win_width >= ent->indent + ent->str_width)
-	{
-		ent->sublines = g_slist_append (ent->sublines, GINT_TO_POINTER (ent->str_len));
-		return 1;
-	}
-
-	indent = ent->indent;
-	str = ent->str;
-
-	do
+	if (ent->nsublines == ent->sublines_size)
 	{
-		len = find_next_wrap (buf->xtext, ent, str, win_width, indent);
-		ent->sublines = g_slist_append (ent->sublines, GINT_TO_POINTER (str + len - ent->str));
-		indent = buf->indent;
-		str += len;
+		ent->sublines_size *= 2;
+		if (ent->sublines == ent->sublines_inline)
+		{
+			ent->sublines = g_new (guint16, ent->sublines_size);
+			memcpy (ent->sublines, ent->sublines_inline, sizeof (ent->sublines_inline));
+		}
+		else
+			ent->sublines = g_renew (guint16, ent->sublines, ent->sublines_size);
 	}
-	while (str < ent->str + ent->str_len);
-
-	return g_slist_length (ent->sublines);
+	ent->sublines[ent->nsublines++] = off;
 }
 
-/* Calculate number of actual lines (with wraps), to set adj->lower. *
- * This should only be called when the window resizes.               */
-
 static void
-gtk_xtext_calc_lines (xtext_buffer *buf, int fire_signal)
+gtk_xtext_sublines_init (textentry *ent)
 {
+	ent->sublines = ent->sublines_inline;
+	ent->sublines_size = SUBLINES_INLINE;
+	ent->nsublines = 0;
+}
+
+static void
+gtk_xtext_sublines_free (textentry *ent)
+{
+	if (ent->sublines != ent->sublines_inline)
+		g_free (ent->sublines);
+	gtk_xtext_sublines_init (ent);
+}
+
+/* Textentries are carved, together with their text, out of large chunks
+ * in append order. Scrollback is trimmed from the top, so chunks empty out
+ * in the same order and are released whole. */
+
+static gsize chunk_total;	/* chunk_bytes of all buffers together */
+
+struct xtext_chunk
+{
+	xtext_chunk *next;
+	xtext_chunk *prev;
+	gsize size;				/* usable bytes after the header */
+	gsize used;
+	int live;				/* entries in this chunk not yet freed */
+};
+
+static void
+gtk_xtext_chunk_release (xtext_buffer *buf, xtext_chunk *chunk)
+{
+	if (chunk == buf->chunk_last)
+	{
+		/* keep the tail around for the next appends */
+		chunk->used = 0;
+		return;
+	}
+
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		buf->chunk_first = chunk->next;
+	chunk->next->prev = chunk->prev;
+
+	buf->chunk_bytes -= chunk->size;
+	chunk_total -= chunk->size;
+	g_free (chunk);
+}
+
+static textentry *
+gtk_xtext_ent_alloc (xtext_buffer *buf, gsize len)
+{
+	xtext_chunk *chunk = buf->chunk_last;
 	textentry *ent;
+	gsize need;
+
+	need = CHUNK_ALIGN (sizeof (textentry) + len);
+
+	if (!chunk || chunk->size - chunk->used < need)
+	{
+		gsize size = MAX (CHUNK_SIZE - CHUNK_ALIGN (sizeof (xtext_chunk)), need);
+
+		chunk = g_malloc (CHUNK_ALIGN (sizeof (xtext_chunk)) + size);
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->live = 0;
+		chunk->next = NULL;
+		chunk->prev = buf->chunk_last;
+		if (buf->chunk_last)
+			buf->chunk_last->next = chunk;
+		else
+			buf->chunk_first = chunk;
+		buf->chunk_last = chunk;
+		buf->chunk_bytes += size;
+		chunk_total += size;
+	}
+
+	ent = (textentry *) ((char *) chunk + CHUNK_ALIGN (sizeof (xtext_chunk)) + chunk->used);
+	chunk->used += need;
+	chunk->live++;
+	ent->chunk = chunk;
+	ent->str = (unsigned char *) ent + sizeof (textentry);
+
+	return ent;
+}
+
+static void
+gtk_xtext_ent_free (xtext_buffer *buf, textentry *ent)
+{
+	xtext_chunk *chunk = ent->chunk;
+
+	g_slist_free_full (ent->slp, g_free);
+	gtk_xtext_ent_glyphs_free (ent);
+	gtk_xtext_ent_node_free (buf->xtext, ent);
+	gtk_xtext_sublines_free (ent);
+
+	if (--chunk->live == 0)
+		gtk_xtext_chunk_release (buf, chunk);
+}
+
+/* drop every entry at once, releasing whole chunks instead of one by one */
+
+static void
+gtk_xtext_ent_free_all (xtext_buffer *buf)
+{
+	textentry *ent;
+	xtext_chunk *chunk, *next;
+
+	for (ent = buf->text_first; ent; ent = ent->next)
+	{
+		g_slist_free_full (ent->slp, g_free);
+		gtk_xtext_ent_glyphs_free (ent);
+		gtk_xtext_ent_node_free (buf->xtext, ent);
+		gtk_xtext_sublines_free (ent);
+	}
+	buf->text_first = NULL;
+	buf->text_last = NULL;
+
+	for (chunk = buf->chunk_first; chunk; chunk = next)
+	{
+		next = chunk->next;
+		g_free (chunk);
+	}
+	buf->chunk_first = NULL;
+	buf->chunk_last = NULL;
+	chunk_total -= buf->chunk_bytes;
+	buf->chunk_bytes = 0;
+}
+
+/* bytes of scrollback held by 'buf', for /DEBUG and friends */
+
+gsize
+gtk_xtext_buffer_get_memory (xtext_buffer *buf)
+{
+	textentry *ent;
+	gsize bytes;
+
+	bytes = sizeof (xtext_buffer) + buf->chunk_bytes;
+	bytes += buf->index_size * (sizeof (textentry *) + sizeof (int));
+
+	for (ent = buf->text_first; ent; ent = ent->next)
+	{
+		if (ent->sublines != ent->sublines_inline)
+			bytes += ent->sublines_size * sizeof (guint16);
+		bytes += g_slist_length (ent->slp) * (sizeof (GSList) + sizeof (offlen_t));
+		if (ent->glyphs)
+			bytes += sizeof (glyph_table) + (ent->glyphs->n + 1) * (sizeof (int) + sizeof (guint16));
+	}
+
+	return bytes;
+}
+
+/* The indent of an entry appended to a hidden tab is only a guess, its left
+ * part gets measured along with the rest. The separator isn't moved from
+ * here; gtk_xtext_layout_deferred does that once the page is laid out. */
+
+static void
+gtk_xtext_ent_indent (xtext_buffer *buf, textentry *ent)
+{
+	int left_width, space;
+
+	left_width = gtk_xtext_text_width (buf->xtext, ent->str, ent->left_len);
+	ent->indent = (buf->indent - left_width) - buf->xtext->space_width;
+
+	space = buf->time_stamp ? buf->xtext->stamp_width : 0;
+	if (buf->xtext->auto_indent && ent->indent < MARGIN + space)
+		buf->indent_wanted = MAX (buf->indent_wanted,
+										  MARGIN + space + buf->xtext->space_width + left_width);
+
+	if (ent->indent < MARGIN)
+		ent->indent = MARGIN;
+}
+
+/* count how many lines 'ent' will take (with wraps) */
+
+static int
+gtk_xtext_lines_taken (xtext_buffer *buf, textentry * ent)
+{
+	unsigned char *str;
+	int indent, len;
+	int win_width;
+
+	if (ent->needs_measure)
+	{
+		ent->str_width = gtk_xtext_text_width_ent (buf->xtext, ent);
+		if (ent->left_len != -1)
+			gtk_xtext_ent_indent (buf, ent);
+		ent->needs_measure = FALSE;
+	}
+
+	ent->nsublines = 0;
+	win_width = buf->window_width - MARGIN;
+
+	if (win_width >= ent->indent + ent->str_width)
+	{
+		gtk_xtext_sublines_push (ent, ent->str_len);
+		return 1;
+	}
+
+	indent = ent->indent;
+	str = ent->str;
+
+	do
+	{
+		len = find_next_wrap (buf->xtext, ent, str, win_width, indent);
+		gtk_xtext_sublines_push (ent, str + len - ent->str);
+		indent = buf->indent;
+		str += len;
+	}
+	while (str < ent->str + ent->str_len);
+
+	return ent->nsublines;
+}
+
+/* ========================================= */
+/* ============ LINE INDEX ================= */
+/* ========================================= */
+
+/* Each entry owns a slot in buf->index_ents, in list order. The Fenwick tree
+ * holds the number of lines per slot, trimmed slots count as zero lines.
+ * Slots are only ever appended; the trimmed prefix is squeezed out when
+ * the arrays fill up. */
+
+static void
+gtk_xtext_index_update (xtext_buffer *buf, int slot, int delta)
+{
+	for (slot++; slot <= buf->index_size; slot += slot & -slot)
+		buf->index_tree[slot] += delta;
+}
+
+/* number of lines taken by all slots before 'slot' */
+
+static int
+gtk_xtext_index_prefix (xtext_buffer *buf, int slot)
+{
+	int lines = 0;
+
+	for (; slot > 0; slot -= slot & -slot)
+		lines += buf->index_tree[slot];
+
+	return lines;
+}
+
+/* rebuild the whole tree from the entries' line counts, O(n) */
+
+static void
+gtk_xtext_index_rebuild (xtext_buffer *buf)
+{
+	int i, j;
+
+	if (buf->index_size == 0)
+		return;
+
+	memset (buf->index_tree, 0, (buf->index_size + 1) * sizeof (int));
+	for (i = 1; i <= buf->index_size; i++)
+	{
+		if (i <= buf->index_len && buf->index_ents[i - 1])
+			buf->index_tree[i] += buf->index_ents[i - 1]->nsublines;
+		j = i + (i & -i);
+		if (j <= buf->index_size)
+			buf->index_tree[j] += buf->index_tree[i];
+	}
+}
+
+static void
+gtk_xtext_index_append (xtext_buffer *buf, textentry *ent)
+{
+	int i, live;
+
+	if (buf->index_len == buf->index_size)
+	{
+		live = buf->index_len - buf->index_first;
+
+		/* plenty of trimmed slots at the front? reuse them, else grow */
+		if (buf->index_size == 0 || buf->index_first < buf->index_size / 2)
+		{
+			buf->index_size = MAX (64, buf->index_size * 2);
+			buf->index_ents = g_renew (textentry *, buf->index_ents, buf->index_size);
+			buf->index_tree = g_renew (int, buf->index_tree, buf->index_size + 1);
+		}
+
+		memmove (buf->index_ents, buf->index_ents + buf->index_first,
+					live * sizeof (textentry *));
+		for (i = 0; i < live; i++)
+			buf->index_ents[i]->slot = i;
+		buf->index_first = 0;
+		buf->index_len = live;
+
+		ent->slot = buf->index_len++;
+		buf->index_ents[ent->slot] = ent;
+		gtk_xtext_index_rebuild (buf);
+		return;
+	}
+
+	ent->slot = buf->index_len++;
+	buf->index_ents[ent->slot] = ent;
+	gtk_xtext_index_update (buf, ent->slot, ent->nsublines);
+}
+
+static void
+gtk_xtext_index_remove (xtext_buffer *buf, textentry *ent)
+{
+	gtk_xtext_index_update (buf, ent->slot, -(int)ent->nsublines);
+	buf->index_ents[ent->slot] = NULL;
+
+	if (ent->slot == buf->index_first)
+		buf->index_first++;
+	else if (ent->slot == buf->index_len - 1)
+		buf->index_len--;
+
+	if (buf->index_first == buf->index_len)
+		buf->index_first = buf->index_len = 0;
+}
+
+static void
+gtk_xtext_index_free (xtext_buffer *buf)
+{
+	g_free (buf->index_ents);
+	g_free (buf->index_tree);
+	buf->index_ents = NULL;
+	buf->index_tree = NULL;
+	buf->index_first = buf->index_len = buf->index_size = 0;
+}
+
+/* line number at which 'ent' starts */
+
+static int
+gtk_xtext_ent_line (xtext_buffer *buf, textentry *ent)
+{
+	return gtk_xtext_index_prefix (buf, ent->slot);
+}
+
+/* guess how many lines 'ent' takes at the current width without measuring */
+
+static int
+gtk_xtext_lines_estimate (xtext_buffer *buf, textentry *ent)
+{
+	int win_width, line_width, rest;
+
+	win_width = buf->window_width - MARGIN;
+	if (win_width < 1 || win_width >= ent->indent + ent->str_width)
+		return 1;
+
+	rest = ent->indent + ent->str_width - win_width;
+	line_width = MAX (win_width - buf->indent, 1);
+
+	return 1 + (rest + line_width - 1) / line_width;
+}
+
+/* forget how 'ent' was wrapped and guess its line count instead */
+
+static void
+gtk_xtext_ent_estimate (xtext_buffer *buf, textentry *ent)
+{
+	gtk_xtext_sublines_free (ent);
+	ent->needs_wrap = TRUE;
+	ent->nsublines = gtk_xtext_lines_estimate (buf, ent);
+}
+
+/* wrap an entry that only had an estimated line count, keeping the index,
+ * the page top and the scroll range in sync */
+
+static void
+gtk_xtext_ent_rewrap (xtext_buffer *buf, textentry *ent)
+{
+	GtkAdjustment *adj = buf->xtext->adj;
+	int delta = ent->nsublines;
+
+	ent->needs_wrap = FALSE;
+	gtk_xtext_lines_taken (buf, ent);
+
+	delta = ent->nsublines - delta;
+	if (delta == 0)
+		return;
+
+	gtk_xtext_index_update (buf, ent->slot, delta);
+	buf->num_lines += delta;
+
+	if (buf->pagetop_ent == ent && buf->pagetop_subline >= ent->nsublines)
+		buf->pagetop_subline = ent->nsublines - 1;
+
+	if (buf->xtext->buffer != buf)
+		return;
+
+	/* lines above the page top moved, so the view follows its text */
+	if (buf->pagetop_ent && ent->slot < buf->pagetop_ent->slot && !buf->scrollbar_down)
+	{
+		buf->pagetop_line += delta;
+		buf->old_value += delta;
+		buf->xtext->select_start_adj += delta;
+		g_signal_handler_block (adj, buf->xtext->vc_signal_tag);
+		gtk_adjustment_set_value (adj, gtk_adjustment_get_value (adj) + delta);
+		g_signal_handler_unblock (adj, buf->xtext->vc_signal_tag);
+	}
+
+	/* This may run while a frame is drawn, so the scroll range is set by
+	 * the background pass, which also keeps the bottom pinned. */
+	if (!buf->wrap_next)
+		buf->wrap_next = ent;
+	gtk_xtext_rewrap_start (buf);
+}
+
+/* where wrapped line 'k' of 'ent' ends, wrapping 'ent' first if its line
+ * count is only an estimate */
+
+static int
+gtk_xtext_ent_subline_end (xtext_buffer *buf, textentry *ent, int k)
+{
+	if (ent->needs_wrap)
+		gtk_xtext_ent_rewrap (buf, ent);
+
+	return k < ent->nsublines ? ent->sublines[k] : ent->str_len;
+}
+
+static gboolean
+gtk_xtext_rewrap_idle (gpointer data)
+{
+	xtext_buffer *buf = data;
+	GtkXText *xtext = buf->xtext;
+	GtkAdjustment *adj = xtext->adj;
+	textentry *top = NULL;
+	gint64 start;
+	int subline = 0;
+
+	/* buffers of hidden tabs are finished off when they are shown again */
+	if (xtext->buffer != buf)
+	{
+		buf->wrap_tag = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	/* keep the top of the page in place while the lines above it change */
+	if (!buf->scrollbar_down)
+		top = gtk_xtext_nth (xtext, gtk_adjustment_get_value (adj), &subline);
+
+	start = g_get_monotonic_time ();
+	while (buf->wrap_next && g_get_monotonic_time () - start < REWRAP_SLICE)
+	{
+		if (buf->wrap_next->needs_wrap)
+			gtk_xtext_ent_rewrap (buf, buf->wrap_next);
+		buf->wrap_next = buf->wrap_next->prev;
+	}
+
+	buf->pagetop_ent = NULL;
+	g_signal_handler_block (adj, xtext->vc_signal_tag);
+	gtk_xtext_adjustment_set (buf, FALSE);
+	if (buf->scrollbar_down)
+		gtk_adjustment_set_value (adj, gtk_adjustment_get_upper (adj) -
+										  gtk_adjustment_get_page_size (adj));
+	else if (top)
+		gtk_adjustment_set_value (adj, gtk_xtext_ent_line (buf, top) + subline);
+	g_signal_handler_unblock (adj, xtext->vc_signal_tag);
+	buf->old_value = gtk_adjustment_get_value (adj);
+
+	if (buf->wrap_next)
+		return G_SOURCE_CONTINUE;
+
+	buf->wrap_tag = 0;
+	gtk_widget_queue_draw (GTK_WIDGET (xtext));
+	return G_SOURCE_REMOVE;
+}
+
+static void
+gtk_xtext_rewrap_start (xtext_buffer *buf)
+{
+	if (buf->wrap_next && !buf->wrap_tag && buf->xtext->buffer == buf)
+		buf->wrap_tag = g_idle_add_full (G_PRIORITY_LOW, gtk_xtext_rewrap_idle, buf, NULL);
+}
+
+static void
+gtk_xtext_rewrap_stop (xtext_buffer *buf)
+{
+	if (buf->wrap_tag)
+	{
+		g_source_remove (buf->wrap_tag);
+		buf->wrap_tag = 0;
+	}
+}
+
+/* Lay out the lines appended while this buffer was hidden: the page that
+ * is about to be shown right away, everything above it in the background. */
+
+static void
+gtk_xtext_layout_deferred (xtext_buffer *buf)
+{
+	GtkAdjustment *adj = buf->xtext->adj;
+	textentry *ent, *anchor = NULL;
+	int lines, page;
+	int subline = 0;
+
+	buf->has_deferred = FALSE;
+
+	if (!buf->scrollbar_down)
+		anchor = gtk_xtext_nth (buf->xtext, gtk_adjustment_get_value (adj), &subline);
+	if (anchor == NULL)
+		anchor = buf->text_last;
+
+	page = gtk_adjustment_get_page_size (adj) + 1;
+	for (ent = anchor, lines = 0; ent && lines < page; ent = ent->next)
+	{
+		if (ent->needs_wrap)
+			gtk_xtext_ent_rewrap (buf, ent);
+		lines += ent->nsublines;
+	}
+	for (ent = anchor ? anchor->prev : NULL, lines = 0; ent && lines < page; ent = ent->prev)
+	{
+		if (ent->needs_wrap)
+			gtk_xtext_ent_rewrap (buf, ent);
+		lines += ent->nsublines;
+	}
+
+	buf->pagetop_ent = NULL;
+	gtk_xtext_adjustment_set (buf, FALSE);
+	if (buf->scrollbar_down)
+		gtk_adjustment_set_value (adj, gtk_adjustment_get_upper (adj) -
+										  gtk_adjustment_get_page_size (adj));
+	else if (anchor)
+		gtk_adjustment_set_value (adj, gtk_xtext_ent_line (buf, anchor) +
+										  MIN (subline, anchor->nsublines - 1));
+	buf->old_value = gtk_adjustment_get_value (adj);
+
+	/* the background pass skips whatever is already wrapped */
+	buf->wrap_next = buf->text_last;
+
+	/* a nick measured just now may need the separator moved */
+	if (buf->indent_wanted > buf->indent && buf->indent < buf->xtext->max_auto_indent)
+	{
+		buf->indent = MIN (buf->indent_wanted, buf->xtext->max_auto_indent);
+		gtk_xtext_fix_indent (buf);
+		gtk_xtext_recalc_widths (buf, FALSE);
+		buf->xtext->force_render = TRUE;
+	}
+	buf->indent_wanted = 0;
+}
+
+/* Calculate number of actual lines (with wraps), to set adj->lower.  *
+ * Only the page around the current scroll position is wrapped here;  *
+ * everything else gets an estimate and is wrapped in the background. */
+
+static void
+gtk_xtext_calc_lines (xtext_buffer *buf, int fire_signal)
+{
+	textentry *ent, *anchor = NULL;
+	GtkAdjustment *adj = buf->xtext->adj;
+	gboolean shown = buf->xtext->buffer == buf;
 	int width;
 	int height;
-	int lines;
+	int lines, page;
+	int subline = 0;
 
 	height = gtk_widget_get_height (GTK_WIDGET (buf->xtext));
 	width = gtk_widget_get_width (GTK_WIDGET (buf->xtext));
@@ -3725,17 +4415,45 @@ gtk_xtext_calc_lines (xtext_buffer *buf, int fire_signal)
 	if (width < 30 || height < buf->xtext->fontsize || width < buf->indent + 30)
 		return;
 
-	lines = 0;
-	ent = buf->text_first;
-	while (ent)
+	gtk_xtext_rewrap_stop (buf);
+
+	/* remember what's at the top of the page before the line counts change */
+	if (shown && !buf->scrollbar_down)
+		anchor = gtk_xtext_nth (buf->xtext, gtk_adjustment_get_value (adj), &subline);
+	if (anchor == NULL)
+		anchor = buf->text_last;
+
+	for (ent = buf->text_first; ent; ent = ent->next)
+		gtk_xtext_ent_estimate (buf, ent);
+
+	/* wrap the visible page and its neighbours right away */
+	if (shown)
 	{
-		lines += gtk_xtext_lines_taken (buf, ent);
-		ent = ent->next;
+		page = height / buf->xtext->fontsize + 1;
+		for (ent = anchor, lines = 0; ent && lines < page * 2; ent = ent->next)
+		{
+			ent->needs_wrap = FALSE;
+			lines += gtk_xtext_lines_taken (buf, ent);
+		}
+		for (ent = anchor ? anchor->prev : NULL, lines = 0; ent && lines < page * 2; ent = ent->prev)
+		{
+			ent->needs_wrap = FALSE;
+			lines += gtk_xtext_lines_taken (buf, ent);
+		}
 	}
 
+	gtk_xtext_index_rebuild (buf);
+
 	buf->pagetop_ent = NULL;
-	buf->num_lines = lines;
+	buf->num_lines = gtk_xtext_index_prefix (buf, buf->index_size);
 	gtk_xtext_adjustment_set (buf, fire_signal);
+
+	if (shown && anchor && !buf->scrollbar_down)
+		gtk_adjustment_set_value (adj, gtk_xtext_ent_line (buf, anchor) +
+										  MIN (subline, anchor->nsublines - 1));
+
+	buf->wrap_next = buf->text_last;
+	gtk_xtext_rewrap_start (buf);
 }
 
 /* find the n-th line in the linked list, this includes wrap calculations */
@@ -3743,58 +4461,36 @@ gtk_xtext_calc_lines (xtext_buffer *buf, int fire_signal)
 static textentry *
 gtk_xtext_nth (GtkXText *xtext, int line, int *subline)
 {
-	int lines = 0;
-	textentry *ent;
+	xtext_buffer *buf = xtext->buffer;
+	int pos, step;
 
-	ent = xtext->buffer->text_first;
+	if (line < 0 || buf->index_size == 0)
+		return NULL;
 
-	/* -- optimization -- try to make a short-cut using the pagetop ent */
-	if (xtext->buffer->pagetop_ent)
+	/* -- optimization -- the pagetop ent is asked for on every render */
+	if (buf->pagetop_ent && line == buf->pagetop_line)
 	{
-		if (line == xtext->buffer->pagetop_line)
-		{
-			*subline = xtext->buffer->pagetop_subline;
-			return xtext->buffer->pagetop_ent;
-		}
-		if (line > xtext->buffer->pagetop_line)
-		{
-			/* lets start from the pagetop instead of the absolute beginning */
-			ent = xtext->buffer->pagetop_ent;
-			lines = xtext->buffer->pagetop_line - xtext->buffer->pagetop_subline;
-		}
-		else if (line > xtext->buffer->pagetop_line - line)
-		{
-			/* move backwards from pagetop */
-			ent = xtext->buffer->pagetop_ent;
-			lines = xtext->buffer->pagetop_line - xtext->buffer->pagetop_subline;
-			while (1)
-			{
-				if (lines <= line)
-				{
-					*subline = line - lines;
-					return ent;
-				}
-				ent = ent->prev;
-				if (!ent)
-					break;
-				lines -= g_slist_length (ent->sublines);
-			}
-			return NULL;
-		}
+		*subline = buf->pagetop_subline;
+		return buf->pagetop_ent;
 	}
-	/* -- end of optimization -- */
 
-	while (ent)
+	/* descend the tree to the last slot starting at or before 'line' */
+	pos = 0;
+	for (step = 1; step * 2 <= buf->index_size; step *= 2);
+	for (; step; step /= 2)
 	{
-		lines += g_slist_length (ent->sublines);
-		if (lines > line)
+		if (pos + step <= buf->index_size && buf->index_tree[pos + step] <= line)
 		{
-			*subline = g_slist_length (ent->sublines) - (lines - line);
-			return ent;
+			pos += step;
+			line -= buf->index_tree[pos];
 		}
-		ent = ent->next;
 	}
-	return NULL;
+
+	if (pos >= buf->index_len || buf->index_ents[pos] == NULL)
+		return NULL;
+
+	*subline = line;
+	return buf->index_ents[pos];
 }
 
 /* render enta (or an inclusive range enta->entb) */
@@ -3878,7 +4574,7 @@ gtk_xtext_render_ents (GtkXText * xtext, textentry * enta, textentry * entb)
 				line -= subline;
 				subline = 0;
 			}
-			line += g_slist_length (ent->sublines);
+			line += ent->nsublines;
 		}
 
 		if (ent == entb)
@@ -3903,6 +4599,185 @@ gtk_xtext_render_ents (GtkXText * xtext, textentry * enta, textentry * entb)
 	return result;
 }
 
+/* What a retained line node was drawn with. If any of it changes, the
+ * entry has to be rendered again. */
+
+typedef struct
+{
+	int width;
+	guint font_gen;
+	guint palette_gen;
+	int indent;
+	int ent_indent;
+	int nsublines;
+	int mark_start;
+	int mark_end;
+	int hilight_start;
+	int hilight_end;
+	int flags;
+} node_key;
+
+#define NODE_STAMP		1
+#define NODE_MARK_STAMP	2
+#define NODE_MARKER_ABOVE	4
+#define NODE_MARKER_BELOW	8
+#define NODE_UN_HILIGHT	16
+
+struct ent_node
+{
+	GskRenderNode *node;
+	node_key key;
+	guint frame;			/* xtext->node_frame it was last drawn in */
+};
+
+static void
+gtk_xtext_ent_node_free (GtkXText *xtext, textentry *ent)
+{
+	if (!ent->node)
+		return;
+
+	gsk_render_node_unref (ent->node->node);
+	g_free (ent->node);
+	ent->node = NULL;
+	g_ptr_array_remove_fast (xtext->node_ents, ent);
+}
+
+/* drop the nodes of entries that have scrolled off the page */
+
+static void
+gtk_xtext_ent_node_sweep (GtkXText *xtext)
+{
+	textentry *ent;
+	guint i = 0;
+
+	if (!xtext->node_ents)
+		return;
+
+	while (i < xtext->node_ents->len)
+	{
+		ent = g_ptr_array_index (xtext->node_ents, i);
+		if (ent->node->frame != xtext->node_frame)
+			gtk_xtext_ent_node_free (xtext, ent);
+		else
+			i++;
+	}
+}
+
+static void
+gtk_xtext_ent_node_key (GtkXText *xtext, textentry *ent, int win_width, node_key *key)
+{
+	memset (key, 0, sizeof (*key));
+	key->width = win_width;
+	key->font_gen = xtext->font_gen;
+	key->palette_gen = xtext->palette_gen;
+	key->indent = xtext->buffer->indent;
+	key->ent_indent = ent->indent;
+	key->nsublines = ent->nsublines;
+	key->mark_start = ent->mark_start;
+	key->mark_end = ent->mark_end;
+	key->hilight_start = -1;
+	key->hilight_end = -1;
+	if (xtext->hilight_ent == ent)
+	{
+		key->hilight_start = xtext->hilight_start;
+		key->hilight_end = xtext->hilight_end;
+		if (xtext->un_hilight)
+			key->flags |= NODE_UN_HILIGHT;
+	}
+	if (xtext->auto_indent && xtext->buffer->time_stamp &&
+		 (!xtext->skip_stamp || xtext->mark_stamp || xtext->force_stamp))
+		key->flags |= NODE_STAMP;
+	if (xtext->mark_stamp)
+		key->flags |= NODE_MARK_STAMP;
+	if (xtext->marker && xtext->buffer->marker_pos == ent)
+		key->flags |= NODE_MARKER_ABOVE;
+	if (xtext->marker && ent->next && xtext->buffer->marker_pos == ent->next)
+		key->flags |= NODE_MARKER_BELOW;
+}
+
+/* render all of 'ent' into a node of its own, at line 0 */
+
+static GskRenderNode *
+gtk_xtext_ent_node_build (GtkXText *xtext, textentry *ent, int win_width)
+{
+	GtkSnapshot *snapshot;
+	graphene_rect_t bounds;
+	cairo_t *cr;
+	int pixel_offset;
+
+	snapshot = gtk_snapshot_new ();
+	graphene_rect_init (&bounds, 0, 0, win_width + MARGIN,
+							  ent->nsublines * xtext->fontsize);
+
+	cr = xtext->cr;
+	pixel_offset = xtext->pixel_offset;
+	xtext->cr = gtk_snapshot_append_cairo (snapshot, &bounds);
+	xtext->pixel_offset = 0;
+
+	gtk_xtext_reset (xtext, FALSE, TRUE);
+	gtk_xtext_render_line (xtext, ent, 0, ent->nsublines, 0, win_width);
+
+	cairo_destroy (xtext->cr);
+	xtext->cr = cr;
+	xtext->pixel_offset = pixel_offset;
+
+	return gtk_snapshot_free_to_node (snapshot);
+}
+
+/* append 'ent' to the frame being snapshotted, from its retained node when
+ * nothing it depends on has changed */
+
+static int
+gtk_xtext_render_line_node (GtkXText *xtext, textentry *ent, int line,
+									 int subline, int win_width)
+{
+	GskRenderNode *node;
+	node_key key;
+	graphene_point_t pos;
+
+	if (ent->needs_wrap)
+		gtk_xtext_ent_rewrap (xtext->buffer, ent);
+
+	gtk_xtext_ent_node_key (xtext, ent, win_width, &key);
+
+	/* search matches are drawn from state that isn't in the key */
+	if (ent->marks || xtext->jump_in_offset || xtext->jump_out_offset)
+	{
+		gtk_xtext_ent_node_free (xtext, ent);
+		node = gtk_xtext_ent_node_build (xtext, ent, win_width);
+	}
+	else
+	{
+		if (ent->node && memcmp (&ent->node->key, &key, sizeof (key)) != 0)
+			gtk_xtext_ent_node_free (xtext, ent);
+
+		if (!ent->node)
+		{
+			if (!xtext->node_ents)
+				xtext->node_ents = g_ptr_array_new ();
+			ent->node = g_new (struct ent_node, 1);
+			ent->node->node = gtk_xtext_ent_node_build (xtext, ent, win_width);
+			ent->node->key = key;
+			g_ptr_array_add (xtext->node_ents, ent);
+		}
+		ent->node->frame = xtext->node_frame;
+		node = ent->node->node ? gsk_render_node_ref (ent->node->node) : NULL;
+	}
+
+	if (node)
+	{
+		pos.x = 0;
+		pos.y = xtext->fontsize * (line - subline) - xtext->pixel_offset;
+		gtk_snapshot_save (xtext->snapshot);
+		gtk_snapshot_translate (xtext->snapshot, &pos);
+		gtk_snapshot_append_node (xtext->snapshot, node);
+		gtk_snapshot_restore (xtext->snapshot);
+		gsk_render_node_unref (node);
+	}
+
+	return ent->nsublines - subline;
+}
+
 /* render a whole page/window, starting from 'startline' */
 
 static void
@@ -3921,7 +4796,7 @@ gtk_xtext_render_page (GtkXText * xtext)
 	  return;
 
 	/* GTK4: Can't render outside snapshot - if no cr, just return and rely on queue_draw */
-	if (xtext->cr == NULL)
+	if (xtext->cr == NULL && xtext->snapshot == NULL)
 		return;
 	width = gtk_widget_get_width (GTK_WIDGET (xtext));
 	height = gtk_widget_get_height (GTK_WIDGET (xtext));
@@ -3961,11 +4836,21 @@ gtk_xtext_render_page (GtkXText * xtext)
 	width -= MARGIN;
 	lines_max = ((height + xtext->pixel_offset) / xtext->fontsize) + 1;
 
+	if (xtext->snapshot)
+		xtext->node_frame++;
+
 	while (ent)
 	{
-		gtk_xtext_reset (xtext, FALSE, TRUE);
-		line += gtk_xtext_render_line (xtext, ent, line, lines_max,
-												 subline, width);
+		if (xtext->snapshot)
+		{
+			line += gtk_xtext_render_line_node (xtext, ent, line, subline, width);
+		}
+		else
+		{
+			gtk_xtext_reset (xtext, FALSE, TRUE);
+			line += gtk_xtext_render_line (xtext, ent, line, lines_max,
+													 subline, width);
+		}
 		subline = 0;
 
 		if (line >= lines_max)
@@ -3974,12 +4859,29 @@ gtk_xtext_render_page (GtkXText * xtext)
 		ent = ent->next;
 	}
 
+	if (xtext->snapshot)
+	{
+		graphene_rect_t bounds;
+
+		gtk_xtext_ent_node_sweep (xtext);
+
+		/* background and separator go on top of the line nodes */
+		graphene_rect_init (&bounds, 0, 0, width + MARGIN, height);
+		xtext->cr = gtk_snapshot_append_cairo (xtext->snapshot, &bounds);
+	}
+
 	line = (xtext->fontsize * line) - xtext->pixel_offset;
 	/* fill any space below the last line with our background GC */
 	xtext_draw_bg (xtext, 0, line, width + MARGIN, height - line);
 
 	/* draw the separator line */
 	gtk_xtext_draw_sep (xtext, -1);
+
+	if (xtext->snapshot)
+	{
+		cairo_destroy (xtext->cr);
+		xtext->cr = NULL;
+	}
 }
 
 void
@@ -4030,10 +4932,10 @@ gtk_xtext_kill_ent (xtext_buffer *buffer, textentry *ent)
 		gtk_xtext_search_textentry_del (buffer, ent);
 	}
 
-	g_slist_free_full (ent->slp, g_free);
-	g_slist_free (ent->sublines);
+	if (buffer->wrap_next == ent)
+		buffer->wrap_next = ent->prev;
 
-	g_free (ent);
+	gtk_xtext_ent_free (buffer, ent);
 	return visible;
 }
 
@@ -4047,41 +4949,30 @@ gtk_xtext_remove_top (xtext_buffer *buffer)
 	ent = buffer->text_first;
 	if (!ent)
 		return;
-	buffer->num_lines -= g_slist_length (ent->sublines);
-	buffer->pagetop_line -= g_slist_length (ent->sublines);
-	buffer->last_pixel_pos -= (g_slist_length (ent->sublines) * buffer->xtext->fontsize);
+	gtk_xtext_index_remove (buffer, ent);
+	buffer->num_lines -= ent->nsublines;
+	buffer->pagetop_line -= ent->nsublines;
+	buffer->last_pixel_pos -= (ent->nsublines * buffer->xtext->fontsize);
 	buffer->text_first = ent->next;
 	if (buffer->text_first)
 		buffer->text_first->prev = NULL;
 	else
 		buffer->text_last = NULL;
 
-	buffer->old_value -= g_slist_length (ent->sublines);
+	buffer->old_value -= ent->nsublines;
 	if (buffer->xtext->buffer == buffer)	/* is it the current buffer? */
 	{
 		g_signal_handler_block (buffer->xtext->adj, buffer->xtext->vc_signal_tag);
 		gtk_adjustment_set_value (buffer->xtext->adj,
-			gtk_adjustment_get_value (buffer->xtext->adj) - g_slist_length (ent->sublines));
+			gtk_adjustment_get_value (buffer->xtext->adj) - ent->nsublines);
 		g_signal_handler_unblock (buffer->xtext->adj, buffer->xtext->vc_signal_tag);
-		buffer->xtext->select_start_adj -= g_slist_length (ent->sublines);
+		buffer->xtext->select_start_adj -= ent->nsublines;
 	}
 
 	if (gtk_xtext_kill_ent (buffer, ent))
 	{
-		if (!buffer->xtext->add_io_tag)
-		{
-			/* remove scrolling events */
-			if (buffer->xtext->io_tag)
-			{
-				g_source_remove (buffer->xtext->io_tag);
-				buffer->xtext->io_tag = 0;
-			}
-			buffer->xtext->force_render = TRUE;
-			buffer->xtext->add_io_tag = g_timeout_add (REFRESH_TIMEOUT * 2,
-														(GSourceFunc)
-														gtk_xtext_render_page_timeout,
-														buffer->xtext);
-		}
+		buffer->xtext->force_render = TRUE;
+		gtk_xtext_invalidate (buffer->xtext, XTEXT_DIRTY_LINES);
 	}
 }
 
@@ -4093,7 +4984,8 @@ gtk_xtext_remove_bottom (xtext_buffer *buffer)
 	ent = buffer->text_last;
 	if (!ent)
 		return;
-	buffer->num_lines -= g_slist_length (ent->sublines);
+	gtk_xtext_index_remove (buffer, ent);
+	buffer->num_lines -= ent->nsublines;
 	buffer->text_last = ent->prev;
 	if (buffer->text_last)
 		buffer->text_last->next = NULL;
@@ -4102,20 +4994,8 @@ gtk_xtext_remove_bottom (xtext_buffer *buffer)
 
 	if (gtk_xtext_kill_ent (buffer, ent))
 	{
-		if (!buffer->xtext->add_io_tag)
-		{
-			/* remove scrolling events */
-			if (buffer->xtext->io_tag)
-			{
-				g_source_remove (buffer->xtext->io_tag);
-				buffer->xtext->io_tag = 0;
-			}
-			buffer->xtext->force_render = TRUE;
-			buffer->xtext->add_io_tag = g_timeout_add (REFRESH_TIMEOUT * 2,
-														(GSourceFunc)
-														gtk_xtext_render_page_timeout,
-														buffer->xtext);
-		}
+		buffer->xtext->force_render = TRUE;
+		gtk_xtext_invalidate (buffer->xtext, XTEXT_DIRTY_LINES);
 	}
 }
 
@@ -4124,9 +5004,10 @@ gtk_xtext_remove_bottom (xtext_buffer *buffer)
 void
 gtk_xtext_clear (xtext_buffer *buf, int lines)
 {
-	textentry *next;
 	int marker_reset = FALSE;
 
+	gtk_xtext_buffer_unspill (buf);
+
 	if (lines != 0)
 	{
 		if (lines < 0)
@@ -4164,17 +5045,13 @@ gtk_xtext_clear (xtext_buffer *buf, int lines)
 		buf->last_ent_start = NULL;
 		buf->last_ent_end = NULL;
 		buf->marker_pos = NULL;
+		buf->wrap_next = NULL;
 		if (buf->text_first)
 			marker_reset = TRUE;
 		dontscroll (buf);
 
-		while (buf->text_first)
-		{
-			next = buf->text_first->next;
-			g_free (buf->text_first);
-			buf->text_first = next;
-		}
-		buf->text_last = NULL;
+		gtk_xtext_ent_free_all (buf);
+		gtk_xtext_index_free (buf);
 	}
 
 	if (buf->xtext->buffer == buf)
@@ -4206,28 +5083,21 @@ gtk_xtext_check_ent_visibility (GtkXText * xtext, textentry *find_ent, int add)
 	height = gtk_widget_get_height (GTK_WIDGET (xtext));
 
 	ent = buf->pagetop_ent;
+	if (ent == NULL || find_ent->slot < ent->slot)
+	{
+		return FALSE;
+	}
 	/* If top line not completely displayed return FALSE */
 	if (ent == find_ent && buf->pagetop_subline > 0)
 	{
 		return FALSE;
 	}
-	/* Loop through line positions looking for find_ent */
+	/* Does find_ent end within the page? */
 	lines = ((height + xtext->pixel_offset) / xtext->fontsize) + buf->pagetop_subline + add;
-	while (ent)	
-	{
-		lines -= g_slist_length (ent->sublines);
-		if (lines <= 0)
-		{
-			return FALSE;
-		}
-		if (ent == find_ent)
-		{
-			return TRUE;
-		}
-		ent = ent->next;
-	}
+	lines -= gtk_xtext_ent_line (buf, find_ent) - gtk_xtext_ent_line (buf, ent);
+	lines -= find_ent->nsublines;
 
-	return FALSE;
+	return lines > 0;
 }
 
 void
@@ -4599,18 +5469,15 @@ gtk_xtext_search (GtkXText * xtext, const gchar *text, gtk_xtext_search_flags fl
 		float value;
 
 		buf->pagetop_ent = NULL;
-		for (value = 0, ent = buf->text_first;
-			  ent && ent != buf->hintsearch; ent = ent->next)
-		{
-			value += g_slist_length (ent->sublines);
-		}
+		ent = buf->hintsearch;
+		value = ent ? gtk_xtext_ent_line (buf, ent) : buf->num_lines;
 		if (value > gtk_adjustment_get_upper (adj) - gtk_adjustment_get_page_size (adj))
 		{
 			value = gtk_adjustment_get_upper (adj) - gtk_adjustment_get_page_size (adj);
 		}
 		else if ((flags & backward)  && ent)
 		{
-			value -= gtk_adjustment_get_page_size (adj) - g_slist_length (ent->sublines);
+			value -= gtk_adjustment_get_page_size (adj) - ent->nsublines;
 			if (value < 0)
 			{
 				value = 0;
@@ -4627,20 +5494,19 @@ gtk_xtext_search (GtkXText * xtext, const gchar *text, gtk_xtext_search_flags fl
 #undef FIRSTLAST
 #undef NEXTPREVIOUS
 
-static int
-gtk_xtext_render_page_timeout (GtkXText * xtext)
+/* lines were appended or trimmed: bring the scrollbar up to date, and
+ * tell whether the page needs drawing */
+
+static gboolean
+gtk_xtext_lines_changed (GtkXText * xtext)
 {
 	GtkAdjustment *adj = xtext->adj;
 
-	xtext->add_io_tag = 0;
-
 	/* less than a complete page? */
 	if (xtext->buffer->num_lines <= gtk_adjustment_get_page_size (adj))
 	{
 		xtext->buffer->old_value = 0;
 		gtk_adjustment_set_value (adj, 0);
-		/* GTK3: Queue a redraw instead of rendering directly */
-		gtk_widget_queue_draw (GTK_WIDGET (xtext));
 	} else if (xtext->buffer->scrollbar_down)
 	{
 		g_signal_handler_block (xtext->adj, xtext->vc_signal_tag);
@@ -4648,20 +5514,495 @@ gtk_xtext_render_page_timeout (GtkXText * xtext)
 		gtk_adjustment_set_value (adj, gtk_adjustment_get_upper (adj) - gtk_adjustment_get_page_size (adj));
 		g_signal_handler_unblock (xtext->adj, xtext->vc_signal_tag);
 		xtext->buffer->old_value = gtk_adjustment_get_value (adj);
-		/* GTK3: Queue a redraw instead of rendering directly */
-		gtk_widget_queue_draw (GTK_WIDGET (xtext));
 	} else
 	{
 		gtk_xtext_adjustment_set (xtext->buffer, TRUE);
-		if (xtext->force_render)
+		if (!xtext->force_render)
+			return FALSE;
+		xtext->force_render = FALSE;
+	}
+
+	return TRUE;
+}
+
+/* the width changed: re-wrap, and stay at the bottom if we were there */
+
+static void
+gtk_xtext_width_changed (GtkXText * xtext)
+{
+	gtk_xtext_calc_lines (xtext->buffer, FALSE);
+
+	if (xtext->buffer->scrollbar_down)
+	{
+		gtk_adjustment_set_value (xtext->adj,
+			gtk_adjustment_get_upper (xtext->adj) -
+			gtk_adjustment_get_page_size (xtext->adj));
+	}
+}
+
+/* start a new second of skipped_renders once the last one is over; a
+ * count from longer ago than that is stale, nothing has been late since */
+
+static void
+gtk_xtext_skipped_roll (GtkXText *xtext, gint64 now)
+{
+	if (now - xtext->skipped_since < G_USEC_PER_SEC)
+		return;
+
+	if (now - xtext->skipped_since < 2 * G_USEC_PER_SEC)
+		xtext->skipped_per_sec = xtext->skipped_renders;
+	else
+		xtext->skipped_per_sec = 0;
+	xtext->skipped_renders = 0;
+	xtext->skipped_since = now;
+}
+
+/* Everything that needs the page redrawn is collected in xtext->dirty and
+ * handled once, at the start of the next frame. Appends, trims, scrolls
+ * and resizes that arrive in between cost nothing extra. */
+
+static gboolean
+gtk_xtext_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+	GtkXText *xtext = GTK_XTEXT (widget);
+	gint64 late = 0;
+	int dirty = xtext->dirty;
+	gboolean redraw;
+
+	xtext->dirty = 0;
+	xtext->tick_id = 0;
+
+	/* the frame after the one we asked in is on time, any further is dropped;
+	 * asked before we had a clock, we only waited to be shown */
+	if (xtext->tick_frame >= 0)
+		late = gdk_frame_clock_get_frame_counter (clock) - xtext->tick_frame - 1;
+	gtk_xtext_skipped_roll (xtext, gdk_frame_clock_get_frame_time (clock));
+	if (late > 0)
+		xtext->skipped_renders += late;
+
+	redraw = (dirty & (XTEXT_DIRTY_DRAW | XTEXT_DIRTY_WIDTH)) != 0;
+
+	if (dirty & XTEXT_DIRTY_WIDTH)
+		gtk_xtext_width_changed (xtext);
+	if ((dirty & XTEXT_DIRTY_LINES) && gtk_xtext_lines_changed (xtext))
+		redraw = TRUE;
+
+	if (redraw)
+		gtk_widget_queue_draw (widget);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+gtk_xtext_invalidate (GtkXText *xtext, int what)
+{
+	GdkFrameClock *clock;
+
+	xtext->dirty |= what;
+
+	/* a frame is already on its way, this rides along */
+	if (xtext->tick_id)
+		return;
+
+	clock = gtk_widget_get_frame_clock (GTK_WIDGET (xtext));
+	xtext->tick_frame = clock ? gdk_frame_clock_get_frame_counter (clock) : -1;
+	xtext->tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (xtext),
+																  gtk_xtext_tick, NULL, NULL);
+}
+
+/* how many frames per second a redraw came later than the next one */
+
+int
+gtk_xtext_get_skipped_renders (GtkXText *xtext)
+{
+	gtk_xtext_skipped_roll (xtext, g_get_monotonic_time ());
+	return xtext->skipped_per_sec;
+}
+
+/* give 'ent' a guessed size, it gets measured and wrapped when laid out */
+
+static void
+gtk_xtext_ent_defer (xtext_buffer *buf, textentry *ent)
+{
+	ent->str_width = MIN (ent->str_len * buf->xtext->space_width, G_MAXINT16);
+	ent->needs_measure = TRUE;
+	ent->needs_wrap = TRUE;
+	buf->has_deferred = TRUE;
+}
+
+/* Scrollback of tabs that haven't been looked at in a while is written out
+ * to a temporary file once all buffers together go over memory_budget, and
+ * read back in when the tab is shown again. Lines that arrive meanwhile are
+ * kept in memory and end up after the spilled ones. */
+
+static gsize memory_budget;	/* bytes, 0 for no limit */
+
+typedef struct
+{
+	gint64 stamp;
+	gint16 str_len;
+	gint16 left_len;
+	gint16 indent;
+} spill_rec;
+
+static gboolean
+gtk_xtext_buffer_owns (xtext_buffer *buf, textentry *ent)
+{
+	xtext_chunk *chunk;
+
+	for (chunk = buf->chunk_first; chunk; chunk = chunk->next)
+		if (ent->chunk == chunk)
+			return TRUE;
+	return FALSE;
+}
+
+/* most lines a spill file has to keep, 0 for no limit */
+
+static guint
+gtk_xtext_spill_cap (xtext_buffer *buf)
+{
+	return buf->xtext->max_lines > 2 ? buf->xtext->max_lines : 0;
+}
+
+/* append bytes 'start' to 'end' of 'from' to 'to' */
+
+static gboolean
+gtk_xtext_spill_copy (int from, int to, gsize start, gsize end)
+{
+	char data[16384];
+	gssize n;
+
+	if (lseek (from, start, SEEK_SET) == -1)
+		return FALSE;
+	while (start < end)
+	{
+		n = read (from, data, MIN (sizeof (data), end - start));
+		if (n < 1 || write (to, data, n) != n)
+			return FALSE;
+		start += n;
+	}
+	return TRUE;
+}
+
+static void
+gtk_xtext_buffer_spill (xtext_buffer *buf)
+{
+	GByteArray *out;
+	GArray *offsets;
+	textentry *ent;
+	spill_rec rec;
+	gchar *path = NULL;
+	gsize base = 0, from = 0;
+	guint old = 0, drop = 0, lines = 0, cap = gtk_xtext_spill_cap (buf);
+	int fd, oldfd, n, marker = -1;
+	gboolean ok = TRUE;
+
+	for (ent = buf->text_first; ent; ent = ent->next)
+		lines++;
+
+	/* Lines that came in since the last spill are added to the same file,
+	 * after the part that is known to be good. Once it would hold more than
+	 * twice what can be shown, it is rewritten with only the last max_lines,
+	 * so the file and the work done here stay bounded. */
+	if (buf->spill_path)
+	{
+		old = buf->spill_offsets->len;
+		if (cap && old + lines > cap * 2)
+			drop = MIN (old, old + lines - cap);
+	}
+
+	if (drop)
+	{
+		from = g_array_index (buf->spill_offsets, gsize, drop);
+		oldfd = g_open (buf->spill_path, O_RDONLY | OFLAGS, 0);
+		if (oldfd == -1)
+			return;
+		fd = g_file_open_tmp ("hexchat-scrollback-XXXXXX", &path, NULL);
+		if (fd != -1)
+		{
+			ok = gtk_xtext_spill_copy (oldfd, fd, from, buf->spill_bytes);
+			base = buf->spill_bytes - from;
+		}
+		close (oldfd);
+	}
+	else if (buf->spill_path)
+	{
+		path = buf->spill_path;
+		base = buf->spill_bytes;
+		fd = g_open (path, O_WRONLY | OFLAGS, 0);
+		if (fd != -1 && lseek (fd, base, SEEK_SET) == -1)
+		{
+			close (fd);
+			fd = -1;
+		}
+	}
+	else
+		fd = g_file_open_tmp ("hexchat-scrollback-XXXXXX", &path, NULL);
+	if (fd == -1)
+	{
+		if (path != buf->spill_path)
+			g_free (path);
+		return;
+	}
+
+	out = g_byte_array_sized_new (buf->chunk_bytes);
+	offsets = g_array_sized_new (FALSE, FALSE, sizeof (gsize), lines);
+	for (ent = buf->text_first, n = old - drop; ent; ent = ent->next, n++)
+	{
+		gsize at = base + out->len;
+
+		g_array_append_val (offsets, at);
+		memset (&rec, 0, sizeof (rec));
+		rec.stamp = ent->stamp;
+		rec.str_len = ent->str_len;
+		rec.left_len = ent->left_len;
+		rec.indent = ent->indent;
+		g_byte_array_append (out, (guint8 *) &rec, sizeof (rec));
+		g_byte_array_append (out, ent->str, ent->str_len);
+		if (ent == buf->marker_pos)
+			marker = n;
+	}
+
+	ok = ok && write (fd, out->data, out->len) == (gssize) out->len;
+	close (fd);
+	if (!ok)
+	{
+		if (path != buf->spill_path)
 		{
-			xtext->force_render = FALSE;
-			/* GTK3: Queue a redraw instead of rendering directly */
-			gtk_widget_queue_draw (GTK_WIDGET (xtext));
+			g_unlink (path);
+			g_free (path);
 		}
+		g_byte_array_free (out, TRUE);
+		g_array_free (offsets, TRUE);
+		return;
 	}
 
-	return 0;
+	if (drop)
+	{
+		/* the kept records moved to the front of the new file */
+		for (n = drop; n < old; n++)
+			g_array_index (buf->spill_offsets, gsize, n) -= from;
+		g_array_remove_range (buf->spill_offsets, 0, drop);
+		g_unlink (buf->spill_path);
+		g_free (buf->spill_path);
+		buf->spill_marker = buf->spill_marker >= (int) drop ? buf->spill_marker - (int) drop : -1;
+	}
+	if (!buf->spill_offsets)
+		buf->spill_offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+	g_array_append_vals (buf->spill_offsets, offsets->data, offsets->len);
+	g_array_free (offsets, TRUE);
+
+	buf->spill_path = path;
+	buf->spill_bytes = base + out->len;
+	if (marker >= 0)
+		buf->spill_marker = marker;
+	g_byte_array_free (out, TRUE);
+
+	/* nothing may point at the lines anymore */
+	if (buf->xtext->hilight_ent && gtk_xtext_buffer_owns (buf, buf->xtext->hilight_ent))
+		buf->xtext->hilight_ent = NULL;
+	gtk_xtext_rewrap_stop (buf);
+	buf->marker_pos = NULL;
+	buf->pagetop_ent = NULL;
+	buf->last_ent_start = NULL;
+	buf->last_ent_end = NULL;
+	buf->hintsearch = NULL;
+	buf->wrap_next = NULL;
+
+	gtk_xtext_ent_free_all (buf);
+	gtk_xtext_index_free (buf);
+	buf->num_lines = 0;
+}
+
+/* read the last max_lines spilled lines, from the byte they start at */
+
+static gchar *
+gtk_xtext_spill_read (xtext_buffer *buf, guint *first, gsize *len)
+{
+	gchar *data;
+	gsize start, got = 0;
+	guint count = buf->spill_offsets->len, cap = gtk_xtext_spill_cap (buf);
+	gssize n;
+	int fd;
+
+	*first = (cap && count > cap) ? count - cap : 0;
+	*len = 0;
+	if (*first >= count)
+		return NULL;
+
+	start = g_array_index (buf->spill_offsets, gsize, *first);
+	fd = g_open (buf->spill_path, O_RDONLY | OFLAGS, 0);
+	if (fd == -1)
+		return NULL;
+	if (lseek (fd, start, SEEK_SET) == -1)
+	{
+		close (fd);
+		return NULL;
+	}
+
+	data = g_malloc (buf->spill_bytes - start);
+	while (got < buf->spill_bytes - start)
+	{
+		n = read (fd, data + got, buf->spill_bytes - start - got);
+		if (n < 1)
+			break;
+		got += n;
+	}
+	close (fd);
+
+	*len = got;
+	return data;
+}
+
+static void
+gtk_xtext_buffer_unspill (xtext_buffer *buf)
+{
+	textentry *first = buf->text_first, *last = buf->text_last;
+	xtext_chunk *chunk_first = buf->chunk_first, *chunk_last = buf->chunk_last;
+	textentry *ent, *marker = NULL;
+	spill_rec rec;
+	gchar *data;
+	gsize len, pos;
+	guint n;
+
+	if (!buf->spill_path)
+		return;
+
+	data = gtk_xtext_spill_read (buf, &n, &len);
+	g_unlink (buf->spill_path);
+	g_free (buf->spill_path);
+	buf->spill_path = NULL;
+	buf->spill_bytes = 0;
+	g_array_free (buf->spill_offsets, TRUE);
+	buf->spill_offsets = NULL;
+
+	/* The spilled lines go before the ones that came in since. They get
+	 * chunks of their own, put in front of the existing ones, so the arena
+	 * stays in list order and keeps emptying out from the front. */
+	buf->text_first = NULL;
+	buf->text_last = NULL;
+	buf->chunk_first = NULL;
+	buf->chunk_last = NULL;
+	for (pos = 0; pos + sizeof (rec) <= len; n++)
+	{
+		memcpy (&rec, data + pos, sizeof (rec));
+		pos += sizeof (rec);
+		if (rec.str_len < 0 || pos + rec.str_len > len)
+			break;
+
+		ent = gtk_xtext_ent_alloc (buf, rec.str_len + 1);
+		memcpy (ent->str, data + pos, rec.str_len);
+		ent->str[rec.str_len] = 0;
+		pos += rec.str_len;
+
+		ent->stamp = rec.stamp;
+		ent->str_len = rec.str_len;
+		ent->left_len = rec.left_len;
+		ent->indent = rec.indent;
+		ent->slp = NULL;
+		ent->glyphs = NULL;
+		ent->node = NULL;
+		ent->mark_start = -1;
+		ent->mark_end = -1;
+		ent->marks = NULL;
+		gtk_xtext_ent_defer (buf, ent);
+		gtk_xtext_sublines_init (ent);
+		ent->nsublines = gtk_xtext_lines_estimate (buf, ent);
+
+		ent->next = NULL;
+		ent->prev = buf->text_last;
+		if (buf->text_last)
+			buf->text_last->next = ent;
+		else
+			buf->text_first = ent;
+		buf->text_last = ent;
+
+		if ((int) n == buf->spill_marker)
+			marker = ent;
+	}
+	g_free (data);
+
+	if (chunk_first)
+	{
+		chunk_first->prev = buf->chunk_last;
+		if (buf->chunk_last)
+			buf->chunk_last->next = chunk_first;
+		else
+			buf->chunk_first = chunk_first;
+		buf->chunk_last = chunk_last;
+	}
+
+	if (first)
+	{
+		first->prev = buf->text_last;
+		if (buf->text_last)
+			buf->text_last->next = first;
+		else
+			buf->text_first = first;
+		buf->text_last = last;
+	}
+
+	if (marker && !buf->marker_pos)
+		buf->marker_pos = marker;
+	buf->spill_marker = -1;
+
+	/* every entry moved, give them all fresh slots in list order */
+	gtk_xtext_index_free (buf);
+	buf->num_lines = 0;
+	for (ent = buf->text_first; ent; ent = ent->next)
+	{
+		gtk_xtext_index_append (buf, ent);
+		buf->num_lines += ent->nsublines;
+	}
+	buf->pagetop_ent = NULL;
+
+	while (buf->xtext->max_lines > 2 && buf->xtext->max_lines < buf->num_lines)
+		gtk_xtext_remove_top (buf);
+}
+
+/* spill the least recently shown buffers until we're back under budget,
+ * leaving 'keep' alone. A new line spills at most one buffer, so the disk
+ * is never waited on for more than one buffer's worth at a time. */
+
+static void
+gtk_xtext_enforce_budget (xtext_buffer *keep)
+{
+	xtext_buffer *buf;
+	GList *list, *prev;
+	int spills = 0;
+
+	for (list = g_list_last (buffers_lru); list && chunk_total > memory_budget / 4 * 3; list = prev)
+	{
+		if (keep && spills > 0)
+			break;
+
+		prev = list->prev;
+		buf = list->data;
+
+		if (buf == keep || !buf->text_first || buf->search_found ||
+			 buf->xtext->buffer == buf || buf->xtext->selection_buffer == buf ||
+			 buf->xtext->orig_buffer == buf)
+			continue;
+
+		gtk_xtext_buffer_spill (buf);
+		spills++;
+	}
+}
+
+void
+gtk_xtext_set_memory_budget (gsize bytes)
+{
+	memory_budget = bytes;
+	if (memory_budget && chunk_total > memory_budget)
+		gtk_xtext_enforce_budget (NULL);
+}
+
+/* bytes of 'buf' that are on disk right now */
+
+gsize
+gtk_xtext_buffer_get_spilled (xtext_buffer *buf)
+{
+	return buf->spill_bytes;
 }
 
 /* append a textentry to our linked list */
@@ -4684,12 +6025,27 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent, time_t stamp)
 	if (stamp == 0)
 		ent->stamp = time (0);
 	ent->slp = NULL;
-	ent->str_width = gtk_xtext_text_width_ent (buf->xtext, ent);
+	ent->glyphs = NULL;
+	ent->node = NULL;
 	ent->mark_start = -1;
 	ent->mark_end = -1;
 	ent->next = NULL;
 	ent->marks = NULL;
 
+	/* Nobody sees a hidden tab's lines until it is shown (if they aren't
+	 * trimmed before that), so only guess their size for now and leave
+	 * measuring and wrapping to gtk_xtext_buffer_show. */
+	if (buf->xtext->buffer == buf)
+	{
+		ent->str_width = gtk_xtext_text_width_ent (buf->xtext, ent);
+		ent->needs_measure = FALSE;
+		ent->needs_wrap = FALSE;
+	}
+	else
+	{
+		gtk_xtext_ent_defer (buf, ent);
+	}
+
 	if (ent->indent < MARGIN)
 		ent->indent = MARGIN;	  /* 2 pixels is the left margin */
 
@@ -4701,13 +6057,19 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent, time_t stamp)
 	ent->prev = buf->text_last;
 	buf->text_last = ent;
 
-	ent->sublines = NULL;
-	buf->num_lines += gtk_xtext_lines_taken (buf, ent);
+	gtk_xtext_sublines_init (ent);
+	if (ent->needs_wrap)
+		ent->nsublines = gtk_xtext_lines_estimate (buf, ent);
+	else
+		gtk_xtext_lines_taken (buf, ent);
+	buf->num_lines += ent->nsublines;
+	gtk_xtext_index_append (buf, ent);
 
-	if ((buf->marker_pos == NULL || buf->marker_seen) && (buf->xtext->buffer != buf || 
+	if (((buf->marker_pos == NULL && buf->spill_marker < 0) || buf->marker_seen) && (buf->xtext->buffer != buf || 
 		!gtk_window_has_toplevel_focus (GTK_WINDOW (gtk_widget_get_toplevel (GTK_WIDGET (buf->xtext))))))
 	{
 		buf->marker_pos = ent;
+		buf->spill_marker = -1;
 		buf->marker_state = MARKER_IS_SET;
 		dontscroll (buf); /* force scrolling off */
 		buf->marker_seen = FALSE;
@@ -4718,25 +6080,16 @@ gtk_xtext_append_entry (xtext_buffer *buf, textentry * ent, time_t stamp)
 		gtk_xtext_remove_top (buf);
 	}
 
+	if (memory_budget && chunk_total > memory_budget)
+		gtk_xtext_enforce_budget (buf);
+
 	if (buf->xtext->buffer == buf)
 	{
 		/* this could be improved */
 		if ((buf->num_lines - 1) <= gtk_adjustment_get_page_size (buf->xtext->adj))
 			dontscroll (buf);
 
-		if (!buf->xtext->add_io_tag)
-		{
-			/* remove scrolling events */
-			if (buf->xtext->io_tag)
-			{
-				g_source_remove (buf->xtext->io_tag);
-				buf->xtext->io_tag = 0;
-			}
-			buf->xtext->add_io_tag = g_timeout_add (REFRESH_TIMEOUT * 2,
-															(GSourceFunc)
-															gtk_xtext_render_page_timeout,
-															buf->xtext);
-		}
+		gtk_xtext_invalidate (buf->xtext, XTEXT_DIRTY_LINES);
 	}
 	if (buf->scrollbar_down)
 	{
@@ -4779,8 +6132,8 @@ gtk_xtext_append_indent (xtext_buffer *buf,
 	if (right_text[right_len-1] == '\n')
 		right_len--;
 
-	ent = g_malloc (left_len + right_len + 2 + sizeof (textentry));
-	str = (unsigned char *) ent + sizeof (textentry);
+	ent = gtk_xtext_ent_alloc (buf, left_len + right_len + 2);
+	str = ent->str;
 
 	if (left_len)
 		memcpy (str, left_text, left_len);
@@ -4789,16 +6142,24 @@ gtk_xtext_append_indent (xtext_buffer *buf,
 		memcpy (str + left_len + 1, right_text, right_len);
 	str[left_len + 1 + right_len] = 0;
 
-	left_width = gtk_xtext_text_width (buf->xtext, left_text, left_len);
-
 	ent->left_len = left_len;
 	ent->str = str;
 	ent->str_len = left_len + 1 + right_len;
-	ent->indent = (buf->indent - left_width) - buf->xtext->space_width;
 
 	/* This is copied into the scratch buffer later, double check math */
 	g_assert (ent->str_len < sizeof (buf->xtext->scratch_buffer));
 
+	/* a hidden tab's lines are measured when it is shown, guess till then */
+	if (buf->xtext->buffer != buf)
+	{
+		ent->indent = buf->indent - (left_len + 1) * buf->xtext->space_width;
+		gtk_xtext_append_entry (buf, ent, stamp);
+		return;
+	}
+
+	left_width = gtk_xtext_text_width (buf->xtext, left_text, left_len);
+	ent->indent = (buf->indent - left_width) - buf->xtext->space_width;
+
 	if (buf->time_stamp)
 		space = buf->xtext->stamp_width;
 	else
@@ -4845,8 +6206,7 @@ gtk_xtext_append (xtext_buffer *buf, unsigned char *text, int len, time_t stamp)
 		truncate = TRUE;
 	}
 
-	ent = g_malloc (len + 1 + sizeof (textentry));
-	ent->str = (unsigned char *) ent + sizeof (textentry);
+	ent = gtk_xtext_ent_alloc (buf, len + 1);
 	ent->str_len = len;
 	if (len)
 	{
@@ -4870,7 +6230,7 @@ gtk_xtext_append (xtext_buffer *buf, unsigned char *text, int len, time_t stamp)
 gboolean
 gtk_xtext_is_empty (xtext_buffer *buf)
 {
-	return buf->text_first == NULL;
+	return buf->text_first == NULL && buf->spill_path == NULL;
 }
 
 
@@ -4881,6 +6241,8 @@ gtk_xtext_lastlog (xtext_buffer *out, xtext_buffer *search_area)
 	int matches;
 	GList *gl;
 
+	gtk_xtext_buffer_unspill (search_area);
+
 	ent = search_area->text_first;
 	matches = 0;
 
@@ -4918,8 +6280,11 @@ gtk_xtext_lastlog (xtext_buffer *out, xtext_buffer *search_area)
 void
 gtk_xtext_foreach (xtext_buffer *buf, GtkXTextForeach func, void *data)
 {
-	textentry *ent = buf->text_first;
+	textentry *ent;
+
+	gtk_xtext_buffer_unspill (buf);
 
+	ent = buf->text_first;
 	while (ent)
 	{
 		(*func) (buf->xtext, ent->str, data);
@@ -4987,6 +6352,7 @@ gtk_xtext_set_marker_last (session *sess)
 	xtext_buffer *buf = sess->res->buffer;
 
 	buf->marker_pos = buf->text_last;
+	buf->spill_marker = -1;
 	buf->marker_state = MARKER_IS_SET;
 }
 
@@ -5008,7 +6374,6 @@ gtk_xtext_moveto_marker_pos (GtkXText *xtext)
 {
 	gdouble value = 0;
 	xtext_buffer *buf = xtext->buffer;
-	textentry *ent = buf->text_first;
 	GtkAdjustment *adj = xtext->adj;
 
 	if (buf->marker_pos == NULL)
@@ -5016,13 +6381,7 @@ gtk_xtext_moveto_marker_pos (GtkXText *xtext)
 
 	if (gtk_xtext_check_ent_visibility (xtext, buf->marker_pos, 1) == FALSE)
 	{
-		while (ent)
-		{
-			if (ent == buf->marker_pos)
-				break;
-			value += g_slist_length (ent->sublines);
-			ent = ent->next;
-		}
+		value = gtk_xtext_ent_line (buf, buf->marker_pos);
 		if (value >= gtk_adjustment_get_value (adj) && value < gtk_adjustment_get_value (adj) + gtk_adjustment_get_page_size (adj))
 			return MARKER_IS_SET;
 		value -= gtk_adjustment_get_page_size (adj) / 2;
@@ -5061,17 +6420,12 @@ gtk_xtext_buffer_show (GtkXText *xtext, xtext_buffer *buf, int render)
 		xtext->buffer->old_value = gtk_adjustment_get_value (xtext->adj);
 	}
 
-	if (xtext->add_io_tag)
-	{
-		g_source_remove (xtext->add_io_tag);
-		xtext->add_io_tag = 0;
-	}
+	/* scrollbar fixups pending for the old buffer don't apply anymore */
+	xtext->dirty &= ~XTEXT_DIRTY_LINES;
 
-	if (xtext->io_tag)
-	{
-		g_source_remove (xtext->io_tag);
-		xtext->io_tag = 0;
-	}
+	buffers_lru = g_list_remove_link (buffers_lru, buf->lru_link);
+	buffers_lru = g_list_concat (buf->lru_link, buffers_lru);
+	gtk_xtext_buffer_unspill (buf);
 
 	if (!gtk_widget_get_realized (GTK_WIDGET (xtext)))
 		gtk_widget_realize (GTK_WIDGET (xtext));
@@ -5134,6 +6488,12 @@ gtk_xtext_buffer_show (GtkXText *xtext, xtext_buffer *buf, int render)
 			gtk_xtext_adjustment_set (buf, FALSE);
 		}
 
+		if (buf->has_deferred)
+			gtk_xtext_layout_deferred (buf);
+
+		/* finish a re-wrap that was put on hold while this buffer was hidden */
+		gtk_xtext_rewrap_start (buf);
+
 		/* GTK3: Queue a redraw instead of rendering directly */
 		gtk_widget_queue_draw (GTK_WIDGET (xtext));
 		gtk_adjustment_changed (xtext->adj);
@@ -5150,33 +6510,40 @@ gtk_xtext_buffer_new (GtkXText *xtext)
 	buf->xtext = xtext;
 	buf->scrollbar_down = TRUE;
 	buf->indent = xtext->space_width * 2;
+	buf->spill_marker = -1;
 	dontscroll (buf);
 
+	buffers_lru = g_list_prepend (buffers_lru, buf);
+	buf->lru_link = buffers_lru;
+
 	return buf;
 }
 
 void
 gtk_xtext_buffer_free (xtext_buffer *buf)
 {
-	textentry *ent, *next;
-
 	if (buf->xtext->buffer == buf)
 		buf->xtext->buffer = buf->xtext->orig_buffer;
 
 	if (buf->xtext->selection_buffer == buf)
 		buf->xtext->selection_buffer = NULL;
 
+	gtk_xtext_rewrap_stop (buf);
+
 	if (buf->search_found)
 	{
 		gtk_xtext_search_fini (buf);
 	}
 
-	ent = buf->text_first;
-	while (ent)
+	gtk_xtext_ent_free_all (buf);
+	gtk_xtext_index_free (buf);
+
+	buffers_lru = g_list_delete_link (buffers_lru, buf->lru_link);
+	if (buf->spill_path)
 	{
-		next = ent->next;
-		g_free (ent);
-		ent = next;
+		g_unlink (buf->spill_path);
+		g_free (buf->spill_path);
+		g_array_free (buf->spill_offsets, TRUE);
 	}
 
 	g_free (buf);
@@ -55,6 +55,7 @@
 typedef struct _GtkXText GtkXText;
 typedef struct _GtkXTextClass GtkXTextClass;
 typedef struct textentry textentry;
+typedef struct xtext_chunk xtext_chunk;
 
 /*
  * offsets_t is used for retaining search information.
@@ -98,6 +99,7 @@ typedef struct {
 
 	int num_lines;
 	int indent;						  /* position of separator (pixels) from left */
+	int indent_wanted;			/* where deferred entries would like it, see gtk_xtext_ent_indent */
 
 	textentry *marker_pos;
 	marker_reset_reason marker_state;
@@ -108,6 +110,7 @@ typedef struct {
 	unsigned int time_stamp:1;
 	unsigned int scrollbar_down:1;
 	unsigned int needs_recalc:1;
+	unsigned int has_deferred:1;	/* entries appended while hidden, not measured yet */
 	unsigned int marker_seen:1;
 
 	GList *search_found;		/* list of textentries where search found strings */
@@ -120,6 +123,27 @@ typedef struct {
 	offsets_t curdata;		/* current offset info, from *curmark */
 	GRegex *search_re;		/* Compiled regular expression */
 	textentry *hintsearch;	/* textentry found for last search */
+
+	/* line index: a Fenwick tree over the number of lines each entry takes,
+	 * so that line <-> entry lookups don't have to walk the whole list */
+	textentry **index_ents;	/* slot -> textentry, NULL for trimmed slots */
+	int *index_tree;			/* 1-based Fenwick tree of line counts */
+	int index_first;			/* slot of text_first */
+	int index_len;				/* slots in use, including trimmed ones */
+	int index_size;			/* slots allocated */
+
+	textentry *wrap_next;	/* where the background re-wrap continues, upwards */
+	guint wrap_tag;			/* idle source of the background re-wrap */
+
+	xtext_chunk *chunk_first;	/* arena holding the textentries, oldest first */
+	xtext_chunk *chunk_last;
+	gsize chunk_bytes;		/* total size of all chunks */
+
+	GList *lru_link;			/* in the list of all buffers, most recently shown first */
+	gchar *spill_path;		/* older lines written out to disk, see gtk_xtext_buffer_spill */
+	gsize spill_bytes;		/* size of that file */
+	GArray *spill_offsets;	/* where each line in it starts */
+	int spill_marker;			/* which of the spilled lines marker_pos was, or -1 */
 } xtext_buffer;
 
 struct _GtkXText
@@ -137,6 +161,10 @@ struct _GtkXText
 	GdkCursor *resize_cursor;
 
 	cairo_t *cr;						/* current Cairo context for drawing operations */
+	GtkSnapshot *snapshot;			/* set while gtk_xtext_snapshot runs */
+	GPtrArray *node_ents;			/* textentries holding a cached render node */
+	guint node_frame;					/* bumped on every snapshot */
+	guint palette_gen;				/* bumped by gtk_xtext_set_palette */
 
 	/* Colors for separator and marker lines */
 	GdkRGBA light_color;
@@ -153,10 +181,13 @@ struct _GtkXText
 	/* GdkGC removed in GTK3 - we use Cairo for all drawing now */
 	GdkRGBA palette[XTEXT_COLS];
 
-	gint io_tag;					  /* for delayed refresh events */
-	gint add_io_tag;				  /* "" when adding new text */
+	guint tick_id;				  /* frame clock callback handling 'dirty' */
+	int dirty;						  /* XTEXT_DIRTY_* work pending for the next frame */
+	gint64 tick_frame;			  /* frame counter when the tick was asked for */
+	int skipped_renders;			  /* frames the page was late by */
+	int skipped_per_sec;			  /* the same, over the last full second */
+	gint64 skipped_since;		  /* when the current count started */
 	gint scroll_tag;				  /* marking-scroll timeout */
-	gint resize_tag;				  /* deferred line recalculation on resize */
 	gulong vc_signal_tag;        /* signal handler for "value_changed" adj */
 
 	int select_start_adj;		  /* the adj->value when the selection started */
@@ -180,6 +211,8 @@ struct _GtkXText
 	int hilight_end;
 
 	guint16 fontwidth[128];	  /* each char's width, only the ASCII ones */
+	GHashTable *char_widths;	  /* (codepoint, emphasis) -> width in Pango units, for the rest */
+	unsigned int font_mono:1;	  /* every ASCII glyph has the same advance */
 
 	struct pangofont
 	{
@@ -190,6 +223,7 @@ struct _GtkXText
 	PangoLayout *layout;
 
 	int fontsize;
+	guint font_gen;				  /* bumped on every font change */
 	int space_width;				  /* width (pixels) of the space " " character */
 	int stamp_width;				  /* width of "[88:88:88]" */
 	int max_auto_indent;
@@ -299,6 +333,10 @@ void gtk_xtext_set_wordwrap (GtkXText *xtext, gboolean word_wrap);
 
 xtext_buffer *gtk_xtext_buffer_new (GtkXText *xtext);
 void gtk_xtext_buffer_free (xtext_buffer *buf);
+gsize gtk_xtext_buffer_get_memory (xtext_buffer *buf);
+int gtk_xtext_get_skipped_renders (GtkXText *xtext);
+gsize gtk_xtext_buffer_get_spilled (xtext_buffer *buf);
+void gtk_xtext_set_memory_budget (gsize bytes);
 void gtk_xtext_buffer_show (GtkXText *xtext, xtext_buffer *buf, int render);
 void gtk_xtext_copy_selection (GtkXText *xtext);
 GType gtk_xtext_get_type (void);
@@ -0,0 +1,416 @@
+#!/usr/bin/env python3
+"""DCC throughput over loopback, end to end through a headless HexChat.
+
+Runs hexchat-text against a stand-in IRC server and DCC peer on 127.0.0.1,
+with a fresh config directory per case, and has it send and receive files
+over DCC: active and passive, resumed, with and without fast send, at a few
+block sizes and under a cps limit. For each case it reports MB/s, the CPU
+time hexchat-text used for the transfer and, if strace is installed, how
+many system calls it made per MB.
+
+usage: dcc_bench.py path/to/hexchat-text [size-in-MB]
+"""
+
+import collections
+import os
+import queue
+import random
+import re
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+MB = 1024 * 1024
+NICK = 'bench'
+PEER = 'peer'
+LOOPBACK = 2130706433  # 127.0.0.1, the way DCC offers write it
+TIMEOUT = 60
+
+Case = collections.namedtuple('Case', 'name send size blocksize fast passive cps resume')
+
+PATTERN = random.Random(0).randbytes(MB)
+
+
+def cases(size):
+    small = max(size // 8, 1) * MB
+    size *= MB
+    return [
+        Case('send', True, size, 102400, True, False, 0, False),
+        Case('send 1 MB', True, MB, 102400, True, False, 0, False),
+        Case('send 8k blocks', True, size, 8192, True, False, 0, False),
+        Case('send, no fast send', True, size, 102400, False, False, 0, False),
+        Case('send passive', True, size, 102400, True, True, 0, False),
+        Case('send 4 MB/s limit', True, small, 102400, True, False, 4 * MB, False),
+        Case('receive', False, size, 0, False, False, 0, False),
+        Case('receive 1 MB', False, MB, 0, False, False, 0, False),
+        Case('receive passive', False, size, 0, False, True, 0, False),
+        Case('receive resumed', False, size, 0, False, False, 0, True),
+        Case('receive 4 MB/s limit', False, small, 0, False, False, 4 * MB, False),
+    ]
+
+
+def pattern_chunks(start, end):
+    """The benchmark file's bytes from start to end, in pieces"""
+    view = memoryview(PATTERN)
+    while start < end:
+        off = start % MB
+        piece = view[off:min(MB, off + end - start)]
+        yield piece
+        start += len(piece)
+
+
+def pattern_crc(start, end):
+    crc = 0
+    for piece in pattern_chunks(start, end):
+        crc = zlib.crc32(piece, crc)
+    return crc
+
+
+def write_pattern(path, size):
+    with open(path, 'wb') as f:
+        for piece in pattern_chunks(0, size):
+            f.write(piece)
+
+
+def cpu_seconds(pid):
+    """user + system time of a process and all its threads"""
+    try:
+        with open('/proc/%d/stat' % pid) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+    except OSError:
+        return 0.0
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def ctcp_words(text):
+    """split a CTCP the way HexChat does, honouring a quoted file name"""
+    match = re.match(r'(\S+) (\S+) "([^"]*)" (.*)', text)
+    if match:
+        return [match.group(1), match.group(2), match.group(3)] + match.group(4).split()
+    return text.split()
+
+
+class HexChat:
+    """hexchat-text connected to our stand-in server"""
+
+    def __init__(self, binary, case, workdir, strace=None):
+        self.workdir = workdir
+        self.dccdir = os.path.join(workdir, 'dcc')
+        cfgdir = os.path.join(workdir, 'config')
+        os.makedirs(self.dccdir, exist_ok=True)
+        os.makedirs(cfgdir, exist_ok=True)
+
+        prefs = {
+            'irc_nick1': NICK,
+            'irc_user_name': NICK,
+            'dcc_auto_recv': 2,
+            'dcc_auto_resume': 1,
+            'dcc_dir': self.dccdir,
+            'dcc_completed_dir': '',
+            'dcc_save_nick': 0,
+            'dcc_remove': 0,
+            'dcc_ip': '127.0.0.1',
+            'dcc_ip_from_server': 0,
+            'dcc_fast_send': int(case.fast),
+            'dcc_blocksize': case.blocksize or 1024,
+            'dcc_max_send_cps': case.cps if case.send else 0,
+            'dcc_max_get_cps': case.cps if not case.send else 0,
+            'net_auto_reconnect': 0,
+        }
+        with open(os.path.join(cfgdir, 'hexchat.conf'), 'w') as f:
+            for key, value in prefs.items():
+                f.write('%s = %s\n' % (key, value))
+
+        self.ctcps = queue.Queue()
+        listener = socket.socket()
+        listener.bind(('127.0.0.1', 0))
+        listener.listen(1)
+
+        argv = [binary, '-a', '-n', '-d', cfgdir]
+        self.strace_out = None
+        if strace:
+            self.strace_out = os.path.join(workdir, 'strace.txt')
+            argv = [strace, '-f', '-qq', '-c', '-o', self.strace_out] + argv
+        self.log = open(os.path.join(workdir, 'hexchat.log'), 'wb')
+        self.proc = subprocess.Popen(argv, stdin=subprocess.PIPE, stdout=self.log,
+                                     stderr=subprocess.STDOUT)
+
+        # -insecure is only understood by TLS builds, try without it after
+        port = listener.getsockname()[1]
+        self.irc = None
+        for command in ('/server -insecure 127.0.0.1 %d', '/server 127.0.0.1 %d'):
+            self.command(command % port)
+            listener.settimeout(5)
+            try:
+                self.irc, _ = listener.accept()
+                break
+            except socket.timeout:
+                pass
+        listener.close()
+        if not self.irc:
+            raise RuntimeError('hexchat-text never connected')
+
+        self.irc.settimeout(None)
+        self.registered = threading.Event()
+        threading.Thread(target=self.read_irc, daemon=True).start()
+        if not self.registered.wait(TIMEOUT):
+            raise RuntimeError('hexchat-text never registered')
+
+    def command(self, text):
+        self.proc.stdin.write(text.encode() + b'\n')
+        self.proc.stdin.flush()
+
+    def send_irc(self, line):
+        self.irc.sendall(line.encode() + b'\r\n')
+
+    def ctcp(self, text):
+        self.send_irc(':%s!%s@127.0.0.1 PRIVMSG %s :\x01%s\x01' % (PEER, PEER, NICK, text))
+
+    def next_ctcp(self):
+        return ctcp_words(self.ctcps.get(timeout=TIMEOUT))
+
+    def read_irc(self):
+        buf = b''
+        seen = set()
+        while True:
+            try:
+                data = self.irc.recv(4096)
+            except OSError:
+                return
+            if not data:
+                return
+            buf += data
+            while b'\n' in buf:
+                line, buf = buf.split(b'\n', 1)
+                words = line.decode(errors='replace').rstrip('\r').split(' ', 2)
+                if words[0] in ('NICK', 'USER'):
+                    seen.add(words[0])
+                    if seen == {'NICK', 'USER'}:
+                        self.send_irc(':bench.server 001 %s :Welcome' % NICK)
+                        self.send_irc(':bench.server 376 %s :End of MOTD' % NICK)
+                        self.registered.set()
+                elif words[0] == 'PING':
+                    self.send_irc('PONG ' + ' '.join(words[1:]))
+                elif words[0] == 'PRIVMSG' and len(words) == 3 and words[1] == PEER:
+                    text = words[2].lstrip(':')
+                    if text.startswith('\x01'):
+                        self.ctcps.put(text.strip('\x01'))
+
+    @property
+    def pid(self):
+        """the hexchat-text process, which is strace's child when traced"""
+        if not self.strace_out:
+            return self.proc.pid
+        try:
+            with open('/proc/%d/task/%d/children' % (self.proc.pid, self.proc.pid)) as f:
+                return int(f.read().split()[0])
+        except (OSError, IndexError):
+            return self.proc.pid
+
+    def close(self):
+        try:
+            self.command('/killall')
+            self.proc.stdin.close()
+            self.proc.wait(TIMEOUT)
+        except (OSError, subprocess.TimeoutExpired):
+            self.proc.kill()
+            self.proc.wait()
+        self.irc.close()
+        self.log.close()
+
+    def syscalls(self):
+        """total calls from strace -c, once hexchat-text has exited"""
+        with open(self.strace_out) as f:
+            for line in f:
+                fields = line.split()
+                if fields and fields[-1] == 'total':
+                    return int(fields[3])
+        return 0
+
+
+def peer_receive(sock, size, ack):
+    """take a file from HexChat, acking each read like a DCC client does"""
+    got = 0
+    crc = 0
+    buf = bytearray(MB)
+    view = memoryview(buf)
+    while True:
+        n = sock.recv_into(buf)
+        if not n:
+            break
+        crc = zlib.crc32(view[:n], crc)
+        got += n
+        if ack:
+            sock.sendall(struct.pack('>I', got & 0xffffffff))
+    sock.close()
+    return got, crc
+
+
+def peer_send(sock, start, size):
+    """give HexChat a file from start and wait until it has acked all of it"""
+    done = threading.Event()
+
+    def read_acks():
+        want = struct.pack('>I', size & 0xffffffff)
+        last = b''
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            last = (last + data)[-4:]
+            if len(last) == 4 and last == want:
+                break
+        done.set()
+
+    reader = threading.Thread(target=read_acks, daemon=True)
+    reader.start()
+    for piece in pattern_chunks(start, size):
+        sock.sendall(piece)
+    done.wait(TIMEOUT * 10)
+    sock.close()
+
+
+def run_send(hx, case):
+    path = os.path.join(hx.workdir, 'send.bin')
+    write_pattern(path, case.size)
+
+    if case.passive:
+        hx.command('/dcc psend %s %s' % (PEER, path))
+        words = hx.next_ctcp()
+        listener = socket.socket()
+        listener.bind(('127.0.0.1', 0))
+        listener.listen(1)
+        hx.ctcp('DCC SEND %s %d %d %s %s' % (words[2], LOOPBACK,
+                                             listener.getsockname()[1], words[5], words[6]))
+        listener.settimeout(TIMEOUT)
+        sock, _ = listener.accept()
+        listener.close()
+    else:
+        hx.command('/dcc send %s %s' % (PEER, path))
+        words = hx.next_ctcp()
+        sock = socket.create_connection((socket.inet_ntoa(struct.pack('>I', int(words[3]))),
+                                         int(words[4])), TIMEOUT)
+    sock.settimeout(TIMEOUT)
+    # acks are 4 bytes each, don't let Nagle hold them back
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    cpu = cpu_seconds(hx.pid)
+    start = time.monotonic()
+    got, crc = peer_receive(sock, case.size, True)
+    elapsed = time.monotonic() - start
+    cpu = cpu_seconds(hx.pid) - cpu
+
+    if got != case.size or crc != pattern_crc(0, case.size):
+        raise RuntimeError('peer got %d bytes, expected %d, crc %s' %
+                           (got, case.size, 'ok' if crc == pattern_crc(0, got) else 'bad'))
+    return case.size, elapsed, cpu
+
+
+def run_receive(hx, case):
+    name = 'recv.bin'
+    start = 0
+    if case.resume:
+        start = case.size // 2 + 12345
+        write_pattern(os.path.join(hx.dccdir, name), start)
+
+    listener = socket.socket()
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(1)
+    port = listener.getsockname()[1]
+
+    if case.passive:
+        hx.ctcp('DCC SEND %s %d 0 %d 77' % (name, LOOPBACK, case.size))
+        words = hx.next_ctcp()
+        listener.close()
+        sock = socket.create_connection((socket.inet_ntoa(struct.pack('>I', int(words[3]))),
+                                         int(words[4])), TIMEOUT)
+    else:
+        hx.ctcp('DCC SEND %s %d %d %d' % (name, LOOPBACK, port, case.size))
+        if case.resume:
+            words = hx.next_ctcp()
+            if words[1] != 'RESUME' or int(words[4]) != start:
+                raise RuntimeError('expected a resume from %d, got %r' % (start, words))
+            hx.ctcp('DCC ACCEPT %s %d %d' % (name, port, start))
+        listener.settimeout(TIMEOUT)
+        sock, _ = listener.accept()
+        listener.close()
+    sock.settimeout(TIMEOUT)
+
+    cpu = cpu_seconds(hx.pid)
+    t = time.monotonic()
+    peer_send(sock, start, case.size)
+    elapsed = time.monotonic() - t
+    cpu = cpu_seconds(hx.pid) - cpu
+
+    # the last ack goes out just before the file is closed
+    path = os.path.join(hx.dccdir, name)
+    deadline = time.monotonic() + TIMEOUT
+    while os.path.getsize(path) < case.size and time.monotonic() < deadline:
+        time.sleep(0.05)
+    crc = 0
+    with open(path, 'rb') as f:
+        for piece in iter(lambda: f.read(MB), b''):
+            crc = zlib.crc32(piece, crc)
+    if crc != pattern_crc(0, case.size):
+        raise RuntimeError('received file is corrupt (%d bytes)' % os.path.getsize(path))
+    return case.size - start, elapsed, cpu
+
+
+def run(binary, case, strace=None):
+    workdir = tempfile.mkdtemp(prefix='dcc-bench-')
+    hx = None
+    try:
+        hx = HexChat(binary, case, workdir, strace)
+        if not case.size:
+            result = None
+        elif case.send:
+            result = run_send(hx, case)
+        else:
+            result = run_receive(hx, case)
+        hx.close()
+        calls = hx.syscalls() if strace else None
+        hx = None
+        return result, calls
+    finally:
+        if hx:
+            hx.close()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+def main():
+    binary = os.path.abspath(sys.argv[1])
+    size = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+    strace = shutil.which('strace')
+
+    baseline = 0
+    if strace:
+        idle = Case('idle', True, 0, 0, False, False, 0, False)
+        baseline = run(binary, idle, strace)[1]
+
+    print('%-22s %8s %9s %10s %12s' % ('case', 'MB', 'MB/s', 'CPU s/GB', 'syscalls/MB'))
+    failed = 0
+    for case in cases(size):
+        try:
+            (moved, elapsed, cpu), _ = run(binary, case)
+            calls = '-'
+            if strace:
+                # a second pass, since tracing slows everything else down
+                traced = run(binary, case, strace)[1]
+                calls = '%.0f' % (max(traced - baseline, 0) / (moved / MB))
+            print('%-22s %8.1f %9.1f %10.2f %12s' % (
+                case.name, moved / MB, moved / MB / elapsed, cpu / (moved / MB / 1024), calls))
+        except Exception as e:
+            failed += 1
+            print('%-22s FAILED: %s' % (case.name, e))
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())